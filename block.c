@@ -113,6 +113,9 @@ bdrv_change_aio_context(BlockDriverState *bs, AioContext *ctx,
 /* If non-zero, use only whitelisted block drivers */
 static int use_bdrv_whitelist;
 
+/* Bumped whenever a node is attached to or detached from a parent */
+static unsigned int bdrv_graph_gen;
+
 #ifdef _WIN32
 static int is_windows_drive_prefix(const char *filename)
 {
@@ -430,6 +433,8 @@ BlockDriverState *bdrv_new(void)
     qemu_co_mutex_init(&bs->bsc_modify_lock);
     bs->block_status_cache = g_new0(BdrvBlockStatusCache, 1);
 
+    qemu_mutex_init(&bs->chain_map_lock);
+
     for (i = 0; i < bdrv_drain_all_count; i++) {
         bdrv_do_drained_begin_quiesce(bs, NULL);
     }
@@ -2986,6 +2991,7 @@ bdrv_replace_child_noperm(BdrvChild *child, BlockDriverState *new_bs)
     }
 
     child->bs = new_bs;
+    qatomic_inc(&bdrv_graph_gen);
 
     if (new_bs) {
         QLIST_INSERT_HEAD(&new_bs->parents, child, next_parent);
@@ -5136,6 +5142,14 @@ static void GRAPH_UNLOCKED bdrv_reopen_commit(BDRVReopenState *reopen_state)
 
     bdrv_refresh_limits(bs, NULL, NULL);
     bdrv_refresh_total_sectors(bs, bs->total_sectors);
+
+    /* The node may now read differently, e.g. with copy-on-read toggled */
+    qatomic_inc(&bdrv_graph_gen);
+}
+
+unsigned int bdrv_graph_generation(void)
+{
+    return qatomic_read(&bdrv_graph_gen);
 }
 
 /*
@@ -5202,6 +5216,8 @@ static void GRAPH_UNLOCKED bdrv_close(BlockDriverState *bs)
     bs->full_open_options = NULL;
     g_free(bs->block_status_cache);
     bs->block_status_cache = NULL;
+    g_free(bs->chain_map);
+    bs->chain_map = NULL;
 
     bdrv_release_named_dirty_bitmaps(bs);
     assert(QLIST_EMPTY(&bs->dirty_bitmaps));
@@ -5563,6 +5579,7 @@ static void bdrv_delete(BlockDriverState *bs)
     bdrv_close(bs);
 
     qemu_mutex_destroy(&bs->reqs_lock);
+    qemu_mutex_destroy(&bs->chain_map_lock);
 
     g_free(bs);
 }
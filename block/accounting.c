@@ -26,6 +26,7 @@
 #include "qemu/osdep.h"
 #include "block/accounting.h"
 #include "block/block_int.h"
+#include "qemu/host-utils.h"
 #include "qemu/timer.h"
 #include "system/qtest.h"
 #include "qapi/error.h"
@@ -213,6 +214,38 @@ void block_latency_histograms_clear(BlockAcctStats *stats)
     }
 }
 
+static unsigned block_acct_hdr_index(uint64_t latency_ns)
+{
+    int msb;
+
+    if (latency_ns < (1 << BLOCK_ACCT_HDR_SUB_BITS)) {
+        return latency_ns;
+    }
+
+    msb = 63 - clz64(latency_ns);
+    if (msb >= BLOCK_ACCT_HDR_MAX_BITS) {
+        return BLOCK_ACCT_HDR_BUCKETS - 1;
+    }
+
+    return ((msb - BLOCK_ACCT_HDR_SUB_BITS + 1) << BLOCK_ACCT_HDR_SUB_BITS) +
+           ((latency_ns >> (msb - BLOCK_ACCT_HDR_SUB_BITS)) &
+            ((1 << BLOCK_ACCT_HDR_SUB_BITS) - 1));
+}
+
+/* Returns the largest latency that falls into bucket @idx */
+static uint64_t block_acct_hdr_value(unsigned idx)
+{
+    unsigned exp = idx >> BLOCK_ACCT_HDR_SUB_BITS;
+    uint64_t mantissa = idx & ((1 << BLOCK_ACCT_HDR_SUB_BITS) - 1);
+
+    if (exp == 0) {
+        return mantissa;
+    }
+
+    mantissa += (1 << BLOCK_ACCT_HDR_SUB_BITS) + 1;
+    return (mantissa << (exp - 1)) - 1;
+}
+
 static void block_account_one_io(BlockAcctStats *stats, BlockAcctCookie *cookie,
                                  bool failed)
 {
@@ -242,9 +275,14 @@ static void block_account_one_io(BlockAcctStats *stats, BlockAcctCookie *cookie,
                                         latency_ns);
 
         if (!failed || stats->account_failed) {
+            BlockAcctHdrHistogram *hdr = &stats->latency_hdr[cookie->type];
+
             stats->total_time_ns[cookie->type] += latency_ns;
             stats->last_access_time_ns = time_ns;
 
+            hdr->buckets[block_acct_hdr_index(MAX(latency_ns, 0))]++;
+            hdr->count++;
+
             QSLIST_FOREACH(s, &stats->intervals, entries) {
                 timed_average_account(&s->latency[cookie->type], latency_ns);
             }
@@ -291,6 +329,40 @@ void block_acct_merge_done(BlockAcctStats *stats, enum BlockAcctType type,
     qemu_mutex_unlock(&stats->lock);
 }
 
+/*
+ * Stores in @value the latency in ns below which @permille thousandths of
+ * the accounted requests of @type completed.  Returns false if no request
+ * of that type has been accounted yet.
+ */
+bool block_acct_latency_percentile(BlockAcctStats *stats,
+                                   enum BlockAcctType type,
+                                   unsigned int permille, uint64_t *value)
+{
+    BlockAcctHdrHistogram *hdr = &stats->latency_hdr[type];
+    uint64_t rank, seen = 0;
+    unsigned i;
+
+    assert(type < BLOCK_MAX_IOTYPE);
+    assert(permille <= 1000);
+
+    QEMU_LOCK_GUARD(&stats->lock);
+
+    if (!hdr->count) {
+        return false;
+    }
+
+    rank = MAX(DIV_ROUND_UP(hdr->count * permille, 1000), 1);
+    for (i = 0; i < BLOCK_ACCT_HDR_BUCKETS - 1; i++) {
+        seen += hdr->buckets[i];
+        if (seen >= rank) {
+            break;
+        }
+    }
+
+    *value = block_acct_hdr_value(i);
+    return true;
+}
+
 int64_t block_acct_idle_time_ns(BlockAcctStats *stats)
 {
     return qemu_clock_get_ns(clock_type) - stats->last_access_time_ns;
@@ -25,6 +25,8 @@
 #include "qemu/osdep.h"
 #include "block/aio.h"
 #include "block/aio_task.h"
+#include "block/block_int-io.h"
+#include "trace.h"
 
 struct AioTaskPool {
     Coroutine *main_co;
@@ -38,11 +40,18 @@ static void coroutine_fn aio_task_co(void *opaque)
 {
     AioTask *task = opaque;
     AioTaskPool *pool = task->pool;
+    const void *latency_trace_tag = task->latency_trace_tag;
 
     assert(pool->busy_tasks < pool->max_busy_tasks);
     pool->busy_tasks++;
 
+    if (latency_trace_tag) {
+        bdrv_latency_trace_enter(latency_trace_tag);
+    }
     task->ret = task->func(task);
+    if (latency_trace_tag) {
+        bdrv_latency_trace_leave(NULL);
+    }
 
     pool->busy_tasks--;
 
@@ -91,6 +100,11 @@ void coroutine_fn aio_task_pool_start_task(AioTaskPool *pool, AioTask *task)
     aio_task_pool_wait_slot(pool);
 
     task->pool = pool;
+    /* Let the task's requests be part of a sampled request */
+    task->latency_trace_tag = NULL;
+    if (trace_event_get_state_backends(TRACE_BDRV_CO_RW_LATENCY)) {
+        task->latency_trace_tag = bdrv_latency_trace_tag();
+    }
     qemu_coroutine_enter(qemu_coroutine_create(aio_task_co, task));
 }
 
@@ -459,7 +459,8 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
     }
 
     cbw = bdrv_cbw_append(bs, target, filter_node_name, discard_source,
-                          perf->min_cluster_size, &bcs, on_cbw_error, errp);
+                          perf->min_cluster_size, perf->cbw_cache_size, &bcs,
+                          on_cbw_error, errp);
     if (!cbw) {
         goto error;
     }
@@ -50,6 +50,9 @@ struct BlockBackend {
     QTAILQ_ENTRY(BlockBackend) monitor_link; /* for monitor_block_backends */
     BlockBackendPublic public;
 
+    /* Sampling counter for the blk_co_rw_latency trace event (atomic) */
+    unsigned int latency_trace_seq;
+
     DeviceState *dev;           /* attached device model, if any */
     const BlockDevOps *dev_ops;
     void *dev_opaque;
@@ -1325,16 +1328,101 @@ static void coroutine_fn blk_wait_while_drained(BlockBackend *blk)
     }
 }
 
+/*
+ * While the blk_co_rw_latency or bdrv_co_rw_latency trace event is enabled,
+ * one read or write in BLK_LATENCY_TRACE_INTERVAL is sampled.  The decision
+ * is taken once, when the request enters the BlockBackend, and every node
+ * the request reaches then traces it under the same tag.  blk_co_rw_latency
+ * splits the latency into:
+ * - submit: from blk_aio_*() until the request coroutine runs
+ * - drain: waiting for a drained section to end
+ * - throttle: waiting for I/O throttling
+ * - io: the node graph below, broken down per node by bdrv_co_rw_latency
+ * - complete: until the completion callback runs, including the completion
+ *   BH for requests that finish before blk_aio_*() returns
+ * Submit and complete are zero for requests made from coroutines.
+ */
+#define BLK_LATENCY_TRACE_INTERVAL 64
+
+typedef struct BlkLatencyTrace {
+    int64_t submit_ns;      /* 0 if the request is not sampled */
+    int64_t start_ns;
+    int64_t drained_ns;
+    int64_t throttled_ns;
+    int64_t done_ns;        /* 0 if the request did not reach the graph */
+    const void *prev_tag;
+    bool is_write;
+} BlkLatencyTrace;
+
+static void blk_latency_trace_sample(BlockBackend *blk, BlkLatencyTrace *lt,
+                                     bool is_write)
+{
+    *lt = (BlkLatencyTrace) { .is_write = is_write };
+    if (!trace_event_get_state_backends(TRACE_BLK_CO_RW_LATENCY) &&
+        !trace_event_get_state_backends(TRACE_BDRV_CO_RW_LATENCY)) {
+        return;
+    }
+    if (qatomic_fetch_inc(&blk->latency_trace_seq) %
+        BLK_LATENCY_TRACE_INTERVAL) {
+        return;
+    }
+    lt->submit_ns = get_clock();
+}
+
+static inline void blk_latency_trace_mark(BlkLatencyTrace *lt, int64_t *ts)
+{
+    if (lt->submit_ns) {
+        *ts = get_clock();
+    }
+}
+
+/* Tag the nodes' trace events of a sampled request as it enters the graph */
+static void coroutine_fn blk_latency_trace_io_start(BlkLatencyTrace *lt)
+{
+    if (lt->submit_ns) {
+        lt->throttled_ns = get_clock();
+        lt->prev_tag = bdrv_latency_trace_enter(lt);
+    }
+}
+
+static void coroutine_fn blk_latency_trace_io_end(BlkLatencyTrace *lt)
+{
+    if (lt->submit_ns) {
+        bdrv_latency_trace_leave(lt->prev_tag);
+        lt->done_ns = get_clock();
+    }
+}
+
+static void blk_latency_trace_done(BlockBackend *blk, BlkLatencyTrace *lt,
+                                   int64_t offset, int64_t bytes, int ret)
+{
+    if (lt->done_ns) {
+        trace_blk_co_rw_latency(blk, lt, lt->is_write, offset, bytes, ret,
+                                lt->start_ns - lt->submit_ns,
+                                lt->drained_ns - lt->start_ns,
+                                lt->throttled_ns - lt->drained_ns,
+                                lt->done_ns - lt->throttled_ns,
+                                get_clock() - lt->done_ns);
+    }
+}
+
 /* To be called between exactly one pair of blk_inc/dec_in_flight() */
 static int coroutine_fn
 blk_co_do_preadv_part(BlockBackend *blk, int64_t offset, int64_t bytes,
                       QEMUIOVector *qiov, size_t qiov_offset,
-                      BdrvRequestFlags flags)
+                      BdrvRequestFlags flags, BlkLatencyTrace *lt)
 {
     int ret;
     BlockDriverState *bs;
+    BlkLatencyTrace own_lt;
     IO_CODE();
 
+    /* Requests from blk_aio_*() were sampled on submission */
+    if (!lt) {
+        blk_latency_trace_sample(blk, &own_lt, false);
+        lt = &own_lt;
+    }
+    blk_latency_trace_mark(lt, &lt->start_ns);
     blk_wait_while_drained(blk);
     GRAPH_RDLOCK_GUARD();
 
@@ -1348,15 +1436,21 @@ blk_co_do_preadv_part(BlockBackend *blk, int64_t offset, int64_t bytes,
     }
 
     bdrv_inc_in_flight(bs);
+    blk_latency_trace_mark(lt, &lt->drained_ns);
 
     /* throttling disk I/O */
     if (blk->public.throttle_group_member.throttle_state) {
         throttle_group_co_io_limits_intercept(&blk->public.throttle_group_member,
                 bytes, THROTTLE_READ);
     }
+    blk_latency_trace_io_start(lt);
 
     ret = bdrv_co_preadv_part(blk->root, offset, bytes, qiov, qiov_offset,
                               flags);
+    blk_latency_trace_io_end(lt);
+    if (lt == &own_lt) {
+        blk_latency_trace_done(blk, lt, offset, bytes, ret);
+    }
     bdrv_dec_in_flight(bs);
     return ret;
 }
@@ -1380,7 +1474,7 @@ int coroutine_fn blk_co_preadv(BlockBackend *blk, int64_t offset,
     IO_OR_GS_CODE();
 
     blk_inc_in_flight(blk);
-    ret = blk_co_do_preadv_part(blk, offset, bytes, qiov, 0, flags);
+    ret = blk_co_do_preadv_part(blk, offset, bytes, qiov, 0, flags, NULL);
     blk_dec_in_flight(blk);
 
     return ret;
@@ -1394,7 +1488,8 @@ int coroutine_fn blk_co_preadv_part(BlockBackend *blk, int64_t offset,
     IO_OR_GS_CODE();
 
     blk_inc_in_flight(blk);
-    ret = blk_co_do_preadv_part(blk, offset, bytes, qiov, qiov_offset, flags);
+    ret = blk_co_do_preadv_part(blk, offset, bytes, qiov, qiov_offset, flags,
+                                NULL);
     blk_dec_in_flight(blk);
 
     return ret;
@@ -1404,12 +1499,19 @@ int coroutine_fn blk_co_preadv_part(BlockBackend *blk, int64_t offset,
 static int coroutine_fn
 blk_co_do_pwritev_part(BlockBackend *blk, int64_t offset, int64_t bytes,
                        QEMUIOVector *qiov, size_t qiov_offset,
-                       BdrvRequestFlags flags)
+                       BdrvRequestFlags flags, BlkLatencyTrace *lt)
 {
     int ret;
     BlockDriverState *bs;
+    BlkLatencyTrace own_lt;
     IO_CODE();
 
+    /* Requests from blk_aio_*() were sampled on submission */
+    if (!lt) {
+        blk_latency_trace_sample(blk, &own_lt, true);
+        lt = &own_lt;
+    }
+    blk_latency_trace_mark(lt, &lt->start_ns);
     blk_wait_while_drained(blk);
     GRAPH_RDLOCK_GUARD();
 
@@ -1423,11 +1525,14 @@ blk_co_do_pwritev_part(BlockBackend *blk, int64_t offset, int64_t bytes,
     }
 
     bdrv_inc_in_flight(bs);
+    blk_latency_trace_mark(lt, &lt->drained_ns);
+
     /* throttling disk I/O */
     if (blk->public.throttle_group_member.throttle_state) {
         throttle_group_co_io_limits_intercept(&blk->public.throttle_group_member,
                 bytes, THROTTLE_WRITE);
     }
+    blk_latency_trace_io_start(lt);
 
     if (!blk->enable_write_cache) {
         flags |= BDRV_REQ_FUA;
@@ -1435,6 +1540,10 @@ blk_co_do_pwritev_part(BlockBackend *blk, int64_t offset, int64_t bytes,
 
     ret = bdrv_co_pwritev_part(blk->root, offset, bytes, qiov, qiov_offset,
                                flags);
+    blk_latency_trace_io_end(lt);
+    if (lt == &own_lt) {
+        blk_latency_trace_done(blk, lt, offset, bytes, ret);
+    }
     bdrv_dec_in_flight(bs);
     return ret;
 }
@@ -1448,7 +1557,8 @@ int coroutine_fn blk_co_pwritev_part(BlockBackend *blk, int64_t offset,
     IO_OR_GS_CODE();
 
     blk_inc_in_flight(blk);
-    ret = blk_co_do_pwritev_part(blk, offset, bytes, qiov, qiov_offset, flags);
+    ret = blk_co_do_pwritev_part(blk, offset, bytes, qiov, qiov_offset, flags,
+                                 NULL);
     blk_dec_in_flight(blk);
 
     return ret;
@@ -1554,15 +1664,21 @@ typedef struct BlkAioEmAIOCB {
     BlkRwCo rwco;
     int64_t bytes;
     bool has_returned;
+    BlkLatencyTrace lt;
 } BlkAioEmAIOCB;
 
 static const AIOCBInfo blk_aio_em_aiocb_info = {
     .aiocb_size         = sizeof(BlkAioEmAIOCB),
 };
 
+static void coroutine_fn blk_aio_read_entry(void *opaque);
+static void coroutine_fn blk_aio_write_entry(void *opaque);
+
 static void blk_aio_complete(BlkAioEmAIOCB *acb)
 {
     if (acb->has_returned) {
+        blk_latency_trace_done(acb->rwco.blk, &acb->lt, acb->rwco.offset,
+                               acb->bytes, acb->rwco.ret);
         acb->common.cb(acb->common.opaque, acb->rwco.ret);
         blk_dec_in_flight(acb->rwco.blk);
         qemu_aio_unref(acb);
@@ -1596,6 +1712,12 @@ static BlockAIOCB *blk_aio_prwv(BlockBackend *blk, int64_t offset,
     };
     acb->bytes = bytes;
     acb->has_returned = false;
+    if (co_entry == blk_aio_read_entry || co_entry == blk_aio_write_entry) {
+        blk_latency_trace_sample(blk, &acb->lt,
+                                 co_entry == blk_aio_write_entry);
+    } else {
+        acb->lt = (BlkLatencyTrace) {};
+    }
 
     co = qemu_coroutine_create(co_entry, acb);
     aio_co_enter(qemu_get_current_aio_context(), co);
@@ -1617,7 +1739,7 @@ static void coroutine_fn blk_aio_read_entry(void *opaque)
 
     assert(qiov->size == acb->bytes);
     rwco->ret = blk_co_do_preadv_part(rwco->blk, rwco->offset, acb->bytes, qiov,
-                                      0, rwco->flags);
+                                      0, rwco->flags, &acb->lt);
     blk_aio_complete(acb);
 }
 
@@ -1629,7 +1751,7 @@ static void coroutine_fn blk_aio_write_entry(void *opaque)
 
     assert(!qiov || qiov->size == acb->bytes);
     rwco->ret = blk_co_do_pwritev_part(rwco->blk, rwco->offset, acb->bytes,
-                                       qiov, 0, rwco->flags);
+                                       qiov, 0, rwco->flags, &acb->lt);
     blk_aio_complete(acb);
 }
 
@@ -1902,6 +2024,7 @@ BlockAIOCB *blk_aio_zone_report(BlockBackend *blk, int64_t offset,
     };
     acb->bytes = (int64_t)(uintptr_t)nr_zones,
     acb->has_returned = false;
+    acb->lt = (BlkLatencyTrace) {};
 
     co = qemu_coroutine_create(blk_aio_zone_report_entry, acb);
     aio_co_enter(qemu_get_current_aio_context(), co);
@@ -1943,6 +2066,7 @@ BlockAIOCB *blk_aio_zone_mgmt(BlockBackend *blk, BlockZoneOp op,
     };
     acb->bytes = len;
     acb->has_returned = false;
+    acb->lt = (BlkLatencyTrace) {};
 
     co = qemu_coroutine_create(blk_aio_zone_mgmt_entry, acb);
     aio_co_enter(qemu_get_current_aio_context(), co);
@@ -1983,6 +2107,7 @@ BlockAIOCB *blk_aio_zone_append(BlockBackend *blk, int64_t *offset,
     };
     acb->bytes = (int64_t)(uintptr_t)offset;
     acb->has_returned = false;
+    acb->lt = (BlkLatencyTrace) {};
 
     co = qemu_coroutine_create(blk_aio_zone_append_entry, acb);
     aio_co_enter(qemu_get_current_aio_context(), co);
@@ -2821,6 +2946,47 @@ int coroutine_fn blk_co_copy_range(BlockBackend *blk_in, int64_t off_in,
                               bytes, read_flags, write_flags);
 }
 
+/*
+ * Send guest data directly from the image file to @out_fd.  See
+ * bdrv_co_sendfile() for the semantics; in particular, the caller must be
+ * ready to fall back to blk_co_preadv() on -ENOTSUP.
+ *
+ * A request usually takes several calls because of short writes and
+ * -EAGAIN.  Pass @throttle only on the first of them, with @bytes covering
+ * the whole request, so that the request is charged to the throttle group
+ * exactly once.
+ */
+int coroutine_fn blk_co_sendfile(BlockBackend *blk, int64_t offset,
+                                 int64_t bytes, int out_fd, bool throttle)
+{
+    BlockDriverState *bs;
+    int ret;
+    IO_CODE();
+
+    blk_wait_while_drained(blk);
+    GRAPH_RDLOCK_GUARD();
+
+    /* Call blk_bs() only after waiting, the graph may have changed */
+    bs = blk_bs(blk);
+    ret = blk_check_byte_request(blk, offset, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+
+    bdrv_inc_in_flight(bs);
+
+    /* throttling disk I/O */
+    if (throttle && bytes &&
+        blk->public.throttle_group_member.throttle_state) {
+        throttle_group_co_io_limits_intercept(&blk->public.throttle_group_member,
+                bytes, THROTTLE_READ);
+    }
+
+    ret = bdrv_co_sendfile(blk->root, offset, bytes, out_fd);
+    bdrv_dec_in_flight(bs);
+    return ret;
+}
+
 const BdrvChild *blk_root(BlockBackend *blk)
 {
     GLOBAL_STATE_CODE();
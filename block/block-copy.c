@@ -33,6 +33,7 @@
 #define BLOCK_COPY_MAX_BUFFER (1 * MiB)
 #define BLOCK_COPY_MAX_MEM (128 * MiB)
 #define BLOCK_COPY_MAX_WORKERS 64
+#define BLOCK_COPY_MAX_CAPTURE_WRITE (16 * MiB)
 #define BLOCK_COPY_SLICE_TIME 100000000ULL /* ns */
 #define BLOCK_COPY_CLUSTER_SIZE_DEFAULT (1 << 16)
 
@@ -112,6 +113,14 @@ static int64_t task_end(BlockCopyTask *task)
     return task->req.offset + task->req.bytes;
 }
 
+typedef struct BlockCopyCapture {
+    BlockCopyState *s;
+    /* In s->reqs while the source is read, in s->captures afterwards */
+    BlockReq req;
+    void *buf;
+    bool zero; /* Reads as zeroes: no buffer, write zeroes to the target */
+} BlockCopyCapture;
+
 typedef struct BlockCopyState {
     /*
      * BdrvChild objects are not owned or managed by block-copy. They are
@@ -139,6 +148,10 @@ typedef struct BlockCopyState {
     BlockCopyMethod method;
     bool discard_source;
     BlockReqList reqs;
+    /* Areas captured in memory that are not yet written to the target */
+    BlockReqList captures;
+    /* First failure to write captured data to the target */
+    int capture_error;
     QLIST_HEAD(, BlockCopyCallState) calls;
     /*
      * skip_unallocated:
@@ -269,6 +282,8 @@ void block_copy_state_free(BlockCopyState *s)
         return;
     }
 
+    assert(QLIST_EMPTY(&s->captures));
+
     ratelimit_destroy(&s->rate_limit);
     bdrv_release_dirty_bitmap(s->copy_bitmap);
     shres_destroy(s->mem);
@@ -442,6 +457,7 @@ BlockCopyState *block_copy_state_new(BdrvChild *source, BdrvChild *target,
     ratelimit_init(&s->rate_limit);
     qemu_co_mutex_init(&s->lock);
     QLIST_INIT(&s->reqs);
+    QLIST_INIT(&s->captures);
     QLIST_INIT(&s->calls);
 
     return s;
@@ -887,6 +903,11 @@ block_copy_common(BlockCopyCallState *call_state)
                  */
                 ret = reqlist_wait_one(&s->reqs, call_state->offset,
                                        call_state->bytes, &s->lock);
+                if (ret == 0) {
+                    /* Captured data must reach the target, too */
+                    ret = reqlist_wait_one(&s->captures, call_state->offset,
+                                           call_state->bytes, &s->lock);
+                }
                 if (ret == 0) {
                     /*
                      * No pending tasks, but check again the bitmap in this
@@ -917,6 +938,14 @@ block_copy_common(BlockCopyCallState *call_state)
          */
     } while (ret > 0 && !qatomic_read(&call_state->cancelled));
 
+    WITH_QEMU_LOCK_GUARD(&s->lock) {
+        /* Lost captured data means that the copy is not complete */
+        if (s->capture_error && !call_state->ret) {
+            call_state->ret = s->capture_error;
+            call_state->error_is_read = false;
+        }
+    }
+
     qatomic_store_release(&call_state->finished, true);
 
     if (call_state->cb) {
@@ -969,6 +998,214 @@ int coroutine_fn block_copy(BlockCopyState *s, int64_t start, int64_t bytes,
     return ret;
 }
 
+/*
+ * Capture the first dirty area in the cluster-aligned region @offset/@bytes,
+ * at most @max_bytes long: read it from the source into memory and take it
+ * over from the copy bitmap.  Until block_copy_capture_write() writes the
+ * data to the target, the area is accounted as in flight and block_copy()
+ * calls covering it wait for it.
+ */
+int64_t coroutine_fn GRAPH_RDLOCK
+block_copy_capture(BlockCopyState *s, int64_t offset, int64_t bytes,
+                   int64_t max_bytes, int64_t *capture_offset,
+                   BlockCopyCapture **capture)
+{
+    BlockCopyCapture *c;
+    int64_t area_offset, area_bytes, status_bytes, nbytes;
+    int ret, status;
+
+    assert(QEMU_IS_ALIGNED(offset, s->cluster_size));
+    assert(QEMU_IS_ALIGNED(bytes, s->cluster_size));
+
+    qemu_co_mutex_lock(&s->lock);
+    max_bytes = QEMU_ALIGN_DOWN(MIN(max_bytes, block_copy_chunk_size(s)),
+                                s->cluster_size);
+    if (max_bytes == 0) {
+        qemu_co_mutex_unlock(&s->lock);
+        return -ENOSPC;
+    }
+
+    for (;;) {
+        while (!bdrv_dirty_bitmap_next_dirty_area(s->copy_bitmap,
+                                                  offset, offset + bytes,
+                                                  max_bytes, &area_offset,
+                                                  &area_bytes))
+        {
+            /*
+             * Nothing dirty.  Copies that are in flight may still fail and
+             * set dirty bits again, so wait for them before reporting that.
+             */
+            if (!reqlist_wait_one(&s->reqs, offset, bytes, &s->lock)) {
+                qemu_co_mutex_unlock(&s->lock);
+                return 0;
+            }
+        }
+
+        area_bytes = QEMU_ALIGN_UP(area_bytes, s->cluster_size);
+        assert(!reqlist_find_conflict(&s->reqs, area_offset, area_bytes));
+
+        bdrv_reset_dirty_bitmap(s->copy_bitmap, area_offset, area_bytes);
+        s->in_flight_bytes += area_bytes;
+
+        c = g_new0(BlockCopyCapture, 1);
+        c->s = s;
+        reqlist_init_req(&s->reqs, &c->req, area_offset, area_bytes);
+        qemu_co_mutex_unlock(&s->lock);
+
+        /* Same allocation and zero checks as block_copy_dirty_clusters() */
+        status = block_copy_block_status(s, area_offset, area_bytes,
+                                         &status_bytes);
+
+        qemu_co_mutex_lock(&s->lock);
+        if (status_bytes < area_bytes) {
+            s->in_flight_bytes -= area_bytes - status_bytes;
+            bdrv_set_dirty_bitmap(s->copy_bitmap, area_offset + status_bytes,
+                                  area_bytes - status_bytes);
+            reqlist_shrink_req(&c->req, status_bytes);
+            area_bytes = status_bytes;
+        }
+        if (!qatomic_read(&s->skip_unallocated) ||
+            (status & BDRV_BLOCK_ALLOCATED)) {
+            break;
+        }
+
+        /* Unallocated and skipped by block_copy() as well */
+        s->in_flight_bytes -= area_bytes;
+        if (s->progress) {
+            progress_set_remaining(s->progress,
+                                   bdrv_get_dirty_count(s->copy_bitmap) +
+                                   s->in_flight_bytes);
+        }
+        reqlist_remove_req(&c->req);
+        g_free(c);
+        trace_block_copy_skip_range(s, area_offset, area_bytes);
+    }
+    qemu_co_mutex_unlock(&s->lock);
+
+    if (status & BDRV_BLOCK_ZERO) {
+        /* Nothing to keep in memory */
+        c->zero = true;
+        ret = 0;
+    } else {
+        nbytes = MIN(area_offset + area_bytes, s->len) - area_offset;
+        c->buf = qemu_try_blockalign(s->source->bs, nbytes);
+        if (!c->buf) {
+            ret = -ENOMEM;
+        } else {
+            ret = bdrv_co_pread(s->source, area_offset, nbytes, c->buf, 0);
+            if (ret < 0) {
+                trace_block_copy_read_fail(s, area_offset, ret);
+            }
+        }
+    }
+
+    QEMU_LOCK_GUARD(&s->lock);
+    reqlist_remove_req(&c->req);
+    if (ret < 0) {
+        s->in_flight_bytes -= area_bytes;
+        bdrv_set_dirty_bitmap(s->copy_bitmap, area_offset, area_bytes);
+        qemu_vfree(c->buf);
+        g_free(c);
+        return ret;
+    }
+
+    reqlist_init_req(&s->captures, &c->req, area_offset, area_bytes);
+    trace_block_copy_capture(s, area_offset, area_bytes);
+
+    *capture_offset = area_offset;
+    *capture = c;
+    return area_bytes;
+}
+
+static void coroutine_fn block_copy_capture_end(BlockCopyCapture *c, int ret)
+{
+    BlockCopyState *s = c->s;
+
+    WITH_QEMU_LOCK_GUARD(&s->lock) {
+        s->in_flight_bytes -= c->req.bytes;
+        if (ret < 0) {
+            if (!s->capture_error) {
+                s->capture_error = ret;
+            }
+        } else if (s->progress) {
+            progress_work_done(s->progress, c->req.bytes);
+        }
+        if (s->progress) {
+            progress_set_remaining(s->progress,
+                                   bdrv_get_dirty_count(s->copy_bitmap) +
+                                   s->in_flight_bytes);
+        }
+        reqlist_remove_req(&c->req);
+    }
+
+    qemu_vfree(c->buf);
+    g_free(c);
+}
+
+/*
+ * Write captured data to the target and release the captures.  Captures
+ * adjacent in @captures, which should be sorted by offset, are combined into
+ * one write request; zero captures are written on their own with write
+ * zeroes.  On failure, the areas are lost for the copy: every block_copy()
+ * call fails from then on.
+ */
+int coroutine_fn GRAPH_RDLOCK
+block_copy_capture_write(BlockCopyState *s, BlockCopyCapture **captures,
+                         int nb_captures)
+{
+    bool merge = !(s->write_flags & BDRV_REQ_WRITE_COMPRESSED);
+    int64_t max_write = MIN(s->max_transfer, BLOCK_COPY_MAX_CAPTURE_WRITE);
+    int i = 0, j, k;
+    int ret = 0;
+
+    while (i < nb_captures) {
+        int64_t start = captures[i]->req.offset;
+        int64_t end = start;
+        QEMUIOVector qiov;
+
+        qemu_iovec_init(&qiov, 1);
+        for (j = i; j < nb_captures; j++) {
+            BlockCopyCapture *c = captures[j];
+            int64_t nbytes = MIN(c->req.offset + c->req.bytes, s->len) -
+                             c->req.offset;
+
+            if (j > i && (!merge || c->zero || captures[i]->zero ||
+                          c->req.offset != end ||
+                          end + nbytes - start > max_write ||
+                          qiov.niov >= IOV_MAX)) {
+                break;
+            }
+            if (!c->zero) {
+                qemu_iovec_add(&qiov, c->buf, nbytes);
+            }
+            end = c->req.offset + nbytes;
+        }
+
+        if (ret == 0 && captures[i]->zero) {
+            ret = bdrv_co_pwrite_zeroes(s->target, start, end - start,
+                                        s->write_flags &
+                                        ~BDRV_REQ_WRITE_COMPRESSED);
+            if (ret < 0) {
+                trace_block_copy_write_zeroes_fail(s, start, ret);
+            }
+        } else if (ret == 0) {
+            ret = bdrv_co_pwritev(s->target, start, end - start, &qiov,
+                                  s->write_flags);
+            if (ret < 0) {
+                trace_block_copy_write_fail(s, start, ret);
+            }
+        }
+        qemu_iovec_destroy(&qiov);
+
+        for (k = i; k < j; k++) {
+            block_copy_capture_end(captures[k], ret);
+        }
+        i = j;
+    }
+
+    return ret;
+}
+
 BlockCopyCallState *block_copy_async(BlockCopyState *s,
                                      int64_t offset, int64_t bytes,
                                      int max_workers, int64_t max_chunk,
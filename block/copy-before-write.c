@@ -39,16 +39,24 @@
 
 #include "qapi/qapi-visit-block-core.h"
 
+/* Old data captured in the cache, waiting to be written to the target */
+typedef struct CbwCacheEntry {
+    BlockReq req;
+    BlockCopyCapture *capture;
+    QSIMPLEQ_ENTRY(CbwCacheEntry) next;
+} CbwCacheEntry;
+
 typedef struct BDRVCopyBeforeWriteState {
     BlockCopyState *bcs;
     BdrvChild *target;
     OnCbwError on_cbw_error;
     uint64_t cbw_timeout_ns;
     bool discard_source;
+    uint64_t cache_size;
 
     /*
-     * @lock: protects access to @access_bitmap, @done_bitmap and
-     * @frozen_read_reqs
+     * @lock: protects access to @access_bitmap, @done_bitmap,
+     * @frozen_read_reqs and the cache fields
      */
     CoMutex lock;
 
@@ -71,6 +79,19 @@ typedef struct BDRVCopyBeforeWriteState {
      */
     BlockReqList frozen_read_reqs;
 
+    /*
+     * @cache_reqs: areas whose old data is held in the cache. Snapshot reads
+     * of these areas wait until the data is written to @target.
+     * @cache_queue: entries not yet picked up by the cache flush coroutine.
+     * @cache_used: bytes of old data in the cache, plus space reserved for
+     * captures in progress.
+     * @cache_flushing: the cache flush coroutine is running.
+     */
+    BlockReqList cache_reqs;
+    QSIMPLEQ_HEAD(, CbwCacheEntry) cache_queue;
+    uint64_t cache_used;
+    bool cache_flushing;
+
     /*
      * @snapshot_error is normally zero. But on first copy-before-write failure
      * when @on_cbw_error == ON_CBW_ERROR_BREAK_SNAPSHOT, @snapshot_error takes
@@ -94,6 +115,144 @@ static void block_copy_cb(void *opaque)
     bdrv_dec_in_flight(bs);
 }
 
+static int cbw_cache_entry_cmp(const void *a, const void *b)
+{
+    const CbwCacheEntry *ea = *(CbwCacheEntry * const *)a;
+    const CbwCacheEntry *eb = *(CbwCacheEntry * const *)b;
+
+    return ea->req.offset < eb->req.offset ? -1 :
+           ea->req.offset > eb->req.offset;
+}
+
+/*
+ * Write the cached old data to the target.  Everything that was captured
+ * while the previous batch was being written forms the next batch, which is
+ * sorted by offset so that adjacent areas are written with one request.
+ */
+static void coroutine_fn cbw_cache_flush_entry(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    BDRVCopyBeforeWriteState *s = bs->opaque;
+
+    for (;;) {
+        g_autofree CbwCacheEntry **entries = NULL;
+        g_autofree BlockCopyCapture **captures = NULL;
+        CbwCacheEntry *entry;
+        int i, n = 0;
+        int ret;
+
+        WITH_QEMU_LOCK_GUARD(&s->lock) {
+            QSIMPLEQ_FOREACH(entry, &s->cache_queue, next) {
+                n++;
+            }
+            if (n == 0) {
+                s->cache_flushing = false;
+                break;
+            }
+
+            entries = g_new(CbwCacheEntry *, n);
+            i = 0;
+            while ((entry = QSIMPLEQ_FIRST(&s->cache_queue))) {
+                QSIMPLEQ_REMOVE_HEAD(&s->cache_queue, next);
+                entries[i++] = entry;
+            }
+        }
+        if (n == 0) {
+            break;
+        }
+
+        qsort(entries, n, sizeof(entries[0]), cbw_cache_entry_cmp);
+        captures = g_new(BlockCopyCapture *, n);
+        for (i = 0; i < n; i++) {
+            captures[i] = entries[i]->capture;
+        }
+
+        WITH_GRAPH_RDLOCK_GUARD() {
+            ret = block_copy_capture_write(s->bcs, captures, n);
+        }
+
+        WITH_QEMU_LOCK_GUARD(&s->lock) {
+            for (i = 0; i < n; i++) {
+                entry = entries[i];
+                if (ret < 0) {
+                    /*
+                     * The guest writes were already completed, so the old data
+                     * is lost whatever on-cbw-error says.
+                     */
+                    if (!s->snapshot_error) {
+                        s->snapshot_error = ret;
+                    }
+                } else {
+                    bdrv_set_dirty_bitmap(s->done_bitmap, entry->req.offset,
+                                          entry->req.bytes);
+                }
+                s->cache_used -= entry->req.bytes;
+                reqlist_remove_req(&entry->req);
+                g_free(entry);
+            }
+        }
+    }
+
+    bdrv_dec_in_flight(bs);
+}
+
+/* Called with s->lock held */
+static void cbw_cache_kick_flush(BlockDriverState *bs)
+{
+    BDRVCopyBeforeWriteState *s = bs->opaque;
+    Coroutine *co;
+
+    if (s->cache_flushing || QSIMPLEQ_EMPTY(&s->cache_queue)) {
+        return;
+    }
+
+    s->cache_flushing = true;
+    bdrv_inc_in_flight(bs);
+    co = qemu_coroutine_create(cbw_cache_flush_entry, bs);
+    aio_co_enter(bdrv_get_aio_context(bs), co);
+}
+
+/*
+ * Capture the old data of the region in the cache instead of copying it to
+ * the target synchronously.
+ *
+ * Returns 0 if nothing in the region needs to be copied anymore.  Otherwise,
+ * typically with -ENOSPC when the cache is full, the caller has to copy what
+ * is left with block_copy().
+ */
+static int coroutine_fn GRAPH_RDLOCK
+cbw_cache_before_write(BlockDriverState *bs, int64_t offset, int64_t bytes)
+{
+    BDRVCopyBeforeWriteState *s = bs->opaque;
+
+    for (;;) {
+        BlockCopyCapture *capture;
+        CbwCacheEntry *entry;
+        int64_t reserved, capture_offset, captured;
+
+        WITH_QEMU_LOCK_GUARD(&s->lock) {
+            reserved = MIN(s->cache_size - s->cache_used, bytes);
+            s->cache_used += reserved;
+        }
+
+        captured = block_copy_capture(s->bcs, offset, bytes, reserved,
+                                      &capture_offset, &capture);
+
+        QEMU_LOCK_GUARD(&s->lock);
+        s->cache_used -= reserved - MAX(captured, 0);
+        if (captured <= 0) {
+            return captured;
+        }
+
+        entry = g_new0(CbwCacheEntry, 1);
+        entry->capture = capture;
+        reqlist_init_req(&s->cache_reqs, &entry->req, capture_offset,
+                         captured);
+        QSIMPLEQ_INSERT_TAIL(&s->cache_queue, entry, next);
+        cbw_cache_kick_flush(bs);
+    }
+}
+
 /*
  * Do copy-before-write operation.
  *
@@ -103,8 +262,9 @@ static void block_copy_cb(void *opaque)
  * node, and it's guaranteed that after cbw_do_copy_before_write() successful
  * return there are no such requests and they will never appear.
  */
-static coroutine_fn int cbw_do_copy_before_write(BlockDriverState *bs,
-        uint64_t offset, uint64_t bytes, BdrvRequestFlags flags)
+static int coroutine_fn GRAPH_RDLOCK
+cbw_do_copy_before_write(BlockDriverState *bs, uint64_t offset,
+                         uint64_t bytes, BdrvRequestFlags flags)
 {
     BDRVCopyBeforeWriteState *s = bs->opaque;
     int ret;
@@ -122,6 +282,13 @@ static coroutine_fn int cbw_do_copy_before_write(BlockDriverState *bs,
     off = QEMU_ALIGN_DOWN(offset, cluster_size);
     end = QEMU_ALIGN_UP(offset + bytes, cluster_size);
 
+    if (s->cache_size && cbw_cache_before_write(bs, off, end - off) == 0) {
+        WITH_QEMU_LOCK_GUARD(&s->lock) {
+            reqlist_wait_all(&s->frozen_read_reqs, off, end - off, &s->lock);
+        }
+        return 0;
+    }
+
     /*
      * Increase in_flight, so that in case of timed-out block-copy, the
      * remaining background block_copy() request (which can't be immediately
@@ -215,6 +382,9 @@ cbw_snapshot_read_lock(BlockDriverState *bs, int64_t offset, int64_t bytes,
 
     QEMU_LOCK_GUARD(&s->lock);
 
+    /* Old data that is still in the cache is not in @target yet */
+    reqlist_wait_all(&s->cache_reqs, offset, bytes, &s->lock);
+
     if (s->snapshot_error) {
         g_free(req);
         return NULL;
@@ -419,6 +589,7 @@ static BlockdevOptions *cbw_parse_options(QDict *options, Error **errp)
     qdict_del(options, "on-cbw-error");
     qdict_del(options, "cbw-timeout");
     qdict_del(options, "min-cluster-size");
+    qdict_del(options, "cbw-cache-size");
 
 out:
     visit_free(v);
@@ -469,6 +640,7 @@ static int cbw_open(BlockDriverState *bs, QDict *options, int flags,
             ON_CBW_ERROR_BREAK_GUEST_WRITE;
     s->cbw_timeout_ns = opts->has_cbw_timeout ?
         opts->cbw_timeout * NANOSECONDS_PER_SECOND : 0;
+    s->cache_size = opts->has_cbw_cache_size ? opts->cbw_cache_size : 0;
 
     bs->total_sectors = bs->file->bs->total_sectors;
     bs->supported_write_flags = BDRV_REQ_WRITE_UNCHANGED |
@@ -507,6 +679,8 @@ static int cbw_open(BlockDriverState *bs, QDict *options, int flags,
 
     qemu_co_mutex_init(&s->lock);
     QLIST_INIT(&s->frozen_read_reqs);
+    QLIST_INIT(&s->cache_reqs);
+    QSIMPLEQ_INIT(&s->cache_queue);
     return 0;
 }
 
@@ -514,6 +688,9 @@ static void cbw_close(BlockDriverState *bs)
 {
     BDRVCopyBeforeWriteState *s = bs->opaque;
 
+    /* Drained, so the cache flush coroutine has emptied the cache */
+    assert(QLIST_EMPTY(&s->cache_reqs) && !s->cache_flushing);
+
     bdrv_release_dirty_bitmap(s->access_bitmap);
     bdrv_release_dirty_bitmap(s->done_bitmap);
 
@@ -550,6 +727,7 @@ BlockDriverState *bdrv_cbw_append(BlockDriverState *source,
                                   const char *filter_node_name,
                                   bool discard_source,
                                   uint64_t min_cluster_size,
+                                  uint64_t cache_size,
                                   BlockCopyState **bcs,
                                   OnCbwError on_cbw_error,
                                   Error **errp)
@@ -578,6 +756,9 @@ BlockDriverState *bdrv_cbw_append(BlockDriverState *source,
         return NULL;
     }
     qdict_put_int(opts, "min-cluster-size", (int64_t)min_cluster_size);
+    if (cache_size) {
+        qdict_put_int(opts, "cbw-cache-size", (int64_t)cache_size);
+    }
 
     top = bdrv_insert_node(source, opts, flags, errp);
     if (!top) {
@@ -41,6 +41,7 @@ BlockDriverState *bdrv_cbw_append(BlockDriverState *source,
                                   const char *filter_node_name,
                                   bool discard_source,
                                   uint64_t min_cluster_size,
+                                  uint64_t cache_size,
                                   BlockCopyState **bcs,
                                   OnCbwError on_cbw_error,
                                   Error **errp);
@@ -21,14 +21,17 @@
 #include "qemu/osdep.h"
 #include "qemu/memalign.h"
 #include "block/aio.h"
+#include "block/aio-wait.h"
 #include "block/block_int-common.h"
 #include "block/export.h"
 #include "block/fuse.h"
 #include "block/qapi.h"
 #include "qapi/error.h"
 #include "qapi/qapi-commands-block.h"
+#include "qemu/coroutine.h"
 #include "qemu/main-loop.h"
 #include "system/block-backend.h"
+#include "system/iothread.h"
 
 #include <fuse.h>
 #include <fuse_lowlevel.h>
@@ -44,8 +47,33 @@
 /* Prevent overly long bounce buffer allocations */
 #define FUSE_MAX_BOUNCE_BYTES (MIN(BDRV_REQUEST_MAX_BYTES, 64 * 1024 * 1024))
 
+typedef struct FuseExport FuseExport;
 
-typedef struct FuseExport {
+/*
+ * A request received by an additional queue, processed in its own coroutine.
+ * Once done, it is put back on its queue's list of spare requests so that its
+ * buffer can be reused.
+ */
+typedef struct FuseQueueRequest {
+    struct FuseQueue *q;
+    struct fuse_buf fuse_buf;
+    QSLIST_ENTRY(FuseQueueRequest) next;
+} FuseQueueRequest;
+
+/*
+ * An additional queue polling the FUSE session FD in an iothread.  All
+ * queues share the same FD, so whichever thread picks up a request first
+ * processes it.
+ */
+typedef struct FuseQueue {
+    FuseExport *exp;
+    AioContext *ctx;
+
+    /* Only accessed in @ctx's thread */
+    QSLIST_HEAD(, FuseQueueRequest) spare_reqs;
+} FuseQueue;
+
+struct FuseExport {
     BlockExport common;
 
     struct fuse_session *fuse_session;
@@ -53,16 +81,24 @@ typedef struct FuseExport {
     unsigned int in_flight; /* atomic */
     bool mounted, fd_handler_set_up;
 
+    FuseQueue *queues;
+    size_t num_queues;
+
     char *mountpoint;
     bool writable;
     bool growable;
+    /*
+     * Serializes resizes, so that concurrent requests extending the image
+     * cannot shrink it again by finishing out of order
+     */
+    CoMutex resize_lock;
     /* Whether allow_other was used as a mount option or not */
     bool allow_other;
 
     mode_t st_mode;
     uid_t st_uid;
     gid_t st_gid;
-} FuseExport;
+};
 
 static GHashTable *exports;
 static const struct fuse_lowlevel_ops fuse_ops;
@@ -75,18 +111,50 @@ static void init_exports_table(void);
 static int setup_fuse_export(FuseExport *exp, const char *mountpoint,
                              bool allow_other, Error **errp);
 static void read_from_fuse_export(void *opaque);
+static void read_from_fuse_queue(void *opaque);
 
 static bool is_regular_file(const char *path, Error **errp);
 
 
+/**
+ * Install the FD handlers polling the FUSE session, or remove them if
+ * @enable is false: One in the export's AioContext, and one for each
+ * additional queue.
+ */
+static void fuse_export_set_fd_handlers(FuseExport *exp, bool enable)
+{
+    int fd = fuse_session_fd(exp->fuse_session);
+    size_t i;
+
+    aio_set_fd_handler(exp->common.ctx, fd,
+                       enable ? read_from_fuse_export : NULL,
+                       NULL, NULL, NULL, enable ? exp : NULL);
+
+    for (i = 0; i < exp->num_queues; i++) {
+        FuseQueue *q = &exp->queues[i];
+
+        /*
+         * There can only be one handler per FD in an AioContext, so if the
+         * node has been moved into this queue's iothread, leave it to the
+         * export's handler
+         */
+        if (enable && q->ctx == exp->common.ctx) {
+            continue;
+        }
+
+        aio_set_fd_handler(q->ctx, fd,
+                           enable ? read_from_fuse_queue : NULL,
+                           NULL, NULL, NULL, enable ? q : NULL);
+    }
+
+    exp->fd_handler_set_up = enable;
+}
+
 static void fuse_export_drained_begin(void *opaque)
 {
     FuseExport *exp = opaque;
 
-    aio_set_fd_handler(exp->common.ctx,
-                       fuse_session_fd(exp->fuse_session),
-                       NULL, NULL, NULL, NULL, NULL);
-    exp->fd_handler_set_up = false;
+    fuse_export_set_fd_handlers(exp, false);
 }
 
 static void fuse_export_drained_end(void *opaque)
@@ -96,10 +164,7 @@ static void fuse_export_drained_end(void *opaque)
     /* Refresh AioContext in case it changed */
     exp->common.ctx = blk_get_aio_context(exp->common.blk);
 
-    aio_set_fd_handler(exp->common.ctx,
-                       fuse_session_fd(exp->fuse_session),
-                       read_from_fuse_export, NULL, NULL, NULL, exp);
-    exp->fd_handler_set_up = true;
+    fuse_export_set_fd_handlers(exp, true);
 }
 
 static bool fuse_export_drained_poll(void *opaque)
@@ -178,6 +243,30 @@ static int fuse_export_create(BlockExport *blk_exp,
     exp->mountpoint = g_strdup(args->mountpoint);
     exp->writable = blk_exp_args->writable;
     exp->growable = args->growable;
+    qemu_co_mutex_init(&exp->resize_lock);
+
+    if (args->iothreads) {
+        strList *e;
+        size_t i = 0;
+
+        exp->num_queues = QAPI_LIST_LENGTH(args->iothreads);
+        exp->queues = g_new0(FuseQueue, exp->num_queues);
+
+        for (e = args->iothreads; e; e = e->next) {
+            IOThread *iothread = iothread_by_id(e->value);
+
+            if (!iothread) {
+                error_setg(errp, "iothread \"%s\" not found", e->value);
+                ret = -EINVAL;
+                goto fail;
+            }
+
+            exp->queues[i++] = (FuseQueue) {
+                .exp = exp,
+                .ctx = iothread_get_aio_context(iothread),
+            };
+        }
+    }
 
     /* set default */
     if (!args->has_allow_other) {
@@ -269,10 +358,19 @@ static int setup_fuse_export(FuseExport *exp, const char *mountpoint,
 
     g_hash_table_insert(exports, g_strdup(mountpoint), NULL);
 
-    aio_set_fd_handler(exp->common.ctx,
-                       fuse_session_fd(exp->fuse_session),
-                       read_from_fuse_export, NULL, NULL, NULL, exp);
-    exp->fd_handler_set_up = true;
+    /*
+     * With more than one thread polling the FD, a thread may find that
+     * another one has already taken the request it was woken up for, and
+     * must then not block in read()
+     */
+    if (exp->num_queues > 0 &&
+        !qemu_set_blocking(fuse_session_fd(exp->fuse_session), false, errp))
+    {
+        ret = -EIO;
+        goto fail;
+    }
+
+    fuse_export_set_fd_handlers(exp, true);
 
     return 0;
 
@@ -311,6 +409,66 @@ out:
     blk_exp_unref(&exp->common);
 }
 
+static void coroutine_fn fuse_queue_co_process(void *opaque)
+{
+    FuseQueueRequest *req = opaque;
+    FuseQueue *q = req->q;
+    FuseExport *exp = q->exp;
+
+    fuse_session_process_buf(exp->fuse_session, &req->fuse_buf);
+
+    QSLIST_INSERT_HEAD(&q->spare_reqs, req, next);
+
+    if (qatomic_fetch_dec(&exp->in_flight) == 1) {
+        aio_wait_kick(); /* wake AIO_WAIT_WHILE() */
+    }
+
+    blk_exp_unref(&exp->common);
+}
+
+/**
+ * Callback to be invoked in an additional queue's iothread when the FUSE
+ * session FD can be read from.  Unlike read_from_fuse_export(), requests are
+ * processed in coroutines, so block I/O does not need to poll the node's
+ * AioContext and several requests can be in flight at the same time.
+ */
+static void read_from_fuse_queue(void *opaque)
+{
+    FuseQueue *q = opaque;
+    FuseExport *exp = q->exp;
+    FuseQueueRequest *req;
+    Coroutine *co;
+    int ret;
+
+    blk_exp_ref(&exp->common);
+
+    qatomic_inc(&exp->in_flight);
+
+    req = QSLIST_FIRST(&q->spare_reqs);
+    if (req) {
+        QSLIST_REMOVE_HEAD(&q->spare_reqs, next);
+    } else {
+        req = g_new0(FuseQueueRequest, 1);
+        req->q = q;
+    }
+
+    do {
+        ret = fuse_session_receive_buf(exp->fuse_session, &req->fuse_buf);
+    } while (ret == -EINTR);
+    if (ret <= 0) {
+        /* -EAGAIN means that another queue has taken the request */
+        QSLIST_INSERT_HEAD(&q->spare_reqs, req, next);
+        if (qatomic_fetch_dec(&exp->in_flight) == 1) {
+            aio_wait_kick(); /* wake AIO_WAIT_WHILE() */
+        }
+        blk_exp_unref(&exp->common);
+        return;
+    }
+
+    co = qemu_coroutine_create(fuse_queue_co_process, req);
+    qemu_coroutine_enter(co);
+}
+
 static void fuse_export_shutdown(BlockExport *blk_exp)
 {
     FuseExport *exp = container_of(blk_exp, FuseExport, common);
@@ -319,10 +477,7 @@ static void fuse_export_shutdown(BlockExport *blk_exp)
         fuse_session_exit(exp->fuse_session);
 
         if (exp->fd_handler_set_up) {
-            aio_set_fd_handler(exp->common.ctx,
-                               fuse_session_fd(exp->fuse_session),
-                               NULL, NULL, NULL, NULL, NULL);
-            exp->fd_handler_set_up = false;
+            fuse_export_set_fd_handlers(exp, false);
         }
     }
 
@@ -338,6 +493,7 @@ static void fuse_export_shutdown(BlockExport *blk_exp)
 static void fuse_export_delete(BlockExport *blk_exp)
 {
     FuseExport *exp = container_of(blk_exp, FuseExport, common);
+    size_t i;
 
     if (exp->fuse_session) {
         if (exp->mounted) {
@@ -347,6 +503,16 @@ static void fuse_export_delete(BlockExport *blk_exp)
         fuse_session_destroy(exp->fuse_session);
     }
 
+    for (i = 0; i < exp->num_queues; i++) {
+        FuseQueueRequest *req, *next_req;
+
+        QSLIST_FOREACH_SAFE(req, &exp->queues[i].spare_reqs, next, next_req) {
+            free(req->fuse_buf.mem);
+            g_free(req);
+        }
+    }
+    g_free(exp->queues);
+
     free(exp->fuse_buf.mem);
     g_free(exp->mountpoint);
 }
@@ -400,6 +566,26 @@ static void fuse_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
     fuse_reply_err(req, ENOENT);
 }
 
+static int64_t coroutine_fn
+fuse_co_get_allocated_file_size(BlockDriverState *bs)
+{
+    GRAPH_RDLOCK_GUARD();
+    return bdrv_co_get_allocated_file_size(bs);
+}
+
+/**
+ * bdrv_get_allocated_file_size() must not be called in coroutine context,
+ * which requests from additional queues are processed in.
+ */
+static int64_t coroutine_mixed_fn
+fuse_get_allocated_file_size(BlockDriverState *bs)
+{
+    if (qemu_in_coroutine()) {
+        return fuse_co_get_allocated_file_size(bs);
+    }
+    return bdrv_get_allocated_file_size(bs);
+}
+
 /**
  * Let clients get file attributes (i.e., stat() the file).
  */
@@ -417,7 +603,7 @@ static void fuse_getattr(fuse_req_t req, fuse_ino_t inode,
         return;
     }
 
-    allocated_blocks = bdrv_get_allocated_file_size(blk_bs(exp->common.blk));
+    allocated_blocks = fuse_get_allocated_file_size(blk_bs(exp->common.blk));
     if (allocated_blocks <= 0) {
         allocated_blocks = DIV_ROUND_UP(length, 512);
     } else {
@@ -485,6 +671,76 @@ static int fuse_do_truncate(const FuseExport *exp, int64_t size,
     return ret;
 }
 
+typedef struct FuseResizeCo {
+    FuseExport *exp;
+    int64_t size;
+    bool grow_only;
+    bool req_zero_write;
+    PreallocMode prealloc;
+    int ret;
+} FuseResizeCo;
+
+/**
+ * Resize the image to @size under exp->resize_lock.  If @grow_only is
+ * true, nothing is done unless the image is still smaller than @size once
+ * the lock is taken.
+ */
+static int coroutine_fn fuse_co_resize(FuseExport *exp, int64_t size,
+                                       bool grow_only, bool req_zero_write,
+                                       PreallocMode prealloc)
+{
+    int64_t length;
+
+    QEMU_LOCK_GUARD(&exp->resize_lock);
+
+    if (grow_only) {
+        length = blk_co_getlength(exp->common.blk);
+        if (length < 0) {
+            return length;
+        }
+        if (size <= length) {
+            return 0;
+        }
+    }
+
+    return fuse_do_truncate(exp, size, req_zero_write, prealloc);
+}
+
+static void coroutine_fn fuse_resize_entry(void *opaque)
+{
+    FuseResizeCo *rco = opaque;
+
+    rco->ret = fuse_co_resize(rco->exp, rco->size, rco->grow_only,
+                              rco->req_zero_write, rco->prealloc);
+    aio_wait_kick();
+}
+
+/**
+ * Requests from additional queues are processed in coroutines, those from
+ * the export's own thread are not, so take the lock in a coroutine for them.
+ */
+static int coroutine_mixed_fn fuse_resize(FuseExport *exp, int64_t size,
+                                          bool grow_only, bool req_zero_write,
+                                          PreallocMode prealloc)
+{
+    FuseResizeCo rco = {
+        .exp = exp,
+        .size = size,
+        .grow_only = grow_only,
+        .req_zero_write = req_zero_write,
+        .prealloc = prealloc,
+        .ret = -EINPROGRESS,
+    };
+
+    if (qemu_in_coroutine()) {
+        return fuse_co_resize(exp, size, grow_only, req_zero_write, prealloc);
+    }
+
+    qemu_coroutine_enter(qemu_coroutine_create(fuse_resize_entry, &rco));
+    AIO_WAIT_WHILE(exp->common.ctx, rco.ret == -EINPROGRESS);
+    return rco.ret;
+}
+
 /**
  * Let clients set file attributes.  Only resizing and changing
  * permissions (st_mode, st_uid, st_gid) is allowed.
@@ -538,7 +794,8 @@ static void fuse_setattr(fuse_req_t req, fuse_ino_t inode, struct stat *statbuf,
             return;
         }
 
-        ret = fuse_do_truncate(exp, statbuf->st_size, true, PREALLOC_MODE_OFF);
+        ret = fuse_resize(exp, statbuf->st_size, false, true,
+                          PREALLOC_MODE_OFF);
         if (ret < 0) {
             fuse_reply_err(req, -ret);
             return;
@@ -650,7 +907,8 @@ static void fuse_write(fuse_req_t req, fuse_ino_t inode, const char *buf,
 
     if (offset + size > length) {
         if (exp->growable) {
-            ret = fuse_do_truncate(exp, offset + size, true, PREALLOC_MODE_OFF);
+            ret = fuse_resize(exp, offset + size, true, true,
+                              PREALLOC_MODE_OFF);
             if (ret < 0) {
                 fuse_reply_err(req, -ret);
                 return;
@@ -705,15 +963,15 @@ static void fuse_fallocate(fuse_req_t req, fuse_ino_t inode, int mode,
 
         if (offset > blk_len) {
             /* No preallocation needed here */
-            ret = fuse_do_truncate(exp, offset, true, PREALLOC_MODE_OFF);
+            ret = fuse_resize(exp, offset, true, true, PREALLOC_MODE_OFF);
             if (ret < 0) {
                 fuse_reply_err(req, -ret);
                 return;
             }
         }
 
-        ret = fuse_do_truncate(exp, offset + length, true,
-                               PREALLOC_MODE_FALLOC);
+        ret = fuse_resize(exp, offset + length, true, true,
+                          PREALLOC_MODE_FALLOC);
     }
 #ifdef CONFIG_FALLOCATE_PUNCH_HOLE
     else if (mode & FALLOC_FL_PUNCH_HOLE) {
@@ -744,8 +1002,8 @@ static void fuse_fallocate(fuse_req_t req, fuse_ino_t inode, int mode,
     else if (mode & FALLOC_FL_ZERO_RANGE) {
         if (!(mode & FALLOC_FL_KEEP_SIZE) && offset + length > blk_len) {
             /* No need for zeroes, we are going to write them ourselves */
-            ret = fuse_do_truncate(exp, offset + length, false,
-                                   PREALLOC_MODE_OFF);
+            ret = fuse_resize(exp, offset + length, true, false,
+                              PREALLOC_MODE_OFF);
             if (ret < 0) {
                 fuse_reply_err(req, -ret);
                 return;
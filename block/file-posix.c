@@ -67,6 +67,7 @@
 #ifdef __linux__
 #include <sys/ioctl.h>
 #include <sys/param.h>
+#include <sys/sendfile.h>
 #include <sys/syscall.h>
 #include <sys/vfs.h>
 #if defined(CONFIG_BLKZONED)
@@ -183,6 +184,7 @@ typedef struct BDRVRawState {
     bool use_linux_aio:1;
     bool has_laio_fdsync:1;
     bool use_linux_io_uring:1;
+    bool use_io_uring_fixed_buffers:1;
     bool use_mpath:1;
     int page_cache_inconsistent; /* errno from fdatasync failure */
     bool has_fallocate;
@@ -240,6 +242,9 @@ typedef struct RawPosixAIOData {
             int aio_fd2;
             off_t aio_offset2;
         } copy_range;
+        struct {
+            int out_fd;
+        } sendfile;
         struct {
             PreallocMode prealloc;
             Error **errp;
@@ -585,6 +590,12 @@ static QemuOptsList raw_runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "AIO max batch size (0 = auto handled by AIO backend, default: 0)",
         },
+        {
+            .name = "io-uring-fixed-buffers",
+            .type = QEMU_OPT_BOOL,
+            .help = "register guest RAM as io_uring fixed buffers "
+                    "(default: off)",
+        },
         {
             .name = "locking",
             .type = QEMU_OPT_STRING,
@@ -613,6 +624,29 @@ static QemuOptsList raw_runtime_opts = {
 
 static const char *const mutable_opts[] = { "x-check-cache-dropped", NULL };
 
+/*
+ * With aio=io_uring, s->fd is registered as an io_uring fixed file, which
+ * keeps a reference to the file.  It must be unregistered before s->fd is
+ * closed.
+ */
+static void raw_register_fixed_file(BDRVRawState *s)
+{
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_linux_io_uring) {
+        luring_register_file(s->fd);
+    }
+#endif
+}
+
+static void raw_unregister_fixed_file(BDRVRawState *s)
+{
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_linux_io_uring) {
+        luring_unregister_file(s->fd);
+    }
+#endif
+}
+
 static int raw_open_common(BlockDriverState *bs, QDict *options,
                            int bdrv_flags, int open_flags,
                            bool device, Error **errp)
@@ -666,6 +700,14 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
 
     s->aio_max_batch = qemu_opt_get_number(opts, "aio-max-batch", 0);
 
+    s->use_io_uring_fixed_buffers =
+        qemu_opt_get_bool(opts, "io-uring-fixed-buffers", false);
+    if (s->use_io_uring_fixed_buffers && !s->use_linux_io_uring) {
+        error_setg(errp, "io-uring-fixed-buffers requires aio=io_uring");
+        ret = -EINVAL;
+        goto fail;
+    }
+
     locking = qapi_enum_parse(&OnOffAuto_lookup,
                               qemu_opt_get(opts, "locking"),
                               ON_OFF_AUTO_AUTO, &local_err);
@@ -832,12 +874,19 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     } else if (s->use_linux_io_uring && !luring_has_fua()) {
         bs->supported_write_flags &= ~BDRV_REQ_FUA;
     }
+    if (s->use_io_uring_fixed_buffers) {
+        /* Not a real write flag, only tells us to try the fixed buffers */
+        bs->supported_write_flags |= BDRV_REQ_REGISTERED_BUF;
+    }
 
     bs->supported_zero_flags = BDRV_REQ_MAY_UNMAP | BDRV_REQ_NO_FALLBACK;
     if (S_ISREG(st.st_mode)) {
         /* When extending regular files, we get zeros from the OS */
         bs->supported_truncate_flags = BDRV_REQ_ZERO_WRITE;
     }
+
+    raw_register_fixed_file(s);
+
     ret = 0;
 fail:
     if (ret < 0 && s->fd != -1) {
@@ -2288,6 +2337,54 @@ static int handle_aiocb_copy_range(void *opaque)
     return 0;
 }
 
+#ifdef CONFIG_LINUX
+/*
+ * Returns the number of bytes sent, which is short if @out_fd stopped
+ * accepting data or the end of the file was reached.  Nothing is waited
+ * for here, so that a slow peer does not tie up a worker thread.
+ */
+static int handle_aiocb_sendfile(void *opaque)
+{
+    RawPosixAIOData *aiocb = opaque;
+    int out_fd = aiocb->sendfile.out_fd;
+    uint64_t bytes = aiocb->aio_nbytes;
+    off_t in_off = aiocb->aio_offset;
+
+    while (bytes) {
+        ssize_t ret = sendfile(out_fd, aiocb->aio_fildes, &in_off, bytes);
+        trace_file_sendfile(aiocb->bs, aiocb->aio_fildes, in_off, out_fd,
+                            bytes, ret);
+        if (ret == 0) {
+            /* End of file, the caller sends the rest as zeroes */
+            break;
+        }
+        if (ret < 0) {
+            switch (errno) {
+            case EINTR:
+                continue;
+            case EAGAIN:
+                if (bytes == aiocb->aio_nbytes) {
+                    return -EAGAIN;
+                }
+                break;
+            case ENOSYS:
+            case EINVAL:
+                /*
+                 * The caller can only fall back to buffered I/O as long as
+                 * nothing has been written to @out_fd yet.
+                 */
+                return bytes == aiocb->aio_nbytes ? -ENOTSUP : -EIO;
+            default:
+                return -errno;
+            }
+            break;
+        }
+        bytes -= ret;
+    }
+    return aiocb->aio_nbytes - bytes;
+}
+#endif
+
 static int handle_aiocb_discard(void *opaque)
 {
     RawPosixAIOData *aiocb = opaque;
@@ -2700,6 +2797,7 @@ static void raw_close(BlockDriverState *bs)
 #if defined(CONFIG_BLKZONED)
         g_free(bs->wps);
 #endif
+        raw_unregister_fixed_file(s);
         qemu_close(s->fd);
         s->fd = -1;
     }
@@ -3766,14 +3864,52 @@ static ImageInfoSpecific *raw_get_specific_info(BlockDriverState *bs,
     return spec_info;
 }
 
+#ifdef CONFIG_LINUX_IO_URING
+static bool raw_register_buf(BlockDriverState *bs, void *host, size_t size,
+                             Error **errp)
+{
+    BDRVRawState *s = bs->opaque;
+
+    /* Failing to register is not fatal, requests just do not use the buffer */
+    if (s->use_io_uring_fixed_buffers) {
+        luring_register_buf(host, size);
+    }
+    return true;
+}
+
+static void raw_unregister_buf(BlockDriverState *bs, void *host, size_t size)
+{
+    BDRVRawState *s = bs->opaque;
+
+    if (s->use_io_uring_fixed_buffers) {
+        luring_unregister_buf(host, size);
+    }
+}
+#endif
+
 static BlockStatsSpecificFile get_blockstats_specific_file(BlockDriverState *bs)
 {
     BDRVRawState *s = bs->opaque;
-    return (BlockStatsSpecificFile) {
+    BlockStatsSpecificFile stats = {
         .discard_nb_ok = s->stats.discard_nb_ok,
         .discard_nb_failed = s->stats.discard_nb_failed,
         .discard_bytes_ok = s->stats.discard_bytes_ok,
     };
+
+#ifdef CONFIG_LINUX_AIO
+    if (s->use_linux_aio) {
+        AioContext *ctx = bdrv_get_aio_context(bs);
+
+        if (ctx->linux_aio) {
+            stats.has_aio_max_batch = true;
+            stats.has_aio_completion_latency_ns = true;
+            laio_get_batch_stats(ctx->linux_aio, &stats.aio_max_batch,
+                                 &stats.aio_completion_latency_ns);
+        }
+    }
+#endif
+
+    return stats;
 }
 
 static BlockStatsSpecific *raw_get_specific_stats(BlockDriverState *bs)
@@ -3892,9 +4028,11 @@ static void raw_set_perm(BlockDriverState *bs, uint64_t perm, uint64_t shared)
     /* For reopen, we have already switched to the new fd (.bdrv_set_perm is
      * called after .bdrv_reopen_commit) */
     if (s->perm_change_fd && s->fd != s->perm_change_fd) {
+        raw_unregister_fixed_file(s);
         qemu_close(s->fd);
         s->fd = s->perm_change_fd;
         s->open_flags = s->perm_change_flags;
+        raw_register_fixed_file(s);
     }
     s->perm_change_fd = 0;
 
@@ -3962,6 +4100,40 @@ raw_co_copy_range_to(BlockDriverState *bs,
     return raw_thread_pool_submit(handle_aiocb_copy_range, &acb);
 }
 
+#ifdef CONFIG_LINUX
+static int coroutine_fn
+raw_co_sendfile(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                int out_fd)
+{
+    RawPosixAIOData acb;
+    BDRVRawState *s = bs->opaque;
+
+    /* Don't pull O_DIRECT images into the page cache */
+    if (bs->open_flags & BDRV_O_NOCACHE) {
+        return -ENOTSUP;
+    }
+    if (fd_open(bs) < 0) {
+        return -EIO;
+    }
+    if (!bytes) {
+        return 0;
+    }
+
+    acb = (RawPosixAIOData) {
+        .bs             = bs,
+        .aio_type       = QEMU_AIO_SENDFILE,
+        .aio_fildes     = s->fd,
+        .aio_offset     = offset,
+        .aio_nbytes     = bytes,
+        .sendfile       = {
+            .out_fd         = out_fd,
+        },
+    };
+
+    return raw_thread_pool_submit(handle_aiocb_sendfile, &acb);
+}
+#endif
+
 BlockDriver bdrv_file = {
     .format_name = "file",
     .protocol_name = "file",
@@ -3988,6 +4160,9 @@ BlockDriver bdrv_file = {
     .bdrv_co_pdiscard       = raw_co_pdiscard,
     .bdrv_co_copy_range_from = raw_co_copy_range_from,
     .bdrv_co_copy_range_to  = raw_co_copy_range_to,
+#ifdef CONFIG_LINUX
+    .bdrv_co_sendfile       = raw_co_sendfile,
+#endif
     .bdrv_refresh_limits = raw_refresh_limits,
 
     .bdrv_co_truncate                   = raw_co_truncate,
@@ -3996,6 +4171,10 @@ BlockDriver bdrv_file = {
     .bdrv_get_specific_info             = raw_get_specific_info,
     .bdrv_co_get_allocated_file_size    = raw_co_get_allocated_file_size,
     .bdrv_get_specific_stats = raw_get_specific_stats,
+#ifdef CONFIG_LINUX_IO_URING
+    .bdrv_register_buf = raw_register_buf,
+    .bdrv_unregister_buf = raw_unregister_buf,
+#endif
     .bdrv_check_perm = raw_check_perm,
     .bdrv_set_perm   = raw_set_perm,
     .bdrv_abort_perm_update = raw_abort_perm_update,
@@ -4446,6 +4625,9 @@ static BlockDriver bdrv_host_device = {
     .bdrv_co_pdiscard       = hdev_co_pdiscard,
     .bdrv_co_copy_range_from = raw_co_copy_range_from,
     .bdrv_co_copy_range_to  = raw_co_copy_range_to,
+#ifdef CONFIG_LINUX
+    .bdrv_co_sendfile       = raw_co_sendfile,
+#endif
     .bdrv_refresh_limits = raw_refresh_limits,
 
     .bdrv_co_truncate                   = raw_co_truncate,
@@ -4454,6 +4636,10 @@ static BlockDriver bdrv_host_device = {
     .bdrv_get_specific_info             = raw_get_specific_info,
     .bdrv_co_get_allocated_file_size    = raw_co_get_allocated_file_size,
     .bdrv_get_specific_stats = hdev_get_specific_stats,
+#ifdef CONFIG_LINUX_IO_URING
+    .bdrv_register_buf = raw_register_buf,
+    .bdrv_unregister_buf = raw_unregister_buf,
+#endif
     .bdrv_check_perm = raw_check_perm,
     .bdrv_set_perm   = raw_set_perm,
     .bdrv_abort_perm_update = raw_abort_perm_update,
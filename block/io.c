@@ -1769,6 +1769,93 @@ int coroutine_fn bdrv_co_preadv(BdrvChild *child,
     return bdrv_co_preadv_part(child, offset, bytes, qiov, 0, flags);
 }
 
+/*
+ * Requests sampled for the latency trace events, keyed by the coroutine
+ * that runs them.  The BlockBackend decides whether a request is sampled,
+ * and bdrv_co_rw_latency then times it at every node it reaches in that
+ * coroutine or in the AioTasks it starts.
+ */
+static QemuMutex latency_trace_lock;
+static GHashTable *latency_trace_tags;
+
+static void __attribute__((constructor)) bdrv_latency_trace_init(void)
+{
+    qemu_mutex_init(&latency_trace_lock);
+}
+
+/*
+ * Tag the requests made by the current coroutine with @tag until
+ * bdrv_latency_trace_leave().  Returns the tag it replaces, if any.
+ */
+const void *coroutine_fn bdrv_latency_trace_enter(const void *tag)
+{
+    Coroutine *co = qemu_coroutine_self();
+    const void *prev;
+
+    QEMU_LOCK_GUARD(&latency_trace_lock);
+    if (!latency_trace_tags) {
+        latency_trace_tags = g_hash_table_new(NULL, NULL);
+    }
+    prev = g_hash_table_lookup(latency_trace_tags, co);
+    g_hash_table_insert(latency_trace_tags, co, (gpointer)tag);
+    return prev;
+}
+
+/* Restore the tag @prev returned by bdrv_latency_trace_enter() */
+void coroutine_fn bdrv_latency_trace_leave(const void *prev)
+{
+    Coroutine *co = qemu_coroutine_self();
+
+    QEMU_LOCK_GUARD(&latency_trace_lock);
+    if (prev) {
+        g_hash_table_insert(latency_trace_tags, co, (gpointer)prev);
+    } else {
+        g_hash_table_remove(latency_trace_tags, co);
+    }
+}
+
+/* Returns the tag of the current coroutine, NULL if it is not sampled */
+const void *coroutine_fn bdrv_latency_trace_tag(void)
+{
+    QEMU_LOCK_GUARD(&latency_trace_lock);
+    if (!latency_trace_tags) {
+        return NULL;
+    }
+    return g_hash_table_lookup(latency_trace_tags, qemu_coroutine_self());
+}
+
+typedef struct BdrvLatencyTrace {
+    const void *tag;
+    int64_t start_ns;
+} BdrvLatencyTrace;
+
+/*
+ * Time a sampled request at @bs from the point where it becomes a tracked
+ * request to its completion, including serialisation waits.
+ */
+static void coroutine_fn bdrv_latency_trace_start(BdrvLatencyTrace *lt)
+{
+    *lt = (BdrvLatencyTrace) {};
+    if (!trace_event_get_state_backends(TRACE_BDRV_CO_RW_LATENCY)) {
+        return;
+    }
+    lt->tag = bdrv_latency_trace_tag();
+    if (lt->tag) {
+        lt->start_ns = get_clock();
+    }
+}
+
+static void bdrv_latency_trace_done(BlockDriverState *bs, BdrvLatencyTrace *lt,
+                                    bool is_write, int64_t offset,
+                                    int64_t bytes, int ret)
+{
+    if (lt->tag) {
+        trace_bdrv_co_rw_latency(bs, bdrv_get_node_name(bs), lt->tag,
+                                 is_write, offset, bytes, ret,
+                                 get_clock() - lt->start_ns);
+    }
+}
+
 int coroutine_fn bdrv_co_preadv_part(BdrvChild *child,
     int64_t offset, int64_t bytes,
     QEMUIOVector *qiov, size_t qiov_offset,
@@ -1777,6 +1864,7 @@ int coroutine_fn bdrv_co_preadv_part(BdrvChild *child,
     BlockDriverState *bs = child->bs;
     BdrvTrackedRequest req;
     BdrvRequestPadding pad;
+    BdrvLatencyTrace lt;
     int ret;
     IO_CODE();
 
@@ -1816,11 +1904,13 @@ int coroutine_fn bdrv_co_preadv_part(BdrvChild *child,
         goto fail;
     }
 
+    bdrv_latency_trace_start(&lt);
     tracked_request_begin(&req, bs, offset, bytes, BDRV_TRACKED_READ);
     ret = bdrv_aligned_preadv(child, &req, offset, bytes,
                               bs->bl.request_alignment,
                               qiov, qiov_offset, flags);
     tracked_request_end(&req);
+    bdrv_latency_trace_done(bs, &lt, false, offset, bytes, ret);
     bdrv_padding_finalize(&pad);
 
 fail:
@@ -1829,6 +1919,185 @@ fail:
     return ret;
 }
 
+/* How much of the backing chain to query at once when filling the cache */
+#define BDRV_CHAIN_MAP_FILL_BYTES (16 * MiB)
+
+/*
+ * Follow @depth links down from @bs and return the last one, or NULL if the
+ * chain is shorter or if the walk would skip a layer that must see the read
+ * itself.  *@gen is set to the sum of write_gen of the layers passed.
+ */
+static BdrvChild * GRAPH_RDLOCK
+bdrv_chain_map_walk(BlockDriverState *bs, int depth, uint64_t *gen)
+{
+    BdrvChild *c = bdrv_filter_or_cow_child(bs);
+    int i;
+
+    *gen = 0;
+    for (i = 1; c; i++) {
+        *gen += qatomic_read(&c->bs->write_gen);
+        if (i == depth) {
+            return c;
+        }
+        if (!c->bs->drv || c->bs->drv->is_filter ||
+            qatomic_read(&c->bs->copy_on_read)) {
+            return NULL;
+        }
+        c = bdrv_filter_or_cow_child(c->bs);
+    }
+
+    return NULL;
+}
+
+/*
+ * Look up the layer that provides [offset, offset + *pnum) of @bs's backing
+ * chain.  On success, *pnum is set to the length of the prefix of the range
+ * that the returned link covers.
+ */
+static BdrvChild * GRAPH_RDLOCK
+bdrv_chain_map_lookup(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                      int64_t *pnum)
+{
+    BdrvChainMapEntry entry = { 0 };
+    BdrvChild *owner;
+    uint64_t gen;
+    int i;
+
+    WITH_QEMU_LOCK_GUARD(&bs->chain_map_lock) {
+        if (!bs->chain_map) {
+            return NULL;
+        }
+        for (i = 0; i < BDRV_CHAIN_MAP_ENTRIES; i++) {
+            BdrvChainMapEntry *e = &bs->chain_map->entries[i];
+
+            if (e->owner && offset >= e->offset &&
+                offset < e->offset + e->bytes) {
+                entry = *e;
+                break;
+            }
+        }
+    }
+
+    if (!entry.owner) {
+        return NULL;
+    }
+
+    if (entry.graph_gen != bdrv_graph_generation()) {
+        return NULL;
+    }
+
+    owner = bdrv_chain_map_walk(bs, entry.depth, &gen);
+    if (owner != entry.owner || gen != entry.gen) {
+        return NULL;
+    }
+
+    *pnum = MIN(bytes, entry.offset + entry.bytes - offset);
+    return owner;
+}
+
+/*
+ * Query the backing chain of @bs at @offset and remember which layer the
+ * data comes from.  Returns NULL if the range cannot be cached, in which
+ * case the caller must read it through the whole chain.
+ */
+static BdrvChild * coroutine_fn GRAPH_RDLOCK
+bdrv_chain_map_fill(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                    int64_t *pnum)
+{
+    BdrvChainMapEntry *e;
+    BdrvChild *owner;
+    int64_t n;
+    uint64_t chain_gen, cur_chain_gen, gen;
+    unsigned int graph_gen;
+    int depth;
+    int ret;
+
+    /* Sample the generations first, so that racing changes are noticed */
+    graph_gen = bdrv_graph_generation();
+    bdrv_chain_map_walk(bs, INT_MAX, &chain_gen);
+
+    ret = bdrv_co_common_block_status_above(bs->backing->bs, NULL, false,
+                                            BDRV_WANT_ALLOCATED, offset,
+                                            MAX(bytes,
+                                                BDRV_CHAIN_MAP_FILL_BYTES),
+                                            &n, NULL, NULL, &depth);
+    if (ret < 0 || n == 0) {
+        return NULL;
+    }
+
+    bdrv_chain_map_walk(bs, INT_MAX, &cur_chain_gen);
+    if (cur_chain_gen != chain_gen || graph_gen != bdrv_graph_generation()) {
+        return NULL;
+    }
+
+    owner = bdrv_chain_map_walk(bs, depth, &gen);
+    if (!owner) {
+        return NULL;
+    }
+
+    WITH_QEMU_LOCK_GUARD(&bs->chain_map_lock) {
+        if (!bs->chain_map) {
+            bs->chain_map = g_new0(BdrvChainMap, 1);
+        }
+        e = &bs->chain_map->entries[bs->chain_map->next];
+        bs->chain_map->next = (bs->chain_map->next + 1) %
+                              BDRV_CHAIN_MAP_ENTRIES;
+        *e = (BdrvChainMapEntry) {
+            .offset = offset,
+            .bytes = n,
+            .owner = owner,
+            .depth = depth,
+            .gen = gen,
+            .graph_gen = graph_gen,
+        };
+    }
+
+    *pnum = MIN(bytes, n);
+    return owner;
+}
+
+int coroutine_fn
+bdrv_co_preadv_backing_part(BlockDriverState *bs, int64_t offset,
+                            int64_t bytes, QEMUIOVector *qiov,
+                            size_t qiov_offset, BdrvRequestFlags flags)
+{
+    int ret;
+    IO_CODE();
+
+    assert(bs->backing);
+
+    /* Nothing to skip if the backing node is the only layer */
+    if (!bdrv_filter_or_cow_child(bs->backing->bs)) {
+        return bdrv_co_preadv_part(bs->backing, offset, bytes,
+                                   qiov, qiov_offset, flags);
+    }
+
+    while (bytes > 0) {
+        BdrvChild *owner;
+        int64_t n;
+
+        owner = bdrv_chain_map_lookup(bs, offset, bytes, &n);
+        if (!owner) {
+            owner = bdrv_chain_map_fill(bs, offset, bytes, &n);
+        }
+        if (!owner) {
+            return bdrv_co_preadv_part(bs->backing, offset, bytes,
+                                       qiov, qiov_offset, flags);
+        }
+
+        ret = bdrv_co_preadv_part(owner, offset, n, qiov, qiov_offset, flags);
+        if (ret < 0) {
+            return ret;
+        }
+
+        offset += n;
+        bytes -= n;
+        qiov_offset += n;
+    }
+
+    return 0;
+}
+
 static int coroutine_fn GRAPH_RDLOCK
 bdrv_co_do_pwrite_zeroes(BlockDriverState *bs, int64_t offset, int64_t bytes,
                          BdrvRequestFlags flags)
@@ -2230,6 +2499,7 @@ int coroutine_fn bdrv_co_pwritev_part(BdrvChild *child,
     BdrvTrackedRequest req;
     uint64_t align = bs->bl.request_alignment;
     BdrvRequestPadding pad;
+    BdrvLatencyTrace lt;
     int ret;
     bool padded = false;
     IO_CODE();
@@ -2282,6 +2552,7 @@ int coroutine_fn bdrv_co_pwritev_part(BdrvChild *child,
     }
 
     bdrv_inc_in_flight(bs);
+    bdrv_latency_trace_start(&lt);
     tracked_request_begin(&req, bs, offset, bytes, BDRV_TRACKED_WRITE);
 
     if (flags & BDRV_REQ_ZERO_WRITE) {
@@ -2309,6 +2580,7 @@ int coroutine_fn bdrv_co_pwritev_part(BdrvChild *child,
 
 out:
     tracked_request_end(&req);
+    bdrv_latency_trace_done(bs, &lt, true, offset, bytes, ret);
     bdrv_dec_in_flight(bs);
 
     return ret;
@@ -3567,6 +3839,48 @@ int coroutine_fn bdrv_co_copy_range(BdrvChild *src, int64_t src_offset,
                                    bytes, read_flags, write_flags);
 }
 
+int coroutine_fn bdrv_co_sendfile(BdrvChild *child, int64_t offset,
+                                  int64_t bytes, int out_fd)
+{
+    BlockDriverState *bs = child->bs;
+    BlockDriver *drv = bs->drv;
+    BdrvTrackedRequest req;
+    int ret;
+
+    IO_CODE();
+    assert_bdrv_graph_readable();
+    trace_bdrv_co_sendfile(bs, offset, bytes, out_fd);
+
+    if (!bdrv_co_is_inserted(bs)) {
+        return -ENOMEDIUM;
+    }
+    ret = bdrv_check_request32(offset, bytes, NULL, 0);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /*
+     * Copy-on-read and unaligned requests need the data in a buffer; leave
+     * those to bdrv_co_preadv().
+     */
+    if (!drv->bdrv_co_sendfile || bs->encrypted ||
+        qatomic_read(&bs->copy_on_read) ||
+        !QEMU_IS_ALIGNED(offset | bytes, bs->bl.request_alignment)) {
+        return -ENOTSUP;
+    }
+
+    bdrv_inc_in_flight(bs);
+    tracked_request_begin(&req, bs, offset, bytes, BDRV_TRACKED_READ);
+    bdrv_wait_serialising_requests(&req);
+
+    ret = drv->bdrv_co_sendfile(bs, offset, bytes, out_fd);
+
+    tracked_request_end(&req);
+    bdrv_dec_in_flight(bs);
+
+    return ret;
+}
+
 void coroutine_fn bdrv_co_parent_cb_resize(BlockDriverState *bs)
 {
     BdrvChild *c;
@@ -14,9 +14,441 @@
 #include "block/block.h"
 #include "block/raw-aio.h"
 #include "qemu/coroutine.h"
+#include "qemu/error-report.h"
+#include "qemu/rcu.h"
+#include "qemu/thread.h"
+#include "qemu/units.h"
 #include "system/block-backend.h"
 #include "trace.h"
 
+#ifdef HAVE_IO_URING_REGISTER_BUFFERS_UPDATE_TAG
+/*
+ * Fixed files and buffers
+ *
+ * Registering files and buffers with io_uring saves the kernel from looking
+ * up the file and pinning the buffer's pages for every request.  Requests are
+ * submitted through the fdmon-io_uring ring of the AioContext they run in, so
+ * registrations are kept in global tables that every such ring mirrors:
+ *
+ * - A ring joins on its first request, registering the tables as they are.
+ * - Later changes are applied to all joined rings right away, from the thread
+ *   making the change.  Once luring_unregister_file() returns, no ring holds a
+ *   reference to the file anymore, so closing the FD really closes the file
+ *   (and e.g. releases its OFD locks).
+ *
+ * Submitters look up slots without taking the lock.  Should a registration go
+ * away before the sqe is submitted, the request fails with -EBADF or -EFAULT
+ * and is resubmitted without fixed file and buffer.
+ */
+
+/* Sizes of the (sparse) fixed file and buffer tables in each ring */
+#define LURING_FIXED_FILES 256
+#define LURING_FIXED_BUFS  1024
+
+/* The kernel does not register larger buffers */
+#define LURING_FIXED_BUF_MAX_SIZE (1 * GiB)
+
+struct LuringFixed {
+    AioContext *ctx;
+    bool files_ok; /* atomic */
+    bool bufs_ok; /* atomic */
+    QLIST_ENTRY(LuringFixed) next;
+};
+
+/* Registered buffers sorted by address, for luring_fixed_buf_index() */
+typedef struct {
+    struct rcu_head rcu;
+    unsigned int nr;
+    struct {
+        uintptr_t start;
+        uintptr_t end;
+        int index;
+    } bufs[];
+} LuringFixedBufMap;
+
+static struct {
+    /* Protects everything below except where noted */
+    QemuMutex lock;
+
+    QLIST_HEAD(, LuringFixed) rings;
+
+    /* The tables as registered with each ring */
+    int files[LURING_FIXED_FILES]; /* -1 for free slots, atomic reads */
+    struct iovec bufs[LURING_FIXED_BUFS]; /* iov_base NULL for free slots */
+    unsigned int buf_refcnt[LURING_FIXED_BUFS];
+
+    unsigned int nr_files; /* highest used file slot + 1, atomic reads */
+    LuringFixedBufMap *buf_map; /* RCU */
+
+    /* Whether anything has been registered yet, atomic */
+    bool in_use;
+} luring_fixed;
+
+static void __attribute__((__constructor__)) luring_fixed_init(void)
+{
+    int i;
+
+    qemu_mutex_init(&luring_fixed.lock);
+    QLIST_INIT(&luring_fixed.rings);
+    for (i = 0; i < LURING_FIXED_FILES; i++) {
+        luring_fixed.files[i] = -1;
+    }
+}
+
+static void luring_fixed_cleanup(AioContext *ctx)
+{
+    LuringFixed *fixed = ctx->luring_fixed;
+
+    /* The registrations themselves go away with the ring */
+    qemu_mutex_lock(&luring_fixed.lock);
+    QLIST_REMOVE(fixed, next);
+    qemu_mutex_unlock(&luring_fixed.lock);
+
+    g_free(fixed);
+    ctx->luring_fixed = NULL;
+}
+
+/* Join the current AioContext's ring, if necessary */
+static LuringFixed *luring_fixed_get(AioContext *ctx)
+{
+    LuringFixed *fixed = ctx->luring_fixed;
+    int ret;
+
+    if (likely(fixed) || !qatomic_read(&luring_fixed.in_use)) {
+        return fixed;
+    }
+
+    fixed = g_new0(LuringFixed, 1);
+    fixed->ctx = ctx;
+
+    qemu_mutex_lock(&luring_fixed.lock);
+
+    ret = io_uring_register_files(&ctx->fdmon_io_uring, luring_fixed.files,
+                                  LURING_FIXED_FILES);
+    fixed->files_ok = ret == 0;
+    trace_luring_fixed_join(ctx, "files", ret);
+
+    ret = io_uring_register_buffers(&ctx->fdmon_io_uring, luring_fixed.bufs,
+                                    LURING_FIXED_BUFS);
+    fixed->bufs_ok = ret == 0;
+    trace_luring_fixed_join(ctx, "buffers", ret);
+    if (ret < 0 && luring_fixed.buf_map && luring_fixed.buf_map->nr) {
+        warn_report_once("Failed to register buffers with io_uring: %s",
+                         strerror(-ret));
+    }
+
+    QLIST_INSERT_HEAD(&luring_fixed.rings, fixed, next);
+
+    qemu_mutex_unlock(&luring_fixed.lock);
+
+    ctx->luring_fixed = fixed;
+    ctx->luring_fixed_cleanup = luring_fixed_cleanup;
+    return fixed;
+}
+
+/* Set file slot @slot to @fd in all rings, called with the lock held */
+static void luring_fixed_update_file(unsigned int slot, int fd)
+{
+    LuringFixed *fixed;
+    int ret;
+
+    QLIST_FOREACH(fixed, &luring_fixed.rings, next) {
+        struct io_uring *ring = &fixed->ctx->fdmon_io_uring;
+
+        if (!qatomic_read(&fixed->files_ok)) {
+            continue;
+        }
+
+        ret = io_uring_register_files_update(ring, slot, &fd, 1);
+        if (ret < 0) {
+            /* Do not leave a stale reference to the file behind */
+            qatomic_set(&fixed->files_ok, false);
+            io_uring_unregister_files(ring);
+        }
+    }
+}
+
+/* Apply buffer slot @slot to all rings, called with the lock held */
+static void luring_fixed_update_buf(unsigned int slot)
+{
+    LuringFixed *fixed;
+    int ret;
+
+    QLIST_FOREACH(fixed, &luring_fixed.rings, next) {
+        struct io_uring *ring = &fixed->ctx->fdmon_io_uring;
+
+        if (!qatomic_read(&fixed->bufs_ok)) {
+            continue;
+        }
+
+        ret = io_uring_register_buffers_update_tag(ring, slot,
+                                                   &luring_fixed.bufs[slot],
+                                                   NULL, 1);
+        if (ret < 0) {
+            warn_report_once("Failed to register buffers with io_uring: %s",
+                             strerror(-ret));
+            qatomic_set(&fixed->bufs_ok, false);
+            io_uring_unregister_buffers(ring);
+        }
+    }
+}
+
+static int luring_fixed_buf_cmp(const void *a, const void *b)
+{
+    const struct iovec *const *iov_a = a;
+    const struct iovec *const *iov_b = b;
+    uintptr_t base_a = (uintptr_t)(*iov_a)->iov_base;
+    uintptr_t base_b = (uintptr_t)(*iov_b)->iov_base;
+
+    return base_a < base_b ? -1 : base_a > base_b;
+}
+
+/* Rebuild luring_fixed.buf_map, called with the lock held */
+static void luring_fixed_update_buf_map(void)
+{
+    g_autofree struct iovec **sorted = g_new(struct iovec *, LURING_FIXED_BUFS);
+    LuringFixedBufMap *map, *old_map;
+    unsigned int i, nr = 0;
+
+    for (i = 0; i < LURING_FIXED_BUFS; i++) {
+        if (luring_fixed.bufs[i].iov_base) {
+            sorted[nr++] = &luring_fixed.bufs[i];
+        }
+    }
+    qsort(sorted, nr, sizeof(sorted[0]), luring_fixed_buf_cmp);
+
+    map = g_malloc(sizeof(*map) + nr * sizeof(map->bufs[0]));
+    map->nr = nr;
+    for (i = 0; i < nr; i++) {
+        map->bufs[i].start = (uintptr_t)sorted[i]->iov_base;
+        map->bufs[i].end = map->bufs[i].start + sorted[i]->iov_len;
+        map->bufs[i].index = sorted[i] - luring_fixed.bufs;
+    }
+
+    old_map = luring_fixed.buf_map;
+    qatomic_rcu_set(&luring_fixed.buf_map, map);
+    if (old_map) {
+        g_free_rcu(old_map, rcu);
+    }
+}
+
+void luring_register_file(int fd)
+{
+    unsigned int slot;
+
+    qemu_mutex_lock(&luring_fixed.lock);
+
+    for (slot = 0; slot < LURING_FIXED_FILES; slot++) {
+        if (luring_fixed.files[slot] == -1) {
+            break;
+        }
+    }
+    if (slot == LURING_FIXED_FILES) {
+        /* Requests on this file just do not use a fixed file */
+        goto out;
+    }
+
+    /* Only let submitters find the slot once all rings know it */
+    luring_fixed_update_file(slot, fd);
+    qatomic_set(&luring_fixed.files[slot], fd);
+    if (slot >= luring_fixed.nr_files) {
+        qatomic_set(&luring_fixed.nr_files, slot + 1);
+    }
+    qatomic_set(&luring_fixed.in_use, true);
+
+out:
+    qemu_mutex_unlock(&luring_fixed.lock);
+}
+
+void luring_unregister_file(int fd)
+{
+    unsigned int slot;
+
+    qemu_mutex_lock(&luring_fixed.lock);
+
+    for (slot = 0; slot < luring_fixed.nr_files; slot++) {
+        if (luring_fixed.files[slot] == fd) {
+            qatomic_set(&luring_fixed.files[slot], -1);
+            luring_fixed_update_file(slot, -1);
+            break;
+        }
+    }
+
+    qemu_mutex_unlock(&luring_fixed.lock);
+}
+
+void luring_register_buf(void *host, size_t size)
+{
+    size_t offset;
+    unsigned int slot;
+
+    qemu_mutex_lock(&luring_fixed.lock);
+
+    for (offset = 0; offset < size; offset += LURING_FIXED_BUF_MAX_SIZE) {
+        struct iovec iov = {
+            .iov_base = host + offset,
+            .iov_len = MIN(size - offset, LURING_FIXED_BUF_MAX_SIZE),
+        };
+        unsigned int free_slot = LURING_FIXED_BUFS;
+
+        /* Several nodes may register the same memory */
+        for (slot = 0; slot < LURING_FIXED_BUFS; slot++) {
+            if (luring_fixed.bufs[slot].iov_base == iov.iov_base &&
+                luring_fixed.bufs[slot].iov_len == iov.iov_len) {
+                break;
+            }
+            if (!luring_fixed.bufs[slot].iov_base &&
+                free_slot == LURING_FIXED_BUFS) {
+                free_slot = slot;
+            }
+        }
+
+        if (slot < LURING_FIXED_BUFS) {
+            luring_fixed.buf_refcnt[slot]++;
+            continue;
+        }
+        if (free_slot == LURING_FIXED_BUFS) {
+            warn_report_once("Too many buffers to register with io_uring");
+            break;
+        }
+
+        luring_fixed.bufs[free_slot] = iov;
+        luring_fixed.buf_refcnt[free_slot] = 1;
+        luring_fixed_update_buf(free_slot);
+    }
+
+    luring_fixed_update_buf_map();
+    qatomic_set(&luring_fixed.in_use, true);
+
+    qemu_mutex_unlock(&luring_fixed.lock);
+}
+
+void luring_unregister_buf(void *host, size_t size)
+{
+    g_autofree unsigned int *freed =
+        g_new(unsigned int, DIV_ROUND_UP(size, LURING_FIXED_BUF_MAX_SIZE));
+    unsigned int nr_freed = 0;
+    size_t offset;
+    unsigned int slot, i;
+
+    qemu_mutex_lock(&luring_fixed.lock);
+
+    for (offset = 0; offset < size; offset += LURING_FIXED_BUF_MAX_SIZE) {
+        void *base = host + offset;
+        size_t len = MIN(size - offset, LURING_FIXED_BUF_MAX_SIZE);
+
+        for (slot = 0; slot < LURING_FIXED_BUFS; slot++) {
+            if (luring_fixed.bufs[slot].iov_base == base &&
+                luring_fixed.bufs[slot].iov_len == len) {
+                break;
+            }
+        }
+        if (slot == LURING_FIXED_BUFS || --luring_fixed.buf_refcnt[slot]) {
+            continue;
+        }
+
+        luring_fixed.bufs[slot] = (struct iovec) {};
+        freed[nr_freed++] = slot;
+    }
+
+    if (nr_freed) {
+        /* Stop handing out the slots before the rings forget them */
+        luring_fixed_update_buf_map();
+        for (i = 0; i < nr_freed; i++) {
+            luring_fixed_update_buf(freed[i]);
+        }
+    }
+
+    qemu_mutex_unlock(&luring_fixed.lock);
+}
+
+/* Returns the fixed file slot for @fd, or -1 */
+static int luring_fixed_file_index(LuringFixed *fixed, int fd)
+{
+    unsigned int slot, nr;
+
+    if (!fixed || !qatomic_read(&fixed->files_ok)) {
+        return -1;
+    }
+
+    nr = qatomic_read(&luring_fixed.nr_files);
+    for (slot = 0; slot < nr; slot++) {
+        if (qatomic_read(&luring_fixed.files[slot]) == fd) {
+            return slot;
+        }
+    }
+    return -1;
+}
+
+/* Returns the fixed buffer containing @iov, or -1 */
+static int luring_fixed_buf_index(LuringFixed *fixed, struct iovec *iov)
+{
+    LuringFixedBufMap *map;
+    uintptr_t start = (uintptr_t)iov->iov_base;
+    uintptr_t end = start + iov->iov_len;
+    unsigned int lo = 0, hi;
+
+    if (!fixed || !qatomic_read(&fixed->bufs_ok)) {
+        return -1;
+    }
+
+    RCU_READ_LOCK_GUARD();
+
+    map = qatomic_rcu_read(&luring_fixed.buf_map);
+    if (!map) {
+        return -1;
+    }
+
+    /* Find the last buffer starting at or before @start */
+    hi = map->nr;
+    while (lo < hi) {
+        unsigned int mid = lo + (hi - lo) / 2;
+
+        if (map->bufs[mid].start <= start) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (lo > 0 && end <= map->bufs[lo - 1].end) {
+        return map->bufs[lo - 1].index;
+    }
+    return -1;
+}
+#else /* !HAVE_IO_URING_REGISTER_BUFFERS_UPDATE_TAG */
+static LuringFixed *luring_fixed_get(AioContext *ctx)
+{
+    return NULL;
+}
+
+void luring_register_file(int fd)
+{
+}
+
+void luring_unregister_file(int fd)
+{
+}
+
+void luring_register_buf(void *host, size_t size)
+{
+}
+
+void luring_unregister_buf(void *host, size_t size)
+{
+}
+
+static int luring_fixed_file_index(LuringFixed *fixed, int fd)
+{
+    return -1;
+}
+
+static int luring_fixed_buf_index(LuringFixed *fixed, struct iovec *iov)
+{
+    return -1;
+}
+#endif /* !HAVE_IO_URING_REGISTER_BUFFERS_UPDATE_TAG */
+
 typedef struct {
     Coroutine *co;
     QEMUIOVector *qiov;
@@ -26,6 +458,10 @@ typedef struct {
     int fd;
     BdrvRequestFlags flags;
 
+    /* Slots in the ring's fixed file and buffer tables, or -1 */
+    int fixed_file;
+    int buf_index;
+
     /*
      * Buffered reads may require resubmission, see
      * luring_resubmit_short_read().
@@ -41,14 +477,19 @@ static void luring_prep_sqe(struct io_uring_sqe *sqe, void *opaque)
     LuringRequest *req = opaque;
     QEMUIOVector *qiov = req->qiov;
     uint64_t offset = req->offset;
-    int fd = req->fd;
+    int fd = req->fixed_file >= 0 ? req->fixed_file : req->fd;
     BdrvRequestFlags flags = req->flags;
 
     switch (req->type) {
     case QEMU_AIO_WRITE:
     {
         int luring_flags = (flags & BDRV_REQ_FUA) ? RWF_DSYNC : 0;
-        if (luring_flags != 0 || qiov->niov > 1) {
+        if (req->buf_index >= 0) {
+            struct iovec *iov = qiov->iov;
+            io_uring_prep_write_fixed(sqe, fd, iov->iov_base, iov->iov_len,
+                                      offset, req->buf_index);
+            sqe->rw_flags = luring_flags;
+        } else if (luring_flags != 0 || qiov->niov > 1) {
 #ifdef HAVE_IO_URING_PREP_WRITEV2
             io_uring_prep_writev2(sqe, fd, qiov->iov,
                                   qiov->niov, offset, luring_flags);
@@ -76,7 +517,12 @@ static void luring_prep_sqe(struct io_uring_sqe *sqe, void *opaque)
         if (req->resubmit_qiov.iov != NULL) {
             qiov = &req->resubmit_qiov;
         }
-        if (qiov->niov > 1) {
+        if (req->buf_index >= 0) {
+            struct iovec *iov = qiov->iov;
+            io_uring_prep_read_fixed(sqe, fd, iov->iov_base, iov->iov_len,
+                                     offset + req->total_read,
+                                     req->buf_index);
+        } else if (qiov->niov > 1) {
             io_uring_prep_readv(sqe, fd, qiov->iov, qiov->niov,
                                 offset + req->total_read);
         } else {
@@ -95,6 +541,10 @@ static void luring_prep_sqe(struct io_uring_sqe *sqe, void *opaque)
                         __func__, req->type);
         abort();
     }
+
+    if (req->fixed_file >= 0) {
+        sqe->flags |= IOSQE_FIXED_FILE;
+    }
 }
 
 /**
@@ -123,6 +573,9 @@ static void luring_resubmit_short_read(LuringRequest *req, int nread)
     }
     qemu_iovec_concat(resubmit_qiov, req->qiov, req->total_read, remaining);
 
+    /* The shortened qiov may have several elements */
+    req->buf_index = -1;
+
     aio_add_sqe(luring_prep_sqe, req, &req->cqe_handler);
 }
 
@@ -152,6 +605,15 @@ static void luring_cqe_handler(CqeHandler *cqe_handler)
             aio_add_sqe(luring_prep_sqe, req, &req->cqe_handler);
             return;
         }
+
+        /* The fixed file or buffer may have been unregistered meanwhile */
+        if ((ret == -EBADF || ret == -EFAULT) &&
+            (req->fixed_file >= 0 || req->buf_index >= 0)) {
+            req->fixed_file = -1;
+            req->buf_index = -1;
+            aio_add_sqe(luring_prep_sqe, req, &req->cqe_handler);
+            return;
+        }
     } else if (req->qiov) {
         /* total_read is non-zero only for resubmitted read requests */
         int total_bytes = ret + req->total_read;
@@ -193,6 +655,7 @@ int coroutine_fn luring_co_submit(BlockDriverState *bs, int fd,
                                   uint64_t offset, QEMUIOVector *qiov,
                                   int type, BdrvRequestFlags flags)
 {
+    LuringFixed *fixed = luring_fixed_get(qemu_get_current_aio_context());
     LuringRequest req = {
         .co         = qemu_coroutine_self(),
         .qiov       = qiov,
@@ -201,11 +664,19 @@ int coroutine_fn luring_co_submit(BlockDriverState *bs, int fd,
         .fd         = fd,
         .offset     = offset,
         .flags      = flags,
+        .fixed_file = luring_fixed_file_index(fixed, fd),
+        .buf_index  = -1,
     };
 
+    if ((flags & BDRV_REQ_REGISTERED_BUF) && qiov->niov == 1 &&
+        (type == QEMU_AIO_READ || type == QEMU_AIO_WRITE)) {
+        req.buf_index = luring_fixed_buf_index(fixed, qiov->iov);
+    }
+
     req.cqe_handler.cb = luring_cqe_handler;
 
-    trace_luring_co_submit(bs, &req, fd, offset, qiov ? qiov->size : 0, type);
+    trace_luring_co_submit(bs, &req, fd, offset, qiov ? qiov->size : 0, type,
+                           req.fixed_file, req.buf_index);
     aio_add_sqe(luring_prep_sqe, &req, &req.cqe_handler);
 
     if (req.ret == -EINPROGRESS) {
@@ -15,8 +15,10 @@
 #include "qemu/event_notifier.h"
 #include "qemu/coroutine.h"
 #include "qemu/defer-call.h"
+#include "qemu/timer.h"
 #include "qapi/error.h"
 #include "system/block-backend.h"
+#include "trace.h"
 
 /* Only used for assertions.  */
 #include "qemu/coroutine_int.h"
@@ -36,6 +38,9 @@
 /* Maximum number of requests in a batch. (default value) */
 #define DEFAULT_MAX_BATCH 32
 
+/* Number of completions after which the batch size is re-evaluated */
+#define ADAPT_INTERVAL 128
+
 struct qemu_laiocb {
     Coroutine *co;
     LinuxAioState *ctx;
@@ -44,6 +49,7 @@ struct qemu_laiocb {
     size_t nbytes;
     QEMUIOVector *qiov;
     bool is_read;
+    int64_t submit_ns;
     QSIMPLEQ_ENTRY(qemu_laiocb) next;
 };
 
@@ -65,6 +71,15 @@ struct LinuxAioState {
     QEMUBH *completion_bh;
     int event_idx;
     int event_max;
+
+    /* Adaptive batching, see laio_adapt_batch() */
+    unsigned int batch;         /* 0 until the first adjustment */
+    bool batch_full;            /* a batch reached @batch in this window */
+    unsigned int window_completions;
+    uint64_t window_latency_ns; /* sum over this window */
+    uint64_t latency_ns;        /* average of the last window (atomic) */
+    uint64_t min_latency_ns;    /* baseline for @latency_ns */
+    uint64_t cur_max_batch;     /* for laio_get_batch_stats() (atomic) */
 };
 
 static void ioq_submit(LinuxAioState *s);
@@ -189,6 +204,54 @@ io_getevents_advance_and_peek(io_context_t ctx,
     return io_getevents_peek(ctx, events);
 }
 
+/*
+ * Adjust the batch size to the submit-to-completion latency of the last
+ * ADAPT_INTERVAL requests.  Latency rising above the baseline means that
+ * requests queue up, so they are submitted in smaller batches; as long as
+ * latency stays low and batches fill up, the batch size grows to save
+ * io_submit() calls.  The AioContext's aio-max-batch (or DEFAULT_MAX_BATCH)
+ * stays the upper limit.
+ */
+static void laio_adapt_batch(LinuxAioState *s)
+{
+    uint64_t ceiling = s->aio_context->aio_max_batch ?: DEFAULT_MAX_BATCH;
+    uint64_t latency = s->window_latency_ns / s->window_completions;
+    unsigned int batch = MIN(s->batch ?: ceiling, ceiling);
+
+    if (!s->min_latency_ns || latency < s->min_latency_ns) {
+        s->min_latency_ns = latency;
+    } else {
+        /* Let the baseline follow lasting changes of the device's latency */
+        s->min_latency_ns += (latency - s->min_latency_ns) / 16;
+    }
+
+    if (latency > s->min_latency_ns + s->min_latency_ns / 2) {
+        batch = MAX(batch / 2, 1);
+    } else if (s->batch_full && batch < ceiling) {
+        batch++;
+    }
+
+    if (batch != s->batch) {
+        trace_laio_adapt_batch(s, latency, s->min_latency_ns, batch);
+    }
+
+    s->batch = batch;
+    s->batch_full = false;
+    s->window_completions = 0;
+    s->window_latency_ns = 0;
+    qatomic_set(&s->latency_ns, latency);
+    qatomic_set(&s->cur_max_batch, batch);
+}
+
+static void laio_account_completion(LinuxAioState *s,
+                                    struct qemu_laiocb *laiocb)
+{
+    s->window_latency_ns += get_clock() - laiocb->submit_ns;
+    if (++s->window_completions >= ADAPT_INTERVAL) {
+        laio_adapt_batch(s);
+    }
+}
+
 /**
  * qemu_laio_process_completions:
  * @s: AIO state
@@ -222,6 +285,7 @@ static void qemu_laio_process_completions(LinuxAioState *s)
             /* Change counters one-by-one because we can be nested. */
             s->io_q.in_flight--;
             s->event_idx++;
+            laio_account_completion(s, laiocb);
             qemu_laio_process_completion(laiocb);
         }
     }
@@ -345,6 +409,9 @@ static uint64_t laio_max_batch(LinuxAioState *s, uint64_t dev_max_batch)
 {
     uint64_t max_batch = s->aio_context->aio_max_batch ?: DEFAULT_MAX_BATCH;
 
+    /* The adaptive batch size, see laio_adapt_batch() */
+    max_batch = MIN_NON_ZERO(s->batch, max_batch);
+
     /*
      * AIO context can be shared between multiple block devices, so
      * `dev_max_batch` allows reducing the batch size for latency-sensitive
@@ -403,11 +470,13 @@ static int laio_do_submit(int fd, struct qemu_laiocb *laiocb, off_t offset,
         return -EIO;
     }
     io_set_eventfd(&laiocb->iocb, event_notifier_get_fd(&s->e));
+    laiocb->submit_ns = get_clock();
 
     QSIMPLEQ_INSERT_TAIL(&s->io_q.pending, laiocb, next);
     s->io_q.in_queue++;
     if (!s->io_q.blocked) {
         if (s->io_q.in_queue >= laio_max_batch(s, dev_max_batch)) {
+            s->batch_full = true;
             ioq_submit(s);
         } else {
             defer_call(laio_deferred_fn, s);
@@ -443,6 +512,13 @@ int coroutine_fn laio_co_submit(int fd, uint64_t offset, QEMUIOVector *qiov,
     return laiocb.ret;
 }
 
+void laio_get_batch_stats(LinuxAioState *s, uint64_t *max_batch,
+                          uint64_t *latency_ns)
+{
+    *max_batch = qatomic_read(&s->cur_max_batch);
+    *latency_ns = qatomic_read(&s->latency_ns);
+}
+
 void laio_detach_aio_context(LinuxAioState *s, AioContext *old_context)
 {
     aio_set_event_notifier(old_context, &s->e, NULL, NULL, NULL);
@@ -22,6 +22,7 @@
 #include "system/block-backend.h"
 #include "qapi/error.h"
 #include "qemu/ratelimit.h"
+#include "qemu/stats64.h"
 #include "qemu/bitmap.h"
 #include "qemu/memalign.h"
 
@@ -29,6 +30,20 @@
 #define MAX_IO_BYTES (1 << 20) /* 1 Mb */
 #define DEFAULT_MIRROR_BUF_SIZE (MAX_IN_FLIGHT * MAX_IO_BYTES)
 
+/*
+ * Adaptive copy mode: guest writes are counted per heat region, and the
+ * counters decay by half every MIRROR_ADAPT_WINDOW_NS.  If the background
+ * copy does not reduce the backlog for MIRROR_ADAPT_STALL_WINDOWS windows
+ * in a row, writes to regions with a heat of at least MIRROR_HEAT_HOT are
+ * copied synchronously until the guest writes nothing or less than half of
+ * what the background copy achieves for MIRROR_ADAPT_CALM_WINDOWS windows.
+ */
+#define MIRROR_HEAT_REGION_SIZE (1 << 20)
+#define MIRROR_HEAT_HOT 4
+#define MIRROR_ADAPT_WINDOW_NS NANOSECONDS_PER_SECOND
+#define MIRROR_ADAPT_STALL_WINDOWS 3
+#define MIRROR_ADAPT_CALM_WINDOWS 5
+
 /* The mirroring buffer is a list of granularity-sized chunks.
  * Free chunks are organized in a list.
  */
@@ -95,6 +110,23 @@ typedef struct MirrorBlockJob {
     bool prepared;
     bool in_drain;
     bool base_ro;
+
+    /*
+     * State of MIRROR_COPY_MODE_ADAPTIVE, see mirror_adapt().  Guest writes
+     * may come from several threads, so write_heat (atomic),
+     * hot_active_copy (atomic) and the window_*_bytes Stat64 counters are
+     * updated from them; everything else only from the job.
+     */
+    uint8_t *write_heat;
+    int heat_region_bits;
+    bool hot_active_copy;
+    int stalled_windows;
+    int calm_windows;
+    int64_t window_start_ns;
+    int64_t window_start_dirty;
+    Stat64 window_written_bytes;
+    Stat64 window_dirtied_bytes;
+    int64_t window_copied_bytes;
 } MirrorBlockJob;
 
 typedef struct MirrorBDSOpaque {
@@ -658,6 +690,7 @@ static void coroutine_fn GRAPH_UNLOCKED mirror_iteration(MirrorBlockJob *s)
             io_bytes_acct = io_bytes;
         }
         assert(io_bytes);
+        s->window_copied_bytes += io_bytes;
         offset += io_bytes;
         nb_chunks -= DIV_ROUND_UP(io_bytes, s->granularity);
         block_job_ratelimit_processed_bytes(&s->common, io_bytes_acct);
@@ -669,6 +702,108 @@ fail:
     g_free(pseudo_op);
 }
 
+static bool mirror_region_is_hot(MirrorBlockJob *s, uint64_t offset,
+                                 uint64_t bytes)
+{
+    uint64_t i;
+
+    for (i = offset >> s->heat_region_bits;
+         i <= (offset + bytes - 1) >> s->heat_region_bits; i++) {
+        if (qatomic_read(&s->write_heat[i]) >= MIRROR_HEAT_HOT) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Account a guest write for the adaptive copy mode */
+static void mirror_note_guest_write(MirrorBlockJob *s, uint64_t offset,
+                                    uint64_t bytes, bool copied)
+{
+    uint64_t i;
+
+    if (!s->write_heat || !bytes) {
+        return;
+    }
+
+    stat64_add(&s->window_written_bytes, bytes);
+    if (!copied) {
+        stat64_add(&s->window_dirtied_bytes, bytes);
+    }
+
+    for (i = offset >> s->heat_region_bits;
+         i <= (offset + bytes - 1) >> s->heat_region_bits; i++) {
+        uint8_t heat = qatomic_read(&s->write_heat[i]);
+
+        /* Losing an increment to a concurrent write does not matter */
+        if (heat < UINT8_MAX) {
+            qatomic_cmpxchg(&s->write_heat[i], heat, heat + 1);
+        }
+    }
+}
+
+/*
+ * Compare what the guest dirtied during the last window with what the
+ * background copy achieved, and decide whether writes to hot regions
+ * should be copied to the target synchronously.  @cnt is the current
+ * number of dirty bytes.
+ */
+static void mirror_adapt(MirrorBlockJob *s, int64_t cnt)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    uint64_t written, dirtied;
+    uint64_t i, nb_regions;
+    bool stalled;
+
+    if (!s->write_heat || now - s->window_start_ns < MIRROR_ADAPT_WINDOW_NS) {
+        return;
+    }
+
+    /* Writes that come in between reading and resetting are not counted */
+    written = stat64_get(&s->window_written_bytes);
+    dirtied = stat64_get(&s->window_dirtied_bytes);
+    stat64_set(&s->window_written_bytes, 0);
+    stat64_set(&s->window_dirtied_bytes, 0);
+
+    /*
+     * The backlog does not shrink if the guest dirties data about as fast
+     * as it is copied, or if the dirty count simply did not go down.
+     */
+    stalled = cnt > 0 &&
+        (cnt >= s->window_start_dirty ||
+         dirtied * 10 >= s->window_copied_bytes * 9);
+    if (stalled) {
+        s->stalled_windows++;
+    } else {
+        s->stalled_windows = 0;
+    }
+    if (!written || written * 2 < s->window_copied_bytes) {
+        s->calm_windows++;
+    } else {
+        s->calm_windows = 0;
+    }
+
+    if (!s->hot_active_copy &&
+        s->stalled_windows >= MIRROR_ADAPT_STALL_WINDOWS) {
+        qatomic_set(&s->hot_active_copy, true);
+    } else if (s->hot_active_copy &&
+               s->calm_windows >= MIRROR_ADAPT_CALM_WINDOWS) {
+        qatomic_set(&s->hot_active_copy, false);
+    }
+
+    trace_mirror_adapt(s, cnt, written, dirtied, s->window_copied_bytes,
+                       s->hot_active_copy);
+
+    nb_regions = DIV_ROUND_UP(s->bdev_length, 1ULL << s->heat_region_bits);
+    for (i = 0; i < nb_regions; i++) {
+        qatomic_set(&s->write_heat[i], qatomic_read(&s->write_heat[i]) >> 1);
+    }
+
+    s->window_start_ns = now;
+    s->window_start_dirty = cnt;
+    s->window_copied_bytes = 0;
+}
+
 static void mirror_free_init(MirrorBlockJob *s)
 {
     int granularity = s->granularity;
@@ -851,6 +986,14 @@ static int mirror_exit_common(Job *job)
 
     bs_opaque->job = NULL;
 
+    /*
+     * The write hooks of mirror_top_bs account guest writes in write_heat
+     * for as long as they can see the job, so only free it now that they
+     * cannot anymore and no write is in flight.
+     */
+    g_free(s->write_heat);
+    s->write_heat = NULL;
+
     bdrv_drained_end(src);
     bdrv_drained_end(mirror_top_bs);
     s->in_drain = false;
@@ -1081,6 +1224,15 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
     length = DIV_ROUND_UP(s->bdev_length, s->granularity);
     s->in_flight_bitmap = bitmap_new(length);
 
+    if (qatomic_read(&s->copy_mode) == MIRROR_COPY_MODE_ADAPTIVE) {
+        s->heat_region_bits = ctz64(MAX(s->granularity,
+                                        MIRROR_HEAT_REGION_SIZE));
+        s->write_heat = g_new0(uint8_t,
+                               DIV_ROUND_UP(s->bdev_length,
+                                            1ULL << s->heat_region_bits));
+        s->window_start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    }
+
     /* If we have no backing file yet in the destination, we cannot let
      * the destination do COW.  Instead, we copy sectors around the
      * dirty data if needed.  We need a bitmap to do that.
@@ -1149,6 +1301,8 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
                                    s->bytes_in_flight + cnt +
                                    s->active_write_bytes_in_flight);
 
+        mirror_adapt(s, cnt);
+
         /* Note that even when no rate limit is applied we need to yield
          * periodically with no pending I/O so that bdrv_drain_all() returns.
          * We do so every BLKOCK_JOB_SLICE_TIME nanoseconds, or when there is
@@ -1184,7 +1338,8 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
                  */
                 job_transition_to_ready(&s->common.job);
             }
-            if (qatomic_read(&s->copy_mode) != MIRROR_COPY_MODE_BACKGROUND) {
+            if (qatomic_read(&s->copy_mode) ==
+                MIRROR_COPY_MODE_WRITE_BLOCKING) {
                 qatomic_set(&s->actively_synced, true);
             }
 
@@ -1363,7 +1518,8 @@ static void mirror_change(BlockJob *job, BlockJobChangeOptions *opts,
 
     GLOBAL_STATE_CODE();
 
-    if (qatomic_read(&s->copy_mode) == change_opts->copy_mode) {
+    current = qatomic_read(&s->copy_mode);
+    if (current == change_opts->copy_mode) {
         return;
     }
 
@@ -1373,13 +1529,7 @@ static void mirror_change(BlockJob *job, BlockJobChangeOptions *opts,
         return;
     }
 
-    current = qatomic_cmpxchg(&s->copy_mode, MIRROR_COPY_MODE_BACKGROUND,
-                              change_opts->copy_mode);
-    if (current != MIRROR_COPY_MODE_BACKGROUND) {
-        error_setg(errp, "Expected current copy mode '%s', got '%s'",
-                   MirrorCopyMode_str(MIRROR_COPY_MODE_BACKGROUND),
-                   MirrorCopyMode_str(current));
-    }
+    qatomic_set(&s->copy_mode, change_opts->copy_mode);
 }
 
 static void mirror_query(BlockJob *job, BlockJobInfo *info)
@@ -1388,6 +1538,9 @@ static void mirror_query(BlockJob *job, BlockJobInfo *info)
 
     info->u.mirror = (BlockJobInfoMirror) {
         .actively_synced = qatomic_read(&s->actively_synced),
+        .has_hot_writes_synced =
+            qatomic_read(&s->copy_mode) == MIRROR_COPY_MODE_ADAPTIVE,
+        .hot_writes_synced = qatomic_read(&s->hot_active_copy),
     };
 }
 
@@ -1635,11 +1788,22 @@ bdrv_mirror_top_preadv(BlockDriverState *bs, int64_t offset, int64_t bytes,
     return bdrv_co_preadv(bs->backing, offset, bytes, qiov, flags);
 }
 
-static bool should_copy_to_target(MirrorBDSOpaque *s)
+static bool should_copy_to_target(MirrorBDSOpaque *s, uint64_t offset,
+                                  uint64_t bytes)
 {
-    return s->job && s->job->ret >= 0 &&
-        !job_is_cancelled(&s->job->common.job) &&
-        qatomic_read(&s->job->copy_mode) == MIRROR_COPY_MODE_WRITE_BLOCKING;
+    if (!s->job || s->job->ret < 0 || job_is_cancelled(&s->job->common.job)) {
+        return false;
+    }
+
+    switch (qatomic_read(&s->job->copy_mode)) {
+    case MIRROR_COPY_MODE_WRITE_BLOCKING:
+        return true;
+    case MIRROR_COPY_MODE_ADAPTIVE:
+        return qatomic_read(&s->job->hot_active_copy) && s->job->write_heat &&
+            bytes && mirror_region_is_hot(s->job, offset, bytes);
+    default:
+        return false;
+    }
 }
 
 static int coroutine_fn GRAPH_RDLOCK
@@ -1654,6 +1818,9 @@ bdrv_mirror_top_do_write(BlockDriverState *bs, MirrorMethod method,
     if (copy_to_target) {
         op = active_write_prepare(s->job, offset, bytes);
     }
+    if (s->job) {
+        mirror_note_guest_write(s->job, offset, bytes, copy_to_target);
+    }
 
     switch (method) {
     case MIRROR_METHOD_COPY:
@@ -1699,7 +1866,7 @@ bdrv_mirror_top_pwritev(BlockDriverState *bs, int64_t offset, int64_t bytes,
     QEMUIOVector bounce_qiov;
     void *bounce_buf;
     int ret = 0;
-    bool copy_to_target = should_copy_to_target(bs->opaque);
+    bool copy_to_target = should_copy_to_target(bs->opaque, offset, bytes);
 
     if (copy_to_target) {
         /* The guest might concurrently modify the data to write; but
@@ -1740,7 +1907,7 @@ static int coroutine_fn GRAPH_RDLOCK
 bdrv_mirror_top_pwrite_zeroes(BlockDriverState *bs, int64_t offset,
                               int64_t bytes, BdrvRequestFlags flags)
 {
-    bool copy_to_target = should_copy_to_target(bs->opaque);
+    bool copy_to_target = should_copy_to_target(bs->opaque, offset, bytes);
     return bdrv_mirror_top_do_write(bs, MIRROR_METHOD_ZERO, copy_to_target,
                                     offset, bytes, NULL, flags);
 }
@@ -1748,7 +1915,7 @@ bdrv_mirror_top_pwrite_zeroes(BlockDriverState *bs, int64_t offset,
 static int coroutine_fn GRAPH_RDLOCK
 bdrv_mirror_top_pdiscard(BlockDriverState *bs, int64_t offset, int64_t bytes)
 {
-    bool copy_to_target = should_copy_to_target(bs->opaque);
+    bool copy_to_target = should_copy_to_target(bs->opaque, offset, bytes);
     return bdrv_mirror_top_do_write(bs, MIRROR_METHOD_DISCARD, copy_to_target,
                                     offset, bytes, NULL, 0);
 }
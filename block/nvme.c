@@ -16,6 +16,7 @@
 #include "qapi/error.h"
 #include "qobject/qdict.h"
 #include "qobject/qstring.h"
+#include "qemu/coroutine-tls.h"
 #include "qemu/defer-call.h"
 #include "qemu/error-report.h"
 #include "qemu/host-pci-mmio.h"
@@ -44,6 +45,12 @@
  */
 #define NVME_NUM_REQS (NVME_QUEUE_SIZE - 1)
 
+/*
+ * I/O queue pairs are created on demand, one for each AioContext that
+ * submits requests, up to this many or what the controller grants.
+ */
+#define NVME_MAX_IO_QUEUES 64
+
 typedef struct BDRVNVMeState BDRVNVMeState;
 
 /* Same index is used for queues and IRQs */
@@ -80,6 +87,9 @@ typedef struct {
     BDRVNVMeState   *s;
     int             index;
 
+    /* Event loop that submits to and completes on this queue pair */
+    AioContext      *aio_context;
+
     /* Fields protected by BQL */
     uint8_t     *prp_list_pages;
 
@@ -90,10 +100,14 @@ typedef struct {
     int         free_req_head;
     NVMeRequest reqs[NVME_NUM_REQS];
     int         need_kick;
-    int         inflight;
+    int         inflight; /* also read atomically by nvme_poll_queues() */
+    uint64_t    submitted;
+    uint64_t    completed;
+    uint64_t    request_waits;
 
     /* Thread-safe, no lock necessary */
     QEMUBH      *completion_bh;
+    QEMUBH      *poll_bh;   /* processes completions in @aio_context */
 } NVMeQueuePair;
 
 struct BDRVNVMeState {
@@ -107,10 +121,19 @@ struct BDRVNVMeState {
     } *doorbells;
     /* The submission/completion queue pairs.
      * [0]: admin queue.
-     * [1..]: io queues.
+     * [1]: io queue of the node's AioContext.
+     * [2..]: io queues of other AioContexts, created on demand.
+     *
+     * The array has room for NVME_MAX_IO_QUEUES io queues.  Entries are
+     * published before @queue_count is incremented and never removed
+     * until the node is closed.
      */
     NVMeQueuePair **queues;
     unsigned queue_count;
+    unsigned max_queues;
+    CoMutex add_queue_lock;
+    /* Tags the per-thread queue lookup cache, see nvme_get_io_queue() */
+    unsigned queue_cache_gen;
     size_t page_size;
     /* How many uint32_t elements does each doorbell entry take. */
     size_t doorbell_scale;
@@ -146,6 +169,29 @@ struct BDRVNVMeState {
 #define NVME_BLOCK_OPT_NAMESPACE "namespace"
 
 static void nvme_process_completion_bh(void *opaque);
+static void nvme_poll_queue_bh(void *opaque);
+
+/*
+ * The queue pair that the last request of this thread used.  @gen is the
+ * queue_cache_gen of @s at that time, so that a new node that happens to
+ * reuse the address of a closed one does not match.
+ */
+typedef struct {
+    BDRVNVMeState *s;
+    unsigned gen;
+    AioContext *ctx;
+    NVMeQueuePair *q;
+} NVMeQueueCache;
+
+QEMU_DEFINE_STATIC_CO_TLS(NVMeQueueCache, nvme_queue_cache);
+
+static unsigned nvme_queue_cache_gen;
+
+/* Invalidate the lookup caches of all threads for @s */
+static void nvme_queue_cache_invalidate(BDRVNVMeState *s)
+{
+    s->queue_cache_gen = qatomic_fetch_inc(&nvme_queue_cache_gen) + 1;
+}
 
 static QemuOptsList runtime_opts = {
     .name = "nvme",
@@ -199,10 +245,14 @@ static void nvme_free_queue_pair(NVMeQueuePair *q)
     if (q->completion_bh) {
         qemu_bh_delete(q->completion_bh);
     }
+    if (q->poll_bh) {
+        qemu_bh_delete(q->poll_bh);
+    }
     nvme_free_queue(&q->sq);
     nvme_free_queue(&q->cq);
     qemu_vfree(q->prp_list_pages);
     qemu_mutex_destroy(&q->lock);
+    aio_context_unref(q->aio_context);
     g_free(q);
 }
 
@@ -234,6 +284,9 @@ static NVMeQueuePair *nvme_create_queue_pair(BDRVNVMeState *s,
         error_setg(errp, "Cannot allocate queue pair");
         return NULL;
     }
+    /* Keep the event loop and our BHs alive even if its iothread goes away */
+    q->aio_context = aio_context;
+    aio_context_ref(aio_context);
     trace_nvme_create_queue_pair(idx, q, size, aio_context,
                                  event_notifier_get_fd(s->irq_notifier));
     bytes = QEMU_ALIGN_UP(s->page_size * NVME_NUM_REQS,
@@ -249,6 +302,7 @@ static NVMeQueuePair *nvme_create_queue_pair(BDRVNVMeState *s,
     q->index = idx;
     qemu_co_queue_init(&q->free_req_queue);
     q->completion_bh = aio_bh_new(aio_context, nvme_process_completion_bh, q);
+    q->poll_bh = aio_bh_new(aio_context, nvme_poll_queue_bh, q);
     r = qemu_vfio_dma_map(s->vfio, q->prp_list_pages, bytes,
                           false, &prp_list_iova, errp);
     if (r) {
@@ -291,10 +345,15 @@ static void nvme_kick(NVMeQueuePair *q)
     }
     trace_nvme_kick(s, q->index);
     assert(!(q->sq.tail & 0xFF00));
+    /*
+     * Account the requests before the device can complete them, so that the
+     * interrupt handler does not miss them (see nvme_poll_queues()).
+     */
+    qatomic_set(&q->inflight, q->inflight + q->need_kick);
     /* Fence the write to submission queue entry before notifying the device. */
     smp_wmb();
     host_pci_stl_le_p(q->sq.doorbell, q->sq.tail);
-    q->inflight += q->need_kick;
+    q->submitted += q->need_kick;
     q->need_kick = 0;
 }
 
@@ -328,6 +387,7 @@ static coroutine_fn NVMeRequest *nvme_get_free_req(NVMeQueuePair *q)
 
     while (q->free_req_head == -1) {
         trace_nvme_free_req_queue_wait(q->s, q->index);
+        q->request_waits++;
         qemu_co_queue_wait(&q->free_req_queue, &q->lock);
     }
 
@@ -345,7 +405,7 @@ static void nvme_put_free_req_locked(NVMeQueuePair *q, NVMeRequest *req)
 static void nvme_wake_free_req_locked(NVMeQueuePair *q)
 {
     if (!qemu_co_queue_empty(&q->free_req_queue)) {
-        replay_bh_schedule_oneshot_event(q->s->aio_context,
+        replay_bh_schedule_oneshot_event(q->aio_context,
                 nvme_free_req_queue_cb, q);
     }
 }
@@ -433,7 +493,8 @@ static bool nvme_process_completion(NVMeQueuePair *q)
         assert(req.cb);
         nvme_put_free_req_locked(q, preq);
         preq->cb = preq->opaque = NULL;
-        q->inflight--;
+        qatomic_set(&q->inflight, q->inflight - 1);
+        q->completed++;
         qemu_mutex_unlock(&q->lock);
         req.cb(req.opaque, ret);
         qemu_mutex_lock(&q->lock);
@@ -511,6 +572,29 @@ static void nvme_submit_command(NVMeQueuePair *q, NVMeRequest *req,
     defer_call(nvme_deferred_fn, q);
 }
 
+typedef struct {
+    Coroutine *co;
+    int ret;
+    AioContext *ctx;
+} NVMeCoData;
+
+static void nvme_rw_cb_bh(void *opaque)
+{
+    NVMeCoData *data = opaque;
+    qemu_coroutine_enter(data->co);
+}
+
+static void nvme_rw_cb(void *opaque, int ret)
+{
+    NVMeCoData *data = opaque;
+    data->ret = ret;
+    if (!data->co) {
+        /* The rw coroutine hasn't yielded, don't try to enter. */
+        return;
+    }
+    replay_bh_schedule_oneshot_event(data->ctx, nvme_rw_cb_bh, data);
+}
+
 static void nvme_admin_cmd_sync_cb(void *opaque, int ret)
 {
     int *pret = opaque;
@@ -535,6 +619,37 @@ static int nvme_admin_cmd_sync(BlockDriverState *bs, NvmeCmd *cmd)
     return ret;
 }
 
+static coroutine_fn int nvme_admin_cmd_co(BlockDriverState *bs, NvmeCmd *cmd)
+{
+    BDRVNVMeState *s = bs->opaque;
+    NVMeQueuePair *q = s->queues[INDEX_ADMIN];
+    NVMeRequest *req;
+    NVMeCoData data = {
+        .ctx = qemu_get_current_aio_context(),
+        .ret = -EINPROGRESS,
+    };
+
+    req = nvme_get_free_req(q);
+    assert(req);
+    nvme_submit_command(q, req, cmd, nvme_rw_cb, &data);
+
+    data.co = qemu_coroutine_self();
+    while (data.ret == -EINPROGRESS) {
+        qemu_coroutine_yield();
+    }
+
+    return data.ret;
+}
+
+static int coroutine_mixed_fn nvme_admin_cmd(BlockDriverState *bs,
+                                             NvmeCmd *cmd)
+{
+    if (qemu_in_coroutine()) {
+        return nvme_admin_cmd_co(bs, cmd);
+    }
+    return nvme_admin_cmd_sync(bs, cmd);
+}
+
 /* Returns true on success, false on failure. */
 static bool nvme_identify(BlockDriverState *bs, int namespace, Error **errp)
 {
@@ -626,18 +741,28 @@ out:
     return ret;
 }
 
-static void nvme_poll_queue(NVMeQueuePair *q)
+/*
+ * Check for completions without taking q->lock.  Only the event loop thread
+ * that owns @q may call this, because cq.head and cq_phase are updated by
+ * nvme_process_completion() in that thread.
+ */
+static bool nvme_queue_has_completions(NVMeQueuePair *q)
 {
     const size_t cqe_offset = q->cq.head * NVME_CQ_ENTRY_BYTES;
     NvmeCqe *cqe = (NvmeCqe *)&q->cq.queue[cqe_offset];
 
+    return (le16_to_cpu(cqe->status) & 0x1) != q->cq_phase;
+}
+
+static void nvme_poll_queue(NVMeQueuePair *q)
+{
     trace_nvme_poll_queue(q->s, q->index);
     /*
      * Do an early check for completions. q->lock isn't needed because
      * nvme_process_completion() only runs in the event loop thread and
      * cannot race with itself.
      */
-    if ((le16_to_cpu(cqe->status) & 0x1) == q->cq_phase) {
+    if (!nvme_queue_has_completions(q)) {
         return;
     }
 
@@ -648,12 +773,31 @@ static void nvme_poll_queue(NVMeQueuePair *q)
     qemu_mutex_unlock(&q->lock);
 }
 
+static void nvme_poll_queue_bh(void *opaque)
+{
+    nvme_poll_queue(opaque);
+}
+
+/*
+ * All queues share one interrupt, which is handled in the node's AioContext.
+ * Queues owned by other event loops are handed over to them, so that request
+ * callbacks run in the thread that submitted the request.  Their completion
+ * queue is only looked at by the owner; here it is enough to know whether
+ * the queue has requests in flight at all.
+ */
 static void nvme_poll_queues(BDRVNVMeState *s)
 {
+    unsigned count = qatomic_load_acquire(&s->queue_count);
     int i;
 
-    for (i = 0; i < s->queue_count; i++) {
-        nvme_poll_queue(s->queues[i]);
+    for (i = 0; i < count; i++) {
+        NVMeQueuePair *q = s->queues[i];
+
+        if (q->aio_context == s->aio_context) {
+            nvme_poll_queue(q);
+        } else if (qatomic_read(&q->inflight)) {
+            qemu_bh_schedule(q->poll_bh);
+        }
     }
 }
 
@@ -667,7 +811,31 @@ static void nvme_handle_event(EventNotifier *n)
     nvme_poll_queues(s);
 }
 
-static bool nvme_add_io_queue(BlockDriverState *bs, Error **errp)
+/*
+ * Ask for as many I/O queues as we may create. The controller can grant
+ * fewer; nvme_get_io_queue() stops creating queues once it refuses one.
+ */
+static void nvme_set_num_queues(BlockDriverState *bs)
+{
+    BDRVNVMeState *s = bs->opaque;
+    uint32_t nr = NVME_MAX_IO_QUEUES - 1;
+    NvmeCmd cmd = {
+        .opcode = NVME_ADM_CMD_SET_FEATURES,
+        .cdw10 = cpu_to_le32(NVME_NUMBER_OF_QUEUES),
+        .cdw11 = cpu_to_le32((nr << 16) | nr),
+    };
+
+    if (nvme_admin_cmd_sync(bs, &cmd)) {
+        s->max_queues = INDEX_IO(1);
+    } else {
+        s->max_queues = INDEX_IO(NVME_MAX_IO_QUEUES);
+    }
+}
+
+/* Create an I/O queue pair that is owned by @aio_context */
+static bool coroutine_mixed_fn nvme_add_io_queue(BlockDriverState *bs,
+                                                 AioContext *aio_context,
+                                                 Error **errp)
 {
     BDRVNVMeState *s = bs->opaque;
     unsigned n = s->queue_count;
@@ -675,9 +843,8 @@ static bool nvme_add_io_queue(BlockDriverState *bs, Error **errp)
     NvmeCmd cmd;
     unsigned queue_size = NVME_QUEUE_SIZE;
 
-    assert(n <= UINT16_MAX);
-    q = nvme_create_queue_pair(s, bdrv_get_aio_context(bs),
-                               n, queue_size, errp);
+    assert(n <= UINT16_MAX && n < s->max_queues);
+    q = nvme_create_queue_pair(s, aio_context, n, queue_size, errp);
     if (!q) {
         return false;
     }
@@ -687,7 +854,7 @@ static bool nvme_add_io_queue(BlockDriverState *bs, Error **errp)
         .cdw10 = cpu_to_le32(((queue_size - 1) << 16) | n),
         .cdw11 = cpu_to_le32(NVME_CQ_IEN | NVME_CQ_PC),
     };
-    if (nvme_admin_cmd_sync(bs, &cmd)) {
+    if (nvme_admin_cmd(bs, &cmd)) {
         error_setg(errp, "Failed to create CQ io queue [%u]", n);
         goto out_error;
     }
@@ -697,14 +864,19 @@ static bool nvme_add_io_queue(BlockDriverState *bs, Error **errp)
         .cdw10 = cpu_to_le32(((queue_size - 1) << 16) | n),
         .cdw11 = cpu_to_le32(NVME_SQ_PC | (n << 16)),
     };
-    if (nvme_admin_cmd_sync(bs, &cmd)) {
+    if (nvme_admin_cmd(bs, &cmd)) {
         error_setg(errp, "Failed to create SQ io queue [%u]", n);
-        goto out_error;
+        goto out_delete_cq;
     }
-    s->queues = g_renew(NVMeQueuePair *, s->queues, n + 1);
     s->queues[n] = q;
-    s->queue_count++;
+    qatomic_store_release(&s->queue_count, n + 1);
     return true;
+out_delete_cq:
+    cmd = (NvmeCmd) {
+        .opcode = NVME_ADM_CMD_DELETE_CQ,
+        .cdw10 = cpu_to_le32(n),
+    };
+    nvme_admin_cmd(bs, &cmd);
 out_error:
     nvme_free_queue_pair(q);
     return false;
@@ -715,18 +887,19 @@ static bool nvme_poll_cb(void *opaque)
     EventNotifier *e = opaque;
     BDRVNVMeState *s = container_of(e, BDRVNVMeState,
                                     irq_notifier[MSIX_SHARED_IRQ_IDX]);
+    unsigned count = qatomic_load_acquire(&s->queue_count);
     int i;
 
-    for (i = 0; i < s->queue_count; i++) {
+    for (i = 0; i < count; i++) {
         NVMeQueuePair *q = s->queues[i];
-        const size_t cqe_offset = q->cq.head * NVME_CQ_ENTRY_BYTES;
-        NvmeCqe *cqe = (NvmeCqe *)&q->cq.queue[cqe_offset];
 
         /*
          * q->lock isn't needed because nvme_process_completion() only runs in
-         * the event loop thread and cannot race with itself.
+         * the event loop thread and cannot race with itself. Queues of other
+         * event loops are left to the interrupt handler.
          */
-        if ((le16_to_cpu(cqe->status) & 0x1) != q->cq_phase) {
+        if (q->aio_context == s->aio_context &&
+            nvme_queue_has_completions(q)) {
             return true;
         }
     }
@@ -757,6 +930,8 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
 
     qemu_co_mutex_init(&s->dma_map_lock);
     qemu_co_queue_init(&s->dma_flush_queue);
+    qemu_co_mutex_init(&s->add_queue_lock);
+    nvme_queue_cache_invalidate(s);
     s->device = g_strdup(device);
     s->nsid = namespace;
     s->aio_context = bdrv_get_aio_context(bs);
@@ -837,7 +1012,8 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
     }
 
     /* Set up admin queue. */
-    s->queues = g_new(NVMeQueuePair *, 1);
+    s->queues = g_new0(NVMeQueuePair *, INDEX_IO(NVME_MAX_IO_QUEUES));
+    s->max_queues = INDEX_IO(1);
     q = nvme_create_queue_pair(s, aio_context, 0, NVME_QUEUE_SIZE, errp);
     if (!q) {
         ret = -EINVAL;
@@ -886,7 +1062,8 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
     }
 
     /* Set up command queues. */
-    if (!nvme_add_io_queue(bs, errp)) {
+    nvme_set_num_queues(bs);
+    if (!nvme_add_io_queue(bs, aio_context, errp)) {
         ret = -EIO;
     }
 out:
@@ -1162,27 +1339,67 @@ fail:
     return r;
 }
 
-typedef struct {
-    Coroutine *co;
-    int ret;
-    AioContext *ctx;
-} NVMeCoData;
-
-static void nvme_rw_cb_bh(void *opaque)
+static NVMeQueuePair *nvme_find_io_queue(BDRVNVMeState *s, AioContext *ctx)
 {
-    NVMeCoData *data = opaque;
-    qemu_coroutine_enter(data->co);
+    unsigned count = qatomic_load_acquire(&s->queue_count);
+    int i;
+
+    for (i = INDEX_IO(0); i < count; i++) {
+        if (s->queues[i]->aio_context == ctx) {
+            return s->queues[i];
+        }
+    }
+    return NULL;
 }
 
-static void nvme_rw_cb(void *opaque, int ret)
+/*
+ * Return the I/O queue pair of the current AioContext, creating it on first
+ * use so that event loops do not contend on each other's queue locks. Once
+ * the controller runs out of queues, the node's own queue pair is shared.
+ */
+static coroutine_fn NVMeQueuePair *nvme_get_io_queue(BlockDriverState *bs)
 {
-    NVMeCoData *data = opaque;
-    data->ret = ret;
-    if (!data->co) {
-        /* The rw coroutine hasn't yielded, don't try to enter. */
-        return;
+    BDRVNVMeState *s = bs->opaque;
+    AioContext *ctx = qemu_get_current_aio_context();
+    NVMeQueueCache *cache = get_ptr_nvme_queue_cache();
+    NVMeQueuePair *q;
+    Error *local_err = NULL;
+
+    if (cache->s == s && cache->gen == s->queue_cache_gen &&
+        cache->ctx == ctx) {
+        return cache->q;
     }
-    replay_bh_schedule_oneshot_event(data->ctx, nvme_rw_cb_bh, data);
+
+    q = nvme_find_io_queue(s, ctx);
+    if (q) {
+        goto out;
+    }
+
+    WITH_QEMU_LOCK_GUARD(&s->add_queue_lock) {
+        q = nvme_find_io_queue(s, ctx);
+        if (q || s->queue_count >= s->max_queues) {
+            break;
+        }
+
+        if (nvme_add_io_queue(bs, ctx, &local_err)) {
+            q = s->queues[s->queue_count - 1];
+        } else {
+            warn_reportf_err(local_err, "Sharing NVMe io queue: ");
+            s->max_queues = s->queue_count;
+        }
+    }
+
+    q = q ?: s->queues[INDEX_IO(0)];
+out:
+    /* Creating the queue may have yielded, look the cache up again */
+    cache = get_ptr_nvme_queue_cache();
+    *cache = (NVMeQueueCache) {
+        .s = s,
+        .gen = s->queue_cache_gen,
+        .ctx = ctx,
+        .q = q,
+    };
+    return q;
 }
 
 static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
@@ -1193,7 +1410,7 @@ static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
 {
     int r;
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[INDEX_IO(0)];
+    NVMeQueuePair *ioq = nvme_get_io_queue(bs);
     NVMeRequest *req;
 
     uint32_t cdw12 = (((bytes >> s->blkshift) - 1) & 0xFFFF) |
@@ -1206,7 +1423,7 @@ static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
         .cdw12 = cpu_to_le32(cdw12),
     };
     NVMeCoData data = {
-        .ctx = bdrv_get_aio_context(bs),
+        .ctx = qemu_get_current_aio_context(),
         .ret = -EINPROGRESS,
     };
 
@@ -1314,14 +1531,14 @@ static coroutine_fn int nvme_co_pwritev(BlockDriverState *bs,
 static coroutine_fn int nvme_co_flush(BlockDriverState *bs)
 {
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[INDEX_IO(0)];
+    NVMeQueuePair *ioq = nvme_get_io_queue(bs);
     NVMeRequest *req;
     NvmeCmd cmd = {
         .opcode = NVME_CMD_FLUSH,
         .nsid = cpu_to_le32(s->nsid),
     };
     NVMeCoData data = {
-        .ctx = bdrv_get_aio_context(bs),
+        .ctx = qemu_get_current_aio_context(),
         .ret = -EINPROGRESS,
     };
 
@@ -1345,7 +1562,7 @@ static coroutine_fn int nvme_co_pwrite_zeroes(BlockDriverState *bs,
                                               BdrvRequestFlags flags)
 {
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[INDEX_IO(0)];
+    NVMeQueuePair *ioq = nvme_get_io_queue(bs);
     NVMeRequest *req;
     uint32_t cdw12;
 
@@ -1372,7 +1589,7 @@ static coroutine_fn int nvme_co_pwrite_zeroes(BlockDriverState *bs,
     };
 
     NVMeCoData data = {
-        .ctx = bdrv_get_aio_context(bs),
+        .ctx = qemu_get_current_aio_context(),
         .ret = -EINPROGRESS,
     };
 
@@ -1408,7 +1625,7 @@ static int coroutine_fn nvme_co_pdiscard(BlockDriverState *bs,
                                          int64_t bytes)
 {
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[INDEX_IO(0)];
+    NVMeQueuePair *ioq = nvme_get_io_queue(bs);
     NVMeRequest *req;
     QEMU_AUTO_VFREE NvmeDsmRange *buf = NULL;
     QEMUIOVector local_qiov;
@@ -1422,7 +1639,7 @@ static int coroutine_fn nvme_co_pdiscard(BlockDriverState *bs,
     };
 
     NVMeCoData data = {
-        .ctx = bdrv_get_aio_context(bs),
+        .ctx = qemu_get_current_aio_context(),
         .ret = -EINPROGRESS,
     };
 
@@ -1555,8 +1772,15 @@ static void nvme_detach_aio_context(BlockDriverState *bs)
     for (unsigned i = 0; i < s->queue_count; i++) {
         NVMeQueuePair *q = s->queues[i];
 
+        /* Queue pairs of other event loops stay where they are */
+        if (q->aio_context != s->aio_context) {
+            continue;
+        }
+
         qemu_bh_delete(q->completion_bh);
         q->completion_bh = NULL;
+        qemu_bh_delete(q->poll_bh);
+        q->poll_bh = NULL;
     }
 
     aio_set_event_notifier(bdrv_get_aio_context(bs),
@@ -1568,18 +1792,29 @@ static void nvme_attach_aio_context(BlockDriverState *bs,
                                     AioContext *new_context)
 {
     BDRVNVMeState *s = bs->opaque;
-
-    s->aio_context = new_context;
-    aio_set_event_notifier(new_context, &s->irq_notifier[MSIX_SHARED_IRQ_IDX],
-                           nvme_handle_event, nvme_poll_cb,
-                           nvme_poll_ready);
+    AioContext *old_context = s->aio_context;
 
     for (unsigned i = 0; i < s->queue_count; i++) {
         NVMeQueuePair *q = s->queues[i];
 
+        if (q->aio_context != old_context) {
+            continue;
+        }
+
+        aio_context_unref(q->aio_context);
+        q->aio_context = new_context;
+        aio_context_ref(new_context);
         q->completion_bh =
             aio_bh_new(new_context, nvme_process_completion_bh, q);
+        q->poll_bh = aio_bh_new(new_context, nvme_poll_queue_bh, q);
     }
+
+    s->aio_context = new_context;
+    /* The node's queue pair moved, do not let threads keep using it */
+    nvme_queue_cache_invalidate(s);
+    aio_set_event_notifier(new_context, &s->irq_notifier[MSIX_SHARED_IRQ_IDX],
+                           nvme_handle_event, nvme_poll_cb,
+                           nvme_poll_ready);
 }
 
 static bool nvme_register_buf(BlockDriverState *bs, void *host, size_t size,
@@ -1608,6 +1843,8 @@ static BlockStatsSpecific *nvme_get_specific_stats(BlockDriverState *bs)
 {
     BlockStatsSpecific *stats = g_new(BlockStatsSpecific, 1);
     BDRVNVMeState *s = bs->opaque;
+    BlockStatsSpecificNvmeQueueList **tail;
+    unsigned count;
 
     stats->driver = BLOCKDEV_DRIVER_NVME;
     stats->u.nvme = (BlockStatsSpecificNvme) {
@@ -1616,6 +1853,24 @@ static BlockStatsSpecific *nvme_get_specific_stats(BlockDriverState *bs)
         .unaligned_accesses = s->stats.unaligned_accesses,
     };
 
+    tail = &stats->u.nvme.io_queues;
+    count = qatomic_load_acquire(&s->queue_count);
+    for (unsigned i = INDEX_IO(0); i < count; i++) {
+        NVMeQueuePair *q = s->queues[i];
+        BlockStatsSpecificNvmeQueue *queue;
+
+        queue = g_new(BlockStatsSpecificNvmeQueue, 1);
+        WITH_QEMU_LOCK_GUARD(&q->lock) {
+            *queue = (BlockStatsSpecificNvmeQueue) {
+                .index = q->index,
+                .submitted = q->submitted,
+                .completed = q->completed,
+                .request_waits = q->request_waits,
+            };
+        }
+        QAPI_LIST_APPEND(tail, queue);
+    }
+
     return stats;
 }
 
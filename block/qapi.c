@@ -529,6 +529,20 @@ bdrv_latency_histogram_stats(BlockLatencyHistogram *hist)
     return info;
 }
 
+static BlockLatencyPercentiles *
+bdrv_latency_percentiles(BlockAcctStats *stats, enum BlockAcctType type)
+{
+    BlockLatencyPercentiles *info = g_new0(BlockLatencyPercentiles, 1);
+
+    if (!block_acct_latency_percentile(stats, type, 500, &info->p50)) {
+        g_free(info);
+        return NULL;
+    }
+    block_acct_latency_percentile(stats, type, 990, &info->p99);
+    block_acct_latency_percentile(stats, type, 999, &info->p999);
+    return info;
+}
+
 static void bdrv_query_blk_stats(BlockDeviceStats *ds, BlockBackend *blk)
 {
     BlockAcctStats *stats = blk_get_stats(blk);
@@ -624,6 +638,15 @@ static void bdrv_query_blk_stats(BlockDeviceStats *ds, BlockBackend *blk)
         = bdrv_latency_histogram_stats(&hgram[BLOCK_ACCT_ZONE_APPEND]);
     ds->flush_latency_histogram
         = bdrv_latency_histogram_stats(&hgram[BLOCK_ACCT_FLUSH]);
+
+    ds->rd_latency_percentiles
+        = bdrv_latency_percentiles(stats, BLOCK_ACCT_READ);
+    ds->wr_latency_percentiles
+        = bdrv_latency_percentiles(stats, BLOCK_ACCT_WRITE);
+    ds->zone_append_latency_percentiles
+        = bdrv_latency_percentiles(stats, BLOCK_ACCT_ZONE_APPEND);
+    ds->flush_latency_percentiles
+        = bdrv_latency_percentiles(stats, BLOCK_ACCT_FLUSH);
 }
 
 static BlockStats * GRAPH_RDLOCK
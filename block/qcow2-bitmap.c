@@ -28,6 +28,7 @@
 #include "qemu/osdep.h"
 #include "block/block-io.h"
 #include "block/dirty-bitmap.h"
+#include "crypto/hash.h"
 #include "qapi/error.h"
 #include "qemu/cutils.h"
 
@@ -91,6 +92,8 @@ typedef struct Qcow2Bitmap {
     char *name;
 
     BdrvDirtyBitmap *dirty_bitmap;
+    /* the existing bitmap table is updated instead of being replaced */
+    bool store_in_place;
 
     QSIMPLEQ_ENTRY(Qcow2Bitmap) entry;
 } Qcow2Bitmap;
@@ -282,6 +285,85 @@ free_bitmap_clusters(BlockDriverState *bs, Qcow2BitmapTable *tb)
     return 0;
 }
 
+/*
+ * Bitmap digests
+ *
+ * For every persistent bitmap that was loaded from or stored to the image,
+ * remember a digest of each of its allocated data clusters together with the
+ * bitmap table they belong to.  As long as the bitmap table in the image is
+ * still that one, storing the bitmap again only needs to write the clusters
+ * whose serialized content has a different digest.
+ *
+ * Loading a bitmap does not hash anything, most bitmaps are never stored in
+ * place.  The digests of a loaded bitmap are unknown until its first store
+ * in place, which compares unknown clusters with the image instead.
+ */
+
+#define BME_DIGEST_SIZE QCRYPTO_HASH_DIGEST_LEN_SHA256
+
+typedef struct Qcow2BitmapDigests {
+    uint64_t table_offset;
+    uint32_t table_size;
+    /* one digest per table entry, all-zero if the content is unknown */
+    uint8_t (*digest)[BME_DIGEST_SIZE];
+} Qcow2BitmapDigests;
+
+static Qcow2BitmapDigests *bitmap_digests_new(uint32_t table_size)
+{
+    Qcow2BitmapDigests *dg = g_new0(Qcow2BitmapDigests, 1);
+
+    dg->table_size = table_size;
+    dg->digest = g_malloc0_n(table_size, BME_DIGEST_SIZE);
+
+    return dg;
+}
+
+static void bitmap_digests_free(gpointer opaque)
+{
+    Qcow2BitmapDigests *dg = opaque;
+
+    if (dg) {
+        g_free(dg->digest);
+        g_free(dg);
+    }
+}
+
+static void bitmap_digests_set(BDRVQcow2State *s, const char *name,
+                               Qcow2BitmapDigests *dg)
+{
+    if (!s->bitmap_digests) {
+        s->bitmap_digests = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                  g_free, bitmap_digests_free);
+    }
+    g_hash_table_replace(s->bitmap_digests, g_strdup(name), dg);
+}
+
+static void bitmap_digests_drop(BDRVQcow2State *s, const char *name)
+{
+    if (s->bitmap_digests) {
+        g_hash_table_remove(s->bitmap_digests, name);
+    }
+}
+
+static void bitmap_digests_drop_all(BDRVQcow2State *s)
+{
+    if (s->bitmap_digests) {
+        g_hash_table_remove_all(s->bitmap_digests);
+    }
+}
+
+static void bitmap_cluster_digest(const uint8_t *buf, size_t len,
+                                  uint8_t *digest)
+{
+    size_t digest_len = BME_DIGEST_SIZE;
+
+    if (qcrypto_hash_bytes(QCRYPTO_HASH_ALGO_SHA256, buf, len,
+                           &digest, &digest_len, NULL) < 0) {
+        /* Unknown content, the cluster will simply be rewritten */
+        memset(digest, 0, BME_DIGEST_SIZE);
+    }
+}
+
 /* load_bitmap_data
  * @bitmap_table entries must satisfy specification constraints.
  * @bitmap must be cleared */
@@ -343,7 +425,9 @@ BdrvDirtyBitmap *load_bitmap(BlockDriverState *bs,
                              Qcow2Bitmap *bm, Error **errp)
 {
     int ret;
+    BDRVQcow2State *s = bs->opaque;
     uint64_t *bitmap_table = NULL;
+    Qcow2BitmapDigests *digests = NULL;
     uint32_t granularity;
     BdrvDirtyBitmap *bitmap = NULL;
 
@@ -373,6 +457,11 @@ BdrvDirtyBitmap *load_bitmap(BlockDriverState *bs,
         goto fail;
     }
 
+    /* All digests unknown for now */
+    digests = bitmap_digests_new(bm->table.size);
+    digests->table_offset = bm->table.offset;
+    bitmap_digests_set(s, bm->name, digests);
+
     g_free(bitmap_table);
     return bitmap;
 
@@ -1275,10 +1364,12 @@ out:
 
 /* store_bitmap_data()
  * Store bitmap to image, filling bitmap table accordingly.
+ * The digests of the written clusters are returned in @digests.
  */
 static uint64_t * GRAPH_RDLOCK
 store_bitmap_data(BlockDriverState *bs, BdrvDirtyBitmap *bitmap,
-                  uint32_t *bitmap_table_size, Error **errp)
+                  uint32_t *bitmap_table_size,
+                  Qcow2BitmapDigests **digests, Error **errp)
 {
     int ret;
     BDRVQcow2State *s = bs->opaque;
@@ -1288,6 +1379,7 @@ store_bitmap_data(BlockDriverState *bs, BdrvDirtyBitmap *bitmap,
     const char *bm_name = bdrv_dirty_bitmap_name(bitmap);
     uint8_t *buf = NULL;
     uint64_t *tb;
+    Qcow2BitmapDigests *dg;
     uint64_t tb_size =
             size_to_clusters(s,
                 bdrv_dirty_bitmap_serialization_size(bitmap, 0, bm_size));
@@ -1305,6 +1397,7 @@ store_bitmap_data(BlockDriverState *bs, BdrvDirtyBitmap *bitmap,
         return NULL;
     }
 
+    dg = bitmap_digests_new(tb_size);
     buf = g_malloc(s->cluster_size);
     limit = bdrv_dirty_bitmap_serialization_coverage(s->cluster_size, bitmap);
     assert(DIV_ROUND_UP(bm_size, limit) == tb_size);
@@ -1354,17 +1447,20 @@ store_bitmap_data(BlockDriverState *bs, BdrvDirtyBitmap *bitmap,
                              bm_name);
             goto fail;
         }
+        bitmap_cluster_digest(buf, s->cluster_size, dg->digest[cluster]);
 
         offset = end;
     }
 
     *bitmap_table_size = tb_size;
+    *digests = dg;
     g_free(buf);
 
     return tb;
 
 fail:
     clear_bitmap_table(bs, tb, tb_size);
+    bitmap_digests_free(dg);
     g_free(buf);
     g_free(tb);
 
@@ -1379,9 +1475,11 @@ static int GRAPH_RDLOCK
 store_bitmap(BlockDriverState *bs, Qcow2Bitmap *bm, Error **errp)
 {
     int ret;
+    BDRVQcow2State *s = bs->opaque;
     uint64_t *tb;
     int64_t tb_offset;
     uint32_t tb_size;
+    Qcow2BitmapDigests *digests = NULL;
     BdrvDirtyBitmap *bitmap = bm->dirty_bitmap;
     const char *bm_name;
 
@@ -1389,7 +1487,7 @@ store_bitmap(BlockDriverState *bs, Qcow2Bitmap *bm, Error **errp)
 
     bm_name = bdrv_dirty_bitmap_name(bitmap);
 
-    tb = store_bitmap_data(bs, bitmap, &tb_size, errp);
+    tb = store_bitmap_data(bs, bitmap, &tb_size, &digests, errp);
     if (tb == NULL) {
         return -EINVAL;
     }
@@ -1425,9 +1523,13 @@ store_bitmap(BlockDriverState *bs, Qcow2Bitmap *bm, Error **errp)
     bm->table.offset = tb_offset;
     bm->table.size = tb_size;
 
+    digests->table_offset = tb_offset;
+    bitmap_digests_set(s, bm_name, digests);
+
     return 0;
 
 fail:
+    bitmap_digests_free(digests);
     clear_bitmap_table(bs, tb, tb_size);
 
     if (tb_offset > 0) {
@@ -1440,6 +1542,199 @@ fail:
     return ret;
 }
 
+/*
+ * Check whether @bitmap can be stored by updating the existing bitmap table
+ * of @bm: the table must have the layout @bitmap needs and we must know the
+ * content of its data clusters.
+ */
+static bool can_store_bitmap_in_place(BlockDriverState *bs, Qcow2Bitmap *bm,
+                                      BdrvDirtyBitmap *bitmap)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t bm_size = bdrv_dirty_bitmap_size(bitmap);
+    Qcow2BitmapDigests *dg;
+
+    if (!s->bitmap_digests || bm->table.offset == 0 || bm->table.size == 0 ||
+        bm->granularity_bits != ctz32(bdrv_dirty_bitmap_granularity(bitmap)))
+    {
+        return false;
+    }
+
+    if (bm->table.size != size_to_clusters(s,
+            bdrv_dirty_bitmap_serialization_size(bitmap, 0, bm_size)))
+    {
+        return false;
+    }
+
+    dg = g_hash_table_lookup(s->bitmap_digests, bm->name);
+    return dg && dg->table_offset == bm->table.offset &&
+           dg->table_size == bm->table.size;
+}
+
+/* store_bitmap_in_place()
+ * Store bm->dirty_bitmap to qcow2 reusing its existing bitmap table.
+ * Only clusters whose content changed are written; clusters that became
+ * all zeroes are released.  Clusters whose digest is unknown are read and
+ * compared.  The bitmap must be marked IN_USE in the image, so the
+ * partially updated state is never trusted after a crash.
+ */
+static int GRAPH_RDLOCK
+store_bitmap_in_place(BlockDriverState *bs, Qcow2Bitmap *bm, Error **errp)
+{
+    int ret;
+    BDRVQcow2State *s = bs->opaque;
+    BdrvDirtyBitmap *bitmap = bm->dirty_bitmap;
+    const char *bm_name = bdrv_dirty_bitmap_name(bitmap);
+    uint64_t bm_size = bdrv_dirty_bitmap_size(bitmap);
+    Qcow2BitmapDigests *dg = g_hash_table_lookup(s->bitmap_digests, bm->name);
+    uint64_t *tb = NULL, *old_tb = NULL;
+    uint64_t offset, limit;
+    uint8_t digest[BME_DIGEST_SIZE];
+    uint8_t *buf = NULL, *old_buf = NULL;
+    bool table_changed = false, table_written = false;
+    uint32_t i;
+
+    assert(dg && dg->table_offset == bm->table.offset);
+
+    ret = bitmap_table_load(bs, &bm->table, &tb);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read bitmap table of bitmap "
+                         "'%s'", bm_name);
+        return ret;
+    }
+    old_tb = g_memdup2(tb, bm->table.size * sizeof(tb[0]));
+
+    buf = g_malloc(s->cluster_size);
+    limit = bdrv_dirty_bitmap_serialization_coverage(s->cluster_size, bitmap);
+    for (i = 0, offset = 0; i < bm->table.size; ++i, offset += limit) {
+        uint64_t count = MIN(bm_size - offset, limit);
+        uint64_t data_offset = tb[i] & BME_TABLE_ENTRY_OFFSET_MASK;
+        uint64_t write_size;
+
+        if (bdrv_dirty_bitmap_next_dirty(bitmap, offset, count) < 0) {
+            if (tb[i] != 0) {
+                /* The cluster is freed once the table no longer uses it */
+                tb[i] = 0;
+                table_changed = true;
+            }
+            memset(dg->digest[i], 0, BME_DIGEST_SIZE);
+            continue;
+        }
+
+        write_size = bdrv_dirty_bitmap_serialization_size(bitmap, offset,
+                                                          count);
+        assert(write_size <= s->cluster_size);
+        bdrv_dirty_bitmap_serialize_part(bitmap, buf, offset, count);
+        if (write_size < s->cluster_size) {
+            memset(buf + write_size, 0, s->cluster_size - write_size);
+        }
+
+        bitmap_cluster_digest(buf, s->cluster_size, digest);
+        if (data_offset && buffer_is_zero(dg->digest[i], BME_DIGEST_SIZE)) {
+            /* Unknown content, e.g. after loading, so look at the image */
+            if (!old_buf) {
+                old_buf = g_malloc(s->cluster_size);
+            }
+            if (bdrv_pread(bs->file, data_offset, s->cluster_size, old_buf,
+                           0) >= 0 &&
+                memcmp(buf, old_buf, s->cluster_size) == 0)
+            {
+                memcpy(dg->digest[i], digest, BME_DIGEST_SIZE);
+                continue;
+            }
+        } else if (data_offset &&
+                   memcmp(digest, dg->digest[i], BME_DIGEST_SIZE) == 0)
+        {
+            /* Unchanged */
+            continue;
+        }
+
+        if (!data_offset) {
+            int64_t off = qcow2_alloc_clusters(bs, s->cluster_size);
+            if (off < 0) {
+                ret = off;
+                error_setg_errno(errp, -ret,
+                                 "Failed to allocate clusters for bitmap '%s'",
+                                 bm_name);
+                goto fail;
+            }
+            data_offset = off;
+            tb[i] = off;
+            table_changed = true;
+        }
+
+        ret = qcow2_pre_write_overlap_check(bs, 0, data_offset,
+                                            s->cluster_size, false);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Qcow2 overlap check failed");
+            goto fail;
+        }
+
+        ret = bdrv_pwrite(bs->file, data_offset, s->cluster_size, buf, 0);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Failed to write bitmap '%s' to file",
+                             bm_name);
+            goto fail;
+        }
+        memcpy(dg->digest[i], digest, BME_DIGEST_SIZE);
+    }
+
+    if (table_changed) {
+        ret = qcow2_pre_write_overlap_check(bs, 0, bm->table.offset,
+                                            bm->table.size * sizeof(tb[0]),
+                                            false);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Qcow2 overlap check failed");
+            goto fail;
+        }
+
+        bitmap_table_bswap_be(tb, bm->table.size);
+        table_written = true;
+        ret = bdrv_pwrite(bs->file, bm->table.offset,
+                          bm->table.size * sizeof(tb[0]), tb, 0);
+        bitmap_table_bswap_be(tb, bm->table.size);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Failed to write bitmap '%s' to file",
+                             bm_name);
+            goto fail;
+        }
+
+        for (i = 0; i < bm->table.size; i++) {
+            uint64_t old_offset = old_tb[i] & BME_TABLE_ENTRY_OFFSET_MASK;
+
+            if (old_offset && tb[i] == 0) {
+                qcow2_free_clusters(bs, old_offset, s->cluster_size,
+                                    QCOW2_DISCARD_ALWAYS);
+            }
+        }
+    }
+
+    ret = 0;
+    goto out;
+
+fail:
+    /*
+     * Release the clusters allocated above, unless the failed write of the
+     * table may have left some of them referenced in the image.  Leaking
+     * them is harmless, freeing them would let the bitmap share clusters
+     * with new data.
+     */
+    for (i = 0; !table_written && i < bm->table.size; i++) {
+        if (tb[i] != old_tb[i] && tb[i] != 0) {
+            qcow2_free_clusters(bs, tb[i] & BME_TABLE_ENTRY_OFFSET_MASK,
+                                s->cluster_size, QCOW2_DISCARD_ALWAYS);
+        }
+    }
+
+out:
+    g_free(old_buf);
+    g_free(buf);
+    g_free(old_tb);
+    g_free(tb);
+
+    return ret;
+}
+
 static Qcow2Bitmap *find_bitmap_by_name(Qcow2BitmapList *bm_list,
                                         const char *name)
 {
@@ -1496,6 +1791,7 @@ int coroutine_fn qcow2_co_remove_persistent_dirty_bitmap(BlockDriverState *bs,
     }
 
     free_bitmap_clusters(bs, &bm->table);
+    bitmap_digests_drop(s, name);
 
 out:
     qemu_co_mutex_unlock(&s->lock);
@@ -1609,10 +1905,13 @@ bool qcow2_store_persistent_dirty_bitmaps(BlockDriverState *bs,
                            name);
                 goto fail;
             }
-            tb = g_memdup2(&bm->table, sizeof(bm->table));
-            bm->table.offset = 0;
-            bm->table.size = 0;
-            QSIMPLEQ_INSERT_TAIL(&drop_tables, tb, entry);
+            bm->store_in_place = can_store_bitmap_in_place(bs, bm, bitmap);
+            if (!bm->store_in_place) {
+                tb = g_memdup2(&bm->table, sizeof(bm->table));
+                bm->table.offset = 0;
+                bm->table.size = 0;
+                QSIMPLEQ_INSERT_TAIL(&drop_tables, tb, entry);
+            }
         }
         bm->flags = bdrv_dirty_bitmap_enabled(bitmap) ? BME_FLAG_AUTO : 0;
         bm->granularity_bits = ctz32(bdrv_dirty_bitmap_granularity(bitmap));
@@ -1636,7 +1935,11 @@ bool qcow2_store_persistent_dirty_bitmaps(BlockDriverState *bs,
             continue;
         }
 
-        ret = store_bitmap(bs, bm, errp);
+        if (bm->store_in_place) {
+            ret = store_bitmap_in_place(bs, bm, errp);
+        } else {
+            ret = store_bitmap(bs, bm, errp);
+        }
         if (ret < 0) {
             goto fail;
         }
@@ -1672,7 +1975,7 @@ success:
 fail:
     QSIMPLEQ_FOREACH(bm, bm_list, entry) {
         if (bm->dirty_bitmap == NULL || bm->table.offset == 0 ||
-            bdrv_dirty_bitmap_readonly(bm->dirty_bitmap))
+            bm->store_in_place || bdrv_dirty_bitmap_readonly(bm->dirty_bitmap))
         {
             continue;
         }
@@ -1680,6 +1983,9 @@ fail:
         free_bitmap_clusters(bs, &bm->table);
     }
 
+    /* The stored digests no longer match what is in the image */
+    bitmap_digests_drop_all(s);
+
     QSIMPLEQ_FOREACH_SAFE(tb, &drop_tables, entry, tb_next) {
         g_free(tb);
     }
@@ -1903,6 +1903,7 @@ qcow2_do_open(BlockDriverState *bs, QDict *options, int flags,
     }
     g_free(s->unknown_header_fields);
     cleanup_unknown_header_ext(bs);
+    g_clear_pointer(&s->bitmap_digests, g_hash_table_destroy);
     qcow2_free_snapshots(bs);
     qcow2_refcount_close(bs);
     qemu_vfree(s->l1_table);
@@ -2346,8 +2347,8 @@ qcow2_co_preadv_task(BlockDriverState *bs, QCow2SubclusterType subc_type,
         assert(bs->backing); /* otherwise handled in qcow2_co_preadv_part */
 
         BLKDBG_CO_EVENT(bs->file, BLKDBG_READ_BACKING_AIO);
-        return bdrv_co_preadv_part(bs->backing, offset, bytes,
-                                   qiov, qiov_offset, 0);
+        return bdrv_co_preadv_backing_part(bs, offset, bytes,
+                                           qiov, qiov_offset, 0);
 
     case QCOW2_SUBCLUSTER_COMPRESSED:
         return qcow2_co_preadv_compressed(bs, host_offset,
@@ -2819,6 +2820,7 @@ qcow2_do_close(BlockDriverState *bs, bool close_data_file)
     g_free(s->image_data_file);
     g_free(s->image_backing_file);
     g_free(s->image_backing_format);
+    g_clear_pointer(&s->bitmap_digests, g_hash_table_destroy);
 
     if (close_data_file && has_data_file(bs)) {
         GLOBAL_STATE_CODE();
@@ -373,6 +373,11 @@ typedef struct BDRVQcow2State {
     uint32_t nb_bitmaps;
     uint64_t bitmap_directory_size;
     uint64_t bitmap_directory_offset;
+    /*
+     * Per-cluster digests of the stored persistent bitmaps, keyed by bitmap
+     * name.  Used to write back only the changed parts of a bitmap.
+     */
+    GHashTable *bitmap_digests;
 
     int flags;
     int qcow_version;
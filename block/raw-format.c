@@ -502,7 +502,8 @@ static int raw_open(BlockDriverState *bs, QDict *options, int flags,
 
     bs->sg = bdrv_is_sg(bs->file->bs);
     bs->supported_write_flags = BDRV_REQ_WRITE_UNCHANGED |
-        (BDRV_REQ_FUA & bs->file->bs->supported_write_flags);
+        ((BDRV_REQ_FUA | BDRV_REQ_REGISTERED_BUF) &
+            bs->file->bs->supported_write_flags);
     bs->supported_zero_flags = BDRV_REQ_WRITE_UNCHANGED |
         ((BDRV_REQ_FUA | BDRV_REQ_MAY_UNMAP | BDRV_REQ_NO_FALLBACK) &
             bs->file->bs->supported_zero_flags);
@@ -604,6 +605,19 @@ raw_co_copy_range_to(BlockDriverState *bs,
                                  read_flags, write_flags);
 }
 
+static int coroutine_fn GRAPH_RDLOCK
+raw_co_sendfile(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                int out_fd)
+{
+    int ret;
+
+    ret = raw_adjust_offset(bs, &offset, bytes, false);
+    if (ret) {
+        return ret;
+    }
+    return bdrv_co_sendfile(bs->file, offset, bytes, out_fd);
+}
+
 static const char *const raw_strong_runtime_opts[] = {
     "offset",
     "size",
@@ -656,6 +670,7 @@ BlockDriver bdrv_raw = {
     .bdrv_co_block_status = &raw_co_block_status,
     .bdrv_co_copy_range_from = &raw_co_copy_range_from,
     .bdrv_co_copy_range_to  = &raw_co_copy_range_to,
+    .bdrv_co_sendfile       = &raw_co_sendfile,
     .bdrv_co_truncate     = &raw_co_truncate,
     .bdrv_co_getlength    = &raw_co_getlength,
     .is_format            = true,
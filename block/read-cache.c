@@ -0,0 +1,934 @@
+/*
+ * Shared read cache filter driver
+ *
+ * The driver is injected above a node and keeps recently read blocks of it
+ * in host RAM.  The memory comes from a read-cache-pool object, which can be
+ * shared by any number of read-cache nodes: all of them compete for the same
+ * budget, and nodes that are given the same cache-id (e.g. the same base
+ * image opened once per guest) share the cached blocks too.  Writes,
+ * discards and resizes through the filter drop the blocks they touch; nobody
+ * else may modify the child.
+ *
+ * Replacement uses CAR (CLOCK with Adaptive Replacement): like ARC it keeps
+ * a recency list T1 and a frequency list T2 with ghost lists B1 and B2 that
+ * steer the target size of T1, but a cache hit only sets a reference bit.
+ * Hits therefore never take the pool lock and iothreads can serve them
+ * concurrently under RCU; only misses and evictions are serialized.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+
+#include "qemu/osdep.h"
+
+#include "qapi/error.h"
+#include "qapi/visitor.h"
+#include "qemu/atomic.h"
+#include "qemu/module.h"
+#include "qemu/option.h"
+#include "qemu/qht.h"
+#include "qemu/rcu.h"
+#include "qemu/stats64.h"
+#include "qemu/units.h"
+#include "qemu/xxhash.h"
+#include "qom/object_interfaces.h"
+#include "block/block-io.h"
+#include "block/block_int.h"
+
+#define TYPE_READ_CACHE_POOL "read-cache-pool"
+OBJECT_DECLARE_SIMPLE_TYPE(ReadCachePool, READ_CACHE_POOL)
+
+#define READ_CACHE_DEFAULT_SIZE         (256 * MiB)
+#define READ_CACHE_DEFAULT_BLOCK_SIZE   (64 * KiB)
+
+/* Consecutive missing blocks are read from the child in one request */
+#define READ_CACHE_MAX_FILL             (1 * MiB)
+
+typedef enum ReadCacheList {
+    READ_CACHE_T1,      /* resident, seen once recently */
+    READ_CACHE_T2,      /* resident, seen at least twice */
+    READ_CACHE_B1,      /* ghost, evicted from T1 */
+    READ_CACHE_B2,      /* ghost, evicted from T2 */
+    READ_CACHE_LIST__MAX,
+} ReadCacheList;
+
+typedef struct ReadCacheKey {
+    uint64_t source;
+    uint64_t offset;
+} ReadCacheKey;
+
+typedef struct ReadCacheData {
+    struct rcu_head rcu;
+    uint8_t buf[];
+} ReadCacheData;
+
+typedef struct ReadCacheBlock {
+    struct rcu_head rcu;
+    ReadCacheKey key;
+    uint32_t hash;
+
+    /* Set locklessly on hits, cleared by the clock hand under the lock */
+    bool referenced;
+
+    /* RCU-protected, NULL for ghost entries */
+    ReadCacheData *data;
+
+    /* Protected by the pool lock */
+    ReadCacheList list;
+    QTAILQ_ENTRY(ReadCacheBlock) entry;
+} ReadCacheBlock;
+
+typedef struct ReadCacheSource {
+    char *id;
+    uint64_t num;
+    unsigned refcnt;
+    /*
+     * Bumped whenever blocks are invalidated, so that fills that read the
+     * old data before do not insert it afterwards.  Protected by the pool
+     * lock.
+     */
+    uint64_t gen;
+} ReadCacheSource;
+
+struct ReadCachePool {
+    Object parent_obj;
+
+    /* Properties, fixed once the object is complete */
+    uint64_t size;
+    uint64_t block_size;
+
+    /* Number of resident blocks that fit into @size */
+    uint64_t capacity;
+
+    Stat64 hits;
+    Stat64 misses;
+
+    /*
+     * Protects everything below, as well as list membership of the cache
+     * blocks.  Lookups in @blocks are done under RCU only.
+     */
+    QemuMutex lock;
+    bool initialized;
+    struct qht blocks;
+    QTAILQ_HEAD(, ReadCacheBlock) lists[READ_CACHE_LIST__MAX];
+    uint64_t list_len[READ_CACHE_LIST__MAX];
+
+    /* Target size of T1, called p in the CAR paper */
+    uint64_t target_t1;
+
+    /* cache-id -> ReadCacheSource */
+    GHashTable *sources;
+    uint64_t next_source_num;
+};
+
+typedef struct BDRVReadCacheState {
+    ReadCachePool *pool;
+    ReadCacheSource *source;
+    int64_t length;
+} BDRVReadCacheState;
+
+static uint32_t read_cache_hash(uint64_t source, uint64_t offset)
+{
+    return qemu_xxhash4(source, offset);
+}
+
+static bool read_cache_key_equal(const void *obj, const void *userp)
+{
+    const ReadCacheBlock *blk = obj;
+    const ReadCacheKey *key = userp;
+
+    return blk->key.source == key->source && blk->key.offset == key->offset;
+}
+
+static bool read_cache_block_cmp(const void *a, const void *b)
+{
+    const ReadCacheBlock *blk = b;
+
+    return read_cache_key_equal(a, &blk->key);
+}
+
+static ReadCacheBlock *read_cache_find(ReadCachePool *pool, uint64_t source,
+                                       uint64_t offset)
+{
+    ReadCacheKey key = { .source = source, .offset = offset };
+
+    return qht_lookup_custom(&pool->blocks, &key,
+                             read_cache_hash(source, offset),
+                             read_cache_key_equal);
+}
+
+static void read_cache_list_move(ReadCachePool *pool, ReadCacheBlock *blk,
+                                 ReadCacheList list)
+{
+    QTAILQ_REMOVE(&pool->lists[blk->list], blk, entry);
+    pool->list_len[blk->list]--;
+    QTAILQ_INSERT_TAIL(&pool->lists[list], blk, entry);
+    pool->list_len[list]++;
+    blk->list = list;
+}
+
+/* Turn a resident block into a ghost, freeing its data */
+static void read_cache_demote(ReadCachePool *pool, ReadCacheBlock *blk,
+                              ReadCacheList list)
+{
+    ReadCacheData *data = blk->data;
+
+    qatomic_rcu_set(&blk->data, NULL);
+    g_free_rcu(data, rcu);
+    read_cache_list_move(pool, blk, list);
+}
+
+static void read_cache_discard(ReadCachePool *pool, ReadCacheBlock *blk)
+{
+    QTAILQ_REMOVE(&pool->lists[blk->list], blk, entry);
+    pool->list_len[blk->list]--;
+    qht_remove(&pool->blocks, blk, blk->hash);
+
+    if (blk->data) {
+        g_free_rcu(blk->data, rcu);
+    }
+    g_free_rcu(blk, rcu);
+}
+
+/* Evict one resident block, called with the pool lock held */
+static void read_cache_replace(ReadCachePool *pool)
+{
+    for (;;) {
+        ReadCacheBlock *blk;
+
+        if (pool->list_len[READ_CACHE_T1] >= MAX(1, pool->target_t1)) {
+            blk = QTAILQ_FIRST(&pool->lists[READ_CACHE_T1]);
+            if (!qatomic_read(&blk->referenced)) {
+                read_cache_demote(pool, blk, READ_CACHE_B1);
+                return;
+            }
+        } else {
+            blk = QTAILQ_FIRST(&pool->lists[READ_CACHE_T2]);
+            if (!qatomic_read(&blk->referenced)) {
+                read_cache_demote(pool, blk, READ_CACHE_B2);
+                return;
+            }
+        }
+
+        qatomic_set(&blk->referenced, false);
+        read_cache_list_move(pool, blk, READ_CACHE_T2);
+    }
+}
+
+/*
+ * Add a freshly read block to the cache.  Takes ownership of @data, which is
+ * freed if another request has cached the block in the meantime, or if the
+ * blocks of @src were invalidated since generation @gen, when the read
+ * started.
+ */
+static void read_cache_insert(ReadCachePool *pool, ReadCacheSource *src,
+                              uint64_t offset, ReadCacheData *data,
+                              uint64_t gen)
+{
+    uint64_t source = src->num;
+    ReadCacheKey key = { .source = source, .offset = offset };
+    uint32_t hash = read_cache_hash(source, offset);
+    ReadCacheBlock *blk;
+
+    QEMU_LOCK_GUARD(&pool->lock);
+    RCU_READ_LOCK_GUARD();
+
+    if (src->gen != gen) {
+        g_free(data);
+        return;
+    }
+
+    blk = read_cache_find(pool, source, offset);
+    if (blk && blk->data) {
+        g_free(data);
+        return;
+    }
+
+    if (pool->list_len[READ_CACHE_T1] + pool->list_len[READ_CACHE_T2] ==
+        pool->capacity) {
+        read_cache_replace(pool);
+
+        if (!blk) {
+            uint64_t total = pool->list_len[READ_CACHE_T1] +
+                             pool->list_len[READ_CACHE_T2] +
+                             pool->list_len[READ_CACHE_B1] +
+                             pool->list_len[READ_CACHE_B2];
+
+            if (pool->list_len[READ_CACHE_T1] +
+                pool->list_len[READ_CACHE_B1] == pool->capacity) {
+                read_cache_discard(pool,
+                                   QTAILQ_FIRST(&pool->lists[READ_CACHE_B1]));
+            } else if (total == 2 * pool->capacity) {
+                read_cache_discard(pool,
+                                   QTAILQ_FIRST(&pool->lists[READ_CACHE_B2]));
+            }
+        }
+    }
+
+    if (!blk) {
+        blk = g_new0(ReadCacheBlock, 1);
+        blk->key = key;
+        blk->hash = hash;
+        blk->data = data;
+        blk->list = READ_CACHE_T1;
+        QTAILQ_INSERT_TAIL(&pool->lists[READ_CACHE_T1], blk, entry);
+        pool->list_len[READ_CACHE_T1]++;
+        qht_insert(&pool->blocks, blk, hash, NULL);
+        return;
+    }
+
+    /* A ghost hit: adapt the target size of T1 towards the list it was in */
+    if (blk->list == READ_CACHE_B1) {
+        uint64_t delta = MAX(1, pool->list_len[READ_CACHE_B2] /
+                                pool->list_len[READ_CACHE_B1]);
+
+        pool->target_t1 = MIN(pool->target_t1 + delta, pool->capacity);
+    } else {
+        uint64_t delta = MAX(1, pool->list_len[READ_CACHE_B1] /
+                                pool->list_len[READ_CACHE_B2]);
+
+        pool->target_t1 = pool->target_t1 > delta ?
+                          pool->target_t1 - delta : 0;
+    }
+
+    qatomic_set(&blk->referenced, false);
+    read_cache_list_move(pool, blk, READ_CACHE_T2);
+    qatomic_rcu_set(&blk->data, data);
+}
+
+/*
+ * Copy @bytes at @offset_in_block of a cached block into @qiov.  Returns
+ * false on a miss.  Never takes the pool lock.
+ */
+static bool read_cache_lookup(ReadCachePool *pool, uint64_t source,
+                              uint64_t offset, size_t offset_in_block,
+                              size_t bytes, QEMUIOVector *qiov,
+                              size_t qiov_offset)
+{
+    ReadCacheBlock *blk;
+    ReadCacheData *data;
+
+    RCU_READ_LOCK_GUARD();
+
+    blk = read_cache_find(pool, source, offset);
+    if (!blk) {
+        return false;
+    }
+
+    data = qatomic_rcu_read(&blk->data);
+    if (!data) {
+        return false;
+    }
+
+    qemu_iovec_from_buf(qiov, qiov_offset, data->buf + offset_in_block,
+                        bytes);
+
+    /* Avoid dirtying the cache line when the bit is already set */
+    if (!qatomic_read(&blk->referenced)) {
+        qatomic_set(&blk->referenced, true);
+    }
+
+    return true;
+}
+
+/*
+ * Drop all blocks of @src that overlap [@start, @end), after the data there
+ * was changed through the filter.
+ */
+static void read_cache_invalidate(ReadCachePool *pool, ReadCacheSource *src,
+                                  uint64_t start, uint64_t end)
+{
+    uint64_t nb_blocks, nb_entries, offset;
+    int i;
+
+    start = QEMU_ALIGN_DOWN(start, pool->block_size);
+    end = QEMU_ALIGN_UP(end, pool->block_size);
+    nb_blocks = (end - start) / pool->block_size;
+
+    QEMU_LOCK_GUARD(&pool->lock);
+    RCU_READ_LOCK_GUARD();
+
+    src->gen++;
+
+    nb_entries = 0;
+    for (i = 0; i < READ_CACHE_LIST__MAX; i++) {
+        nb_entries += pool->list_len[i];
+    }
+
+    /* Large ranges, e.g. the whole image, are cheaper to find by walking */
+    if (nb_blocks > nb_entries) {
+        for (i = 0; i < READ_CACHE_LIST__MAX; i++) {
+            ReadCacheBlock *blk, *next;
+
+            QTAILQ_FOREACH_SAFE(blk, &pool->lists[i], entry, next) {
+                if (blk->key.source == src->num &&
+                    blk->key.offset >= start && blk->key.offset < end) {
+                    read_cache_discard(pool, blk);
+                }
+            }
+        }
+        return;
+    }
+
+    for (offset = start; offset < end; offset += pool->block_size) {
+        ReadCacheBlock *blk = read_cache_find(pool, src->num, offset);
+
+        if (blk) {
+            read_cache_discard(pool, blk);
+        }
+    }
+}
+
+static bool read_cache_is_resident(ReadCachePool *pool, uint64_t source,
+                                   uint64_t offset)
+{
+    ReadCacheBlock *blk;
+
+    RCU_READ_LOCK_GUARD();
+
+    blk = read_cache_find(pool, source, offset);
+    return blk && qatomic_rcu_read(&blk->data);
+}
+
+static ReadCacheSource *read_cache_source_get(ReadCachePool *pool,
+                                              const char *id)
+{
+    ReadCacheSource *src;
+
+    QEMU_LOCK_GUARD(&pool->lock);
+
+    src = g_hash_table_lookup(pool->sources, id);
+    if (!src) {
+        src = g_new0(ReadCacheSource, 1);
+        src->id = g_strdup(id);
+        src->num = pool->next_source_num++;
+        g_hash_table_insert(pool->sources, src->id, src);
+    }
+    src->refcnt++;
+
+    return src;
+}
+
+static void read_cache_source_put(ReadCachePool *pool, ReadCacheSource *src)
+{
+    int i;
+
+    QEMU_LOCK_GUARD(&pool->lock);
+
+    if (--src->refcnt > 0) {
+        return;
+    }
+
+    /* Nobody can look up blocks of this source any more, drop them */
+    for (i = 0; i < READ_CACHE_LIST__MAX; i++) {
+        ReadCacheBlock *blk, *next;
+
+        QTAILQ_FOREACH_SAFE(blk, &pool->lists[i], entry, next) {
+            if (blk->key.source == src->num) {
+                read_cache_discard(pool, blk);
+            }
+        }
+    }
+
+    g_hash_table_remove(pool->sources, src->id);
+}
+
+static void read_cache_source_free(gpointer opaque)
+{
+    ReadCacheSource *src = opaque;
+
+    g_free(src->id);
+    g_free(src);
+}
+
+static void read_cache_pool_get_size(Object *obj, Visitor *v,
+                                     const char *name, void *opaque,
+                                     Error **errp)
+{
+    uint64_t *field = opaque;
+    uint64_t value = *field;
+
+    visit_type_size(v, name, &value, errp);
+}
+
+static void read_cache_pool_set_size(Object *obj, Visitor *v,
+                                     const char *name, void *opaque,
+                                     Error **errp)
+{
+    ReadCachePool *pool = READ_CACHE_POOL(obj);
+    uint64_t *field = opaque;
+    uint64_t value;
+
+    if (pool->initialized) {
+        error_setg(errp, "Cannot change property '%s' of a read cache pool "
+                   "in use", name);
+        return;
+    }
+
+    if (!visit_type_size(v, name, &value, errp)) {
+        return;
+    }
+    *field = value;
+}
+
+static void read_cache_pool_get_stat(Object *obj, Visitor *v,
+                                     const char *name, void *opaque,
+                                     Error **errp)
+{
+    uint64_t value = stat64_get(opaque);
+
+    visit_type_uint64(v, name, &value, errp);
+}
+
+static void read_cache_pool_complete(UserCreatable *uc, Error **errp)
+{
+    ReadCachePool *pool = READ_CACHE_POOL(uc);
+
+    if (pool->block_size < BDRV_SECTOR_SIZE ||
+        pool->block_size > READ_CACHE_MAX_FILL ||
+        !is_power_of_2(pool->block_size)) {
+        error_setg(errp, "block-size must be a power of two between %llu "
+                   "and %d", BDRV_SECTOR_SIZE, READ_CACHE_MAX_FILL);
+        return;
+    }
+
+    pool->capacity = pool->size / pool->block_size;
+    if (!pool->capacity) {
+        error_setg(errp, "size must be at least block-size");
+        return;
+    }
+
+    /* Resident blocks plus at most as many ghosts */
+    qht_init(&pool->blocks, read_cache_block_cmp,
+             MIN(2 * pool->capacity, 1 << 20), QHT_MODE_AUTO_RESIZE);
+    pool->initialized = true;
+}
+
+static bool read_cache_pool_can_be_deleted(UserCreatable *uc)
+{
+    return OBJECT(uc)->ref == 1;
+}
+
+static void read_cache_pool_init(Object *obj)
+{
+    ReadCachePool *pool = READ_CACHE_POOL(obj);
+    int i;
+
+    pool->size = READ_CACHE_DEFAULT_SIZE;
+    pool->block_size = READ_CACHE_DEFAULT_BLOCK_SIZE;
+
+    qemu_mutex_init(&pool->lock);
+    for (i = 0; i < READ_CACHE_LIST__MAX; i++) {
+        QTAILQ_INIT(&pool->lists[i]);
+    }
+    pool->sources = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+                                          read_cache_source_free);
+
+    object_property_add(obj, "size", "size",
+                        read_cache_pool_get_size, read_cache_pool_set_size,
+                        NULL, &pool->size);
+    object_property_add(obj, "block-size", "size",
+                        read_cache_pool_get_size, read_cache_pool_set_size,
+                        NULL, &pool->block_size);
+    object_property_add(obj, "hits", "uint64", read_cache_pool_get_stat,
+                        NULL, NULL, &pool->hits);
+    object_property_add(obj, "misses", "uint64", read_cache_pool_get_stat,
+                        NULL, NULL, &pool->misses);
+}
+
+static void read_cache_pool_finalize(Object *obj)
+{
+    ReadCachePool *pool = READ_CACHE_POOL(obj);
+    int i;
+
+    /* No nodes use the pool any more, so there are no concurrent readers */
+    for (i = 0; i < READ_CACHE_LIST__MAX; i++) {
+        ReadCacheBlock *blk, *next;
+
+        QTAILQ_FOREACH_SAFE(blk, &pool->lists[i], entry, next) {
+            g_free(blk->data);
+            g_free(blk);
+        }
+    }
+
+    if (pool->initialized) {
+        qht_destroy(&pool->blocks);
+    }
+    g_hash_table_destroy(pool->sources);
+    qemu_mutex_destroy(&pool->lock);
+}
+
+static void read_cache_pool_class_init(ObjectClass *klass,
+                                       const void *class_data)
+{
+    UserCreatableClass *ucc = USER_CREATABLE_CLASS(klass);
+
+    ucc->complete = read_cache_pool_complete;
+    ucc->can_be_deleted = read_cache_pool_can_be_deleted;
+}
+
+static const TypeInfo read_cache_pool_info = {
+    .name = TYPE_READ_CACHE_POOL,
+    .parent = TYPE_OBJECT,
+    .class_init = read_cache_pool_class_init,
+    .instance_size = sizeof(ReadCachePool),
+    .instance_init = read_cache_pool_init,
+    .instance_finalize = read_cache_pool_finalize,
+    .interfaces = (const InterfaceInfo[]) {
+        { TYPE_USER_CREATABLE },
+        { }
+    },
+};
+
+#define READ_CACHE_OPT_POOL "pool"
+#define READ_CACHE_OPT_CACHE_ID "cache-id"
+static QemuOptsList runtime_opts = {
+    .name = "read-cache",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = READ_CACHE_OPT_POOL,
+            .type = QEMU_OPT_STRING,
+            .help = "ID of the read-cache-pool object to use",
+        },
+        {
+            .name = READ_CACHE_OPT_CACHE_ID,
+            .type = QEMU_OPT_STRING,
+            .help = "nodes with the same cache-id share cached data, "
+                "default is the node name of the child",
+        },
+        { /* end of list */ }
+    },
+};
+
+static int read_cache_open(BlockDriverState *bs, QDict *options, int flags,
+                           Error **errp)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    QemuOpts *opts;
+    const char *pool_id;
+    const char *cache_id;
+    Object *obj;
+    int ret;
+
+    GLOBAL_STATE_CODE();
+
+    ret = bdrv_open_file_child(NULL, options, "file", bs, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    GRAPH_RDLOCK_GUARD_MAINLOOP();
+
+    bs->supported_write_flags = BDRV_REQ_WRITE_UNCHANGED |
+        (BDRV_REQ_FUA & bs->file->bs->supported_write_flags);
+
+    bs->supported_zero_flags = BDRV_REQ_WRITE_UNCHANGED |
+        ((BDRV_REQ_FUA | BDRV_REQ_MAY_UNMAP | BDRV_REQ_NO_FALLBACK) &
+            bs->file->bs->supported_zero_flags);
+
+    bs->supported_truncate_flags = bs->file->bs->supported_truncate_flags &
+                                   BDRV_REQ_ZERO_WRITE;
+
+    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    if (!qemu_opts_absorb_qdict(opts, options, errp)) {
+        ret = -EINVAL;
+        goto out;
+    }
+
+    pool_id = qemu_opt_get(opts, READ_CACHE_OPT_POOL);
+    if (!pool_id) {
+        error_setg(errp, "Parameter '%s' is required", READ_CACHE_OPT_POOL);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    obj = object_resolve_path_component(object_get_objects_root(), pool_id);
+    if (!obj || !object_dynamic_cast(obj, TYPE_READ_CACHE_POOL)) {
+        error_setg(errp, "'%s' is not a read-cache-pool object", pool_id);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    s->length = bdrv_getlength(bs->file->bs);
+    if (s->length < 0) {
+        error_setg_errno(errp, -s->length, "Failed to get file length");
+        ret = s->length;
+        goto out;
+    }
+
+    /*
+     * Not the filename: a format node and its protocol node share it, but
+     * present different data
+     */
+    cache_id = qemu_opt_get(opts, READ_CACHE_OPT_CACHE_ID);
+    if (!cache_id) {
+        cache_id = bdrv_get_node_name(bs->file->bs);
+    }
+
+    s->pool = READ_CACHE_POOL(obj);
+    object_ref(obj);
+    s->source = read_cache_source_get(s->pool, cache_id);
+    ret = 0;
+
+out:
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static void read_cache_close(BlockDriverState *bs)
+{
+    BDRVReadCacheState *s = bs->opaque;
+
+    if (s->pool) {
+        read_cache_source_put(s->pool, s->source);
+        object_unref(OBJECT(s->pool));
+    }
+}
+
+static void read_cache_child_perm(BlockDriverState *bs, BdrvChild *c,
+                                  BdrvChildRole role,
+                                  BlockReopenQueue *reopen_queue,
+                                  uint64_t perm, uint64_t shared,
+                                  uint64_t *nperm, uint64_t *nshared)
+{
+    bdrv_default_perms(bs, c, role, reopen_queue, perm, shared,
+                       nperm, nshared);
+
+    /* Cached data would go stale if someone else modified the child */
+    *nshared &= ~(BLK_PERM_WRITE | BLK_PERM_RESIZE);
+}
+
+static int64_t coroutine_fn GRAPH_RDLOCK
+read_cache_co_getlength(BlockDriverState *bs)
+{
+    return bdrv_co_getlength(bs->file->bs);
+}
+
+/*
+ * Read the blocks [@start, @end) from the child and add them to the cache,
+ * copying the part requested by the guest into @qiov on the way.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+read_cache_fill(BlockDriverState *bs, int64_t start, int64_t end,
+                int64_t offset, int64_t bytes, QEMUIOVector *qiov,
+                size_t qiov_offset)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    ReadCachePool *pool = s->pool;
+    int nb_blocks = (end - start) / pool->block_size;
+    g_autofree ReadCacheData **blocks = g_new(ReadCacheData *, nb_blocks);
+    int64_t len = MIN(end, s->length) - start;
+    QEMUIOVector fill_qiov;
+    uint64_t gen;
+    int64_t pos;
+    int i, ret;
+
+    WITH_QEMU_LOCK_GUARD(&pool->lock) {
+        gen = s->source->gen;
+    }
+
+    qemu_iovec_init(&fill_qiov, nb_blocks);
+    for (i = 0; i < nb_blocks; i++) {
+        size_t n = MIN(pool->block_size, len - i * pool->block_size);
+
+        blocks[i] = g_malloc(sizeof(ReadCacheData) + pool->block_size);
+        qemu_iovec_add(&fill_qiov, blocks[i]->buf, n);
+
+        /* Only the last block can extend past the end of the image */
+        if (n < pool->block_size) {
+            memset(blocks[i]->buf + n, 0, pool->block_size - n);
+        }
+    }
+
+    ret = bdrv_co_preadv(bs->file, start, len, &fill_qiov, 0);
+    qemu_iovec_destroy(&fill_qiov);
+    if (ret < 0) {
+        for (i = 0; i < nb_blocks; i++) {
+            g_free(blocks[i]);
+        }
+        return ret;
+    }
+
+    pos = offset;
+    for (i = 0; i < nb_blocks; i++) {
+        int64_t block_start = start + i * pool->block_size;
+        int64_t block_end = block_start + pool->block_size;
+
+        if (pos < block_end && pos < offset + bytes) {
+            int64_t n = MIN(block_end, offset + bytes) - pos;
+
+            qemu_iovec_from_buf(qiov, qiov_offset + (pos - offset),
+                                blocks[i]->buf + (pos - block_start), n);
+            pos += n;
+        }
+
+        read_cache_insert(pool, s->source, block_start, blocks[i], gen);
+    }
+
+    return 0;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+read_cache_co_preadv_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                          QEMUIOVector *qiov, size_t qiov_offset,
+                          BdrvRequestFlags flags)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    ReadCachePool *pool = s->pool;
+    uint64_t source = s->source->num;
+    int64_t end = offset + bytes;
+    uint64_t hits = 0, misses = 0;
+    int ret = 0;
+
+    while (offset < end) {
+        int64_t start = QEMU_ALIGN_DOWN(offset, pool->block_size);
+        int64_t fill_end = start + pool->block_size;
+        int64_t n = MIN(end, fill_end) - offset;
+
+        if (read_cache_lookup(pool, source, start, offset - start, n,
+                              qiov, qiov_offset)) {
+            hits++;
+            offset += n;
+            qiov_offset += n;
+            continue;
+        }
+
+        while (fill_end < end && fill_end - start < READ_CACHE_MAX_FILL &&
+               !read_cache_is_resident(pool, source, fill_end)) {
+            fill_end += pool->block_size;
+        }
+
+        n = MIN(end, fill_end) - offset;
+        ret = read_cache_fill(bs, start, fill_end, offset, n, qiov,
+                              qiov_offset);
+        if (ret < 0) {
+            break;
+        }
+
+        misses += (fill_end - start) / pool->block_size;
+        offset += n;
+        qiov_offset += n;
+    }
+
+    stat64_add(&pool->hits, hits);
+    stat64_add(&pool->misses, misses);
+
+    return ret;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+read_cache_co_pwritev_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                           QEMUIOVector *qiov, size_t qiov_offset,
+                           BdrvRequestFlags flags)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int ret;
+
+    ret = bdrv_co_pwritev_part(bs->file, offset, bytes, qiov, qiov_offset,
+                               flags);
+
+    /* Even a failed request may have changed part of the data */
+    read_cache_invalidate(s->pool, s->source, offset, offset + bytes);
+    return ret;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+read_cache_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset,
+                            int64_t bytes, BdrvRequestFlags flags)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int ret;
+
+    ret = bdrv_co_pwrite_zeroes(bs->file, offset, bytes, flags);
+    read_cache_invalidate(s->pool, s->source, offset, offset + bytes);
+    return ret;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+read_cache_co_pdiscard(BlockDriverState *bs, int64_t offset, int64_t bytes)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int ret;
+
+    ret = bdrv_co_pdiscard(bs->file, offset, bytes);
+    read_cache_invalidate(s->pool, s->source, offset, offset + bytes);
+    return ret;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+read_cache_co_truncate(BlockDriverState *bs, int64_t offset, bool exact,
+                       PreallocMode prealloc, BdrvRequestFlags flags,
+                       Error **errp)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int64_t old_length = s->length;
+    int64_t length;
+    int ret;
+
+    ret = bdrv_co_truncate(bs->file, offset, exact, prealloc, flags, errp);
+
+    length = bdrv_co_getlength(bs->file->bs);
+    if (length >= 0) {
+        s->length = length;
+    } else if (ret >= 0) {
+        error_setg_errno(errp, -length, "Failed to get file length");
+        ret = length;
+    }
+
+    /*
+     * Blocks past the old end were filled with zeroes, and blocks past the
+     * new end hold data that is gone now
+     */
+    read_cache_invalidate(s->pool, s->source, MIN(old_length, offset),
+                          INT64_MAX);
+    return ret;
+}
+
+static int coroutine_fn GRAPH_RDLOCK read_cache_co_flush(BlockDriverState *bs)
+{
+    return bdrv_co_flush(bs->file->bs);
+}
+
+static const char *const read_cache_strong_runtime_opts[] = {
+    READ_CACHE_OPT_POOL,
+    READ_CACHE_OPT_CACHE_ID,
+
+    NULL
+};
+
+static BlockDriver bdrv_read_cache_filter = {
+    .format_name            = "read-cache",
+    .instance_size          = sizeof(BDRVReadCacheState),
+
+    .bdrv_open              = read_cache_open,
+    .bdrv_close             = read_cache_close,
+    .bdrv_co_getlength      = read_cache_co_getlength,
+    .bdrv_co_flush          = read_cache_co_flush,
+
+    .bdrv_co_preadv_part    = read_cache_co_preadv_part,
+    .bdrv_co_pwritev_part   = read_cache_co_pwritev_part,
+    .bdrv_co_pwrite_zeroes  = read_cache_co_pwrite_zeroes,
+    .bdrv_co_pdiscard       = read_cache_co_pdiscard,
+    .bdrv_co_truncate       = read_cache_co_truncate,
+
+    .bdrv_child_perm        = read_cache_child_perm,
+
+    .is_filter              = true,
+    .strong_runtime_opts    = read_cache_strong_runtime_opts,
+};
+
+static void read_cache_pool_register_types(void)
+{
+    type_register_static(&read_cache_pool_info);
+}
+
+type_init(read_cache_pool_register_types);
+
+static void bdrv_read_cache_init(void)
+{
+    bdrv_register(&bdrv_read_cache_filter);
+}
+
+block_init(bdrv_read_cache_init);
@@ -13,6 +13,7 @@
 
 #include "qemu/osdep.h"
 #include "trace.h"
+#include "block/aio_task.h"
 #include "block/block_int.h"
 #include "block/blockjob_int.h"
 #include "qapi/error.h"
@@ -28,8 +29,28 @@ enum {
      * that populating contiguous regions of the image is efficient.
      */
     STREAM_CHUNK = 512 * 1024, /* in bytes */
+
+    /*
+     * Number of chunks that are populated in parallel.  While they are in
+     * flight, the allocation status of the following extents is queried.
+     */
+    STREAM_MAX_WORKERS = 8,
+
+    /* Maximum range whose allocation status is queried at once */
+    STREAM_MAX_EXTENT = 64 * 1024 * 1024, /* in bytes */
 };
 
+/*
+ * An extent whose progress is published once all extents before it are
+ * done, so that the job offset never runs ahead of a chunk in flight.
+ */
+typedef struct StreamChunk {
+    int64_t bytes;
+    bool done;
+    int ret;
+    QSIMPLEQ_ENTRY(StreamChunk) next;
+} StreamChunk;
+
 typedef struct StreamBlockJob {
     BlockJob common;
     BlockBackend *blk;
@@ -41,8 +62,24 @@ typedef struct StreamBlockJob {
     char *backing_file_str;
     bool backing_mask_protocol;
     bool bs_read_only;
+
+    /* Extents not accounted in the job progress yet, in offset order */
+    QSIMPLEQ_HEAD(, StreamChunk) chunks;
+
+    /* First failure among the chunks since the error policy was applied */
+    int task_ret;
+    int64_t error_offset;
+    int64_t error_end;
 } StreamBlockJob;
 
+typedef struct StreamTask {
+    AioTask task;
+    StreamBlockJob *s;
+    StreamChunk *chunk;
+    int64_t offset;
+    int64_t bytes;
+} StreamTask;
+
 static int coroutine_fn stream_populate(BlockBackend *blk,
                                         int64_t offset, uint64_t bytes)
 {
@@ -51,6 +88,137 @@ static int coroutine_fn stream_populate(BlockBackend *blk,
     return blk_co_preadv(blk, offset, bytes, NULL, BDRV_REQ_PREFETCH);
 }
 
+static void stream_record_error(StreamBlockJob *s, int64_t offset,
+                                int64_t bytes, int ret)
+{
+    if (!s->task_ret || offset < s->error_offset) {
+        s->task_ret = ret;
+        s->error_offset = offset;
+    }
+    s->error_end = MAX(s->error_end, offset + bytes);
+}
+
+static StreamChunk *stream_add_chunk(StreamBlockJob *s, int64_t bytes,
+                                     bool done, int ret)
+{
+    StreamChunk *c = g_new(StreamChunk, 1);
+
+    *c = (StreamChunk) {
+        .bytes = bytes,
+        .done = done,
+        .ret = ret,
+    };
+    QSIMPLEQ_INSERT_TAIL(&s->chunks, c, next);
+
+    return c;
+}
+
+/*
+ * Account the leading chunks that are done in the job progress.  Failed
+ * chunks stop the walk, unless @include_failed is true.
+ */
+static void stream_publish_progress(StreamBlockJob *s, bool include_failed)
+{
+    StreamChunk *c;
+
+    while ((c = QSIMPLEQ_FIRST(&s->chunks)) && c->done &&
+           (c->ret >= 0 || include_failed)) {
+        job_progress_update(&s->common.job, c->bytes);
+        QSIMPLEQ_REMOVE_HEAD(&s->chunks, next);
+        g_free(c);
+    }
+}
+
+/* Forget the remaining chunks; none of them may be in flight */
+static void stream_drop_chunks(StreamBlockJob *s)
+{
+    StreamChunk *c;
+
+    while ((c = QSIMPLEQ_FIRST(&s->chunks))) {
+        assert(c->done);
+        QSIMPLEQ_REMOVE_HEAD(&s->chunks, next);
+        g_free(c);
+    }
+}
+
+static int coroutine_fn stream_task_entry(AioTask *task)
+{
+    StreamTask *t = container_of(task, StreamTask, task);
+    StreamBlockJob *s = t->s;
+    int ret;
+
+    ret = stream_populate(s->blk, t->offset, t->bytes);
+    trace_stream_task_done(s, t->offset, t->bytes, ret);
+    t->chunk->done = true;
+    t->chunk->ret = ret;
+    if (ret < 0) {
+        stream_record_error(s, t->offset, t->bytes, ret);
+        return ret;
+    }
+
+    stream_publish_progress(s, false);
+    return 0;
+}
+
+static void coroutine_fn stream_start_task(StreamBlockJob *s,
+                                           AioTaskPool *pool,
+                                           int64_t offset, int64_t bytes)
+{
+    StreamTask *t = g_new(StreamTask, 1);
+
+    *t = (StreamTask) {
+        .task.func = stream_task_entry,
+        .s = s,
+        .chunk = stream_add_chunk(s, bytes, false, 0),
+        .offset = offset,
+        .bytes = bytes,
+    };
+
+    aio_task_pool_start_task(pool, &t->task);
+}
+
+/*
+ * Apply the error policy to the first recorded failure once all chunks in
+ * flight have finished.  On return, @offset is where streaming continues.
+ * Returns false if the job must fail.
+ */
+static bool coroutine_fn stream_handle_error(StreamBlockJob *s,
+                                             AioTaskPool *pool,
+                                             int64_t *offset, int *error)
+{
+    BlockErrorAction action;
+    int ret;
+
+    aio_task_pool_wait_all(pool);
+
+    /* Progress stops at the first failed chunk, as if it ran alone */
+    stream_publish_progress(s, false);
+
+    ret = s->task_ret;
+    action = block_job_error_action(&s->common, s->on_error, true, -ret);
+    if (action == BLOCK_ERROR_ACTION_STOP) {
+        /*
+         * Retry from the first failed chunk once resumed.  Chunks after it
+         * that did succeed are found allocated then and accounted.
+         */
+        stream_drop_chunks(s);
+        *offset = s->error_offset;
+    } else {
+        if (*error == 0) {
+            *error = ret;
+        }
+        if (action == BLOCK_ERROR_ACTION_IGNORE) {
+            stream_publish_progress(s, true);
+            *offset = MAX(*offset, s->error_end);
+        }
+    }
+
+    s->task_ret = 0;
+    s->error_end = 0;
+
+    return action != BLOCK_ERROR_ACTION_REPORT;
+}
+
 static int GRAPH_UNLOCKED stream_prepare(Job *job)
 {
     StreamBlockJob *s = container_of(job, StreamBlockJob, common.job);
@@ -153,8 +321,11 @@ static int coroutine_fn stream_run(Job *job, Error **errp)
 {
     StreamBlockJob *s = container_of(job, StreamBlockJob, common.job);
     BlockDriverState *unfiltered_bs = NULL;
+    AioTaskPool *pool;
     int64_t len = -1;
     int64_t offset = 0;
+    int64_t status_end = 0; /* end of the extent whose status is known */
+    bool copy = false;
     int error = 0;
     int64_t n = 0; /* bytes */
 
@@ -172,66 +343,94 @@ static int coroutine_fn stream_run(Job *job, Error **errp)
     }
     job_progress_set_remaining(&s->common.job, len);
 
-    for ( ; offset < len; offset += n) {
-        bool copy;
+    QSIMPLEQ_INIT(&s->chunks);
+    pool = aio_task_pool_new(STREAM_MAX_WORKERS);
+
+    for (;;) {
         int ret = -1;
 
         /* Note that even when no rate limit is applied we need to yield
-         * with no pending I/O here so that bdrv_drain_all() returns.
+         * here so that bdrv_drain_all() returns.  Chunks still in flight
+         * are waited for by the drain itself.
          */
         block_job_ratelimit_sleep(&s->common);
         if (job_is_cancelled(&s->common.job)) {
             break;
         }
 
-        copy = false;
-
-        WITH_GRAPH_RDLOCK_GUARD() {
-            ret = bdrv_co_is_allocated(unfiltered_bs, offset, STREAM_CHUNK, &n);
-            if (ret == 1) {
-                /* Allocated in the top, no need to copy.  */
-            } else if (ret >= 0) {
-                /*
-                 * Copy if allocated in the intermediate images.  Limit to the
-                 * known-unallocated area [offset, offset+n*BDRV_SECTOR_SIZE).
-                 */
-                ret = bdrv_co_is_allocated_above(bdrv_cow_bs(unfiltered_bs),
-                                                 s->base_overlay, true,
-                                                 offset, n, &n);
-                /* Finish early if end of backing file has been reached */
-                if (ret == 0 && n == 0) {
-                    n = len - offset;
-                }
+        if (offset >= len) {
+            /* Everything has been submitted, wait for the last chunks */
+            aio_task_pool_wait_all(pool);
+        }
 
-                copy = (ret > 0);
+        if (s->task_ret) {
+            if (!stream_handle_error(s, pool, &offset, &error)) {
+                break;
             }
+            status_end = offset;
+            continue;
         }
-        trace_stream_one_iteration(s, offset, n, ret);
-        if (copy) {
-            ret = stream_populate(s->blk, offset, n);
+
+        if (offset >= len) {
+            break;
         }
-        if (ret < 0) {
-            BlockErrorAction action =
-                block_job_error_action(&s->common, s->on_error, true, -ret);
-            if (action == BLOCK_ERROR_ACTION_STOP) {
-                n = 0;
-                continue;
-            }
-            if (error == 0) {
-                error = ret;
+
+        if (offset >= status_end) {
+            int64_t bytes = MIN(len - offset, STREAM_MAX_EXTENT);
+
+            copy = false;
+
+            WITH_GRAPH_RDLOCK_GUARD() {
+                ret = bdrv_co_is_allocated(unfiltered_bs, offset, bytes, &n);
+                if (ret == 1) {
+                    /* Allocated in the top, no need to copy.  */
+                } else if (ret >= 0) {
+                    /*
+                     * Copy if allocated in the intermediate images.  Limit
+                     * to the known-unallocated area [offset, offset+n).
+                     */
+                    ret = bdrv_co_is_allocated_above(
+                            bdrv_cow_bs(unfiltered_bs), s->base_overlay,
+                            true, offset, n, &n);
+                    /* Finish early if end of backing file has been reached */
+                    if (ret == 0 && n == 0) {
+                        n = len - offset;
+                    }
+
+                    copy = (ret > 0);
+                }
             }
-            if (action == BLOCK_ERROR_ACTION_REPORT) {
-                break;
+            trace_stream_one_iteration(s, offset, n, ret);
+            if (ret < 0) {
+                n = MIN(len - offset, STREAM_CHUNK);
+                stream_record_error(s, offset, n, ret);
+                stream_add_chunk(s, n, true, ret);
+                continue;
             }
+            status_end = offset + n;
         }
 
-        /* Publish progress */
-        job_progress_update(&s->common.job, n);
+        n = status_end - offset;
         if (copy) {
+            /*
+             * Populate the extent in chunks that run in parallel, so that
+             * a slow backing file is kept busy with several requests.
+             */
+            n = MIN(n, STREAM_CHUNK);
+            stream_start_task(s, pool, offset, n);
             block_job_ratelimit_processed_bytes(&s->common, n);
+        } else {
+            /* Publish progress once the chunks before are done */
+            stream_add_chunk(s, n, true, 0);
+            stream_publish_progress(s, false);
         }
+        offset += n;
     }
 
+    aio_task_pool_wait_all(pool);
+    aio_task_pool_free(pool);
+    stream_drop_chunks(s);
+
     /* Do not remove the backing file if an error was there but ignored. */
     return error;
 }
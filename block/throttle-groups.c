@@ -75,8 +75,15 @@ struct ThrottleGroup {
     QLIST_HEAD(, ThrottleGroupMember) head;
     ThrottleGroupMember *tokens[THROTTLE_MAX];
     bool any_timer_armed[THROTTLE_MAX];
+    unsigned int nr_members;
     QEMUClockType clock_type;
 
+    /* How many microseconds worth of the group limits are handed out to
+     * the members as local budgets, 0 if local budgets are disabled.
+     * Accessed with atomic operations.
+     */
+    uint32_t local_budget_us;
+
     /* This field is protected by the global QEMU mutex */
     QTAILQ_ENTRY(ThrottleGroup) list;
 };
@@ -292,6 +299,224 @@ static bool throttle_group_schedule_timer(ThrottleGroupMember *tgm,
     return must_wait;
 }
 
+/*
+ * Local budgets
+ *
+ * With many members in a group, every request taking tg->lock becomes a
+ * bottleneck.  If local-budget-us is set, a member whose request has
+ * been admitted through the group lock also charges the group for a
+ * batch of future requests in the same direction and keeps these tokens
+ * in its local budget.  Later requests are admitted by atomically taking
+ * from that budget, and only go through the group lock and the
+ * round-robin scheduler once it is exhausted.  Since tokens are charged
+ * to the shared buckets before they are spent, the group limits still
+ * hold.
+ *
+ * To keep the group fair, a batch is an equal share of the group's
+ * allowance for local-budget-us, and batches are only handed out while
+ * no member of the group is waiting for a timer in that direction.
+ * Local budgets are not used with iops-size, where the number of
+ * operations a request counts for depends on its size.
+ *
+ * A batch is only valid for local-budget-us.  Tokens that a member did
+ * not spend in that time cannot be used anymore, so that an idle member
+ * does not keep a burst above the group limits.  Whatever is left when
+ * the member next goes through the group lock is given back to the
+ * group's buckets.
+ */
+
+#define THROTTLE_BUDGET_MAX_US 100000
+#define THROTTLE_BUDGET_UNLIMITED (LONG_MAX / 2)
+
+static const BucketType budget_bucket_types_size[THROTTLE_MAX][2] = {
+    { THROTTLE_BPS_TOTAL, THROTTLE_BPS_READ },
+    { THROTTLE_BPS_TOTAL, THROTTLE_BPS_WRITE }
+};
+static const BucketType budget_bucket_types_units[THROTTLE_MAX][2] = {
+    { THROTTLE_OPS_TOTAL, THROTTLE_OPS_READ },
+    { THROTTLE_OPS_TOTAL, THROTTLE_OPS_WRITE }
+};
+
+static bool throttle_budget_sub(long *budget, long amount)
+{
+    long old = qatomic_read(budget);
+
+    while (old >= amount) {
+        long prev = qatomic_cmpxchg(budget, old, old - amount);
+        if (prev == old) {
+            return true;
+        }
+        old = prev;
+    }
+    return false;
+}
+
+static void throttle_budget_add(long *budget, long amount)
+{
+    long old = qatomic_read(budget);
+
+    for (;;) {
+        long new = MIN(old + MIN(amount, THROTTLE_BUDGET_UNLIMITED),
+                       THROTTLE_BUDGET_UNLIMITED);
+        long prev = qatomic_cmpxchg(budget, old, new);
+        if (prev == old) {
+            return;
+        }
+        old = prev;
+    }
+}
+
+/* Try to admit a request from the local budget of @tgm, without taking the
+ * group lock.
+ *
+ * @tgm:       the ThrottleGroupMember
+ * @bytes:     the number of bytes for this I/O
+ * @direction: the ThrottleDirection
+ * @ret:       whether the request was admitted
+ */
+static bool throttle_group_take_budget(ThrottleGroupMember *tgm,
+                                       int64_t bytes,
+                                       ThrottleDirection direction)
+{
+    ThrottleGroup *tg = container_of(tgm->throttle_state, ThrottleGroup, ts);
+
+    /* Don't overtake requests that are already queued */
+    if (qatomic_read(&tgm->pending_reqs[direction])) {
+        return false;
+    }
+
+    if (qemu_clock_get_ns(tg->clock_type) >=
+        qatomic_read_i64(&tgm->budget_expiry_ns[direction])) {
+        return false;
+    }
+
+    if (!throttle_budget_sub(&tgm->budget_ops[direction], 1)) {
+        return false;
+    }
+    if (!throttle_budget_sub(&tgm->budget_bytes[direction], bytes)) {
+        qatomic_add(&tgm->budget_ops[direction], 1);
+        return false;
+    }
+    return true;
+}
+
+/* Return the share of a member in the tokens that @bucket_types allow in
+ * @budget_us, or THROTTLE_BUDGET_UNLIMITED if none of them is limited.
+ *
+ * This assumes that tg->lock is held.
+ */
+static long throttle_group_budget_share(ThrottleGroup *tg,
+                                        const BucketType *bucket_types,
+                                        uint32_t budget_us)
+{
+    double share = THROTTLE_BUDGET_UNLIMITED;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        LeakyBucket *bkt = &tg->ts.cfg.buckets[bucket_types[i]];
+        if (bkt->avg) {
+            share = MIN(share, (double) bkt->avg * budget_us /
+                               (1000000.0 * tg->nr_members));
+        }
+    }
+    return share;
+}
+
+/* Hand out a batch of tokens to the local budget of @tgm, charging them to
+ * the group.
+ *
+ * This assumes that tg->lock is held.
+ *
+ * @tgm:       the ThrottleGroupMember
+ * @direction: the ThrottleDirection
+ */
+static void throttle_group_refill_budget(ThrottleGroupMember *tgm,
+                                         ThrottleDirection direction)
+{
+    ThrottleState *ts = tgm->throttle_state;
+    ThrottleGroup *tg = container_of(ts, ThrottleGroup, ts);
+    uint32_t budget_us = qatomic_read(&tg->local_budget_us);
+    long bytes, ops;
+
+    if (!budget_us || ts->cfg.op_size || tg->any_timer_armed[direction] ||
+        qatomic_read(&tgm->io_limits_disabled)) {
+        return;
+    }
+
+    budget_us = MIN(budget_us, THROTTLE_BUDGET_MAX_US);
+    bytes = throttle_group_budget_share(tg,
+                                        budget_bucket_types_size[direction],
+                                        budget_us);
+    ops = throttle_group_budget_share(tg,
+                                      budget_bucket_types_units[direction],
+                                      budget_us);
+    if (!bytes || !ops) {
+        /* The share is too small to be worth a local budget */
+        return;
+    }
+
+    throttle_account_units(ts, direction,
+                           bytes == THROTTLE_BUDGET_UNLIMITED ? 0 : bytes,
+                           ops == THROTTLE_BUDGET_UNLIMITED ? 0 : ops);
+    throttle_budget_add(&tgm->budget_bytes[direction], bytes);
+    throttle_budget_add(&tgm->budget_ops[direction], ops);
+    qatomic_set_i64(&tgm->budget_expiry_ns[direction],
+                    qemu_clock_get_ns(tg->clock_type) +
+                    budget_us * SCALE_US);
+}
+
+/* Take back what is left of the local budget of @tgm and remove it from the
+ * group's buckets, which were charged for it by
+ * throttle_group_refill_budget().
+ *
+ * This assumes that tg->lock is held.
+ *
+ * @tgm:       the ThrottleGroupMember
+ * @direction: the ThrottleDirection
+ */
+static void throttle_group_return_budget(ThrottleGroupMember *tgm,
+                                         ThrottleDirection direction)
+{
+    ThrottleState *ts = tgm->throttle_state;
+    long bytes = qatomic_xchg(&tgm->budget_bytes[direction], 0);
+    long ops = qatomic_xchg(&tgm->budget_ops[direction], 0);
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        LeakyBucket *bkt;
+
+        bkt = &ts->cfg.buckets[budget_bucket_types_size[direction][i]];
+        if (bytes && bytes != THROTTLE_BUDGET_UNLIMITED) {
+            bkt->level = MAX(bkt->level - bytes, 0);
+            bkt->burst_level = MAX(bkt->burst_level - bytes, 0);
+        }
+
+        bkt = &ts->cfg.buckets[budget_bucket_types_units[direction][i]];
+        if (ops && ops != THROTTLE_BUDGET_UNLIMITED) {
+            bkt->level = MAX(bkt->level - ops, 0);
+            bkt->burst_level = MAX(bkt->burst_level - ops, 0);
+        }
+    }
+}
+
+/* Drop the local budgets of all members, e.g. because the limits of the
+ * group changed.
+ *
+ * This assumes that tg->lock is held.
+ */
+static void throttle_group_reset_budgets(ThrottleGroup *tg)
+{
+    ThrottleGroupMember *tgm;
+    ThrottleDirection dir;
+
+    QLIST_FOREACH(tgm, &tg->head, round_robin) {
+        for (dir = THROTTLE_READ; dir < THROTTLE_MAX; dir++) {
+            qatomic_set(&tgm->budget_bytes[dir], 0);
+            qatomic_set(&tgm->budget_ops[dir], 0);
+        }
+    }
+}
+
 /* Start the next pending I/O request for a ThrottleGroupMember. Return whether
  * any request was actually pending.
  *
@@ -369,26 +594,34 @@ void coroutine_fn throttle_group_co_io_limits_intercept(ThrottleGroupMember *tgm
     assert(bytes >= 0);
     assert(direction < THROTTLE_MAX);
 
+    if (throttle_group_take_budget(tgm, bytes, direction)) {
+        return;
+    }
+
     qemu_mutex_lock(&tg->lock);
 
+    /* Whatever is left of the local budget is not enough or has expired */
+    throttle_group_return_budget(tgm, direction);
+
     /* First we check if this I/O has to be throttled. */
     token = next_throttle_token(tgm, direction);
     must_wait = throttle_group_schedule_timer(token, direction);
 
     /* Wait if there's a timer set or queued requests of this type */
     if (must_wait || tgm->pending_reqs[direction]) {
-        tgm->pending_reqs[direction]++;
+        qatomic_inc(&tgm->pending_reqs[direction]);
         qemu_mutex_unlock(&tg->lock);
         qemu_co_mutex_lock(&tgm->throttled_reqs_lock);
         qemu_co_queue_wait(&tgm->throttled_reqs[direction],
                            &tgm->throttled_reqs_lock);
         qemu_co_mutex_unlock(&tgm->throttled_reqs_lock);
         qemu_mutex_lock(&tg->lock);
-        tgm->pending_reqs[direction]--;
+        qatomic_dec(&tgm->pending_reqs[direction]);
     }
 
     /* The I/O will be executed, so do the accounting */
     throttle_account(tgm->throttle_state, direction, bytes);
+    throttle_group_refill_budget(tgm, direction);
 
     /* Schedule the next request */
     schedule_next_request(tgm, direction);
@@ -478,6 +711,7 @@ void throttle_group_config(ThrottleGroupMember *tgm, ThrottleConfig *cfg)
     ThrottleGroup *tg = container_of(ts, ThrottleGroup, ts);
     qemu_mutex_lock(&tg->lock);
     throttle_config(ts, tg->clock_type, cfg);
+    throttle_group_reset_budgets(tg);
     qemu_mutex_unlock(&tg->lock);
 
     throttle_group_restart_tgm(tgm);
@@ -559,9 +793,13 @@ void throttle_group_register_tgm(ThrottleGroupMember *tgm,
             tg->tokens[dir] = tgm;
         }
         qemu_co_queue_init(&tgm->throttled_reqs[dir]);
+        tgm->budget_bytes[dir] = 0;
+        tgm->budget_ops[dir] = 0;
+        tgm->budget_expiry_ns[dir] = 0;
     }
 
     QLIST_INSERT_HEAD(&tg->head, tgm, round_robin);
+    tg->nr_members++;
 
     throttle_timers_init(&tgm->throttle_timers,
                          tgm->aio_context,
@@ -614,6 +852,7 @@ void throttle_group_unregister_tgm(ThrottleGroupMember *tgm)
 
         /* remove the current tgm from the list */
         QLIST_REMOVE(tgm, round_robin);
+        tg->nr_members--;
         throttle_timers_destroy(&tgm->throttle_timers);
     }
 
@@ -764,6 +1003,10 @@ static void throttle_group_obj_init(Object *obj)
     qemu_mutex_init(&tg->lock);
     throttle_init(&tg->ts);
     QLIST_INIT(&tg->head);
+
+    object_property_add_uint32_ptr(obj, "local-budget-us",
+                                   &tg->local_budget_us,
+                                   OBJ_PROP_FLAG_READWRITE);
 }
 
 /* This function edits throttle_groups and must be called under the global
@@ -903,6 +1146,7 @@ static void throttle_group_set_limits(Object *obj, Visitor *v,
         goto unlock;
     }
     throttle_config(&tg->ts, tg->clock_type, &cfg);
+    throttle_group_reset_budgets(tg);
 
 unlock:
     qemu_mutex_unlock(&tg->lock);
@@ -257,6 +257,8 @@ static const uint32_t nvme_feature_cap[NVME_FID_MAX] = {
     [NVME_ERROR_RECOVERY]           = NVME_FEAT_CAP_CHANGE | NVME_FEAT_CAP_NS,
     [NVME_VOLATILE_WRITE_CACHE]     = NVME_FEAT_CAP_CHANGE,
     [NVME_NUMBER_OF_QUEUES]         = NVME_FEAT_CAP_CHANGE,
+    [NVME_INTERRUPT_COALESCING]     = NVME_FEAT_CAP_CHANGE,
+    [NVME_INTERRUPT_VECTOR_CONF]    = NVME_FEAT_CAP_CHANGE,
     [NVME_WRITE_ATOMICITY]          = NVME_FEAT_CAP_CHANGE,
     [NVME_ASYNCHRONOUS_EVENT_CONF]  = NVME_FEAT_CAP_CHANGE,
     [NVME_TIMESTAMP]                = NVME_FEAT_CAP_CHANGE,
@@ -705,6 +707,60 @@ static void nvme_irq_deassert(NvmeCtrl *n, NvmeCQueue *cq)
     }
 }
 
+static bool nvme_intv_coalescing_disabled(NvmeCtrl *n, uint16_t iv)
+{
+    /* interrupt coalescing never applies to the admin completion queue */
+    if (iv == n->admin_cq.vector) {
+        return true;
+    }
+
+    return iv <= n->conf_ioqpairs && test_bit(iv, n->features.int_vector_cd);
+}
+
+static void nvme_cq_coalesce_timer(void *opaque)
+{
+    NvmeCQueue *cq = opaque;
+
+    cq->coalesced = 0;
+
+    if (cq->tail != cq->head) {
+        nvme_irq_assert(cq->ctrl, cq);
+    }
+}
+
+/*
+ * Signal newly posted completion queue entries, aggregating interrupts as
+ * configured with the Interrupt Coalescing feature. An interrupt is sent
+ * once more than THR entries have been posted or when the aggregation time
+ * has passed since the first entry that was not signalled.
+ */
+static void nvme_cq_notify(NvmeCtrl *n, NvmeCQueue *cq, uint32_t posted)
+{
+    uint32_t intc = n->features.int_coalescing;
+
+    if (!cq->irq_enabled || !NVME_INTC_THR(intc) || !NVME_INTC_TIME(intc) ||
+        nvme_intv_coalescing_disabled(n, cq->vector)) {
+        nvme_irq_assert(n, cq);
+        return;
+    }
+
+    if (!posted && !cq->coalesced) {
+        return;
+    }
+
+    cq->coalesced += posted;
+
+    if (cq->coalesced > NVME_INTC_THR(intc)) {
+        timer_del(cq->coalesce_timer);
+        cq->coalesced = 0;
+        nvme_irq_assert(n, cq);
+    } else if (!timer_pending(cq->coalesce_timer)) {
+        /* aggregation time is specified in 100 microsecond increments */
+        timer_mod(cq->coalesce_timer, qemu_clock_get_us(QEMU_CLOCK_VIRTUAL) +
+                  NVME_INTC_TIME(intc) * 100);
+    }
+}
+
 static void nvme_req_clear(NvmeRequest *req)
 {
     req->ns = NULL;
@@ -1501,19 +1557,33 @@ static void nvme_post_cqes(void *opaque)
     NvmeCtrl *n = cq->ctrl;
     NvmeRequest *req, *next;
     bool pending = cq->head != cq->tail;
+    uint32_t posted = 0;
     int ret;
 
+    /*
+     * With shadow doorbells, read the head once per batch and only go back
+     * to host memory if the queue looks full. The event index is published
+     * once the batch has been posted.
+     */
+    if (n->dbbuf_enabled && !QTAILQ_EMPTY(&cq->req_list)) {
+        nvme_update_cq_head(cq);
+    }
+
     QTAILQ_FOREACH_SAFE(req, &cq->req_list, entry, next) {
         NvmeSQueue *sq;
         hwaddr addr;
 
-        if (n->dbbuf_enabled) {
+        if (nvme_cq_full(cq)) {
+            if (!n->dbbuf_enabled) {
+                break;
+            }
+
             nvme_update_cq_eventidx(cq);
             nvme_update_cq_head(cq);
-        }
 
-        if (nvme_cq_full(cq)) {
-            break;
+            if (nvme_cq_full(cq)) {
+                break;
+            }
         }
 
         sq = req->sq;
@@ -1534,6 +1604,7 @@ static void nvme_post_cqes(void *opaque)
 
         nvme_inc_cq_tail(cq);
         nvme_sg_unmap(&req->sg);
+        posted++;
 
         if (QTAILQ_EMPTY(&sq->req_list) && !nvme_sq_empty(sq)) {
             qemu_bh_schedule(sq->bh);
@@ -1541,12 +1612,17 @@ static void nvme_post_cqes(void *opaque)
 
         QTAILQ_INSERT_TAIL(&sq->req_list, req, entry);
     }
+
+    if (n->dbbuf_enabled && posted) {
+        nvme_update_cq_eventidx(cq);
+    }
+
     if (cq->tail != cq->head) {
         if (cq->irq_enabled && !pending) {
             n->cq_pending++;
         }
 
-        nvme_irq_assert(n, cq);
+        nvme_cq_notify(n, cq, posted);
     }
 }
 
@@ -5511,6 +5587,7 @@ static void nvme_free_cq(NvmeCQueue *cq, NvmeCtrl *n)
 
     n->cq[cq->cqid] = NULL;
     qemu_bh_delete(cq->bh);
+    timer_free(cq->coalesce_timer);
     if (cq->ioeventfd_enabled) {
         memory_region_del_eventfd(&n->iomem,
                                   0x1000 + offset, 4, false, 0, &cq->notifier);
@@ -5570,6 +5647,7 @@ static void nvme_init_cq(NvmeCQueue *cq, NvmeCtrl *n, uint64_t dma_addr,
     cq->irq_enabled = irq_enabled;
     cq->vector = vector;
     cq->head = cq->tail = 0;
+    cq->coalesced = 0;
     QTAILQ_INIT(&cq->req_list);
     QTAILQ_INIT(&cq->sq_list);
     if (n->dbbuf_enabled) {
@@ -5585,6 +5663,8 @@ static void nvme_init_cq(NvmeCQueue *cq, NvmeCtrl *n, uint64_t dma_addr,
     n->cq[cqid] = cq;
     cq->bh = qemu_bh_new_guarded(nvme_post_cqes, cq,
                                  &DEVICE(cq->ctrl)->mem_reentrancy_guard);
+    cq->coalesce_timer = timer_new_us(QEMU_CLOCK_VIRTUAL,
+                                      nvme_cq_coalesce_timer, cq);
 }
 
 static uint16_t nvme_create_cq(NvmeCtrl *n, NvmeRequest *req)
@@ -6370,6 +6450,20 @@ static uint16_t nvme_get_feature(NvmeCtrl *n, NvmeRequest *req)
         }
         trace_pci_nvme_getfeat_vwcache(result ? "enabled" : "disabled");
         goto out;
+    case NVME_INTERRUPT_COALESCING:
+        result = n->features.int_coalescing;
+        goto out;
+    case NVME_INTERRUPT_VECTOR_CONF:
+        iv = dw11 & 0xffff;
+        if (iv >= n->conf_ioqpairs + 1) {
+            return NVME_INVALID_FIELD | NVME_DNR;
+        }
+
+        result = iv;
+        if (nvme_intv_coalescing_disabled(n, iv)) {
+            result |= NVME_INTVC_NOCOALESCING;
+        }
+        goto out;
     case NVME_ASYNCHRONOUS_EVENT_CONF:
         result = n->features.async_config;
         goto out;
@@ -6535,6 +6629,7 @@ static uint16_t nvme_set_feature(NvmeCtrl *n, NvmeRequest *req)
     uint8_t fid = NVME_GETSETFEAT_FID(dw10);
     uint8_t save = NVME_SETFEAT_SAVE(dw10);
     uint16_t status;
+    uint16_t iv;
     int i;
     NvmeIdCtrl *id = &n->id_ctrl;
     NvmeAtomic *atomic = &n->atomic;
@@ -6653,6 +6748,21 @@ static uint16_t nvme_set_feature(NvmeCtrl *n, NvmeRequest *req)
         req->cqe.result = cpu_to_le32((n->conf_ioqpairs - 1) |
                                       ((n->conf_ioqpairs - 1) << 16));
         break;
+    case NVME_INTERRUPT_COALESCING:
+        n->features.int_coalescing = dw11 & 0xffff;
+        break;
+    case NVME_INTERRUPT_VECTOR_CONF:
+        iv = dw11 & 0xffff;
+        if (iv >= n->conf_ioqpairs + 1) {
+            return NVME_INVALID_FIELD | NVME_DNR;
+        }
+
+        if (dw11 & NVME_INTVC_NOCOALESCING) {
+            set_bit(iv, n->features.int_vector_cd);
+        } else {
+            clear_bit(iv, n->features.int_vector_cd);
+        }
+        break;
     case NVME_ASYNCHRONOUS_EVENT_CONF:
         n->features.async_config = dw11;
         break;
@@ -7783,6 +7893,11 @@ static void nvme_process_sq(void *opaque)
         nvme_update_sq_tail(sq);
     }
 
+    /*
+     * With shadow doorbells, the event index and the tail are only synced
+     * with host memory once the entries fetched so far have been consumed
+     * rather than after every command.
+     */
     while (!(nvme_sq_empty(sq) || QTAILQ_EMPTY(&sq->req_list))) {
         NvmeAtomic *atomic;
         bool cmd_is_atomic;
@@ -7834,7 +7949,7 @@ static void nvme_process_sq(void *opaque)
             nvme_enqueue_req_completion(cq, req);
         }
 
-        if (n->dbbuf_enabled) {
+        if (n->dbbuf_enabled && nvme_sq_empty(sq)) {
             nvme_update_sq_eventidx(sq);
             nvme_update_sq_tail(sq);
         }
@@ -7932,6 +8047,9 @@ static void nvme_ctrl_reset(NvmeCtrl *n, NvmeResetType rst)
 
     n->dn = n->params.atomic_dn; /* Set Disable Normal */
 
+    n->features.int_coalescing = 0;
+    bitmap_zero(n->features.int_vector_cd, n->params.max_ioqpairs + 1);
+
     nvme_update_msixcap_ts(pci_dev, n->conf_msix_qsize);
 
     if (pci_is_vf(pci_dev)) {
@@ -8729,6 +8847,7 @@ static void nvme_init_state(NvmeCtrl *n)
     n->cq = g_new0(NvmeCQueue *, n->params.max_ioqpairs + 1);
     n->temperature = NVME_TEMPERATURE;
     n->features.temp_thresh_hi = NVME_TEMPERATURE_WARNING;
+    n->features.int_vector_cd = bitmap_new(n->params.max_ioqpairs + 1);
     n->starttime_ms = qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL);
     n->aer_reqs = g_new0(NvmeRequest *, n->params.aerl + 1);
     QTAILQ_INIT(&n->aer_queue);
@@ -9331,6 +9450,7 @@ static void nvme_exit(PCIDevice *pci_dev)
     g_free(n->cq);
     g_free(n->sq);
     g_free(n->aer_reqs);
+    g_free(n->features.int_vector_cd);
 
     if (n->params.cmb_size_mb) {
         g_free(n->cmb.buf);
@@ -533,6 +533,8 @@ typedef struct NvmeCQueue {
     QEMUBH      *bh;
     EventNotifier notifier;
     bool        ioeventfd_enabled;
+    uint32_t    coalesced;      /* entries posted since the last interrupt */
+    QEMUTimer   *coalesce_timer;
     QTAILQ_HEAD(, NvmeSQueue) sq_list;
     QTAILQ_HEAD(, NvmeRequest) req_list;
 } NvmeCQueue;
@@ -652,6 +654,8 @@ typedef struct NvmeCtrl {
         };
 
         uint32_t                async_config;
+        uint32_t                int_coalescing;
+        unsigned long           *int_vector_cd; /* Coalescing Disable */
         NvmeHostBehaviorSupport hbs;
     } features;
 
@@ -79,6 +79,25 @@ typedef struct BlockLatencyHistogram {
     uint64_t *bins;
 } BlockLatencyHistogram;
 
+/*
+ * Always-on log-linear latency histogram, used to report percentiles.
+ * Latencies below 2^BLOCK_ACCT_HDR_SUB_BITS ns get a bucket each; above
+ * that, every power of two is split into 2^BLOCK_ACCT_HDR_SUB_BITS
+ * buckets, so the relative error of a reported percentile stays below
+ * 1/16.  Everything from 2^BLOCK_ACCT_HDR_MAX_BITS ns (~69 s) up shares
+ * the last bucket.
+ */
+#define BLOCK_ACCT_HDR_SUB_BITS 4
+#define BLOCK_ACCT_HDR_MAX_BITS 36
+#define BLOCK_ACCT_HDR_BUCKETS \
+    ((BLOCK_ACCT_HDR_MAX_BITS - BLOCK_ACCT_HDR_SUB_BITS + 1) << \
+     BLOCK_ACCT_HDR_SUB_BITS)
+
+typedef struct BlockAcctHdrHistogram {
+    uint64_t count;
+    uint64_t buckets[BLOCK_ACCT_HDR_BUCKETS];
+} BlockAcctHdrHistogram;
+
 struct BlockAcctStats {
     QemuMutex lock;
     uint64_t nr_bytes[BLOCK_MAX_IOTYPE];
@@ -92,6 +111,7 @@ struct BlockAcctStats {
     bool account_invalid;
     bool account_failed;
     BlockLatencyHistogram latency_histogram[BLOCK_MAX_IOTYPE];
+    BlockAcctHdrHistogram latency_hdr[BLOCK_MAX_IOTYPE];
 };
 
 typedef struct BlockAcctCookie {
@@ -121,5 +141,8 @@ double block_acct_queue_depth(BlockAcctTimedStats *stats,
 int block_latency_histogram_set(BlockAcctStats *stats, enum BlockAcctType type,
                                 uint64List *boundaries);
 void block_latency_histograms_clear(BlockAcctStats *stats);
+bool block_acct_latency_percentile(BlockAcctStats *stats,
+                                   enum BlockAcctType type,
+                                   unsigned int permille, uint64_t *value);
 
 #endif
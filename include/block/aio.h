@@ -315,6 +315,14 @@ struct AioContext {
     AioHandlerSList submit_list;
     void *io_uring_fd_tag;
 
+    /*
+     * Fixed files and buffers of block/io_uring.c in fdmon_io_uring, and the
+     * function dropping them when the AioContext goes away.  Not every program
+     * using util/ links block/io_uring.c, so it is called through a pointer.
+     */
+    struct LuringFixed *luring_fixed;
+    void (*luring_fixed_cleanup)(AioContext *ctx);
+
     /* Pending callback state for cqe handlers */
     CqeHandlerSimpleQ cqe_handler_ready_list;
 #endif /* CONFIG_LINUX_IO_URING */
@@ -32,6 +32,7 @@ struct AioTask {
     AioTaskPool *pool;
     AioTaskFunc func;
     int ret;
+    const void *latency_trace_tag;  /* set by aio_task_pool_start_task() */
 };
 
 AioTaskPool *coroutine_fn aio_task_pool_new(int max_busy_tasks);
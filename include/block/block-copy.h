@@ -23,6 +23,7 @@
 typedef void (*BlockCopyAsyncCallbackFunc)(void *opaque);
 typedef struct BlockCopyState BlockCopyState;
 typedef struct BlockCopyCallState BlockCopyCallState;
+typedef struct BlockCopyCapture BlockCopyCapture;
 
 BlockCopyState *block_copy_state_new(BdrvChild *source, BdrvChild *target,
                                      BlockDriverState *copy_bitmap_bs,
@@ -97,6 +98,35 @@ void block_copy_kick(BlockCopyCallState *call_state);
  */
 void block_copy_call_cancel(BlockCopyCallState *call_state);
 
+/*
+ * Capture the first dirty area of cluster-aligned @offset/@bytes, at most
+ * @max_bytes long, in memory.  The area is read from the source and no longer
+ * copied by block_copy(); its data reaches the target only through
+ * block_copy_capture_write().  Like block_copy(), unallocated areas are
+ * skipped if skip_unallocated is set, and areas that read as zeroes are not
+ * read at all but written to the target with write zeroes.
+ *
+ * Returns the length of the captured area, whose offset is stored in
+ * @capture_offset.  Returns 0 if nothing in the region needs copying anymore,
+ * after waiting for copies of the region that are in flight.  Returns -ENOSPC
+ * if @max_bytes is smaller than a cluster, or another negative errno value if
+ * reading the source failed.
+ */
+int64_t coroutine_fn GRAPH_RDLOCK
+block_copy_capture(BlockCopyState *s, int64_t offset, int64_t bytes,
+                   int64_t max_bytes, int64_t *capture_offset,
+                   BlockCopyCapture **capture);
+
+/*
+ * Write @nb_captures captures, sorted by offset, to the target and free them.
+ * Adjacent captures are written with a single request.  A failure is
+ * reported by all block_copy() calls from then on, as the captured data
+ * cannot be copied again.
+ */
+int coroutine_fn GRAPH_RDLOCK
+block_copy_capture_write(BlockCopyState *s, BlockCopyCapture **captures,
+                         int nb_captures);
+
 BdrvDirtyBitmap *block_copy_dirty_bitmap(BlockCopyState *s);
 int64_t block_copy_cluster_size(BlockCopyState *s);
 void block_copy_set_skip_unallocated(BlockCopyState *s, bool skip);
@@ -330,6 +330,33 @@ bdrv_co_copy_range(BdrvChild *src, int64_t src_offset,
                    int64_t bytes, BdrvRequestFlags read_flags,
                    BdrvRequestFlags write_flags);
 
+/**
+ * bdrv_co_sendfile:
+ *
+ * Write @bytes of guest-visible data starting at @offset of @child directly
+ * into the file descriptor @out_fd (typically a socket), without bouncing
+ * it through a userspace buffer.  Only drivers that pass data through
+ * unmodified down to a host file implement this.
+ *
+ * A request of zero bytes can be used to probe for support without touching
+ * @out_fd.
+ *
+ * Like bdrv_co_copy_range(), the block layer does not fall back to a bounce
+ * buffer itself.  -ENOTSUP is only returned if nothing has been written to
+ * @out_fd, so the caller can still fall back to bdrv_co_preadv(); any other
+ * error leaves @out_fd in an undefined state.
+ *
+ * @out_fd is never waited for: if it does not accept any data, -EAGAIN is
+ * returned and the caller should poll it before retrying.
+ *
+ * Returns: the number of bytes written to @out_fd, which can be less than
+ * @bytes if @out_fd is full or the host file ends before @offset + @bytes
+ * (0 if it ends at or before @offset; the data past the end reads as
+ * zeroes); negative error code if failed.
+ **/
+int coroutine_fn GRAPH_RDLOCK
+bdrv_co_sendfile(BdrvChild *child, int64_t offset, int64_t bytes, int out_fd);
+
 /*
  * "I/O or GS" API functions. These functions can run without
  * the BQL, but only in one specific iothread/main loop.
@@ -612,6 +612,17 @@ struct BlockDriver {
         BdrvChild *dst, int64_t dst_offset, int64_t bytes,
         BdrvRequestFlags read_flags, BdrvRequestFlags write_flags);
 
+    /*
+     * Map [offset, offset + bytes) range onto a child of @bs and invoke
+     * bdrv_co_sendfile(child, ...), or write the data directly to @out_fd
+     * if @bs is the leaf.
+     *
+     * See the comment of bdrv_co_sendfile for the parameter and return value
+     * semantics.
+     */
+    int coroutine_fn GRAPH_RDLOCK_PTR (*bdrv_co_sendfile)(
+        BlockDriverState *bs, int64_t offset, int64_t bytes, int out_fd);
+
     /*
      * Building block for bdrv_block_status[_above] and
      * bdrv_is_allocated[_above].  The driver should answer only
@@ -1096,6 +1107,38 @@ typedef struct BdrvBlockStatusCache {
     int64_t data_end;
 } BdrvBlockStatusCache;
 
+/*
+ * Remembers which layer of a node's backing chain provides the data for
+ * recently read extents, so that reads of unallocated areas can skip the
+ * layers in between.  See bdrv_co_preadv_backing_part().
+ *
+ * @offset, @bytes: The extent, in guest offsets
+ * @owner: Link to the layer that the extent is read from, @depth links
+ *         below the node owning the cache (1 is its backing child)
+ * @gen: Sum of write_gen of the layers 1..@depth when the entry was
+ *       filled; any write, discard or truncate on those layers changes
+ *       it and thereby invalidates the entry
+ * @graph_gen: bdrv_graph_generation() when the entry was filled; any
+ *             change to the graph or reopen of a node invalidates the entry,
+ *             so that neither replaced layers nor a reused @owner pointer
+ *             can make it match again
+ */
+typedef struct BdrvChainMapEntry {
+    int64_t offset;
+    int64_t bytes;
+    BdrvChild *owner;
+    int depth;
+    uint64_t gen;
+    unsigned int graph_gen;
+} BdrvChainMapEntry;
+
+#define BDRV_CHAIN_MAP_ENTRIES 64
+
+typedef struct BdrvChainMap {
+    BdrvChainMapEntry entries[BDRV_CHAIN_MAP_ENTRIES];
+    unsigned int next;  /* round-robin replacement */
+} BdrvChainMap;
+
 struct BlockDriverState {
     /*
      * Protected by big QEMU lock or read-only after opening.  No special
@@ -1282,6 +1325,10 @@ struct BlockDriverState {
     /* Always non-NULL, but must only be dereferenced under an RCU read guard */
     BdrvBlockStatusCache *block_status_cache;
 
+    /* Backing chain owner cache, allocated on first use */
+    QemuMutex chain_map_lock;
+    BdrvChainMap *chain_map;
+
     /* array of write pointers' location of each zone in the zoned device. */
     BlockZoneWps *wps;
 };
@@ -50,6 +50,25 @@ int coroutine_fn GRAPH_RDLOCK bdrv_co_preadv(BdrvChild *child,
 int coroutine_fn GRAPH_RDLOCK bdrv_co_preadv_part(BdrvChild *child,
     int64_t offset, int64_t bytes,
     QEMUIOVector *qiov, size_t qiov_offset, BdrvRequestFlags flags);
+
+/*
+ * Return a counter that changes whenever the block graph changes shape or a
+ * node is reopened.  Anything that caches facts about the path from a node
+ * down to its children can compare it to notice that they may be stale.
+ */
+unsigned int bdrv_graph_generation(void);
+
+/*
+ * Read what the backing chain of @bs contains at [offset, offset + bytes),
+ * like bdrv_co_preadv_part(bs->backing, ...) does.  Requests are sent
+ * straight to the layer that owns the data, as long as it is known from
+ * previous reads and the layers in between have not been modified since.
+ */
+int coroutine_fn GRAPH_RDLOCK
+bdrv_co_preadv_backing_part(BlockDriverState *bs, int64_t offset,
+                            int64_t bytes, QEMUIOVector *qiov,
+                            size_t qiov_offset, BdrvRequestFlags flags);
+
 int coroutine_fn GRAPH_RDLOCK bdrv_co_pwritev(BdrvChild *child,
     int64_t offset, int64_t bytes, QEMUIOVector *qiov,
     BdrvRequestFlags flags);
@@ -81,6 +100,10 @@ void coroutine_fn bdrv_make_request_serialising(BdrvTrackedRequest *req,
                                                 uint64_t align);
 BdrvTrackedRequest *coroutine_fn bdrv_co_get_self_request(BlockDriverState *bs);
 
+const void *coroutine_fn bdrv_latency_trace_enter(const void *tag);
+void coroutine_fn bdrv_latency_trace_leave(const void *prev);
+const void *coroutine_fn bdrv_latency_trace_tag(void);
+
 BlockDriver *bdrv_probe_all(const uint8_t *buf, int buf_size,
                             const char *filename);
 
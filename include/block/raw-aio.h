@@ -32,6 +32,7 @@
 #define QEMU_AIO_ZONE_REPORT  0x0100
 #define QEMU_AIO_ZONE_MGMT    0x0200
 #define QEMU_AIO_ZONE_APPEND  0x0400
+#define QEMU_AIO_SENDFILE     0x0800
 #define QEMU_AIO_TYPE_MASK \
         (QEMU_AIO_READ | \
          QEMU_AIO_WRITE | \
@@ -43,7 +44,8 @@
          QEMU_AIO_TRUNCATE | \
          QEMU_AIO_ZONE_REPORT | \
          QEMU_AIO_ZONE_MGMT | \
-         QEMU_AIO_ZONE_APPEND)
+         QEMU_AIO_ZONE_APPEND | \
+         QEMU_AIO_SENDFILE)
 
 /* AIO flags */
 #define QEMU_AIO_MISALIGNED   0x1000
@@ -64,6 +66,14 @@ int coroutine_fn laio_co_submit(int fd, uint64_t offset, QEMUIOVector *qiov,
 
 bool laio_has_fdsync(int);
 bool laio_has_fua(void);
+
+/*
+ * laio_get_batch_stats: the current adaptive batch size (0 while it has not
+ * been adjusted yet) and the average submit-to-completion latency it is based
+ * on.  May be called from any thread.
+ */
+void laio_get_batch_stats(LinuxAioState *s, uint64_t *max_batch,
+                          uint64_t *latency_ns);
 void laio_detach_aio_context(LinuxAioState *s, AioContext *old_context);
 void laio_attach_aio_context(LinuxAioState *s, AioContext *new_context);
 #else
@@ -79,6 +89,18 @@ int coroutine_fn luring_co_submit(BlockDriverState *bs, int fd, uint64_t offset,
                                   QEMUIOVector *qiov, int type,
                                   BdrvRequestFlags flags);
 bool luring_has_fua(void);
+
+/*
+ * Fixed files and buffers: requests on a registered FD use it as a fixed
+ * file, and requests with BDRV_REQ_REGISTERED_BUF whose single buffer lies
+ * in a registered buffer use IORING_OP_READ_FIXED/WRITE_FIXED.  An FD must
+ * be unregistered before it is closed.
+ */
+typedef struct LuringFixed LuringFixed;
+void luring_register_file(int fd);
+void luring_unregister_file(int fd);
+void luring_register_buf(void *host, size_t size);
+void luring_unregister_buf(void *host, size_t size);
 #else
 static inline bool luring_has_fua(void)
 {
@@ -49,6 +49,15 @@ typedef struct ThrottleGroupMember {
      */
     unsigned int restart_pending;
 
+    /* Tokens this member has already charged to the group and may spend
+     * without taking the group lock, in bytes and in requests, and the
+     * time at which they expire.  See throttle_group_take_budget().
+     * Accessed with atomic operations.
+     */
+    long budget_bytes[THROTTLE_MAX];
+    long budget_ops[THROTTLE_MAX];
+    int64_t budget_expiry_ns[THROTTLE_MAX];
+
     /* The following fields are protected by the ThrottleGroup lock.
      * See the ThrottleGroup documentation for details.
      * throttle_state tells us if I/O limits are configured. */
@@ -58,6 +58,8 @@ typedef uintptr_t ram_addr_t;
 /* memory API */
 
 void qemu_ram_remap(ram_addr_t addr);
+int qemu_ram_map_file_private(RAMBlock *block, int fd, off_t offset,
+                              Error **errp);
 /* This should not be used by devices.  */
 ram_addr_t qemu_ram_addr_from_host(void *ptr);
 ram_addr_t qemu_ram_addr_from_host_nofail(void *ptr);
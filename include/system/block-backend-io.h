@@ -124,6 +124,9 @@ int coroutine_fn blk_co_copy_range(BlockBackend *blk_in, int64_t off_in,
                                    int64_t bytes, BdrvRequestFlags read_flags,
                                    BdrvRequestFlags write_flags);
 
+int coroutine_fn blk_co_sendfile(BlockBackend *blk, int64_t offset,
+                                 int64_t bytes, int out_fd, bool throttle);
+
 int coroutine_fn blk_co_block_status_above(BlockBackend *blk,
                                            BlockDriverState *base,
                                            int64_t offset, int64_t bytes,
@@ -42,15 +42,35 @@ struct RAMBlock {
     uint64_t fd_offset;
     int guest_memfd;
     RamBlockAttributes *attributes;
+    /*
+     * Mapped copy-on-write from a file by qemu_ram_map_file_private(), so
+     * RAM discard stays disabled while the block exists
+     */
+    bool file_private;
     size_t page_size;
     /* dirty bitmap used during migration */
     unsigned long *bmap;
+    /*
+     * Below fields are only used when hot page deferral is enabled.  Both
+     * have one entry per word of @bmap.
+     */
+    /* consecutive bitmap syncs in which the pages of the word got dirty */
+    uint8_t *dirty_rounds;
+    /* dirty pages held back from @bmap until the final stage */
+    unsigned long *hot_bmap;
 
     /*
      * Below fields are only used by mapped-ram migration
      */
     /* bitmap of pages present in the migration file */
     unsigned long *file_bmap;
+    /* host pages not read in yet by a lazy load, on destination side */
+    unsigned long *lazy_bmap;
+    /*
+     * pages present in the migration file during a lazy load; kept apart
+     * from @file_bmap, which belongs to outgoing migration
+     */
+    unsigned long *lazy_file_bmap;
     /*
      * offset in the file pages belonging to this ramblock are saved,
      * used only during migration to a file.
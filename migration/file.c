@@ -9,6 +9,7 @@
 #include "system/ramblock.h"
 #include "qemu/cutils.h"
 #include "qemu/error-report.h"
+#include "qemu/madvise.h"
 #include "qapi/error.h"
 #include "channel.h"
 #include "file.h"
@@ -250,11 +251,29 @@ int file_write_ramblock_iov(QIOChannel *ioc, const struct iovec *iov,
     return (ret < 0) ? ret : 0;
 }
 
+/*
+ * Fault in the destination of a read in one go.  Otherwise every page of
+ * still unpopulated guest RAM takes its own fault while the kernel copies
+ * the data in, which dominates the restore time of large guests.  This is
+ * only an optimization, so errors (e.g. an older kernel) are ignored.
+ */
+static void file_populate_recv_buffer(void *buf, size_t size)
+{
+    uintptr_t start = QEMU_ALIGN_DOWN((uintptr_t)buf,
+                                      qemu_real_host_page_size());
+    uintptr_t end = QEMU_ALIGN_UP((uintptr_t)buf + size,
+                                  qemu_real_host_page_size());
+
+    qemu_madvise((void *)start, end - start, QEMU_MADV_POPULATE_WRITE);
+}
+
 int multifd_file_recv_data(MultiFDRecvParams *p, Error **errp)
 {
     MultiFDRecvData *data = p->data;
     size_t ret;
 
+    file_populate_recv_buffer(data->opaque, data->size);
+
     ret = qio_channel_pread(p->c, (char *) data->opaque,
                             data->size, data->file_offset, errp);
     if (ret != data->size) {
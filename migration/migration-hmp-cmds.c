@@ -65,6 +65,45 @@ static const gchar *format_time_str(uint64_t us)
     return g_strdup_printf("%"PRIu64" %s", us, units[index]);
 }
 
+static void migration_dump_downtime(Monitor *mon, MigrationInfo *info)
+{
+    DowntimeStats *stats = info->downtime_stats;
+    DowntimeDeviceStatsList *dev;
+
+    if (!stats) {
+        return;
+    }
+
+    monitor_printf(mon, "Downtime (us):");
+    if (stats->has_vm_stop) {
+        monitor_printf(mon, " vm_stop=%" PRId64, stats->vm_stop);
+    }
+    if (stats->has_bitmap_sync) {
+        monitor_printf(mon, " bitmap_sync=%" PRId64, stats->bitmap_sync);
+    }
+    if (stats->has_iterable_save) {
+        monitor_printf(mon, " iterable=%" PRId64, stats->iterable_save);
+    }
+    if (stats->has_non_iterable_save) {
+        monitor_printf(mon, " non_iterable=%" PRId64,
+                       stats->non_iterable_save);
+    }
+    if (stats->has_load) {
+        monitor_printf(mon, " load=%" PRId64, stats->load);
+    }
+    if (stats->has_start) {
+        monitor_printf(mon, " start=%" PRId64, stats->start);
+    }
+    monitor_printf(mon, "\n");
+
+    for (dev = stats->devices; dev; dev = dev->next) {
+        monitor_printf(mon, "  %s/%" PRIu32 "%s: %" PRId64 "\n",
+                       dev->value->idstr, dev->value->instance_id,
+                       dev->value->iterable ? " (iterable)" : "",
+                       dev->value->time);
+    }
+}
+
 static void migration_dump_blocktime(Monitor *mon, MigrationInfo *info)
 {
     if (info->has_postcopy_blocktime) {
@@ -243,6 +282,10 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
             monitor_printf(mon, ", zerocopy_fallbacks=%" PRIu64,
                            info->ram->dirty_sync_missed_zero_copy);
         }
+        if (info->ram->deferred_bytes) {
+            monitor_printf(mon, ", deferred_bytes=%" PRIu64,
+                           info->ram->deferred_bytes);
+        }
         monitor_printf(mon, "\n");
     }
 
@@ -285,6 +328,7 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
     }
 
     migration_dump_blocktime(mon, info);
+    migration_dump_downtime(mon, info);
 out:
     qapi_free_MigrationInfo(info);
 }
@@ -452,6 +496,16 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
 
         assert(params->has_cpr_exec_command);
         monitor_print_cpr_exec_command(mon, params->cpr_exec_command);
+
+        assert(params->has_hot_page_rounds);
+        monitor_printf(mon, "%s: %u\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_HOT_PAGE_ROUNDS),
+            params->hot_page_rounds);
+
+        assert(params->has_postcopy_prefetch_pages);
+        monitor_printf(mon, "%s: %u\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_POSTCOPY_PREFETCH_PAGES),
+            params->postcopy_prefetch_pages);
     }
 
     qapi_free_MigrationParameters(params);
@@ -754,6 +808,14 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
         p->has_cpr_exec_command = true;
         break;
     }
+    case MIGRATION_PARAMETER_HOT_PAGE_ROUNDS:
+        p->has_hot_page_rounds = true;
+        visit_type_uint8(v, param, &p->hot_page_rounds, &err);
+        break;
+    case MIGRATION_PARAMETER_POSTCOPY_PREFETCH_PAGES:
+        p->has_postcopy_prefetch_pages = true;
+        visit_type_uint8(v, param, &p->postcopy_prefetch_pages, &err);
+        break;
     default:
         g_assert_not_reached();
     }
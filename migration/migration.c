@@ -113,6 +113,8 @@ static void migration_downtime_start(MigrationState *s)
 {
     trace_vmstate_downtime_checkpoint("src-downtime-start");
     s->downtime_start = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    qapi_free_DowntimeStats(s->downtime_stats);
+    s->downtime_stats = g_new0(DowntimeStats, 1);
 }
 
 /*
@@ -150,6 +152,114 @@ static void migration_downtime_end(MigrationState *s)
     }
 }
 
+void migration_downtime_add_device(DowntimeStats *stats, const char *idstr,
+                                   uint32_t instance_id, bool iterable,
+                                   int64_t time)
+{
+    DowntimeDeviceStats *dev = g_new0(DowntimeDeviceStats, 1);
+
+    dev->idstr = g_strdup(idstr);
+    dev->instance_id = instance_id;
+    dev->iterable = iterable;
+    dev->time = time;
+    QAPI_LIST_PREPEND(stats->devices, dev);
+}
+
+/* Called after each precopy dirty bitmap sync, @time is in microseconds */
+void migration_record_bitmap_sync(int64_t time, bool last_stage)
+{
+    MigrationState *s = migrate_get_current();
+
+    s->bitmap_sync_time = time;
+    if (last_stage && s->downtime_stats) {
+        s->downtime_stats->has_bitmap_sync = true;
+        s->downtime_stats->bitmap_sync = time;
+    }
+}
+
+void migration_incoming_record_load(MigrationIncomingState *mis,
+                                    const char *idstr, uint32_t instance_id,
+                                    bool iterable, int64_t time)
+{
+    /*
+     * Neither COLO checkpoints nor loadvm are part of a migration downtime;
+     * recording them would grow the device list without bound
+     */
+    switch (qatomic_read(&mis->state)) {
+    case MIGRATION_STATUS_ACTIVE:
+    case MIGRATION_STATUS_POSTCOPY_DEVICE:
+    case MIGRATION_STATUS_POSTCOPY_ACTIVE:
+        break;
+    default:
+        return;
+    }
+    if (migration_incoming_in_colo_state()) {
+        return;
+    }
+
+    QEMU_LOCK_GUARD(&mis->downtime_stats_lock);
+
+    if (!mis->downtime_stats) {
+        mis->downtime_stats = g_new0(DowntimeStats, 1);
+        mis->downtime_stats->has_load = true;
+    }
+    mis->downtime_stats->load += time;
+    migration_downtime_add_device(mis->downtime_stats, idstr, instance_id,
+                                  iterable, time);
+}
+
+/* Record the time from @start_time (us) until the guest runs */
+void migration_incoming_record_start(MigrationIncomingState *mis,
+                                     int64_t start_time)
+{
+    QEMU_LOCK_GUARD(&mis->downtime_stats_lock);
+
+    if (mis->downtime_stats) {
+        mis->downtime_stats->has_start = true;
+        mis->downtime_stats->start =
+            qemu_clock_get_us(QEMU_CLOCK_REALTIME) - start_time;
+    }
+}
+
+/*
+ * Remember what the switchover cost besides sending the remaining data,
+ * for predictive-switchover in later migrations.
+ */
+static void migration_switchover_cost_update(MigrationState *s)
+{
+    DowntimeStats *stats = s->downtime_stats;
+
+    if (stats && stats->has_non_iterable_save) {
+        s->switchover_cost = stats->vm_stop + stats->non_iterable_save;
+    }
+}
+
+/*
+ * Part of the downtime that does not depend on the amount of dirty data
+ * (ms), as measured by the latest bitmap sync and switchover.  Only
+ * accounted for with predictive-switchover.
+ */
+static int64_t migration_switchover_fixed_cost(MigrationState *s)
+{
+    if (!migrate_predictive_switchover()) {
+        return 0;
+    }
+
+    return (s->bitmap_sync_time + s->switchover_cost) / 1000;
+}
+
+/*
+ * Time left to send the remaining data within the downtime limit (ms).
+ * A tenth of the limit is always left, so that migration can still
+ * converge when the fixed cost alone exceeds it.
+ */
+static int64_t migration_switchover_budget(MigrationState *s)
+{
+    int64_t limit = migrate_downtime_limit();
+
+    return MAX(limit - migration_switchover_fixed_cost(s), limit / 10);
+}
+
 static void precopy_notify_complete(void)
 {
     Error *local_err = NULL;
@@ -285,15 +395,20 @@ static gint page_request_addr_cmp(gconstpointer ap, gconstpointer bp)
 
 static int migration_stop_vm(MigrationState *s, RunState state)
 {
+    int64_t start_time;
     int ret;
 
     migration_downtime_start(s);
+    start_time = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
 
     s->vm_old_state = runstate_get();
     global_state_store();
 
     ret = vm_stop_force_state(state);
 
+    s->downtime_stats->has_vm_stop = true;
+    s->downtime_stats->vm_stop = qemu_clock_get_us(QEMU_CLOCK_REALTIME) -
+                                 start_time;
     trace_vmstate_downtime_checkpoint("src-vm-stopped");
     trace_migration_completion_vm_stop(ret);
 
@@ -325,6 +440,7 @@ void migration_object_init(void)
 
     qemu_mutex_init(&current_incoming->page_request_mutex);
     qemu_cond_init(&current_incoming->page_request_cond);
+    qemu_mutex_init(&current_incoming->downtime_stats_lock);
     current_incoming->page_requested = g_tree_new(page_request_addr_cmp);
 
     current_incoming->exit_on_error = INMIGRATE_DEFAULT_EXIT_ON_ERROR;
@@ -540,12 +656,12 @@ static int migrate_send_rp_message(MigrationIncomingState *mis,
  *   Start: Address offset within the RB
  *   Len: Length in bytes required - must be a multiple of pagesize
  */
-int migrate_send_rp_message_req_pages(MigrationIncomingState *mis,
-                                      RAMBlock *rb, ram_addr_t start)
+static int migrate_send_rp_message_req_range(MigrationIncomingState *mis,
+                                             RAMBlock *rb, ram_addr_t start,
+                                             uint32_t len)
 {
     uint8_t bufc[12 + 1 + 255]; /* start (8), len (4), rbname up to 256 */
     size_t msglen = 12; /* start + len */
-    size_t len = qemu_ram_pagesize(rb);
     enum mig_rp_message_type msg_type;
     const char *rbname;
     int rbname_len;
@@ -577,6 +693,26 @@ int migrate_send_rp_message_req_pages(MigrationIncomingState *mis,
     return migrate_send_rp_message(mis, msg_type, msglen, bufc);
 }
 
+int migrate_send_rp_message_req_pages(MigrationIncomingState *mis,
+                                      RAMBlock *rb, ram_addr_t start)
+{
+    return migrate_send_rp_message_req_range(mis, rb, start,
+                                             qemu_ram_pagesize(rb));
+}
+
+/*
+ * Ask the source for pages nobody faulted on yet.  Unlike
+ * migrate_send_rp_req_pages(), they are neither tracked in page_requested
+ * nor accounted as blocktime; the source skips those it already sent.
+ * Only called within the postcopy ram fault thread.
+ */
+int migrate_send_rp_prefetch_pages(MigrationIncomingState *mis,
+                                   RAMBlock *rb, ram_addr_t start,
+                                   uint32_t len)
+{
+    return migrate_send_rp_message_req_range(mis, rb, start, len);
+}
+
 int migrate_send_rp_req_pages(MigrationIncomingState *mis,
                               RAMBlock *rb, ram_addr_t start, uint64_t haddr,
                               uint32_t tid)
@@ -739,6 +875,10 @@ migration_incoming_state_setup(MigrationIncomingState *mis, Error **errp)
         return false;
     }
 
+    WITH_QEMU_LOCK_GUARD(&mis->downtime_stats_lock) {
+        g_clear_pointer(&mis->downtime_stats, qapi_free_DowntimeStats);
+    }
+
     migrate_set_state(&mis->state, current, MIGRATION_STATUS_SETUP);
     return true;
 }
@@ -814,6 +954,7 @@ static void qemu_start_incoming_migration(const char *uri, bool has_channels,
 static void process_incoming_migration_bh(void *opaque)
 {
     MigrationIncomingState *mis = opaque;
+    int64_t start_time = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
 
     trace_vmstate_downtime_checkpoint("dst-precopy-bh-enter");
 
@@ -855,6 +996,7 @@ static void process_incoming_migration_bh(void *opaque)
     } else {
         runstate_set(global_state_get_runstate());
     }
+    migration_incoming_record_start(mis, start_time);
     trace_vmstate_downtime_checkpoint("dst-precopy-bh-vm-started");
     /*
      * This must happen after any state changes since as soon as an external
@@ -1255,6 +1397,12 @@ static void populate_time_info(MigrationInfo *info, MigrationState *s)
     if (migrate_show_downtime(s)) {
         info->has_downtime = true;
         info->downtime = s->downtime;
+        if (s->downtime_stats) {
+            /* Replaces what an earlier incoming migration reported */
+            qapi_free_DowntimeStats(info->downtime_stats);
+            info->downtime_stats = QAPI_CLONE(DowntimeStats,
+                                              s->downtime_stats);
+        }
     } else {
         info->has_expected_downtime = true;
         info->expected_downtime = s->expected_downtime;
@@ -1284,6 +1432,7 @@ static void populate_ram_info(MigrationInfo *info, MigrationState *s)
     info->ram->precopy_bytes = stat64_get(&mig_stats.precopy_bytes);
     info->ram->downtime_bytes = stat64_get(&mig_stats.downtime_bytes);
     info->ram->postcopy_bytes = stat64_get(&mig_stats.postcopy_bytes);
+    info->ram->deferred_bytes = ram_bytes_deferred();
 
     if (migrate_xbzrle()) {
         info->xbzrle_cache = g_malloc0(sizeof(*info->xbzrle_cache));
@@ -1422,6 +1571,13 @@ static void fill_destination_migration_info(MigrationInfo *info)
     }
     info->status = mis->state;
 
+    WITH_QEMU_LOCK_GUARD(&mis->downtime_stats_lock) {
+        if (mis->downtime_stats) {
+            info->downtime_stats = QAPI_CLONE(DowntimeStats,
+                                              mis->downtime_stats);
+        }
+    }
+
     if (!info->error_desc) {
         MigrationState *s = migrate_get_current();
         QEMU_LOCK_GUARD(&s->error_mutex);
@@ -1813,6 +1969,8 @@ int migrate_init(MigrationState *s, Error **errp)
     s->pages_per_second = 0.0;
     s->downtime = 0;
     s->expected_downtime = 0;
+    g_clear_pointer(&s->downtime_stats, qapi_free_DowntimeStats);
+    s->bitmap_sync_time = 0;
     s->setup_time = 0;
     s->start_postcopy = false;
     s->migration_thread_running = false;
@@ -3025,6 +3183,7 @@ static int migration_completion_precopy(MigrationState *s)
     }
 
     ret = qemu_savevm_state_complete_precopy(s->to_dst_file, false);
+    migration_switchover_cost_update(s);
 out_unlock:
     bql_unlock();
     return ret;
@@ -3415,7 +3574,7 @@ static void migration_update_counters(MigrationState *s,
         expected_bw_per_ms = bandwidth;
     }
 
-    s->threshold_size = expected_bw_per_ms * migrate_downtime_limit();
+    s->threshold_size = expected_bw_per_ms * migration_switchover_budget(s);
 
     s->mbps = (((double) transferred * 8.0) /
                ((double) time_spent / 1000.0)) / 1000.0 / 1000.0;
@@ -3432,7 +3591,8 @@ static void migration_update_counters(MigrationState *s,
     if (stat64_get(&mig_stats.dirty_pages_rate) &&
         transferred > 10000) {
         s->expected_downtime =
-            stat64_get(&mig_stats.dirty_bytes_last_sync) / expected_bw_per_ms;
+            stat64_get(&mig_stats.dirty_bytes_last_sync) / expected_bw_per_ms +
+            migration_switchover_fixed_cost(s);
     }
 
     migration_rate_reset();
@@ -4157,6 +4317,7 @@ static void migration_instance_finalize(Object *obj)
     qemu_sem_destroy(&ms->rp_state.rp_pong_acks);
     qemu_sem_destroy(&ms->postcopy_qemufile_src_sem);
     error_free(ms->error);
+    qapi_free_DowntimeStats(ms->downtime_stats);
     qemu_event_destroy(&ms->postcopy_package_loaded_event);
 }
 
@@ -249,6 +249,14 @@ struct MigrationIncomingState {
 
     /* Do exit on incoming migration failure */
     bool exit_on_error;
+
+    /*
+     * Breakdown of the downtime on this side, created when the first
+     * device state is loaded.  Protected by downtime_stats_lock, since
+     * the postcopy listen thread loads without the BQL.
+     */
+    DowntimeStats *downtime_stats;
+    QemuMutex downtime_stats_lock;
 };
 
 MigrationIncomingState *migration_incoming_get_current(void);
@@ -359,6 +367,16 @@ struct MigrationState {
     int64_t downtime_start;
     int64_t downtime;
     int64_t expected_downtime;
+    /* Breakdown of the latest downtime, created when the VM is stopped */
+    DowntimeStats *downtime_stats;
+    /* Duration of the latest dirty bitmap sync (us) */
+    int64_t bitmap_sync_time;
+    /*
+     * Time spent stopping the VM and saving non-iterable devices during
+     * the latest switchover (us).  Unlike the above, this is kept across
+     * migrations, for predictive-switchover.
+     */
+    int64_t switchover_cost;
     bool capabilities[MIGRATION_CAPABILITY__MAX];
     int64_t setup_time;
 
@@ -553,6 +571,9 @@ int migrate_send_rp_req_pages(MigrationIncomingState *mis, RAMBlock *rb,
                               ram_addr_t start, uint64_t haddr, uint32_t tid);
 int migrate_send_rp_message_req_pages(MigrationIncomingState *mis,
                                       RAMBlock *rb, ram_addr_t start);
+int migrate_send_rp_prefetch_pages(MigrationIncomingState *mis,
+                                   RAMBlock *rb, ram_addr_t start,
+                                   uint32_t len);
 void migrate_send_rp_recv_bitmap(MigrationIncomingState *mis,
                                  char *block_name);
 void migrate_send_rp_resume_ack(MigrationIncomingState *mis, uint32_t value);
@@ -574,6 +595,15 @@ void migration_make_urgent_request(void);
 void migration_consume_urgent_request(void);
 bool migration_rate_limit(void);
 void migration_bh_schedule(QEMUBHFunc *cb, void *opaque);
+void migration_downtime_add_device(DowntimeStats *stats, const char *idstr,
+                                   uint32_t instance_id, bool iterable,
+                                   int64_t time);
+void migration_record_bitmap_sync(int64_t time, bool last_stage);
+void migration_incoming_record_load(MigrationIncomingState *mis,
+                                    const char *idstr, uint32_t instance_id,
+                                    bool iterable, int64_t time);
+void migration_incoming_record_start(MigrationIncomingState *mis,
+                                     int64_t start_time);
 void migration_cancel(void);
 
 void migration_populate_vfio_info(MigrationInfo *info);
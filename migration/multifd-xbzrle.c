@@ -0,0 +1,368 @@
+/*
+ * Multifd XBZRLE delta encoding implementation
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include "qemu/host-utils.h"
+#include "qemu/lockable.h"
+#include "qemu/rcu.h"
+#include "system/ramblock.h"
+#include "exec/target_page.h"
+#include "qapi/error.h"
+#include "migration.h"
+#include "migration-stats.h"
+#include "trace.h"
+#include "options.h"
+#include "page_cache.h"
+#include "xbzrle.h"
+#include "multifd.h"
+
+/*
+ * Packet payload: one big endian 32-bit header per normal page, followed
+ * by the data of all pages.  The header holds the length of the delta for
+ * that page, 0 if the page did not change, or MULTIFD_XBZRLE_RAW if the
+ * whole page follows.
+ */
+#define MULTIFD_XBZRLE_RAW  (1U << 31)
+
+/*
+ * The XBZRLE cache is split in one partition per channel, indexed by page
+ * number.  A channel allocates and frees its own partition, but encodes
+ * pages from any partition, so each one has its own lock.
+ */
+typedef struct MultiFDXbzrlePart {
+    QemuMutex lock;
+    PageCache *cache;
+} MultiFDXbzrlePart;
+
+static struct {
+    MultiFDXbzrlePart *parts;
+    uint32_t nr_parts;
+    uint32_t users;
+} multifd_xbzrle;
+
+struct xbzrle_data {
+    /* copy of the page being encoded, stable against guest writes */
+    uint8_t *current;
+    /* contents the cache is updated with for zero pages */
+    uint8_t *zero;
+    /* packet payload */
+    uint8_t *buf;
+    /* size of packet payload buffer */
+    uint32_t buf_len;
+};
+
+static uint32_t multifd_xbzrle_buf_len(void)
+{
+    return multifd_ram_page_count() *
+           (sizeof(uint32_t) + multifd_ram_page_size());
+}
+
+/* Find the partition owning @addr and the key of @addr inside of it */
+static MultiFDXbzrlePart *multifd_xbzrle_part(ram_addr_t addr, uint64_t *key)
+{
+    uint32_t page_size = multifd_ram_page_size();
+    uint64_t page = addr / page_size;
+
+    *key = (page / multifd_xbzrle.nr_parts) * page_size;
+    return &multifd_xbzrle.parts[page % multifd_xbzrle.nr_parts];
+}
+
+/* Multifd XBZRLE delta encoding */
+
+static int multifd_xbzrle_send_setup(MultiFDSendParams *p, Error **errp)
+{
+    uint32_t page_size = multifd_ram_page_size();
+    MultiFDXbzrlePart *part;
+    struct xbzrle_data *x;
+    uint64_t part_size;
+
+    if (!multifd_xbzrle.parts) {
+        multifd_xbzrle.nr_parts = migrate_multifd_channels();
+        multifd_xbzrle.parts = g_new0(MultiFDXbzrlePart,
+                                      multifd_xbzrle.nr_parts);
+    }
+
+    /* PageCache wants a power of two number of pages */
+    part_size = migrate_xbzrle_cache_size() / multifd_xbzrle.nr_parts;
+    part_size = pow2floor(MAX(part_size / page_size, 1)) * page_size;
+
+    part = &multifd_xbzrle.parts[p->id];
+    part->cache = cache_init(part_size, page_size, errp);
+    if (!part->cache) {
+        error_prepend(errp, "multifd %u: ", p->id);
+        if (!multifd_xbzrle.users) {
+            g_clear_pointer(&multifd_xbzrle.parts, g_free);
+        }
+        return -1;
+    }
+    qemu_mutex_init(&part->lock);
+    multifd_xbzrle.users++;
+
+    x = g_new0(struct xbzrle_data, 1);
+    x->current = g_malloc(page_size);
+    x->zero = g_malloc0(page_size);
+    x->buf_len = multifd_xbzrle_buf_len();
+    x->buf = g_malloc(x->buf_len);
+    p->compress_data = x;
+
+    /* Needs 2 IOVs, one for packet header and one for the payload */
+    p->iov = g_new0(struct iovec, 2);
+    return 0;
+}
+
+static void multifd_xbzrle_send_cleanup(MultiFDSendParams *p, Error **errp)
+{
+    struct xbzrle_data *x = p->compress_data;
+    MultiFDXbzrlePart *part;
+
+    if (!x) {
+        return;
+    }
+
+    part = &multifd_xbzrle.parts[p->id];
+    cache_fini(part->cache);
+    part->cache = NULL;
+    qemu_mutex_destroy(&part->lock);
+    if (--multifd_xbzrle.users == 0) {
+        g_free(multifd_xbzrle.parts);
+        multifd_xbzrle.parts = NULL;
+        multifd_xbzrle.nr_parts = 0;
+    }
+
+    g_free(x->current);
+    g_free(x->zero);
+    g_free(x->buf);
+    g_free(p->compress_data);
+    p->compress_data = NULL;
+
+    g_free(p->iov);
+    p->iov = NULL;
+}
+
+/*
+ * Like xbzrle_cache_zero_page(): the destination zeroes the page, so any
+ * older contents in the cache must go.
+ */
+static void multifd_xbzrle_cache_zero_page(struct xbzrle_data *x,
+                                           ram_addr_t addr,
+                                           uint64_t generation)
+{
+    MultiFDXbzrlePart *part;
+    uint64_t key;
+
+    part = multifd_xbzrle_part(addr, &key);
+
+    QEMU_LOCK_GUARD(&part->lock);
+    cache_insert(part->cache, key, x->zero, generation);
+}
+
+/*
+ * Encode one page into @dst, following save_xbzrle_page().  Returns the
+ * header for the page; the amount of data written to @dst is the page size
+ * for MULTIFD_XBZRLE_RAW and the header itself otherwise.
+ */
+static uint32_t multifd_xbzrle_encode_page(struct xbzrle_data *x,
+                                           ram_addr_t addr, uint8_t *host,
+                                           uint8_t *dst, uint64_t generation)
+{
+    uint32_t page_size = multifd_ram_page_size();
+    MultiFDXbzrlePart *part;
+    uint8_t *cached;
+    uint64_t key;
+    int len;
+
+    part = multifd_xbzrle_part(addr, &key);
+
+    QEMU_LOCK_GUARD(&part->lock);
+
+    if (!cache_is_cached(part->cache, key, generation)) {
+        if (cache_insert(part->cache, key, host, generation) == 0) {
+            /* Send what was cached, the guest may have changed it since */
+            host = get_cached_data(part->cache, key);
+        }
+        memcpy(dst, host, page_size);
+        return MULTIFD_XBZRLE_RAW;
+    }
+
+    cached = get_cached_data(part->cache, key);
+    memcpy(x->current, host, page_size);
+
+    len = xbzrle_encode_buffer(cached, x->current, page_size, dst, page_size);
+    if (len == 0) {
+        return 0;
+    }
+
+    memcpy(cached, x->current, page_size);
+    if (len == -1) {
+        memcpy(dst, x->current, page_size);
+        return MULTIFD_XBZRLE_RAW;
+    }
+
+    return len;
+}
+
+static int multifd_xbzrle_send_prepare(MultiFDSendParams *p, Error **errp)
+{
+    MultiFDPages_t *pages = &p->data->u.ram;
+    struct xbzrle_data *x = p->compress_data;
+    uint32_t page_size = multifd_ram_page_size();
+    uint64_t generation = stat64_get(&mig_stats.dirty_sync_count);
+    /*
+     * Like rs->xbzrle_started: every page is sent during the first round
+     * anyway, so filling the cache then would only thrash it.
+     */
+    bool started = generation > 1;
+    uint32_t deltas = 0;
+    uint32_t size;
+    uint32_t i;
+
+    if (!multifd_send_prepare_common(p)) {
+        goto zero;
+    }
+
+    size = pages->normal_num * sizeof(uint32_t);
+    for (i = 0; i < pages->normal_num; i++) {
+        ram_addr_t offset = pages->offset[i];
+        uint8_t *host = pages->block->host + offset;
+        uint32_t hdr = MULTIFD_XBZRLE_RAW;
+
+        if (started) {
+            hdr = multifd_xbzrle_encode_page(x, pages->block->offset + offset,
+                                             host, x->buf + size, generation);
+        } else {
+            memcpy(x->buf + size, host, page_size);
+        }
+
+        stl_be_p(x->buf + i * sizeof(uint32_t), hdr);
+        if (hdr == MULTIFD_XBZRLE_RAW) {
+            size += page_size;
+        } else {
+            size += hdr;
+            deltas++;
+        }
+    }
+
+    p->iov[p->iovs_num].iov_base = x->buf;
+    p->iov[p->iovs_num].iov_len = size;
+    p->iovs_num++;
+    p->next_packet_size = size;
+    trace_multifd_xbzrle_send(p->id, pages->normal_num, deltas, size);
+
+zero:
+    if (started) {
+        for (i = pages->normal_num; i < pages->num; i++) {
+            multifd_xbzrle_cache_zero_page(x, pages->block->offset +
+                                           pages->offset[i], generation);
+        }
+    }
+
+    p->flags |= MULTIFD_FLAG_XBZRLE;
+    multifd_send_fill_packet(p);
+    return 0;
+}
+
+static int multifd_xbzrle_recv_setup(MultiFDRecvParams *p, Error **errp)
+{
+    struct xbzrle_data *x = g_new0(struct xbzrle_data, 1);
+
+    x->buf_len = multifd_xbzrle_buf_len();
+    x->buf = g_malloc(x->buf_len);
+    p->compress_data = x;
+    return 0;
+}
+
+static void multifd_xbzrle_recv_cleanup(MultiFDRecvParams *p)
+{
+    struct xbzrle_data *x = p->compress_data;
+
+    g_free(x->buf);
+    g_free(p->compress_data);
+    p->compress_data = NULL;
+}
+
+static int multifd_xbzrle_recv(MultiFDRecvParams *p, Error **errp)
+{
+    struct xbzrle_data *x = p->compress_data;
+    uint32_t in_size = p->next_packet_size;
+    uint32_t page_size = multifd_ram_page_size();
+    uint32_t flags = p->flags & MULTIFD_FLAG_COMPRESSION_MASK;
+    uint32_t pos = p->normal_num * sizeof(uint32_t);
+    int ret;
+    int i;
+
+    if (flags != MULTIFD_FLAG_XBZRLE) {
+        error_setg(errp, "multifd %u: flags received %x flags expected %x",
+                   p->id, flags, MULTIFD_FLAG_XBZRLE);
+        return -1;
+    }
+
+    multifd_recv_zero_page_process(p);
+
+    if (!p->normal_num) {
+        assert(in_size == 0);
+        return 0;
+    }
+
+    if (in_size < pos || in_size > x->buf_len) {
+        error_setg(errp, "multifd %u: invalid packet size %u for %u pages",
+                   p->id, in_size, p->normal_num);
+        return -1;
+    }
+
+    ret = qio_channel_read_all(p->c, (void *)x->buf, in_size, errp);
+    if (ret != 0) {
+        return ret;
+    }
+
+    for (i = 0; i < p->normal_num; i++) {
+        uint32_t hdr = ldl_be_p(x->buf + i * sizeof(uint32_t));
+        uint32_t len = hdr == MULTIFD_XBZRLE_RAW ? page_size : hdr;
+        uint8_t *host = p->host + p->normal[i];
+
+        if (len > page_size || len > in_size - pos) {
+            error_setg(errp, "multifd %u: page %d overruns the packet",
+                       p->id, i);
+            return -1;
+        }
+
+        ramblock_recv_bitmap_set_offset(p->block, p->normal[i]);
+        if (hdr == MULTIFD_XBZRLE_RAW) {
+            memcpy(host, x->buf + pos, page_size);
+        } else if (len &&
+                   xbzrle_decode_buffer(x->buf + pos, len, host,
+                                        page_size) < 0) {
+            error_setg(errp, "multifd %u: failed to decode page %d",
+                       p->id, i);
+            return -1;
+        }
+        pos += len;
+    }
+
+    if (pos != in_size) {
+        error_setg(errp, "multifd %u: packet size received %u size used %u",
+                   p->id, in_size, pos);
+        return -1;
+    }
+    return 0;
+}
+
+static const MultiFDMethods multifd_xbzrle_ops = {
+    .send_setup = multifd_xbzrle_send_setup,
+    .send_cleanup = multifd_xbzrle_send_cleanup,
+    .send_prepare = multifd_xbzrle_send_prepare,
+    .recv_setup = multifd_xbzrle_recv_setup,
+    .recv_cleanup = multifd_xbzrle_recv_cleanup,
+    .recv = multifd_xbzrle_recv
+};
+
+static void multifd_xbzrle_register(void)
+{
+    multifd_register_ops(MULTIFD_COMPRESSION_XBZRLE, &multifd_xbzrle_ops);
+}
+
+migration_init(multifd_xbzrle_register);
@@ -33,8 +33,34 @@ struct zstd_data {
     uint8_t *zbuff;
     /* size of compressed buffer */
     uint32_t zbuff_len;
+    /*
+     * zstd-adaptive only: last compressed size seen for each region of
+     * guest memory, in percent of the uncompressed size; 0 if unknown.
+     */
+    uint8_t *ratio;
+    /* zstd-adaptive only: packets sent, to schedule probes */
+    uint64_t packets;
 };
 
+/*
+ * zstd-adaptive keeps one ratio per 64 MiB of guest memory, hashed into a
+ * fixed size table.  Regions that compress to more than RAW_PERCENT of
+ * their size are sent uncompressed, and probed again with the fast level
+ * every PROBE_INTERVAL packets; those that compress below STRONG_PERCENT
+ * use multifd-zstd-level, everything else the fast level.
+ */
+#define ZSTD_ADAPTIVE_REGION_SHIFT      26
+#define ZSTD_ADAPTIVE_REGIONS           1024
+#define ZSTD_ADAPTIVE_RAW_PERCENT       90
+#define ZSTD_ADAPTIVE_STRONG_PERCENT    50
+#define ZSTD_ADAPTIVE_PROBE_INTERVAL    16
+#define ZSTD_ADAPTIVE_FAST_LEVEL        (-1)
+
+static bool multifd_zstd_adaptive(void)
+{
+    return migrate_multifd_compression() == MULTIFD_COMPRESSION_ZSTD_ADAPTIVE;
+}
+
 /* Multifd zstd compression */
 
 static int multifd_zstd_send_setup(MultiFDSendParams *p, Error **errp)
@@ -68,6 +94,13 @@ static int multifd_zstd_send_setup(MultiFDSendParams *p, Error **errp)
     }
     p->compress_data = z;
 
+    if (multifd_zstd_adaptive()) {
+        z->ratio = g_new0(uint8_t, ZSTD_ADAPTIVE_REGIONS);
+        /* Uncompressed packets need one IOV per page plus the header */
+        p->iov = g_new0(struct iovec, multifd_ram_page_count() + 1);
+        return 0;
+    }
+
     /* Needs 2 IOVs, one for packet header and one for compressed data */
     p->iov = g_new0(struct iovec, 2);
     return 0;
@@ -81,6 +114,8 @@ static void multifd_zstd_send_cleanup(MultiFDSendParams *p, Error **errp)
     z->zcs = NULL;
     g_free(z->zbuff);
     z->zbuff = NULL;
+    g_free(z->ratio);
+    z->ratio = NULL;
     g_free(p->compress_data);
     p->compress_data = NULL;
 
@@ -147,6 +182,128 @@ out:
     return 0;
 }
 
+static uint8_t *multifd_zstd_adaptive_ratio(struct zstd_data *z,
+                                            MultiFDPages_t *pages)
+{
+    ram_addr_t addr = pages->block->offset + pages->offset[0];
+
+    return &z->ratio[(addr >> ZSTD_ADAPTIVE_REGION_SHIFT) %
+                     ZSTD_ADAPTIVE_REGIONS];
+}
+
+/*
+ * Compress the normal pages of the packet into an independent zstd frame,
+ * so that the level can change from one packet to the next.
+ */
+static int multifd_zstd_adaptive_compress(MultiFDSendParams *p, int level,
+                                          Error **errp)
+{
+    MultiFDPages_t *pages = &p->data->u.ram;
+    struct zstd_data *z = p->compress_data;
+    size_t ret;
+    uint32_t i;
+
+    ZSTD_CCtx_reset(z->zcs, ZSTD_reset_session_only);
+    ret = ZSTD_CCtx_setParameter(z->zcs, ZSTD_c_compressionLevel, level);
+    if (ZSTD_isError(ret)) {
+        error_setg(errp, "multifd %u: setting zstd level %d failed: %s",
+                   p->id, level, ZSTD_getErrorName(ret));
+        return -1;
+    }
+
+    z->out.dst = z->zbuff;
+    z->out.size = z->zbuff_len;
+    z->out.pos = 0;
+
+    for (i = 0; i < pages->normal_num; i++) {
+        ZSTD_EndDirective end = ZSTD_e_continue;
+
+        if (i == pages->normal_num - 1) {
+            end = ZSTD_e_end;
+        }
+        z->in.src = pages->block->host + pages->offset[i];
+        z->in.size = multifd_ram_page_size();
+        z->in.pos = 0;
+
+        do {
+            ret = ZSTD_compressStream2(z->zcs, &z->out, &z->in, end);
+        } while (!ZSTD_isError(ret) && ret > 0 &&
+                 (z->in.size > z->in.pos || end == ZSTD_e_end) &&
+                 z->out.size > z->out.pos);
+        if (ZSTD_isError(ret)) {
+            error_setg(errp, "multifd %u: compressStream error %s",
+                       p->id, ZSTD_getErrorName(ret));
+            return -1;
+        }
+        if (ret > 0 && (z->in.size > z->in.pos || end == ZSTD_e_end)) {
+            error_setg(errp, "multifd %u: compressStream buffer too small",
+                       p->id);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int multifd_zstd_adaptive_send_prepare(MultiFDSendParams *p,
+                                              Error **errp)
+{
+    MultiFDPages_t *pages = &p->data->u.ram;
+    struct zstd_data *z = p->compress_data;
+    uint32_t page_size = multifd_ram_page_size();
+    uint32_t size;
+    uint8_t *ratio;
+    int level;
+
+    if (!multifd_send_prepare_common(p)) {
+        p->flags |= MULTIFD_FLAG_ZSTD;
+        goto out;
+    }
+
+    size = pages->normal_num * page_size;
+    ratio = multifd_zstd_adaptive_ratio(z, pages);
+    z->packets++;
+
+    if (*ratio > ZSTD_ADAPTIVE_RAW_PERCENT &&
+        z->packets % ZSTD_ADAPTIVE_PROBE_INTERVAL) {
+        goto raw;
+    }
+
+    level = ZSTD_ADAPTIVE_FAST_LEVEL;
+    if (*ratio && *ratio < ZSTD_ADAPTIVE_STRONG_PERCENT) {
+        level = MAX(migrate_multifd_zstd_level(), ZSTD_ADAPTIVE_FAST_LEVEL);
+    }
+
+    if (multifd_zstd_adaptive_compress(p, level, errp)) {
+        return -1;
+    }
+
+    *ratio = MAX(DIV_ROUND_UP((uint64_t)z->out.pos * 100, size), 1);
+    if (z->out.pos >= size) {
+        goto raw;
+    }
+
+    p->iov[p->iovs_num].iov_base = z->zbuff;
+    p->iov[p->iovs_num].iov_len = z->out.pos;
+    p->iovs_num++;
+    p->next_packet_size = z->out.pos;
+    p->flags |= MULTIFD_FLAG_ZSTD;
+    goto out;
+
+raw:
+    for (uint32_t i = 0; i < pages->normal_num; i++) {
+        p->iov[p->iovs_num].iov_base = pages->block->host + pages->offset[i];
+        p->iov[p->iovs_num].iov_len = page_size;
+        p->iovs_num++;
+    }
+    p->next_packet_size = size;
+    p->flags |= MULTIFD_FLAG_NOCOMP;
+
+out:
+    multifd_send_fill_packet(p);
+    return 0;
+}
+
 static int multifd_zstd_recv_setup(MultiFDRecvParams *p, Error **errp)
 {
     struct zstd_data *z = g_new0(struct zstd_data, 1);
@@ -178,6 +335,11 @@ static int multifd_zstd_recv_setup(MultiFDRecvParams *p, Error **errp)
         error_setg(errp, "multifd %u: out of memory for zbuff", p->id);
         return -1;
     }
+
+    if (multifd_zstd_adaptive()) {
+        /* Uncompressed packets are read straight into guest memory */
+        p->iov = g_new0(struct iovec, multifd_ram_page_count());
+    }
     return 0;
 }
 
@@ -191,32 +353,21 @@ static void multifd_zstd_recv_cleanup(MultiFDRecvParams *p)
     z->zbuff = NULL;
     g_free(p->compress_data);
     p->compress_data = NULL;
+
+    g_free(p->iov);
+    p->iov = NULL;
 }
 
-static int multifd_zstd_recv(MultiFDRecvParams *p, Error **errp)
+static int multifd_zstd_recv_pages(MultiFDRecvParams *p, Error **errp)
 {
     uint32_t in_size = p->next_packet_size;
     uint32_t out_size = 0;
     uint32_t page_size = multifd_ram_page_size();
     uint32_t expected_size = p->normal_num * page_size;
-    uint32_t flags = p->flags & MULTIFD_FLAG_COMPRESSION_MASK;
     struct zstd_data *z = p->compress_data;
     int ret;
     int i;
 
-    if (flags != MULTIFD_FLAG_ZSTD) {
-        error_setg(errp, "multifd %u: flags received %x flags expected %x",
-                   p->id, flags, MULTIFD_FLAG_ZSTD);
-        return -1;
-    }
-
-    multifd_recv_zero_page_process(p);
-
-    if (!p->normal_num) {
-        assert(in_size == 0);
-        return 0;
-    }
-
     ret = qio_channel_read_all(p->c, (void *)z->zbuff, in_size, errp);
 
     if (ret != 0) {
@@ -265,6 +416,59 @@ static int multifd_zstd_recv(MultiFDRecvParams *p, Error **errp)
     return 0;
 }
 
+static int multifd_zstd_recv(MultiFDRecvParams *p, Error **errp)
+{
+    uint32_t flags = p->flags & MULTIFD_FLAG_COMPRESSION_MASK;
+
+    if (flags != MULTIFD_FLAG_ZSTD) {
+        error_setg(errp, "multifd %u: flags received %x flags expected %x",
+                   p->id, flags, MULTIFD_FLAG_ZSTD);
+        return -1;
+    }
+
+    multifd_recv_zero_page_process(p);
+
+    if (!p->normal_num) {
+        assert(p->next_packet_size == 0);
+        return 0;
+    }
+
+    return multifd_zstd_recv_pages(p, errp);
+}
+
+static int multifd_zstd_adaptive_recv(MultiFDRecvParams *p, Error **errp)
+{
+    uint32_t flags = p->flags & MULTIFD_FLAG_COMPRESSION_MASK;
+    struct zstd_data *z = p->compress_data;
+
+    if (flags != MULTIFD_FLAG_ZSTD && flags != MULTIFD_FLAG_NOCOMP) {
+        error_setg(errp, "multifd %u: flags received %x flags expected "
+                   "%x or %x", p->id, flags, MULTIFD_FLAG_ZSTD,
+                   MULTIFD_FLAG_NOCOMP);
+        return -1;
+    }
+
+    multifd_recv_zero_page_process(p);
+
+    if (!p->normal_num) {
+        assert(p->next_packet_size == 0);
+        return 0;
+    }
+
+    if (flags == MULTIFD_FLAG_ZSTD) {
+        /* Every compressed packet starts a new frame */
+        ZSTD_DCtx_reset(z->zds, ZSTD_reset_session_only);
+        return multifd_zstd_recv_pages(p, errp);
+    }
+
+    for (int i = 0; i < p->normal_num; i++) {
+        p->iov[i].iov_base = p->host + p->normal[i];
+        p->iov[i].iov_len = multifd_ram_page_size();
+        ramblock_recv_bitmap_set_offset(p->block, p->normal[i]);
+    }
+    return qio_channel_readv_all(p->c, p->iov, p->normal_num, errp);
+}
+
 static const MultiFDMethods multifd_zstd_ops = {
     .send_setup = multifd_zstd_send_setup,
     .send_cleanup = multifd_zstd_send_cleanup,
@@ -274,9 +478,20 @@ static const MultiFDMethods multifd_zstd_ops = {
     .recv = multifd_zstd_recv
 };
 
+static const MultiFDMethods multifd_zstd_adaptive_ops = {
+    .send_setup = multifd_zstd_send_setup,
+    .send_cleanup = multifd_zstd_send_cleanup,
+    .send_prepare = multifd_zstd_adaptive_send_prepare,
+    .recv_setup = multifd_zstd_recv_setup,
+    .recv_cleanup = multifd_zstd_recv_cleanup,
+    .recv = multifd_zstd_adaptive_recv
+};
+
 static void multifd_zstd_register(void)
 {
     multifd_register_ops(MULTIFD_COMPRESSION_ZSTD, &multifd_zstd_ops);
+    multifd_register_ops(MULTIFD_COMPRESSION_ZSTD_ADAPTIVE,
+                         &multifd_zstd_adaptive_ops);
 }
 
 migration_init(multifd_zstd_register);
@@ -57,7 +57,11 @@ MultiFDRecvData *multifd_get_recv_data(void);
 /* Multifd Compression flags */
 #define MULTIFD_FLAG_SYNC (1 << 0)
 
-/* We reserve 5 bits for compression methods */
+/*
+ * We reserve 5 bits for compression methods.  The field holds a single
+ * method and is compared as a value, not tested bit by bit, so methods
+ * may use any value that is not taken yet, not just powers of two.
+ */
 #define MULTIFD_FLAG_COMPRESSION_MASK (0x1f << 1)
 /* we need to be compatible. Before compression value was 0 */
 #define MULTIFD_FLAG_NOCOMP (0 << 1)
@@ -66,6 +70,8 @@ MultiFDRecvData *multifd_get_recv_data(void);
 #define MULTIFD_FLAG_QPL (4 << 1)
 #define MULTIFD_FLAG_UADK (8 << 1)
 #define MULTIFD_FLAG_QATZIP (16 << 1)
+/* All single bits are taken; 3 is the first unused value */
+#define MULTIFD_FLAG_XBZRLE (3 << 1)
 
 /*
  * If set it means that this packet contains device state
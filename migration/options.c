@@ -65,6 +65,9 @@
 
 /* 0: means nocompress, 1: best speed, ... 20: best compress ratio */
 #define DEFAULT_MIGRATE_MULTIFD_ZSTD_LEVEL 1
+/* Hot page deferral is disabled by default */
+#define DEFAULT_MIGRATE_HOT_PAGE_ROUNDS 0
+#define DEFAULT_MIGRATE_POSTCOPY_PREFETCH_PAGES 0
 
 /* Background transfer rate for postcopy, 0 means unlimited, note
  * that page requests can still exceed this limit.
@@ -177,6 +180,12 @@ const Property migration_properties[] = {
     DEFINE_PROP_ZERO_PAGE_DETECTION("zero-page-detection", MigrationState,
                        parameters.zero_page_detection,
                        ZERO_PAGE_DETECTION_MULTIFD),
+    DEFINE_PROP_UINT8("hot-page-rounds", MigrationState,
+                      parameters.hot_page_rounds,
+                      DEFAULT_MIGRATE_HOT_PAGE_ROUNDS),
+    DEFINE_PROP_UINT8("postcopy-prefetch-pages", MigrationState,
+                      parameters.postcopy_prefetch_pages,
+                      DEFAULT_MIGRATE_POSTCOPY_PREFETCH_PAGES),
 
     /* Migration capabilities */
     DEFINE_PROP_MIG_CAP("x-xbzrle", MIGRATION_CAPABILITY_XBZRLE),
@@ -203,6 +212,11 @@ const Property migration_properties[] = {
                         MIGRATION_CAPABILITY_SWITCHOVER_ACK),
     DEFINE_PROP_MIG_CAP("x-dirty-limit", MIGRATION_CAPABILITY_DIRTY_LIMIT),
     DEFINE_PROP_MIG_CAP("mapped-ram", MIGRATION_CAPABILITY_MAPPED_RAM),
+    DEFINE_PROP_MIG_CAP("mapped-ram-lazy",
+                        MIGRATION_CAPABILITY_MAPPED_RAM_LAZY),
+    DEFINE_PROP_MIG_CAP("mapped-ram-cow", MIGRATION_CAPABILITY_MAPPED_RAM_COW),
+    DEFINE_PROP_MIG_CAP("predictive-switchover",
+                        MIGRATION_CAPABILITY_PREDICTIVE_SWITCHOVER),
 };
 const size_t migration_properties_count = ARRAY_SIZE(migration_properties);
 
@@ -262,6 +276,20 @@ bool migrate_mapped_ram(void)
     return s->capabilities[MIGRATION_CAPABILITY_MAPPED_RAM];
 }
 
+bool migrate_mapped_ram_cow(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->capabilities[MIGRATION_CAPABILITY_MAPPED_RAM_COW];
+}
+
+bool migrate_mapped_ram_lazy(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->capabilities[MIGRATION_CAPABILITY_MAPPED_RAM_LAZY];
+}
+
 bool migrate_ignore_shared(void)
 {
     MigrationState *s = migrate_get_current();
@@ -311,6 +339,13 @@ bool migrate_postcopy_ram(void)
     return s->capabilities[MIGRATION_CAPABILITY_POSTCOPY_RAM];
 }
 
+bool migrate_predictive_switchover(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->capabilities[MIGRATION_CAPABILITY_PREDICTIVE_SWITCHOVER];
+}
+
 bool migrate_rdma_pin_all(void)
 {
     MigrationState *s = migrate_get_current();
@@ -652,6 +687,36 @@ bool migrate_caps_check(bool *old_caps, bool *new_caps, Error **errp)
         }
     }
 
+    if (new_caps[MIGRATION_CAPABILITY_MAPPED_RAM_LAZY]) {
+        if (!new_caps[MIGRATION_CAPABILITY_MAPPED_RAM]) {
+            error_setg(errp, "Capability 'mapped-ram-lazy' requires "
+                             "capability 'mapped-ram'");
+            return false;
+        }
+
+        /* Same host requirements as postcopy on the destination */
+        if (!old_caps[MIGRATION_CAPABILITY_MAPPED_RAM_LAZY] &&
+            runstate_check(RUN_STATE_INMIGRATE) &&
+            !postcopy_ram_supported_by_host(mis, errp)) {
+            error_prepend(errp, "Lazy mapped-ram load is not supported: ");
+            return false;
+        }
+    }
+
+    if (new_caps[MIGRATION_CAPABILITY_MAPPED_RAM_COW]) {
+        if (!new_caps[MIGRATION_CAPABILITY_MAPPED_RAM]) {
+            error_setg(errp, "Capability 'mapped-ram-cow' requires "
+                             "capability 'mapped-ram'");
+            return false;
+        }
+
+        if (new_caps[MIGRATION_CAPABILITY_MAPPED_RAM_LAZY]) {
+            error_setg(errp, "Capability 'mapped-ram-cow' is incompatible "
+                             "with capability 'mapped-ram-lazy'");
+            return false;
+        }
+    }
+
     /*
      * On destination side, check the cases that capability is being set
      * after incoming thread has started.
@@ -900,6 +965,20 @@ ZeroPageDetection migrate_zero_page_detection(void)
     return s->parameters.zero_page_detection;
 }
 
+uint8_t migrate_hot_page_rounds(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->parameters.hot_page_rounds;
+}
+
+uint8_t migrate_postcopy_prefetch_pages(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->parameters.postcopy_prefetch_pages;
+}
+
 /* parameters helpers */
 
 AnnounceParameters *migrate_announce_params(void)
@@ -988,6 +1067,10 @@ MigrationParameters *qmp_query_migrate_parameters(Error **errp)
     params->has_cpr_exec_command = true;
     params->cpr_exec_command = QAPI_CLONE(strList,
                                           s->parameters.cpr_exec_command);
+    params->has_hot_page_rounds = true;
+    params->hot_page_rounds = s->parameters.hot_page_rounds;
+    params->has_postcopy_prefetch_pages = true;
+    params->postcopy_prefetch_pages = s->parameters.postcopy_prefetch_pages;
 
     return params;
 }
@@ -1023,6 +1106,8 @@ void migrate_params_init(MigrationParameters *params)
     params->has_zero_page_detection = true;
     params->has_direct_io = true;
     params->has_cpr_exec_command = true;
+    params->has_hot_page_rounds = true;
+    params->has_postcopy_prefetch_pages = true;
 }
 
 /*
@@ -1181,6 +1266,15 @@ bool migrate_params_check(MigrationParameters *params, Error **errp)
     }
 #endif
 
+    if (params->has_multifd_compression &&
+        params->multifd_compression == MULTIFD_COMPRESSION_XBZRLE &&
+        params->has_zero_page_detection &&
+        params->zero_page_detection == ZERO_PAGE_DETECTION_LEGACY) {
+        error_setg(errp, "Multifd xbzrle is not compatible with legacy "
+                   "zero page detection");
+        return false;
+    }
+
     if (migrate_mapped_ram() &&
         (migrate_multifd_compression() || migrate_tls())) {
         error_setg(errp,
@@ -1331,6 +1425,14 @@ static void migrate_params_test_apply(MigrateSetParameters *params,
     if (params->has_cpr_exec_command) {
         dest->cpr_exec_command = params->cpr_exec_command;
     }
+
+    if (params->has_hot_page_rounds) {
+        dest->hot_page_rounds = params->hot_page_rounds;
+    }
+
+    if (params->has_postcopy_prefetch_pages) {
+        dest->postcopy_prefetch_pages = params->postcopy_prefetch_pages;
+    }
 }
 
 static void migrate_params_apply(MigrateSetParameters *params, Error **errp)
@@ -1469,6 +1571,15 @@ static void migrate_params_apply(MigrateSetParameters *params, Error **errp)
         s->parameters.cpr_exec_command =
             QAPI_CLONE(strList, params->cpr_exec_command);
     }
+
+    if (params->has_hot_page_rounds) {
+        s->parameters.hot_page_rounds = params->hot_page_rounds;
+    }
+
+    if (params->has_postcopy_prefetch_pages) {
+        s->parameters.postcopy_prefetch_pages =
+            params->postcopy_prefetch_pages;
+    }
 }
 
 void qmp_migrate_set_parameters(MigrateSetParameters *params, Error **errp)
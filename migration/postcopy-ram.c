@@ -18,6 +18,7 @@
 
 #include "qemu/osdep.h"
 #include "qemu/madvise.h"
+#include "qemu/units.h"
 #include "exec/target_page.h"
 #include "migration.h"
 #include "qemu-file.h"
@@ -1269,16 +1270,145 @@ static void postcopy_pause_fault_thread(MigrationIncomingState *mis)
     trace_postcopy_pause_fault_thread_continued();
 }
 
+/* Userfaultfd messages read at once by the fault thread */
+#define POSTCOPY_FAULT_BATCH        16
+/* Sequential faults in a row before the prefetcher kicks in */
+#define POSTCOPY_PREFETCH_RUN       2
+/* Initial prefetch window in host pages, doubled on each sequential fault */
+#define POSTCOPY_PREFETCH_WINDOW    4
+/* Largest prefetch window in bytes, so that huge pages do not send GiBs */
+#define POSTCOPY_PREFETCH_MAX_BYTES (8 * MiB)
+
+/*
+ * Sequential fault detection.  A fault is sequential if it hits the host
+ * page right after the previous fault, or any page up to the end of what
+ * was prefetched after it.
+ */
+typedef struct PostcopyPrefetch {
+    RAMBlock *rb;
+    /* offset right after the last faulting host page */
+    ram_addr_t next;
+    /* end of the prefetched range */
+    ram_addr_t end;
+    unsigned int run;
+    unsigned int window;
+} PostcopyPrefetch;
+
+static void postcopy_prefetch(MigrationIncomingState *mis,
+                              PostcopyPrefetch *pf, RAMBlock *rb,
+                              ram_addr_t offset)
+{
+    unsigned int max_pages = migrate_postcopy_prefetch_pages();
+    size_t psize = qemu_ram_pagesize(rb);
+    ram_addr_t start, end;
+
+    /*
+     * With preempt, the source sends requested pages right away on the
+     * urgent channel, so a prefetch would hold up real page faults.
+     */
+    if (migrate_postcopy_preempt()) {
+        return;
+    }
+
+    max_pages = MIN(max_pages, POSTCOPY_PREFETCH_MAX_BYTES / psize);
+    if (!max_pages) {
+        return;
+    }
+
+    if (rb == pf->rb && offset >= pf->next &&
+        offset <= MAX(pf->end, pf->next)) {
+        pf->run++;
+    } else {
+        pf->rb = rb;
+        pf->end = 0;
+        pf->run = 0;
+        pf->window = POSTCOPY_PREFETCH_WINDOW;
+    }
+    pf->next = offset + psize;
+
+    if (pf->run < POSTCOPY_PREFETCH_RUN) {
+        return;
+    }
+
+    start = MAX(pf->next, pf->end);
+    end = pf->next + (ram_addr_t)MIN(pf->window, max_pages) * psize;
+    end = MIN(end, rb->used_length);
+    pf->window = MIN(pf->window * 2, max_pages);
+
+    if (start >= end) {
+        return;
+    }
+
+    trace_postcopy_prefetch(qemu_ram_get_idstr(rb), start, end - start);
+    /* Only a hint; a broken return path is noticed by the next fault */
+    if (!migrate_send_rp_prefetch_pages(mis, rb, start, end - start)) {
+        pf->end = end;
+    }
+}
+
+/*
+ * Handle one userfaultfd message: request the faulting page from the
+ * source, and its neighbours if the faults look sequential.  Returns false
+ * if the fault thread has to quit.
+ */
+static bool postcopy_ram_fault_handle(MigrationIncomingState *mis,
+                                      struct uffd_msg *msg,
+                                      PostcopyPrefetch *pf)
+{
+    ram_addr_t rb_offset;
+    RAMBlock *rb;
+    int ret;
+
+    if (msg->event != UFFD_EVENT_PAGEFAULT) {
+        error_report("%s: Read unexpected event %ud from userfaultfd",
+                     __func__, msg->event);
+        return true; /* It's not a page fault, shouldn't happen */
+    }
+
+    rb = qemu_ram_block_from_host(
+             (void *)(uintptr_t)msg->arg.pagefault.address,
+             true, &rb_offset);
+    if (!rb) {
+        error_report("postcopy_ram_fault_thread: Fault outside guest: %"
+                     PRIx64, (uint64_t)msg->arg.pagefault.address);
+        return false;
+    }
+
+    rb_offset = ROUND_DOWN(rb_offset, qemu_ram_pagesize(rb));
+    trace_postcopy_ram_fault_thread_request(msg->arg.pagefault.address,
+                                            qemu_ram_get_idstr(rb),
+                                            rb_offset,
+                                            msg->arg.pagefault.feat.ptid);
+retry:
+    /*
+     * Send the request to the source - we want to request one
+     * of our host page sizes (which is >= TPS)
+     */
+    ret = postcopy_request_page(mis, rb, rb_offset,
+                                msg->arg.pagefault.address,
+                                msg->arg.pagefault.feat.ptid);
+    if (ret) {
+        /* May be network failure, try to wait for recovery */
+        postcopy_pause_fault_thread(mis);
+        goto retry;
+    }
+
+    postcopy_prefetch(mis, pf, rb, rb_offset);
+    return true;
+}
+
 /*
  * Handle faults detected by the USERFAULT markings
  */
 static void *postcopy_ram_fault_thread(void *opaque)
 {
     MigrationIncomingState *mis = opaque;
+    struct uffd_msg msgs[POSTCOPY_FAULT_BATCH];
     struct uffd_msg msg;
+    PostcopyPrefetch prefetch = {};
+    bool quit = false;
     int ret;
     size_t index;
-    RAMBlock *rb = NULL;
 
     trace_postcopy_ram_fault_thread_entry();
     rcu_register_thread();
@@ -1305,7 +1435,6 @@ static void *postcopy_ram_fault_thread(void *opaque)
     }
 
     while (true) {
-        ram_addr_t rb_offset;
         int poll_result;
 
         /*
@@ -1346,9 +1475,10 @@ static void *postcopy_ram_fault_thread(void *opaque)
 
         if (pfd[0].revents) {
             poll_result--;
-            ret = read(mis->userfault_fd, &msg, sizeof(msg));
-            if (ret != sizeof(msg)) {
-                if (errno == EAGAIN) {
+            /* Drain whatever faults queued up meanwhile in one go */
+            ret = read(mis->userfault_fd, msgs, sizeof(msgs));
+            if (ret <= 0 || ret % sizeof(msgs[0])) {
+                if (ret < 0 && errno == EAGAIN) {
                     /*
                      * if a wake up happens on the other thread just after
                      * the poll, there is nothing to read.
@@ -1362,43 +1492,21 @@ static void *postcopy_ram_fault_thread(void *opaque)
                     break;
                 } else {
                     error_report("%s: Read %d bytes from userfaultfd "
-                                 "expected %zd",
-                                 __func__, ret, sizeof(msg));
+                                 "expected a multiple of %zd",
+                                 __func__, ret, sizeof(msgs[0]));
                     break; /* Lost alignment, don't know what we'd read next */
                 }
             }
-            if (msg.event != UFFD_EVENT_PAGEFAULT) {
-                error_report("%s: Read unexpected event %ud from userfaultfd",
-                             __func__, msg.event);
-                continue; /* It's not a page fault, shouldn't happen */
-            }
 
-            rb = qemu_ram_block_from_host(
-                     (void *)(uintptr_t)msg.arg.pagefault.address,
-                     true, &rb_offset);
-            if (!rb) {
-                error_report("postcopy_ram_fault_thread: Fault outside guest: %"
-                             PRIx64, (uint64_t)msg.arg.pagefault.address);
-                break;
+            for (index = 0; index < ret / sizeof(msgs[0]); index++) {
+                if (!postcopy_ram_fault_handle(mis, &msgs[index],
+                                               &prefetch)) {
+                    quit = true;
+                    break;
+                }
             }
-
-            rb_offset = ROUND_DOWN(rb_offset, qemu_ram_pagesize(rb));
-            trace_postcopy_ram_fault_thread_request(msg.arg.pagefault.address,
-                                                qemu_ram_get_idstr(rb),
-                                                rb_offset,
-                                                msg.arg.pagefault.feat.ptid);
-retry:
-            /*
-             * Send the request to the source - we want to request one
-             * of our host page sizes (which is >= TPS)
-             */
-            ret = postcopy_request_page(mis, rb, rb_offset,
-                                        msg.arg.pagefault.address,
-                                        msg.arg.pagefault.feat.ptid);
-            if (ret) {
-                /* May be network failure, try to wait for recovery */
-                postcopy_pause_fault_thread(mis);
-                goto retry;
+            if (quit) {
+                break;
             }
         }
 
@@ -32,13 +32,17 @@
 #include "qemu/bitmap.h"
 #include "qemu/madvise.h"
 #include "qemu/main-loop.h"
+#include "qemu/event_notifier.h"
+#include "block/thread-pool.h"
 #include "xbzrle.h"
 #include "ram.h"
 #include "migration.h"
 #include "migration-stats.h"
 #include "migration/register.h"
 #include "migration/misc.h"
+#include "migration/blocker.h"
 #include "qemu-file.h"
+#include "io/channel-file.h"
 #include "postcopy-ram.h"
 #include "page_cache.h"
 #include "qemu/error-report.h"
@@ -59,6 +63,7 @@
 #include "qemu/iov.h"
 #include "multifd.h"
 #include "system/runstate.h"
+#include "system/system.h"
 #include "rdma.h"
 #include "options.h"
 #include "system/dirtylimit.h"
@@ -67,6 +72,7 @@
 #include "hw/boards.h" /* for machine_dump_guest_core() */
 
 #if defined(__linux__)
+#include <poll.h>
 #include "qemu/userfaultfd.h"
 #endif /* defined(__linux__) */
 
@@ -408,10 +414,13 @@ struct RAMState {
     uint64_t target_page_count;
     /* number of dirty bits in the bitmap */
     uint64_t migration_dirty_pages;
+    /* number of dirty pages held back in the hot bitmaps */
+    uint64_t deferred_pages;
     /*
      * Protects:
      * - dirty/clear bitmap
      * - migration_dirty_pages
+     * - hot bitmaps and deferred_pages
      * - pss structures
      */
     QemuMutex bitmap_mutex;
@@ -435,6 +444,11 @@ struct RAMState {
      * Protected by @bitmap_mutex.
      */
     PageLocationHint page_hint;
+    /*
+     * Threads syncing the dirty bitmap of large RAMBlocks, one per multifd
+     * channel.  NULL when the sync runs on the migration thread only.
+     */
+    ThreadPool *sync_threads;
 };
 typedef struct RAMState RAMState;
 
@@ -473,8 +487,13 @@ int precopy_notify(PrecopyNotifyReason reason, Error **errp)
 
 uint64_t ram_bytes_remaining(void)
 {
-    return ram_state ? (ram_state->migration_dirty_pages * TARGET_PAGE_SIZE) :
-                       0;
+    return ram_state ? ((ram_state->migration_dirty_pages +
+                         ram_state->deferred_pages) * TARGET_PAGE_SIZE) : 0;
+}
+
+uint64_t ram_bytes_deferred(void)
+{
+    return ram_state ? (ram_state->deferred_pages * TARGET_PAGE_SIZE) : 0;
 }
 
 void ram_transferred_add(uint64_t bytes)
@@ -937,10 +956,126 @@ bool ramblock_page_is_discarded(RAMBlock *rb, ram_addr_t start)
     return false;
 }
 
+/*
+ * Number of bitmap words synced by one worker when the dirty bitmap of a
+ * RAMBlock is split across the sync threads: 1 GiB of guest memory with
+ * 4 KiB target pages.
+ */
+#define RAM_SYNC_SLICE_WORDS    (4096)
+
+typedef struct RAMSyncSlice {
+    unsigned long * const *src;
+    unsigned long *dest;
+    uint8_t *rounds;
+    /* first word in the global dirty memory bitmap */
+    unsigned long word;
+    /* first word in the RAMBlock bitmap */
+    unsigned long page;
+    unsigned long nr;
+    uint64_t num_dirty;
+} RAMSyncSlice;
+
+/*
+ * Move @nr words of the global migration dirty bitmap, starting at @word,
+ * into @dest starting at @page.  Returns the number of pages that were not
+ * dirty in @dest yet.  If @rounds is not NULL, also count for each word of
+ * @dest how many syncs in a row dirtied it.
+ */
+static uint64_t ramblock_sync_dirty_words(unsigned long * const *src,
+                                          unsigned long word,
+                                          unsigned long *dest,
+                                          uint8_t *rounds,
+                                          unsigned long page,
+                                          unsigned long nr)
+{
+    unsigned long idx = (word * BITS_PER_LONG) / DIRTY_MEMORY_BLOCK_SIZE;
+    unsigned long offset = BIT_WORD((word * BITS_PER_LONG) %
+                                    DIRTY_MEMORY_BLOCK_SIZE);
+    uint64_t num_dirty = 0;
+    unsigned long k;
+
+    for (k = page; k < page + nr; k++) {
+        unsigned long bits = 0;
+
+        if (src[idx][offset]) {
+            unsigned long new_dirty;
+            bits = qatomic_xchg(&src[idx][offset], 0);
+            new_dirty = ~dest[k];
+            dest[k] |= bits;
+            new_dirty &= bits;
+            num_dirty += ctpopl(new_dirty);
+        }
+
+        if (rounds) {
+            rounds[k] = bits ? MIN(rounds[k] + 1, UINT8_MAX) : 0;
+        }
+
+        if (++offset >= BITS_TO_LONGS(DIRTY_MEMORY_BLOCK_SIZE)) {
+            offset = 0;
+            idx++;
+        }
+    }
+
+    return num_dirty;
+}
+
+static int ramblock_sync_slice(void *opaque)
+{
+    RAMSyncSlice *slice = opaque;
+
+    slice->num_dirty = ramblock_sync_dirty_words(slice->src, slice->word,
+                                                 slice->dest, slice->rounds,
+                                                 slice->page, slice->nr);
+    return 0;
+}
+
+/*
+ * Split the sync of a word aligned range across the threads of @pool.
+ * Slices cover disjoint words of both bitmaps, so the workers need no
+ * locking.  The caller's RCU critical section keeps @src alive until all
+ * of them are done.
+ */
+static uint64_t ramblock_sync_dirty_words_parallel(ThreadPool *pool,
+                                                   unsigned long * const *src,
+                                                   unsigned long word,
+                                                   unsigned long *dest,
+                                                   uint8_t *rounds,
+                                                   unsigned long page,
+                                                   unsigned long nr)
+{
+    unsigned long nr_slices = DIV_ROUND_UP(nr, RAM_SYNC_SLICE_WORDS);
+    g_autofree RAMSyncSlice *slices = g_new(RAMSyncSlice, nr_slices);
+    uint64_t num_dirty = 0;
+    unsigned long i;
+
+    for (i = 0; i < nr_slices; i++) {
+        unsigned long done = i * RAM_SYNC_SLICE_WORDS;
+
+        slices[i] = (RAMSyncSlice) {
+            .src = src,
+            .dest = dest,
+            .rounds = rounds,
+            .word = word + done,
+            .page = page + done,
+            .nr = MIN(nr - done, RAM_SYNC_SLICE_WORDS),
+        };
+        thread_pool_submit(pool, ramblock_sync_slice, &slices[i], NULL);
+    }
+
+    thread_pool_wait(pool);
+
+    for (i = 0; i < nr_slices; i++) {
+        num_dirty += slices[i].num_dirty;
+    }
+
+    return num_dirty;
+}
+
 /* Called with RCU critical section */
 static uint64_t physical_memory_sync_dirty_bitmap(RAMBlock *rb,
                                                   ram_addr_t start,
-                                                  ram_addr_t length)
+                                                  ram_addr_t length,
+                                                  ThreadPool *pool)
 {
     ram_addr_t addr;
     unsigned long word = BIT_WORD((start + rb->offset) >> TARGET_PAGE_BITS);
@@ -951,31 +1086,21 @@ static uint64_t physical_memory_sync_dirty_bitmap(RAMBlock *rb,
     if (((word * BITS_PER_LONG) << TARGET_PAGE_BITS) ==
          (start + rb->offset) &&
         !(length & ((BITS_PER_LONG << TARGET_PAGE_BITS) - 1))) {
-        int k;
-        int nr = BITS_TO_LONGS(length >> TARGET_PAGE_BITS);
+        unsigned long nr = BITS_TO_LONGS(length >> TARGET_PAGE_BITS);
         unsigned long * const *src;
-        unsigned long idx = (word * BITS_PER_LONG) / DIRTY_MEMORY_BLOCK_SIZE;
-        unsigned long offset = BIT_WORD((word * BITS_PER_LONG) %
-                                        DIRTY_MEMORY_BLOCK_SIZE);
         unsigned long page = BIT_WORD(start >> TARGET_PAGE_BITS);
 
         src = qatomic_rcu_read(
                 &ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION])->blocks;
 
-        for (k = page; k < page + nr; k++) {
-            if (src[idx][offset]) {
-                unsigned long bits = qatomic_xchg(&src[idx][offset], 0);
-                unsigned long new_dirty;
-                new_dirty = ~dest[k];
-                dest[k] |= bits;
-                new_dirty &= bits;
-                num_dirty += ctpopl(new_dirty);
-            }
-
-            if (++offset >= BITS_TO_LONGS(DIRTY_MEMORY_BLOCK_SIZE)) {
-                offset = 0;
-                idx++;
-            }
+        if (pool && nr > RAM_SYNC_SLICE_WORDS) {
+            num_dirty = ramblock_sync_dirty_words_parallel(pool, src, word,
+                                                           dest,
+                                                           rb->dirty_rounds,
+                                                           page, nr);
+        } else {
+            num_dirty = ramblock_sync_dirty_words(src, word, dest,
+                                                  rb->dirty_rounds, page, nr);
         }
         if (num_dirty) {
             physical_memory_dirty_bits_cleared(start, length);
@@ -1016,12 +1141,93 @@ static uint64_t physical_memory_sync_dirty_bitmap(RAMBlock *rb,
 static void ramblock_sync_dirty_bitmap(RAMState *rs, RAMBlock *rb)
 {
     uint64_t new_dirty_pages =
-        physical_memory_sync_dirty_bitmap(rb, 0, rb->used_length);
+        physical_memory_sync_dirty_bitmap(rb, 0, rb->used_length,
+                                          rs->sync_threads);
 
     rs->migration_dirty_pages += new_dirty_pages;
     rs->num_dirty_pages_period += new_dirty_pages;
 }
 
+/*
+ * ramblock_defer_hot_pages: hold back the pages of hot chunks
+ *
+ * Dirty pages of chunks that got dirty in at least @hot_rounds syncs in a
+ * row move from the dirty bitmap to the hot bitmap, so that they are not
+ * sent again and again while the guest keeps writing to them.  Chunks that
+ * cooled down get their deferred pages back into the dirty bitmap.  A chunk
+ * is one word of the dirty bitmap.
+ *
+ * Called with bitmap_mutex held.
+ */
+static void ramblock_defer_hot_pages(RAMState *rs, RAMBlock *rb,
+                                     uint8_t hot_rounds)
+{
+    unsigned long words = BITS_TO_LONGS(rb->used_length >> TARGET_PAGE_BITS);
+    unsigned long *bmap = rb->bmap;
+    unsigned long *hot = rb->hot_bmap;
+    unsigned long k;
+
+    for (k = 0; k < words; k++) {
+        if (rb->dirty_rounds[k] >= hot_rounds) {
+            if (!bmap[k]) {
+                continue;
+            }
+            rs->migration_dirty_pages -= ctpopl(bmap[k]);
+            rs->deferred_pages += ctpopl(bmap[k] & ~hot[k]);
+            hot[k] |= bmap[k];
+            bmap[k] = 0;
+            /*
+             * Like migration_bitmap_clear_dirty(), so that the next syncs
+             * tell whether the guest still writes to the chunk.
+             */
+            migration_clear_memory_region_dirty_bitmap_range(
+                rb, k * BITS_PER_LONG, BITS_PER_LONG);
+        } else if (hot[k]) {
+            rs->migration_dirty_pages += ctpopl(hot[k] & ~bmap[k]);
+            rs->deferred_pages -= ctpopl(hot[k]);
+            bmap[k] |= hot[k];
+            hot[k] = 0;
+        }
+    }
+}
+
+/*
+ * ram_undefer_hot_pages: give all deferred pages back to the dirty bitmap,
+ * before the last iteration or the switch to postcopy
+ *
+ * Called with bitmap_mutex held.
+ */
+static void ram_undefer_hot_pages(RAMState *rs)
+{
+    RAMBlock *block;
+
+    if (!rs->deferred_pages) {
+        return;
+    }
+
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        unsigned long words;
+        unsigned long k;
+
+        if (!block->hot_bmap) {
+            continue;
+        }
+
+        words = BITS_TO_LONGS(block->used_length >> TARGET_PAGE_BITS);
+        for (k = 0; k < words; k++) {
+            if (block->hot_bmap[k]) {
+                rs->migration_dirty_pages +=
+                    ctpopl(block->hot_bmap[k] & ~block->bmap[k]);
+                block->bmap[k] |= block->hot_bmap[k];
+                block->hot_bmap[k] = 0;
+            }
+        }
+    }
+
+    trace_ram_undefer_hot_pages(rs->deferred_pages);
+    rs->deferred_pages = 0;
+}
+
 /**
  * ram_pagesize_summary: calculate all the pagesizes of a VM
  *
@@ -1143,6 +1349,7 @@ static void migration_trigger_throttle(RAMState *rs)
 
 static void migration_bitmap_sync(RAMState *rs, bool last_stage)
 {
+    uint8_t hot_rounds = migrate_hot_page_rounds();
     RAMBlock *block;
     int64_t end_time;
 
@@ -1159,6 +1366,12 @@ static void migration_bitmap_sync(RAMState *rs, bool last_stage)
         WITH_RCU_READ_LOCK_GUARD() {
             RAMBLOCK_FOREACH_NOT_IGNORED(block) {
                 ramblock_sync_dirty_bitmap(rs, block);
+                if (block->hot_bmap && hot_rounds && !last_stage) {
+                    ramblock_defer_hot_pages(rs, block, hot_rounds);
+                }
+            }
+            if (last_stage) {
+                ram_undefer_hot_pages(rs);
             }
             stat64_set(&mig_stats.dirty_bytes_last_sync, ram_bytes_remaining());
         }
@@ -1190,6 +1403,7 @@ static void migration_bitmap_sync(RAMState *rs, bool last_stage)
 
 void migration_bitmap_sync_precopy(bool last_stage)
 {
+    int64_t start_time = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
     Error *local_err = NULL;
     assert(ram_state);
 
@@ -1207,6 +1421,9 @@ void migration_bitmap_sync_precopy(bool last_stage)
     if (precopy_notify(PRECOPY_NOTIFY_AFTER_BITMAP_SYNC, &local_err)) {
         error_report_err(local_err);
     }
+
+    migration_record_bitmap_sync(qemu_clock_get_us(QEMU_CLOCK_REALTIME) -
+                                 start_time, last_stage);
 }
 
 void ram_release_page(const char *rbname, uint64_t offset)
@@ -2432,6 +2649,7 @@ static void ram_state_cleanup(RAMState **rsp)
 {
     if (*rsp) {
         migration_page_queue_free(*rsp);
+        g_clear_pointer(&(*rsp)->sync_threads, thread_pool_free);
         qemu_mutex_destroy(&(*rsp)->bitmap_mutex);
         qemu_mutex_destroy(&(*rsp)->src_page_req_mutex);
         g_free(*rsp);
@@ -2464,6 +2682,10 @@ static void ram_bitmaps_destroy(void)
         block->clear_bmap = NULL;
         g_free(block->bmap);
         block->bmap = NULL;
+        g_free(block->dirty_rounds);
+        block->dirty_rounds = NULL;
+        g_free(block->hot_bmap);
+        block->hot_bmap = NULL;
         g_free(block->file_bmap);
         block->file_bmap = NULL;
     }
@@ -2703,6 +2925,11 @@ void ram_postcopy_send_discard_bitmap(MigrationState *ms)
     /* This should be our last sync, the src is now paused */
     migration_bitmap_sync(rs, false);
 
+    /* Deferred hot pages are left for postcopy */
+    WITH_QEMU_LOCK_GUARD(&rs->bitmap_mutex) {
+        ram_undefer_hot_pages(rs);
+    }
+
     /* Easiest way to make sure we don't resume in the middle of a host-page */
     rs->pss[RAM_CHANNEL_PRECOPY].last_sent_block = NULL;
     rs->last_seen_block = NULL;
@@ -2823,6 +3050,12 @@ static bool ram_state_init(RAMState **rsp, Error **errp)
     (*rsp)->migration_dirty_pages = (*rsp)->ram_bytes_total >> TARGET_PAGE_BITS;
     ram_state_reset(*rsp);
 
+    if (migrate_multifd() && migrate_multifd_channels() > 1) {
+        (*rsp)->sync_threads = thread_pool_new();
+        thread_pool_set_max_threads((*rsp)->sync_threads,
+                                    migrate_multifd_channels());
+    }
+
     return true;
 }
 
@@ -2862,6 +3095,10 @@ static void ram_list_init_bitmaps(void)
             if (migrate_mapped_ram()) {
                 block->file_bmap = bitmap_new(pages);
             }
+            if (migrate_hot_page_rounds()) {
+                block->dirty_rounds = g_new0(uint8_t, BITS_TO_LONGS(pages));
+                block->hot_bmap = bitmap_new(pages);
+            }
             block->clear_bmap_shift = shift;
             block->clear_bmap = bitmap_new(clear_bmap_size(pages, shift));
         }
@@ -3447,7 +3684,8 @@ static void ram_state_pending_estimate(void *opaque, uint64_t *must_precopy,
     RAMState **temp = opaque;
     RAMState *rs = *temp;
 
-    uint64_t remaining_size = rs->migration_dirty_pages * TARGET_PAGE_SIZE;
+    uint64_t remaining_size = (rs->migration_dirty_pages + rs->deferred_pages) *
+                              TARGET_PAGE_SIZE;
 
     if (migrate_postcopy_ram()) {
         /* We can do postcopy, and all the data is postcopiable */
@@ -3472,7 +3710,8 @@ static void ram_state_pending_exact(void *opaque, uint64_t *must_precopy,
         bql_unlock();
     }
 
-    remaining_size = rs->migration_dirty_pages * TARGET_PAGE_SIZE;
+    remaining_size = (rs->migration_dirty_pages + rs->deferred_pages) *
+                     TARGET_PAGE_SIZE;
 
     if (migrate_postcopy_ram()) {
         /* We can do postcopy, and all the data is postcopiable */
@@ -3764,6 +4003,8 @@ static int ram_load_setup(QEMUFile *f, void *opaque, Error **errp)
     return 0;
 }
 
+static void mapped_ram_lazy_abort(void);
+
 static int ram_load_cleanup(void *opaque)
 {
     RAMBlock *rb;
@@ -3775,6 +4016,7 @@ static int ram_load_cleanup(void *opaque)
     }
 
     xbzrle_load_cleanup();
+    mapped_ram_lazy_abort();
 
     RAMBLOCK_FOREACH_NOT_IGNORED(rb) {
         g_free(rb->receivedmap);
@@ -4150,6 +4392,507 @@ err:
     return false;
 }
 
+#if defined(__linux__)
+/*
+ * Lazy mapped-ram load: rather than reading all of guest RAM from the
+ * migration file before the VM starts, RAM is registered with userfaultfd
+ * and each host page is read in when it is first touched.  A background
+ * thread reads in whatever the guest did not touch yet.  Only used for
+ * incoming migration, where RAM starts out empty like with postcopy.
+ */
+typedef struct MappedRamLazy {
+    /* private copy of the migration file, which outlives the QEMUFile */
+    QIOChannel *ioc;
+    int uffd;
+    /* tells the fault thread to quit */
+    EventNotifier quit;
+    /* serializes reading pages in; protects @buf and the lazy_bmaps */
+    QemuMutex lock;
+    /* bounce buffer, large enough for the largest host page */
+    uint8_t *buf;
+    size_t buf_size;
+    /* blocks registered with @uffd, each holding a memory region ref */
+    GPtrArray *blocks;
+    /* pages read in because of a fault, for tracing */
+    uint64_t faults;
+    /* outgoing migration would see RAM that is not there yet */
+    Error *blocker;
+    QemuThread fault_thread;
+    QemuThread load_thread;
+} MappedRamLazy;
+
+static MappedRamLazy *mapped_ram_lazy;
+
+/*
+ * Read host page @idx of @block in from the file, unless it is already
+ * there.  Target pages the file has no data for are zeroed: the file may
+ * hold stale data for them from an earlier iteration.
+ *
+ * Returns 0 on success, -1 on error with @errp set.
+ */
+static int mapped_ram_lazy_load_page(MappedRamLazy *lazy, RAMBlock *block,
+                                     unsigned long idx, Error **errp)
+{
+    size_t pagesize = qemu_ram_pagesize(block);
+    ram_addr_t offset = (ram_addr_t)idx * pagesize;
+    unsigned long first = offset >> TARGET_PAGE_BITS;
+    unsigned long last = (offset + pagesize) >> TARGET_PAGE_BITS;
+    uint8_t *host = block->host + offset;
+    unsigned long i;
+    ssize_t len;
+    int ret;
+
+    QEMU_LOCK_GUARD(&lazy->lock);
+
+    if (!test_bit(idx, block->lazy_bmap)) {
+        return 0;
+    }
+
+    if (find_next_bit(block->lazy_file_bmap, last, first) == last &&
+        qemu_ram_is_uf_zeroable(block)) {
+        ret = uffd_zero_page(lazy->uffd, host, pagesize, false);
+    } else {
+        len = qio_channel_pread(lazy->ioc, (char *)lazy->buf, pagesize,
+                                block->pages_offset + offset, errp);
+        if (len < 0) {
+            error_prepend(errp, "(%s) failed to read page " RAM_ADDR_FMT
+                          ": ", block->idstr, offset);
+            return -1;
+        }
+        if (len != pagesize) {
+            error_setg(errp, "(%s) short read of page " RAM_ADDR_FMT,
+                       block->idstr, offset);
+            return -1;
+        }
+        for (i = first; i < last; i++) {
+            if (!test_bit(i, block->lazy_file_bmap)) {
+                memset(lazy->buf + ((i - first) << TARGET_PAGE_BITS), 0,
+                       TARGET_PAGE_SIZE);
+            }
+        }
+        ret = uffd_copy_page(lazy->uffd, host, lazy->buf, pagesize, false);
+    }
+    if (ret) {
+        error_setg_errno(errp, -ret, "(%s) failed to place page " RAM_ADDR_FMT,
+                         block->idstr, offset);
+        return -1;
+    }
+
+    clear_bit(idx, block->lazy_bmap);
+    return 0;
+}
+
+/*
+ * The guest cannot make progress without the page, and the file is all
+ * there is to get it from.
+ */
+static void mapped_ram_lazy_fail(Error *err)
+{
+    error_report_err(err);
+    exit(EXIT_FAILURE);
+}
+
+static void *mapped_ram_lazy_fault_thread(void *opaque)
+{
+    MappedRamLazy *lazy = opaque;
+    struct uffd_msg msgs[16];
+    struct pollfd pfd[2] = {
+        { .fd = lazy->uffd, .events = POLLIN },
+        { .fd = event_notifier_get_fd(&lazy->quit), .events = POLLIN },
+    };
+    Error *local_err = NULL;
+    int i, n;
+
+    rcu_register_thread();
+
+    while (true) {
+        if (poll(pfd, ARRAY_SIZE(pfd), -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error_report("%s: poll: %s", __func__, strerror(errno));
+            break;
+        }
+        if (pfd[1].revents) {
+            break;
+        }
+
+        n = uffd_read_events(lazy->uffd, msgs, ARRAY_SIZE(msgs));
+        if (n < 0) {
+            break;
+        }
+
+        for (i = 0; i < n; i++) {
+            void *addr = (void *)(uintptr_t)msgs[i].arg.pagefault.address;
+            ram_addr_t offset;
+            RAMBlock *block;
+
+            if (msgs[i].event != UFFD_EVENT_PAGEFAULT) {
+                continue;
+            }
+
+            WITH_RCU_READ_LOCK_GUARD() {
+                block = qemu_ram_block_from_host(addr, false, &offset);
+            }
+            if (!block || !block->lazy_bmap) {
+                error_report("%s: fault outside of guest RAM: %p",
+                             __func__, addr);
+                continue;
+            }
+
+            trace_mapped_ram_lazy_fault(block->idstr, offset);
+            if (mapped_ram_lazy_load_page(lazy, block,
+                                          offset / qemu_ram_pagesize(block),
+                                          &local_err)) {
+                mapped_ram_lazy_fail(local_err);
+            }
+            lazy->faults++;
+        }
+    }
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+/*
+ * Stop the fault thread, unregister all blocks and free @lazy.  The load
+ * thread must not be running.  Pages not read in by then read as zero.
+ */
+static void mapped_ram_lazy_free(MappedRamLazy *lazy)
+{
+    RAMBlock *block;
+    int i;
+
+    event_notifier_set(&lazy->quit);
+    qemu_thread_join(&lazy->fault_thread);
+
+    for (i = 0; i < lazy->blocks->len; i++) {
+        block = g_ptr_array_index(lazy->blocks, i);
+        uffd_unregister_memory(lazy->uffd, block->host, block->used_length);
+        g_free(block->lazy_bmap);
+        block->lazy_bmap = NULL;
+        g_free(block->lazy_file_bmap);
+        block->lazy_file_bmap = NULL;
+        memory_region_unref(block->mr);
+    }
+
+    /* Undo the munlockall() in mapped_ram_lazy_init() */
+    if (should_mlock(mlock_state) &&
+        os_mlock(is_mlock_on_fault(mlock_state)) < 0) {
+        error_report("mlock: %s", strerror(errno));
+    }
+
+    migrate_del_blocker(&lazy->blocker);
+    g_ptr_array_free(lazy->blocks, true);
+    uffd_close_fd(lazy->uffd);
+    event_notifier_cleanup(&lazy->quit);
+    qemu_mutex_destroy(&lazy->lock);
+    object_unref(OBJECT(lazy->ioc));
+    qemu_vfree(lazy->buf);
+    g_free(lazy);
+}
+
+static void mapped_ram_lazy_cleanup_bh(void *opaque)
+{
+    MappedRamLazy *lazy = opaque;
+
+    qemu_thread_join(&lazy->load_thread);
+    trace_mapped_ram_lazy_done(lazy->faults);
+    mapped_ram_lazy_free(lazy);
+}
+
+static void *mapped_ram_lazy_load_thread(void *opaque)
+{
+    MappedRamLazy *lazy = opaque;
+    Error *local_err = NULL;
+    RAMBlock *block;
+    unsigned long idx, pages;
+    int i;
+
+    rcu_register_thread();
+
+    for (i = 0; i < lazy->blocks->len; i++) {
+        block = g_ptr_array_index(lazy->blocks, i);
+        pages = block->used_length / qemu_ram_pagesize(block);
+
+        for (idx = find_first_bit(block->lazy_bmap, pages); idx < pages;
+             idx = find_next_bit(block->lazy_bmap, pages, idx + 1)) {
+            if (mapped_ram_lazy_load_page(lazy, block, idx, &local_err)) {
+                mapped_ram_lazy_fail(local_err);
+            }
+        }
+    }
+
+    rcu_unregister_thread();
+
+    /* Unregistering and dropping references needs the BQL */
+    migration_bh_schedule(mapped_ram_lazy_cleanup_bh, lazy);
+    return NULL;
+}
+
+static MappedRamLazy *mapped_ram_lazy_init(QEMUFile *f, Error **errp)
+{
+    QIOChannel *ioc = qemu_file_get_ioc(f);
+    MappedRamLazy *lazy;
+    int fd;
+
+    if (!object_dynamic_cast(OBJECT(ioc), TYPE_QIO_CHANNEL_FILE)) {
+        error_setg(errp, "Lazy mapped-ram load needs a file");
+        return NULL;
+    }
+
+    lazy = g_new0(MappedRamLazy, 1);
+    error_setg(&lazy->blocker,
+               "RAM is still being loaded from the migration file");
+    if (migrate_add_blocker_internal(&lazy->blocker, errp)) {
+        g_free(lazy);
+        return NULL;
+    }
+
+    lazy->uffd = uffd_create_fd(0, true);
+    if (lazy->uffd < 0) {
+        error_setg(errp, "Failed to create userfaultfd");
+        goto err_blocker;
+    }
+
+    fd = dup(QIO_CHANNEL_FILE(ioc)->fd);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "Failed to duplicate migration file");
+        goto err_uffd;
+    }
+
+    /*
+     * Like postcopy: userfaultfd and mlock don't go together, and locked
+     * memory cannot be discarded.  mapped_ram_lazy_free() locks it again.
+     */
+    if (should_mlock(mlock_state) && munlockall()) {
+        error_setg_errno(errp, errno, "munlockall() failed");
+        close(fd);
+        goto err_uffd;
+    }
+
+    lazy->ioc = QIO_CHANNEL(qio_channel_file_new_fd(fd));
+
+    event_notifier_init(&lazy->quit, false);
+    qemu_mutex_init(&lazy->lock);
+    lazy->buf_size = qemu_ram_pagesize_largest();
+    lazy->buf = qemu_memalign(lazy->buf_size, lazy->buf_size);
+    lazy->blocks = g_ptr_array_new();
+
+    qemu_thread_create(&lazy->fault_thread, "mapped-ram-fault",
+                       mapped_ram_lazy_fault_thread, lazy,
+                       QEMU_THREAD_JOINABLE);
+    return lazy;
+
+err_uffd:
+    uffd_close_fd(lazy->uffd);
+err_blocker:
+    migrate_del_blocker(&lazy->blocker);
+    g_free(lazy);
+    return NULL;
+}
+
+/*
+ * Register @block for a lazy load instead of reading its pages in.  Takes
+ * over @bitmap, the pages the file has data for, on success.
+ *
+ * Returns true on success, false on error with @errp set.
+ */
+static bool mapped_ram_lazy_register(QEMUFile *f, RAMBlock *block,
+                                     unsigned long *bitmap, Error **errp)
+{
+    unsigned long pages = block->used_length / qemu_ram_pagesize(block);
+    uint64_t ioctls;
+
+    if (!mapped_ram_lazy) {
+        mapped_ram_lazy = mapped_ram_lazy_init(f, errp);
+        if (!mapped_ram_lazy) {
+            return false;
+        }
+    }
+
+    /* Everything must fault, including what was set up during init */
+    if (ram_discard_range(block->idstr, 0, block->used_length)) {
+        error_setg(errp, "failed to discard RAM block %s", block->idstr);
+        return false;
+    }
+
+    /* Set up before any fault can look at them */
+    block->lazy_bmap = bitmap_new(pages);
+    bitmap_fill(block->lazy_bmap, pages);
+    block->lazy_file_bmap = bitmap;
+
+    if (uffd_register_memory(mapped_ram_lazy->uffd, block->host,
+                             block->used_length, UFFDIO_REGISTER_MODE_MISSING,
+                             &ioctls)) {
+        error_setg_errno(errp, errno, "failed to register RAM block %s",
+                         block->idstr);
+        goto err;
+    }
+    if (!(ioctls & BIT(_UFFDIO_COPY))) {
+        uffd_unregister_memory(mapped_ram_lazy->uffd, block->host,
+                               block->used_length);
+        error_setg(errp, "RAM block %s doesn't support UFFDIO_COPY",
+                   block->idstr);
+        goto err;
+    }
+    if (ioctls & BIT(_UFFDIO_ZEROPAGE)) {
+        qemu_ram_set_uf_zeroable(block);
+    }
+
+    memory_region_ref(block->mr);
+    g_ptr_array_add(mapped_ram_lazy->blocks, block);
+
+    trace_mapped_ram_lazy_register(block->idstr, block->used_length);
+    return true;
+
+err:
+    /* @bitmap stays with the caller */
+    block->lazy_file_bmap = NULL;
+    g_free(block->lazy_bmap);
+    block->lazy_bmap = NULL;
+    return false;
+}
+
+/* Start reading in the pages of all blocks registered for a lazy load */
+static void mapped_ram_lazy_start(void)
+{
+    if (!mapped_ram_lazy) {
+        return;
+    }
+
+    qemu_thread_create(&mapped_ram_lazy->load_thread, "mapped-ram-load",
+                       mapped_ram_lazy_load_thread, mapped_ram_lazy,
+                       QEMU_THREAD_JOINABLE);
+    /* The threads clean up after themselves once everything is loaded */
+    mapped_ram_lazy = NULL;
+}
+
+/*
+ * Drop the blocks registered for a lazy load that was never started,
+ * because the load failed before all of them were parsed.
+ */
+static void mapped_ram_lazy_abort(void)
+{
+    if (!mapped_ram_lazy) {
+        return;
+    }
+
+    mapped_ram_lazy_free(mapped_ram_lazy);
+    mapped_ram_lazy = NULL;
+}
+#else
+static bool mapped_ram_lazy_register(QEMUFile *f, RAMBlock *block,
+                                     unsigned long *bitmap, Error **errp)
+{
+    error_setg(errp, "Lazy mapped-ram load is only supported on Linux");
+    return false;
+}
+
+static void mapped_ram_lazy_start(void)
+{
+}
+
+static void mapped_ram_lazy_abort(void)
+{
+}
+#endif /* defined(__linux__) */
+
+#ifndef _WIN32
+/*
+ * Zero the pages in [@from, @to) of a block mapped from the file which the
+ * file has no data for.  Holes in the file read as zero already, so only
+ * stale data left there by an earlier iteration needs clearing.
+ */
+static void mapped_ram_map_zero_range(int fd, RAMBlock *block,
+                                      unsigned long from, unsigned long to)
+{
+    off_t start = block->pages_offset + ((off_t)from << TARGET_PAGE_BITS);
+    off_t end = block->pages_offset + ((off_t)to << TARGET_PAGE_BITS);
+    off_t data, hole;
+
+    while (start < end) {
+#ifdef SEEK_DATA
+        data = lseek(fd, start, SEEK_DATA);
+        if (data < 0 || data >= end) {
+            /* ENXIO means no data up to the end of the file */
+            return;
+        }
+        hole = lseek(fd, data, SEEK_HOLE);
+        if (hole < 0) {
+            hole = end;
+        }
+#else
+        data = start;
+        hole = end;
+#endif
+        data = block->pages_offset +
+               QEMU_ALIGN_DOWN(data - block->pages_offset, TARGET_PAGE_SIZE);
+        hole = MIN(end, block->pages_offset +
+                        QEMU_ALIGN_UP(hole - block->pages_offset,
+                                      TARGET_PAGE_SIZE));
+        ram_handle_zero(block->host + (data - block->pages_offset),
+                        hole - data);
+        start = hole;
+    }
+}
+
+/*
+ * Map the pages of @block copy-on-write from the migration file instead of
+ * reading them in, so that VMs started from the same file share the memory
+ * until they write to it.
+ *
+ * Returns true on success, false on error with @errp set.
+ */
+static bool mapped_ram_map_block(QEMUFile *f, RAMBlock *block,
+                                 long num_pages, unsigned long *bitmap,
+                                 Error **errp)
+{
+    QIOChannel *ioc = qemu_file_get_ioc(f);
+    unsigned long set_bit_idx, clear_bit_idx = 0;
+    int fd;
+
+    if (!object_dynamic_cast(OBJECT(ioc), TYPE_QIO_CHANNEL_FILE)) {
+        error_setg(errp, "Mapping RAM from the migration needs a file");
+        return false;
+    }
+    if (memory_region_has_ram_discard_manager(block->mr)) {
+        error_setg(errp, "RAM block %s has a RAM discard manager",
+                   block->idstr);
+        return false;
+    }
+    if (!QEMU_IS_ALIGNED(block->pages_offset, qemu_real_host_page_size())) {
+        error_setg(errp, "RAM block %s pages are not aligned in the file",
+                   block->idstr);
+        return false;
+    }
+
+    fd = QIO_CHANNEL_FILE(ioc)->fd;
+    if (qemu_ram_map_file_private(block, fd, block->pages_offset, errp)) {
+        return false;
+    }
+
+    for (set_bit_idx = find_first_bit(bitmap, num_pages);
+         set_bit_idx < num_pages;
+         set_bit_idx = find_next_bit(bitmap, num_pages, clear_bit_idx + 1)) {
+        mapped_ram_map_zero_range(fd, block, clear_bit_idx, set_bit_idx);
+        clear_bit_idx = find_next_zero_bit(bitmap, num_pages, set_bit_idx + 1);
+    }
+    mapped_ram_map_zero_range(fd, block, clear_bit_idx, num_pages);
+
+    trace_mapped_ram_map_block(block->idstr, block->used_length);
+    return true;
+}
+#else
+static bool mapped_ram_map_block(QEMUFile *f, RAMBlock *block,
+                                 long num_pages, unsigned long *bitmap,
+                                 Error **errp)
+{
+    error_setg(errp, "Mapping RAM from the migration file is not supported");
+    return false;
+}
+#endif /* !_WIN32 */
+
 static void parse_ramblock_mapped_ram(QEMUFile *f, RAMBlock *block,
                                       ram_addr_t length, Error **errp)
 {
@@ -4187,7 +4930,18 @@ static void parse_ramblock_mapped_ram(QEMUFile *f, RAMBlock *block,
         return;
     }
 
-    if (!read_ramblock_mapped_ram(f, block, num_pages, bitmap, errp)) {
+    if (migrate_mapped_ram_cow() && runstate_check(RUN_STATE_INMIGRATE)) {
+        /* The file offset gets reset below */
+        if (!mapped_ram_map_block(f, block, num_pages, bitmap, errp)) {
+            return;
+        }
+    } else if (migrate_mapped_ram_lazy() &&
+               runstate_check(RUN_STATE_INMIGRATE)) {
+        if (!mapped_ram_lazy_register(f, block, bitmap, errp)) {
+            return;
+        }
+        bitmap = NULL;
+    } else if (!read_ramblock_mapped_ram(f, block, num_pages, bitmap, errp)) {
         return;
     }
 
@@ -4398,6 +5152,9 @@ static int ram_load_precopy(QEMUFile *f)
              */
             if (migrate_mapped_ram()) {
                 multifd_recv_sync_main();
+                if (!ret) {
+                    mapped_ram_lazy_start();
+                }
             }
             break;
 
@@ -4494,6 +5251,9 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
             ret = ram_load_precopy(f);
         }
     }
+    if (ret < 0) {
+        mapped_ram_lazy_abort();
+    }
     trace_ram_load_complete(ret, seq_iter);
 
     return ret;
@@ -75,6 +75,7 @@ extern XBZRLECacheStats xbzrle_counters;
 void ram_mig_init(void);
 int xbzrle_cache_resize(uint64_t new_size, Error **errp);
 uint64_t ram_bytes_remaining(void);
+uint64_t ram_bytes_deferred(void);
 uint64_t ram_bytes_total(void);
 void mig_throttle_counter_reset(void);
 
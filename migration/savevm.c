@@ -1586,8 +1586,19 @@ bool qemu_savevm_state_postcopy_prepare(QEMUFile *f, Error **errp)
     return true;
 }
 
+/* COLO checkpoints are not part of the migration downtime */
+static DowntimeStats *savevm_downtime_stats(void)
+{
+    if (migration_in_colo_state()) {
+        return NULL;
+    }
+    return migrate_get_current()->downtime_stats;
+}
+
 int qemu_savevm_state_complete_precopy_iterable(QEMUFile *f, bool in_postcopy)
 {
+    DowntimeStats *stats = savevm_downtime_stats();
+    int64_t start_ts = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
     int64_t start_ts_each, end_ts_each;
     SaveStateEntry *se;
     bool multifd_device_state = multifd_device_state_supported();
@@ -1631,6 +1642,10 @@ int qemu_savevm_state_complete_precopy_iterable(QEMUFile *f, bool in_postcopy)
 
         trace_vmstate_downtime_save("iterable", se->idstr, se->instance_id,
                                     end_ts_each - start_ts_each);
+        if (stats) {
+            migration_downtime_add_device(stats, se->idstr, se->instance_id,
+                                          true, end_ts_each - start_ts_each);
+        }
     }
 
     if (multifd_device_state) {
@@ -1644,6 +1659,11 @@ int qemu_savevm_state_complete_precopy_iterable(QEMUFile *f, bool in_postcopy)
         }
     }
 
+    if (stats) {
+        stats->has_iterable_save = true;
+        stats->iterable_save = qemu_clock_get_us(QEMU_CLOCK_REALTIME) -
+                               start_ts;
+    }
     trace_vmstate_downtime_checkpoint("src-iterable-saved");
 
     return 0;
@@ -1661,6 +1681,8 @@ int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
                                                     bool in_postcopy)
 {
     MigrationState *ms = migrate_get_current();
+    DowntimeStats *stats = savevm_downtime_stats();
+    int64_t start_ts = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
     int64_t start_ts_each, end_ts_each;
     JSONWriter *vmdesc = ms->vmdesc;
     int vmdesc_len;
@@ -1690,6 +1712,10 @@ int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
         end_ts_each = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
         trace_vmstate_downtime_save("non-iterable", se->idstr, se->instance_id,
                                     end_ts_each - start_ts_each);
+        if (stats) {
+            migration_downtime_add_device(stats, se->idstr, se->instance_id,
+                                          false, end_ts_each - start_ts_each);
+        }
     }
 
     if (!in_postcopy) {
@@ -1707,6 +1733,11 @@ int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
         }
     }
 
+    if (stats) {
+        stats->has_non_iterable_save = true;
+        stats->non_iterable_save = qemu_clock_get_us(QEMU_CLOCK_REALTIME) -
+                                   start_ts;
+    }
     trace_vmstate_downtime_checkpoint("src-non-iterable-saved");
 
     return 0;
@@ -2123,6 +2154,7 @@ static int loadvm_postcopy_handle_listen(MigrationIncomingState *mis,
 static void loadvm_postcopy_handle_run_bh(void *opaque)
 {
     MigrationIncomingState *mis = opaque;
+    int64_t start_ts = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
 
     trace_vmstate_downtime_checkpoint("dst-postcopy-bh-enter");
 
@@ -2156,6 +2188,7 @@ static void loadvm_postcopy_handle_run_bh(void *opaque)
         runstate_set(RUN_STATE_PAUSED);
     }
 
+    migration_incoming_record_start(mis, start_ts);
     trace_vmstate_downtime_checkpoint("dst-postcopy-bh-vm-started");
 }
 
@@ -2663,6 +2696,9 @@ qemu_loadvm_section_start_full(QEMUFile *f, uint8_t type, Error **errp)
         end_ts = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
         trace_vmstate_downtime_load("non-iterable", se->idstr,
                                     se->instance_id, end_ts - start_ts);
+        migration_incoming_record_load(migration_incoming_get_current(),
+                                       se->idstr, se->instance_id, false,
+                                       end_ts - start_ts);
     }
 
     if (!check_section_footer(f, se)) {
@@ -2715,6 +2751,9 @@ qemu_loadvm_section_part_end(QEMUFile *f, uint8_t type, Error **errp)
         end_ts = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
         trace_vmstate_downtime_load("iterable", se->idstr,
                                     se->instance_id, end_ts - start_ts);
+        migration_incoming_record_load(migration_incoming_get_current(),
+                                       se->idstr, se->instance_id, true,
+                                       end_ts - start_ts);
     }
 
     if (!check_section_footer(f, se)) {
@@ -18,7 +18,9 @@
 #include "qobject/json-writer.h"
 #include "qemu-file.h"
 #include "qemu/bitops.h"
+#include "qemu/bswap.h"
 #include "qemu/error-report.h"
+#include "qemu/lockable.h"
 #include "trace.h"
 
 static int vmstate_subsection_save(QEMUFile *f, const VMStateDescription *vmsd,
@@ -131,11 +133,238 @@ static void vmstate_handle_alloc(void *ptr, const VMStateField *field,
     }
 }
 
+/*
+ * Fast path for plain fields: integers, arrays of integers and static
+ * buffers whose count, size and existence only depend on the version
+ * being loaded.  For each VMStateDescription and version, a load plan
+ * groups consecutive plain fields into runs that are read from the stream
+ * with a single qemu_get_buffer() and then converted from big endian in
+ * place.  The wire format is the same as with the VMStateInfo callbacks.
+ */
+
+/* Runs are read through a bounce buffer of this size */
+#define VMSTATE_LOAD_RUN_MAX 512
+
+typedef struct VMStateLoadRun {
+    /* Fields covered by the run, 0 if the field must be interpreted */
+    uint16_t n_fields;
+    /* Bytes on the wire */
+    uint32_t wire_size;
+} VMStateLoadRun;
+
+typedef struct VMStateLoadPlanKey {
+    const VMStateDescription *vmsd;
+    int version_id;
+} VMStateLoadPlanKey;
+
+typedef struct VMStateLoadPlan {
+    VMStateLoadPlanKey key;
+    /* Indexed by field, only meaningful at the start of a run */
+    VMStateLoadRun runs[];
+} VMStateLoadPlan;
+
+static QemuMutex vmstate_load_plans_lock;
+static GHashTable *vmstate_load_plans;
+
+static void __attribute__((constructor)) vmstate_load_plans_init(void)
+{
+    qemu_mutex_init(&vmstate_load_plans_lock);
+}
+
+static guint vmstate_load_plan_hash(gconstpointer key)
+{
+    const VMStateLoadPlanKey *k = key;
+
+    return g_direct_hash(k->vmsd) ^ k->version_id;
+}
+
+static gboolean vmstate_load_plan_equal(gconstpointer a, gconstpointer b)
+{
+    const VMStateLoadPlanKey *ka = a, *kb = b;
+
+    return ka->vmsd == kb->vmsd && ka->version_id == kb->version_id;
+}
+
+/*
+ * Returns the size of one element of @field if it is a plain field, or 0.
+ * Plain fields are loaded by copying the wire bytes and byteswapping each
+ * element of that size.
+ */
+static int vmstate_plain_elem_size(const VMStateField *field)
+{
+    const VMStateInfo *info = field->info;
+    int size = field->size;
+
+    if (field->field_exists ||
+        field->flags & ~(VMS_SINGLE | VMS_ARRAY | VMS_BUFFER |
+                         VMS_MUST_EXIST)) {
+        return 0;
+    }
+
+    if (field->flags & VMS_BUFFER) {
+        return info == &vmstate_info_buffer ? 1 : 0;
+    }
+    if ((info == &vmstate_info_uint8 || info == &vmstate_info_int8) &&
+        size == sizeof(uint8_t)) {
+        return size;
+    }
+    if ((info == &vmstate_info_uint16 || info == &vmstate_info_int16) &&
+        size == sizeof(uint16_t)) {
+        return size;
+    }
+    if ((info == &vmstate_info_uint32 || info == &vmstate_info_int32) &&
+        size == sizeof(uint32_t)) {
+        return size;
+    }
+    if ((info == &vmstate_info_uint64 || info == &vmstate_info_int64) &&
+        size == sizeof(uint64_t)) {
+        return size;
+    }
+    return 0;
+}
+
+static void vmstate_be_to_cpus(void *p, int n_elems, int elem_size)
+{
+    int i;
+
+    switch (elem_size) {
+    case sizeof(uint16_t):
+        for (i = 0; i < n_elems; i++) {
+            be16_to_cpus((uint16_t *)p + i);
+        }
+        break;
+    case sizeof(uint32_t):
+        for (i = 0; i < n_elems; i++) {
+            be32_to_cpus((uint32_t *)p + i);
+        }
+        break;
+    case sizeof(uint64_t):
+        for (i = 0; i < n_elems; i++) {
+            be64_to_cpus((uint64_t *)p + i);
+        }
+        break;
+    }
+}
+
+static VMStateLoadPlan *vmstate_load_plan_new(const VMStateDescription *vmsd,
+                                              int version_id)
+{
+    const VMStateField *field;
+    VMStateLoadPlan *plan;
+    VMStateLoadRun *run = NULL;
+    int n_fields = 0;
+
+    for (field = vmsd->fields; field->name; field++) {
+        n_fields++;
+    }
+    plan = g_malloc0(sizeof(*plan) + n_fields * sizeof(plan->runs[0]));
+    plan->key.vmsd = vmsd;
+    plan->key.version_id = version_id;
+
+    for (field = vmsd->fields; field->name; field++) {
+        int elem_size = vmstate_plain_elem_size(field);
+        size_t wire_size;
+
+        if (!elem_size) {
+            run = NULL;
+            continue;
+        }
+
+        /* Without field_exists, existence only depends on the version */
+        if (field->version_id > version_id) {
+            if (field->flags & VMS_MUST_EXIST) {
+                run = NULL;
+            } else if (run) {
+                run->n_fields++;
+            }
+            continue;
+        }
+
+        wire_size = field->size;
+        if (field->flags & VMS_ARRAY) {
+            wire_size *= field->num;
+        }
+        assert(wire_size <= UINT32_MAX);
+        if (!run || run->wire_size + wire_size > VMSTATE_LOAD_RUN_MAX) {
+            run = &plan->runs[field - vmsd->fields];
+        }
+        run->n_fields++;
+        run->wire_size += wire_size;
+        if (wire_size > VMSTATE_LOAD_RUN_MAX) {
+            /* Loaded in place, do not append to it */
+            run = NULL;
+        }
+    }
+
+    return plan;
+}
+
+static const VMStateLoadPlan *
+vmstate_load_plan_get(const VMStateDescription *vmsd, int version_id)
+{
+    VMStateLoadPlanKey key = { .vmsd = vmsd, .version_id = version_id };
+    VMStateLoadPlan *plan;
+
+    QEMU_LOCK_GUARD(&vmstate_load_plans_lock);
+    if (!vmstate_load_plans) {
+        vmstate_load_plans = g_hash_table_new(vmstate_load_plan_hash,
+                                              vmstate_load_plan_equal);
+    }
+    plan = g_hash_table_lookup(vmstate_load_plans, &key);
+    if (!plan) {
+        /* VMStateDescriptions are never freed, neither are their plans */
+        plan = vmstate_load_plan_new(vmsd, version_id);
+        g_hash_table_insert(vmstate_load_plans, &plan->key, plan);
+    }
+    return plan;
+}
+
+/* Load the fields of @run, starting at @field */
+static void vmstate_load_run(QEMUFile *f, const VMStateDescription *vmsd,
+                             const VMStateField *field,
+                             const VMStateLoadRun *run, void *opaque,
+                             int version_id)
+{
+    uint8_t buf[VMSTATE_LOAD_RUN_MAX];
+    uint8_t *p = buf;
+    int i;
+
+    if (run->wire_size > VMSTATE_LOAD_RUN_MAX) {
+        /* A single large field, read it straight into place */
+        assert(run->n_fields == 1);
+        trace_vmstate_load_state_field(vmsd->name, field->name, true);
+        qemu_get_buffer(f, opaque + field->offset, run->wire_size);
+        vmstate_be_to_cpus(opaque + field->offset,
+                           run->wire_size / vmstate_plain_elem_size(field),
+                           vmstate_plain_elem_size(field));
+        return;
+    }
+
+    qemu_get_buffer(f, buf, run->wire_size);
+    for (i = 0; i < run->n_fields; i++, field++) {
+        bool exists = field->version_id <= version_id;
+        int n_elems = field->flags & VMS_ARRAY ? field->num : 1;
+        size_t size = field->size * n_elems;
+
+        trace_vmstate_load_state_field(vmsd->name, field->name, exists);
+        if (!exists) {
+            continue;
+        }
+        memcpy(opaque + field->offset, p, size);
+        vmstate_be_to_cpus(opaque + field->offset, size /
+                           vmstate_plain_elem_size(field),
+                           vmstate_plain_elem_size(field));
+        p += size;
+    }
+    assert(p == buf + run->wire_size);
+}
+
 int vmstate_load_state(QEMUFile *f, const VMStateDescription *vmsd,
                        void *opaque, int version_id, Error **errp)
 {
     ERRP_GUARD();
     const VMStateField *field = vmsd->fields;
+    const VMStateLoadPlan *plan;
     int ret = 0;
 
     trace_vmstate_load_state(vmsd->name, version_id);
@@ -171,8 +400,25 @@ int vmstate_load_state(QEMUFile *f, const VMStateDescription *vmsd,
             return ret;
         }
     }
+    plan = vmstate_load_plan_get(vmsd, version_id);
     while (field->name) {
-        bool exists = vmstate_field_exists(vmsd, field, opaque, version_id);
+        const VMStateLoadRun *run = &plan->runs[field - vmsd->fields];
+        bool exists;
+
+        if (run->n_fields) {
+            vmstate_load_run(f, vmsd, field, run, opaque, version_id);
+            ret = qemu_file_get_error(f);
+            if (ret < 0) {
+                error_setg(errp, "Failed to load %s state: stream error: %d",
+                           vmsd->name, ret);
+                trace_vmstate_load_field_error(field->name, ret);
+                return ret;
+            }
+            field += run->n_fields;
+            continue;
+        }
+
+        exists = vmstate_field_exists(vmsd, field, opaque, version_id);
         trace_vmstate_load_state_field(vmsd->name, field->name, exists);
         if (exists) {
             void *first_elem = opaque + field->offset;
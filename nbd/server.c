@@ -152,6 +152,8 @@ struct NBDClient {
     NBDMode mode;
     NBDMetaContexts contexts; /* Negotiated meta contexts */
 
+    int zero_copy; /* Result of nbd_can_zero_copy(), -1 until probed */
+
     uint32_t opt; /* Current option being negotiated */
     uint32_t optlen; /* remaining length of data in ioc for the option being
                         negotiated now */
@@ -2051,6 +2053,92 @@ static int coroutine_fn nbd_co_send_iov(NBDClient *client, struct iovec *iov,
     return ret;
 }
 
+/*
+ * Return true if read payloads can be sent straight from the image to the
+ * client socket.  This needs a plain socket (no TLS) and a block graph that
+ * passes the data through unmodified down to a host file.
+ *
+ * The graph is probed once per client.  If it changes later so that
+ * sendfile is no longer possible, the next zero-copy read fails and takes
+ * the connection down, just like a read error in the middle of a reply.
+ */
+static bool coroutine_fn nbd_can_zero_copy(NBDClient *client)
+{
+    if (client->zero_copy < 0) {
+        client->zero_copy =
+            client->ioc == (QIOChannel *)client->sioc &&
+            blk_co_sendfile(client->exp->common.blk, 0, 0,
+                            client->sioc->fd, false) == 0;
+    }
+    return client->zero_copy;
+}
+
+/* Send @size zero bytes, with client->send_lock held */
+static int coroutine_fn nbd_co_send_zeroes(NBDClient *client, uint64_t size,
+                                           Error **errp)
+{
+    g_autofree void *zeroes = g_malloc0(MIN(size, 64 * KiB));
+
+    while (size) {
+        size_t len = MIN(size, 64 * KiB);
+
+        if (qio_channel_write_all(client->ioc, zeroes, len, errp) < 0) {
+            return -EIO;
+        }
+        size -= len;
+    }
+    return 0;
+}
+
+/*
+ * Like nbd_co_send_iov(), but follow @iov with @size bytes of export data
+ * starting at @offset, which are sent from the image file without being
+ * copied through a bounce buffer.  Once the header is out there is no way
+ * to report a read error to the client, so any failure is fatal for the
+ * connection.
+ */
+static int coroutine_fn nbd_co_send_iov_zero_copy(NBDClient *client,
+                                                  struct iovec *iov,
+                                                  unsigned niov,
+                                                  uint64_t offset,
+                                                  uint64_t size,
+                                                  Error **errp)
+{
+    bool throttle = true;
+    int ret;
+
+    g_assert(qemu_in_coroutine());
+    qemu_co_mutex_lock(&client->send_lock);
+    client->send_coroutine = qemu_coroutine_self();
+
+    ret = qio_channel_writev_all(client->ioc, iov, niov, errp) < 0 ? -EIO : 0;
+    while (!ret && size) {
+        ret = blk_co_sendfile(client->exp->common.blk, offset, size,
+                              client->sioc->fd, throttle);
+        throttle = false;
+        if (ret == -EAGAIN) {
+            qio_channel_yield(client->ioc, G_IO_OUT);
+            ret = 0;
+        } else if (ret < 0) {
+            error_setg_errno(errp, -ret, "reading from file failed");
+            ret = -EIO;
+        } else if (ret == 0) {
+            /* The export is rounded up to sectors past the end of the file */
+            ret = nbd_co_send_zeroes(client, size, errp);
+            size = 0;
+        } else {
+            offset += ret;
+            size -= ret;
+            ret = 0;
+        }
+    }
+
+    client->send_coroutine = NULL;
+    qemu_co_mutex_unlock(&client->send_lock);
+
+    return ret;
+}
+
 static inline void set_be_simple_reply(NBDSimpleReply *reply, uint64_t error,
                                        uint64_t cookie)
 {
@@ -2085,6 +2173,25 @@ static int coroutine_fn nbd_co_send_simple_reply(NBDClient *client,
     return nbd_co_send_iov(client, iov, 2, errp);
 }
 
+static int coroutine_fn nbd_co_send_simple_reply_zero_copy(NBDClient *client,
+                                                           NBDRequest *request,
+                                                           Error **errp)
+{
+    NBDSimpleReply reply;
+    struct iovec iov[] = {
+        {.iov_base = &reply, .iov_len = sizeof(reply)},
+    };
+
+    assert(request->len <= NBD_MAX_BUFFER_SIZE);
+    assert(client->mode < NBD_MODE_STRUCTURED);
+    trace_nbd_co_send_read_zero_copy(request->cookie, request->from,
+                                     request->len);
+    set_be_simple_reply(&reply, 0, request->cookie);
+
+    return nbd_co_send_iov_zero_copy(client, iov, 1, request->from,
+                                     request->len, errp);
+}
+
 /*
  * Prepare the header of a reply chunk for network transmission.
  *
@@ -2166,6 +2273,31 @@ static int coroutine_fn nbd_co_send_chunk_read(NBDClient *client,
     return nbd_co_send_iov(client, iov, 3, errp);
 }
 
+static int coroutine_fn nbd_co_send_chunk_read_zero_copy(NBDClient *client,
+                                                         NBDRequest *request,
+                                                         uint64_t offset,
+                                                         uint64_t size,
+                                                         bool final,
+                                                         Error **errp)
+{
+    NBDReply hdr;
+    NBDStructuredReadData chunk;
+    struct iovec iov[] = {
+        {.iov_base = &hdr},
+        {.iov_base = &chunk, .iov_len = sizeof(chunk)},
+        {.iov_base = NULL, .iov_len = size}
+    };
+
+    assert(size && size <= NBD_MAX_BUFFER_SIZE);
+    trace_nbd_co_send_read_zero_copy(request->cookie, offset, size);
+    /* iov[2] only describes the payload length, the data comes from the file */
+    set_be_chunk(client, iov, 3, final ? NBD_REPLY_FLAG_DONE : 0,
+                 NBD_REPLY_TYPE_OFFSET_DATA, request);
+    stq_be_p(&chunk.offset, offset);
+
+    return nbd_co_send_iov_zero_copy(client, iov, 2, offset, size, errp);
+}
+
 static int coroutine_fn nbd_co_send_chunk_error(NBDClient *client,
                                                 NBDRequest *request,
                                                 uint32_t error,
@@ -2206,6 +2338,7 @@ static int coroutine_fn nbd_co_send_sparse_read(NBDClient *client,
     int ret = 0;
     NBDExport *exp = client->exp;
     size_t progress = 0;
+    bool zero_copy = nbd_can_zero_copy(client);
 
     assert(size <= NBD_MAX_BUFFER_SIZE);
     while (progress < size) {
@@ -2242,6 +2375,10 @@ static int coroutine_fn nbd_co_send_sparse_read(NBDClient *client,
             stq_be_p(&chunk.offset, offset + progress);
             stl_be_p(&chunk.length, pnum);
             ret = nbd_co_send_iov(client, iov, 2, errp);
+        } else if (zero_copy) {
+            ret = nbd_co_send_chunk_read_zero_copy(client, request,
+                                                   offset + progress, pnum,
+                                                   final, errp);
         } else {
             ret = blk_co_pread(exp->common.blk, offset + progress, pnum,
                                data + progress, 0);
@@ -2685,7 +2822,8 @@ static int coroutine_fn nbd_co_receive_request(NBDRequestData *req,
             valid_flags |= NBD_CMD_FLAG_DF;
         }
         check_length = true;
-        allocate_buffer = true;
+        /* Zero-copy reads go from the image to the socket, no buffer */
+        allocate_buffer = !nbd_can_zero_copy(client);
         break;
 
     case NBD_CMD_WRITE:
@@ -2869,6 +3007,16 @@ static coroutine_fn int nbd_do_cmd_read(NBDClient *client, NBDRequest *request,
                                        data, request->len, errp);
     }
 
+    if (request->len && nbd_can_zero_copy(client)) {
+        if (client->mode >= NBD_MODE_STRUCTURED) {
+            return nbd_co_send_chunk_read_zero_copy(client, request,
+                                                    request->from,
+                                                    request->len, true, errp);
+        } else {
+            return nbd_co_send_simple_reply_zero_copy(client, request, errp);
+        }
+    }
+
     ret = blk_co_pread(exp->common.blk, request->from, request->len, data, 0);
     if (ret < 0) {
         return nbd_send_generic_reply(client, request, ret,
@@ -3292,6 +3440,7 @@ void nbd_client_new(QIOChannelSocket *sioc,
     object_ref(OBJECT(client->ioc));
     client->close_fn = close_fn;
     client->owner = owner;
+    client->zero_copy = -1;
 
     nbd_set_socket_send_buffer(sioc);
 
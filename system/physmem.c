@@ -2607,6 +2607,10 @@ static void reclaim_ramblock(RAMBlock *block)
         ram_block_coordinated_discard_require(false);
     }
 
+    if (block->file_private) {
+        ram_block_discard_disable(false);
+    }
+
     g_free(block);
 }
 
@@ -2713,6 +2717,60 @@ void qemu_ram_remap(ram_addr_t addr)
         }
     }
 }
+
+/*
+ * qemu_ram_map_file_private - map a RAM block copy-on-write from a file
+ *
+ * @block: RAMBlock to map, which must be private anonymous memory
+ * @fd: file to map from, open for reading
+ * @offset: offset in @fd of the block contents
+ *
+ * Replaces the memory of @block up to its used length with a private
+ * mapping of @fd, so that processes mapping the same file share the pages
+ * until they write to them.  The old contents of @block are lost.
+ *
+ * Discarding such memory would bring back the file contents instead of
+ * zeroes, so RAM discard is disabled for as long as @block exists.
+ *
+ * Returns 0 on success, -1 on error with @errp set.
+ */
+int qemu_ram_map_file_private(RAMBlock *block, int fd, off_t offset,
+                              Error **errp)
+{
+    int flags = MAP_FIXED | MAP_PRIVATE;
+    void *area;
+
+    if (block->fd >= 0 || xen_enabled() ||
+        block->flags & (RAM_SHARED | RAM_PREALLOC | RAM_READONLY |
+                        RAM_GUEST_MEMFD)) {
+        error_setg(errp, "RAM block %s is not private anonymous memory",
+                   block->idstr);
+        return -1;
+    }
+
+    if (!block->file_private && ram_block_discard_disable(true)) {
+        error_setg(errp, "RAM block %s cannot be mapped from a file while "
+                   "RAM discard is required", block->idstr);
+        return -1;
+    }
+
+    flags |= block->flags & RAM_NORESERVE ? MAP_NORESERVE : 0;
+    area = mmap(block->host, block->used_length, PROT_READ | PROT_WRITE,
+                flags, fd, offset);
+    if (area != block->host) {
+        error_setg_errno(errp, errno, "failed to map RAM block %s",
+                         block->idstr);
+        if (!block->file_private) {
+            ram_block_discard_disable(false);
+        }
+        return -1;
+    }
+    block->file_private = true;
+
+    memory_try_enable_merging(block->host, block->used_length);
+    qemu_ram_setup_dump(block->host, block->used_length);
+    return 0;
+}
 #endif /* !_WIN32 */
 
 /*
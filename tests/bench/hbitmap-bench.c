@@ -0,0 +1,147 @@
+/*
+ * QEMU HBitmap speed benchmark
+ *
+ * Measures the bulk operations used when dirty bitmaps are merged and
+ * persisted, on a bitmap covering a 16 TiB disk with 64 KiB granularity.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/hbitmap.h"
+#include "qemu/units.h"
+
+#define BENCH_DISK_SIZE     (16 * TiB)
+#define BENCH_GRANULARITY   16          /* 64 KiB */
+#define BENCH_EXTENT        (64 * MiB)  /* size of the dirty extents */
+#define BENCH_CLUSTER_SIZE  (64 * KiB)  /* serialization chunk */
+
+typedef struct HBitmapBenchOpts {
+    unsigned dirty_percent;
+} HBitmapBenchOpts;
+
+static HBitmap *bench_bitmap_new(unsigned dirty_percent)
+{
+    HBitmap *hb = hbitmap_alloc(BENCH_DISK_SIZE, BENCH_GRANULARITY);
+    uint64_t offset;
+
+    for (offset = 0; offset < BENCH_DISK_SIZE; offset += BENCH_EXTENT) {
+        if (g_test_rand_int_range(0, 100) < dirty_percent) {
+            hbitmap_set(hb, offset, BENCH_EXTENT);
+        }
+    }
+
+    return hb;
+}
+
+/* dst |= src, as done when merging a bitmap into another one */
+static void test_merge_in_place(const void *opaque)
+{
+    const HBitmapBenchOpts *opts = opaque;
+    HBitmap *src = bench_bitmap_new(opts->dirty_percent);
+    HBitmap *dst = bench_bitmap_new(opts->dirty_percent);
+    unsigned long iterations = 0;
+
+    g_test_timer_start();
+    do {
+        hbitmap_merge(dst, src, dst);
+        iterations++;
+    } while (g_test_timer_elapsed() < 0.5);
+
+    g_test_message("merge in place, %2u%% dirty: %8.3f ms/merge",
+                   opts->dirty_percent,
+                   g_test_timer_last() * 1000 / iterations);
+
+    hbitmap_free(src);
+    hbitmap_free(dst);
+}
+
+/* result = a | b, which also recomputes the dirty count */
+static void test_merge_count(const void *opaque)
+{
+    const HBitmapBenchOpts *opts = opaque;
+    HBitmap *a = bench_bitmap_new(opts->dirty_percent);
+    HBitmap *b = bench_bitmap_new(opts->dirty_percent);
+    HBitmap *result = hbitmap_alloc(BENCH_DISK_SIZE, BENCH_GRANULARITY);
+    unsigned long iterations = 0;
+
+    g_test_timer_start();
+    do {
+        hbitmap_merge(a, b, result);
+        iterations++;
+    } while (g_test_timer_elapsed() < 0.5);
+
+    g_test_message("merge and count, %2u%% dirty: %8.3f ms/merge",
+                   opts->dirty_percent,
+                   g_test_timer_last() * 1000 / iterations);
+    g_assert_cmpuint(hbitmap_count(result), >=, hbitmap_count(a));
+
+    hbitmap_free(a);
+    hbitmap_free(b);
+    hbitmap_free(result);
+}
+
+/* Serialize the bitmap in cluster-sized chunks, as qcow2 stores it */
+static void test_serialize(const void *opaque)
+{
+    const HBitmapBenchOpts *opts = opaque;
+    HBitmap *hb = bench_bitmap_new(opts->dirty_percent);
+    uint64_t coverage = BENCH_CLUSTER_SIZE * BITS_PER_BYTE *
+                        (1ULL << BENCH_GRANULARITY);
+    uint8_t *buf = g_malloc(BENCH_CLUSTER_SIZE);
+    double total = 0.0;
+
+    g_test_timer_start();
+    do {
+        uint64_t offset;
+
+        for (offset = 0; offset < BENCH_DISK_SIZE; offset += coverage) {
+            uint64_t count = MIN(BENCH_DISK_SIZE - offset, coverage);
+
+            if (hbitmap_next_dirty(hb, offset, count) < 0) {
+                continue;
+            }
+            hbitmap_serialize_part(hb, buf, offset, count);
+        }
+        total += hbitmap_serialization_size(hb, 0, BENCH_DISK_SIZE);
+    } while (g_test_timer_elapsed() < 0.5);
+
+    g_test_message("serialize, %2u%% dirty: %8.0f MB/sec",
+                   opts->dirty_percent, total / MiB / g_test_timer_last());
+
+    g_free(buf);
+    hbitmap_free(hb);
+}
+
+int main(int argc, char **argv)
+{
+    static const HBitmapBenchOpts opts[] = {
+        { .dirty_percent = 1 },
+        { .dirty_percent = 50 },
+    };
+    int i;
+
+    g_test_init(&argc, &argv, NULL);
+
+    for (i = 0; i < ARRAY_SIZE(opts); i++) {
+        char *name;
+
+        name = g_strdup_printf("/hbitmap/merge-in-place/%u",
+                               opts[i].dirty_percent);
+        g_test_add_data_func(name, &opts[i], test_merge_in_place);
+        g_free(name);
+
+        name = g_strdup_printf("/hbitmap/merge-count/%u",
+                               opts[i].dirty_percent);
+        g_test_add_data_func(name, &opts[i], test_merge_count);
+        g_free(name);
+
+        name = g_strdup_printf("/hbitmap/serialize/%u",
+                               opts[i].dirty_percent);
+        g_test_add_data_func(name, &opts[i], test_serialize);
+        g_free(name);
+    }
+
+    return g_test_run();
+}
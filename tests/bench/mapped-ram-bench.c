@@ -0,0 +1,147 @@
+/*
+ * QEMU mapped-ram file save and restore speed benchmark
+ *
+ * Mimics how multifd channels write guest RAM to a mapped-ram file and
+ * read it back into fresh guest RAM: each channel handles every Nth
+ * request at its fixed file offset.  Restore is timed with and without
+ * populating the destination before the read, and for the request sizes
+ * that the main thread could hand to the channels.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/madvise.h"
+#include "qemu/thread.h"
+#include "qemu/units.h"
+
+#define BENCH_RAM_SIZE  (512 * MiB)
+#define BENCH_CHANNELS  4
+#define BENCH_ROUNDS    5
+
+typedef struct BenchParams {
+    const char *name;
+    size_t request_size;
+    bool save;
+    bool populate;
+} BenchParams;
+
+typedef struct BenchChannel {
+    const BenchParams *params;
+    int fd;
+    uint8_t *host;
+    int index;
+    QemuThread thread;
+} BenchChannel;
+
+static void *bench_channel_thread(void *opaque)
+{
+    BenchChannel *c = opaque;
+    size_t request_size = c->params->request_size;
+    size_t offset, size;
+    ssize_t ret;
+
+    for (offset = c->index * request_size; offset < BENCH_RAM_SIZE;
+         offset += BENCH_CHANNELS * request_size) {
+        size = MIN(request_size, BENCH_RAM_SIZE - offset);
+        if (c->params->save) {
+            ret = pwrite(c->fd, c->host + offset, size, offset);
+        } else {
+            if (c->params->populate) {
+                qemu_madvise(c->host + offset, size,
+                             QEMU_MADV_POPULATE_WRITE);
+            }
+            ret = pread(c->fd, c->host + offset, size, offset);
+        }
+        g_assert_cmpint(ret, ==, size);
+    }
+
+    return NULL;
+}
+
+/* Returns the time one save or restore of all of RAM took, in seconds */
+static double bench_round(const BenchParams *params, int fd)
+{
+    BenchChannel channels[BENCH_CHANNELS];
+    uint8_t *host;
+    int i;
+
+    /* Like guest RAM, restore goes to memory that was never touched */
+    host = qemu_memalign(qemu_real_host_page_size(), BENCH_RAM_SIZE);
+    if (params->save) {
+        memset(host, 0x5a, BENCH_RAM_SIZE);
+    }
+
+    g_test_timer_start();
+    for (i = 0; i < BENCH_CHANNELS; i++) {
+        channels[i] = (BenchChannel) {
+            .params = params,
+            .fd = fd,
+            .host = host,
+            .index = i,
+        };
+        qemu_thread_create(&channels[i].thread, "bench-channel",
+                           bench_channel_thread, &channels[i],
+                           QEMU_THREAD_JOINABLE);
+    }
+    for (i = 0; i < BENCH_CHANNELS; i++) {
+        qemu_thread_join(&channels[i].thread);
+    }
+    g_test_timer_elapsed();
+
+    qemu_vfree(host);
+    return g_test_timer_last();
+}
+
+static void test_mapped_ram(const void *opaque)
+{
+    const BenchParams *params = opaque;
+    g_autofree char *path = NULL;
+    double best = INFINITY;
+    int fd, i;
+
+    fd = g_file_open_tmp("mapped-ram-bench-XXXXXX", &path, NULL);
+    g_assert_cmpint(fd, >=, 0);
+
+    if (!params->save) {
+        BenchParams fill = { .request_size = 16 * MiB, .save = true };
+
+        bench_round(&fill, fd);
+    }
+
+    /* The file stays in the page cache; only the memory side is timed */
+    for (i = 0; i < BENCH_ROUNDS; i++) {
+        best = MIN(best, bench_round(params, fd));
+    }
+
+    g_test_message("%-24s %8.3f s, %6.0f MB/s", params->name, best,
+                   BENCH_RAM_SIZE / MiB / best);
+
+    close(fd);
+    unlink(path);
+}
+
+static const BenchParams bench_params[] = {
+    { "save 512K",            512 * KiB, true,  false },
+    { "save 16M",             16 * MiB,  true,  false },
+    { "restore 1M",           1 * MiB,   false, false },
+    { "restore 1M populate",  1 * MiB,   false, true },
+    { "restore 16M",          16 * MiB,  false, false },
+    { "restore 16M populate", 16 * MiB,  false, true },
+};
+
+int main(int argc, char **argv)
+{
+    int i;
+
+    g_test_init(&argc, &argv, NULL);
+    for (i = 0; i < ARRAY_SIZE(bench_params); i++) {
+        g_autofree char *path = g_strdup_printf("/mapped-ram/%s",
+                                                bench_params[i].name);
+
+        g_strdelimit(path, " ", '-');
+        g_test_add_data_func(path, &bench_params[i], test_mapped_ram);
+    }
+    return g_test_run();
+}
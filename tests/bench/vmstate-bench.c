@@ -0,0 +1,177 @@
+/*
+ * QEMU VMState load speed benchmark
+ *
+ * Measures loading two device states: one made mostly of large integer
+ * arrays, shaped like the register files of NICs and interrupt
+ * controllers, and one made of many scalar registers.  Each is loaded
+ * both with the plain field load plan and through the generic
+ * interpreter, by giving the fields copies of the VMStateInfo that the
+ * plan does not recognise.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "migration/vmstate.h"
+#include "../migration/qemu-file.h"
+#include "io/channel-buffer.h"
+#include "qapi/error.h"
+#include "qemu/module.h"
+
+#define BENCH_REGS      0x8000
+#define BENCH_SCALARS   128
+
+typedef struct BenchState {
+    uint32_t regs[BENCH_REGS];
+    uint16_t eeprom[64];
+    uint64_t counters[256];
+    uint8_t flags[512];
+    uint32_t status;
+    uint32_t irq_mask;
+} BenchState;
+
+static const VMStateDescription vmstate_bench_regfile = {
+    .name = "bench/regfile",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (const VMStateField[]) {
+        VMSTATE_UINT32_ARRAY(regs, BenchState, BENCH_REGS),
+        VMSTATE_UINT16_ARRAY(eeprom, BenchState, 64),
+        VMSTATE_UINT64_ARRAY(counters, BenchState, 256),
+        VMSTATE_UINT8_ARRAY(flags, BenchState, 512),
+        VMSTATE_UINT32(status, BenchState),
+        VMSTATE_UINT32(irq_mask, BenchState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+/* Filled in by main(): one field per register, alternating 32 and 16 bit */
+typedef struct BenchScalars {
+    uint32_t r32[BENCH_SCALARS];
+    uint16_t r16[BENCH_SCALARS];
+} BenchScalars;
+
+static VMStateField bench_scalars_fields[2 * BENCH_SCALARS + 1];
+
+static const VMStateDescription vmstate_bench_scalars = {
+    .name = "bench/scalars",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = bench_scalars_fields,
+};
+
+typedef struct BenchParams {
+    const char *name;
+    const VMStateDescription *vmsd;
+    size_t state_size;
+    bool generic;
+} BenchParams;
+
+/* Returns a copy of @vmsd whose fields use copies of their VMStateInfo */
+static VMStateDescription *bench_generic_vmsd(const VMStateDescription *vmsd)
+{
+    VMStateDescription *copy = g_memdup2(vmsd, sizeof(*vmsd));
+    VMStateField *fields;
+    int i, n = 0;
+
+    while (vmsd->fields[n].name) {
+        n++;
+    }
+    fields = g_memdup2(vmsd->fields, (n + 1) * sizeof(*fields));
+    for (i = 0; i < n; i++) {
+        fields[i].info = g_memdup2(fields[i].info, sizeof(VMStateInfo));
+    }
+    copy->fields = fields;
+    return copy;
+}
+
+static void test_load(const void *opaque)
+{
+    const BenchParams *params = opaque;
+    const VMStateDescription *vmsd = params->vmsd;
+    g_autofree uint8_t *s = g_malloc(params->state_size);
+    g_autofree uint8_t *loaded = g_malloc0(params->state_size);
+    QIOChannelBuffer *bioc = qio_channel_buffer_new(params->state_size);
+    g_autofree uint8_t *wire = NULL;
+    size_t wire_size;
+    QEMUFile *f;
+    unsigned long iterations = 0;
+    int i;
+
+    if (params->generic) {
+        vmsd = bench_generic_vmsd(vmsd);
+    }
+    for (i = 0; i < params->state_size; i++) {
+        s[i] = i * 7;
+    }
+
+    f = qemu_file_new_output(QIO_CHANNEL(bioc));
+    g_assert_cmpint(vmstate_save_state(f, vmsd, s, NULL, &error_abort),
+                    ==, 0);
+    g_assert_cmpint(qemu_fflush(f), ==, 0);
+    wire_size = bioc->usage;
+    wire = g_memdup2(bioc->data, wire_size);
+    qemu_fclose(f);
+    object_unref(OBJECT(bioc));
+
+    /* Closing the QEMUFile frees the buffer, so each load gets a copy */
+    g_test_timer_start();
+    do {
+        bioc = qio_channel_buffer_new(0);
+        bioc->data = g_memdup2(wire, wire_size);
+        bioc->capacity = bioc->usage = wire_size;
+        f = qemu_file_new_input(QIO_CHANNEL(bioc));
+        object_unref(OBJECT(bioc));
+        g_assert_cmpint(vmstate_load_state(f, vmsd, loaded, 1,
+                                           &error_abort), ==, 0);
+        qemu_fclose(f);
+        iterations++;
+    } while (g_test_timer_elapsed() < 0.5);
+
+    g_test_message("%-18s load %6zu bytes: %8.3f us/load", params->name,
+                   wire_size, g_test_timer_last() * 1000000 / iterations);
+    g_assert_cmpmem(loaded, params->state_size, s, params->state_size);
+}
+
+static const BenchParams bench_params[] = {
+    { "regfile plan", &vmstate_bench_regfile, sizeof(BenchState), false },
+    { "regfile generic", &vmstate_bench_regfile, sizeof(BenchState), true },
+    { "scalars plan", &vmstate_bench_scalars, sizeof(BenchScalars), false },
+    { "scalars generic", &vmstate_bench_scalars, sizeof(BenchScalars), true },
+};
+
+int main(int argc, char **argv)
+{
+    int i;
+
+    for (i = 0; i < BENCH_SCALARS; i++) {
+        bench_scalars_fields[2 * i] = (VMStateField) {
+            .name = g_strdup_printf("r32_%d", i),
+            .info = &vmstate_info_uint32,
+            .size = sizeof(uint32_t),
+            .flags = VMS_SINGLE,
+            .offset = offsetof(BenchScalars, r32) + i * sizeof(uint32_t),
+        };
+        bench_scalars_fields[2 * i + 1] = (VMStateField) {
+            .name = g_strdup_printf("r16_%d", i),
+            .info = &vmstate_info_uint16,
+            .size = sizeof(uint16_t),
+            .flags = VMS_SINGLE,
+            .offset = offsetof(BenchScalars, r16) + i * sizeof(uint16_t),
+        };
+    }
+    bench_scalars_fields[2 * BENCH_SCALARS] =
+        (VMStateField) VMSTATE_END_OF_LIST();
+
+    module_call_init(MODULE_INIT_QOM);
+    g_test_init(&argc, &argv, NULL);
+    for (i = 0; i < ARRAY_SIZE(bench_params); i++) {
+        g_autofree char *path = g_strdup_printf("/vmstate/load/%s",
+                                                bench_params[i].name);
+
+        g_strdelimit(path, " ", '/');
+        g_test_add_data_func(path, &bench_params[i], test_load);
+    }
+    return g_test_run();
+}
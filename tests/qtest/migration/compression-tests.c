@@ -56,6 +56,29 @@ static void test_multifd_postcopy_tcp_zstd(void)
 
     test_precopy_common(&args);
 }
+
+static void *
+migrate_hook_start_precopy_tcp_multifd_zstd_adaptive(QTestState *from,
+                                                     QTestState *to)
+{
+    migrate_set_parameter_int(from, "multifd-zstd-level", 2);
+    migrate_set_parameter_int(to, "multifd-zstd-level", 2);
+
+    return migrate_hook_start_precopy_tcp_multifd_common(from, to,
+                                                         "zstd-adaptive");
+}
+
+static void test_multifd_tcp_zstd_adaptive(void)
+{
+    MigrateCommon args = {
+        .listen_uri = "defer",
+        .start = {
+            .caps[MIGRATION_CAPABILITY_MULTIFD] = true,
+        },
+        .start_hook = migrate_hook_start_precopy_tcp_multifd_zstd_adaptive,
+    };
+    test_precopy_common(&args);
+}
 #endif /* CONFIG_ZSTD */
 
 #ifdef CONFIG_QATZIP
@@ -179,6 +202,30 @@ static void test_multifd_tcp_zlib(void)
     test_precopy_common(&args);
 }
 
+static void *
+migrate_hook_start_precopy_tcp_multifd_xbzrle(QTestState *from,
+                                              QTestState *to)
+{
+    migrate_set_parameter_int(from, "xbzrle-cache-size", 33554432);
+
+    return migrate_hook_start_precopy_tcp_multifd_common(from, to, "xbzrle");
+}
+
+static void test_multifd_tcp_xbzrle(void)
+{
+    MigrateCommon args = {
+        .listen_uri = "defer",
+        .start = {
+            .caps[MIGRATION_CAPABILITY_MULTIFD] = true,
+        },
+        .start_hook = migrate_hook_start_precopy_tcp_multifd_xbzrle,
+        .iterations = 2,
+        /* Pages must change between rounds to be sent as deltas */
+        .live = true,
+    };
+    test_precopy_common(&args);
+}
+
 static void migration_test_add_compression_smoke(MigrationTestEnv *env)
 {
     migration_test_add("/migration/multifd/tcp/plain/zlib",
@@ -198,12 +245,17 @@ void migration_test_add_compression(MigrationTestEnv *env)
 #ifdef CONFIG_ZSTD
     migration_test_add("/migration/multifd/tcp/plain/zstd",
                        test_multifd_tcp_zstd);
+    migration_test_add("/migration/multifd/tcp/plain/zstd-adaptive",
+                       test_multifd_tcp_zstd_adaptive);
     if (env->has_uffd) {
         migration_test_add("/migration/multifd+postcopy/tcp/plain/zstd",
                            test_multifd_postcopy_tcp_zstd);
     }
 #endif
 
+    migration_test_add("/migration/multifd/tcp/plain/xbzrle",
+                       test_multifd_tcp_xbzrle);
+
 #ifdef CONFIG_QATZIP
     migration_test_add("/migration/multifd/tcp/plain/qatzip",
                        test_multifd_tcp_qatzip);
@@ -169,6 +169,67 @@ static void test_multifd_file_mapped_ram(void)
     test_file_common(&args, true);
 }
 
+static void test_precopy_file_mapped_ram_lazy(void)
+{
+    g_autofree char *uri = g_strdup_printf("file:%s/%s", tmpfs,
+                                           FILE_TEST_FILENAME);
+    MigrateCommon args = {
+        .connect_uri = uri,
+        .listen_uri = "defer",
+        .start = {
+            .caps[MIGRATION_CAPABILITY_MAPPED_RAM] = true,
+            .caps[MIGRATION_CAPABILITY_MAPPED_RAM_LAZY] = true,
+        },
+    };
+
+    test_file_common(&args, false);
+}
+
+/*
+ * Locked memory can be neither discarded nor registered with userfaultfd,
+ * so the lazy load has to unlock guest RAM on the destination.
+ */
+static void test_precopy_file_mapped_ram_lazy_mlock(void)
+{
+    g_autofree char *uri = g_strdup_printf("file:%s/%s", tmpfs,
+                                           FILE_TEST_FILENAME);
+    MigrateCommon args = {
+        .connect_uri = uri,
+        .listen_uri = "defer",
+        .start = {
+            .opts_target = "-overcommit mem-lock=on",
+            .caps[MIGRATION_CAPABILITY_MAPPED_RAM] = true,
+            .caps[MIGRATION_CAPABILITY_MAPPED_RAM_LAZY] = true,
+        },
+    };
+    struct rlimit rlim;
+
+    /* All of guest RAM gets locked */
+    if (getuid() != 0 &&
+        (getrlimit(RLIMIT_MEMLOCK, &rlim) || rlim.rlim_cur != RLIM_INFINITY)) {
+        g_test_skip("'ulimit -l' is not unlimited");
+        return;
+    }
+
+    test_file_common(&args, false);
+}
+
+static void test_precopy_file_mapped_ram_cow(void)
+{
+    g_autofree char *uri = g_strdup_printf("file:%s/%s", tmpfs,
+                                           FILE_TEST_FILENAME);
+    MigrateCommon args = {
+        .connect_uri = uri,
+        .listen_uri = "defer",
+        .start = {
+            .caps[MIGRATION_CAPABILITY_MAPPED_RAM] = true,
+            .caps[MIGRATION_CAPABILITY_MAPPED_RAM_COW] = true,
+        },
+    };
+
+    test_file_common(&args, false);
+}
+
 static void *migrate_hook_start_multifd_mapped_ram_dio(QTestState *from,
                                                        QTestState *to)
 {
@@ -326,6 +387,16 @@ void migration_test_add_file(MigrationTestEnv *env)
                        test_precopy_file_mapped_ram);
     migration_test_add("/migration/precopy/file/mapped-ram/live",
                        test_precopy_file_mapped_ram_live);
+#ifndef _WIN32
+    migration_test_add("/migration/precopy/file/mapped-ram/cow",
+                       test_precopy_file_mapped_ram_cow);
+#endif
+    if (env->has_uffd) {
+        migration_test_add("/migration/precopy/file/mapped-ram/lazy",
+                           test_precopy_file_mapped_ram_lazy);
+        migration_test_add("/migration/precopy/file/mapped-ram/lazy/mlock",
+                           test_precopy_file_mapped_ram_lazy_mlock);
+    }
 
     migration_test_add("/migration/multifd/file/mapped-ram",
                        test_multifd_file_mapped_ram);
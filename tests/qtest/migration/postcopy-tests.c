@@ -47,6 +47,46 @@ static void test_postcopy_preempt(void)
     test_postcopy_common(&args);
 }
 
+static void *migrate_hook_start_postcopy_prefetch(QTestState *from,
+                                                  QTestState *to)
+{
+    migrate_set_parameter_int(to, "postcopy-prefetch-pages", 64);
+
+    return NULL;
+}
+
+static void migrate_hook_end_postcopy_prefetch(QTestState *from,
+                                               QTestState *to,
+                                               void *opaque)
+{
+    int64_t requests = read_ram_property_int(from, "postcopy-requests");
+
+    /* The guest faulted at least once before the prefetch could kick in */
+    g_assert_cmpint(requests, >, 0);
+
+    /* The framework already checked that blocktime is reported at all */
+    if (migration_get_env()->uffd_feature_thread_id) {
+        int64_t blocktime = read_migrate_property_int(to,
+                                                      "postcopy-blocktime");
+
+        g_test_message("postcopy prefetch: %" PRId64 " page requests, "
+                       "%" PRId64 " ms blocktime", requests, blocktime);
+    }
+}
+
+static void test_postcopy_prefetch(void)
+{
+    MigrateCommon args = {
+        .start = {
+            .caps[MIGRATION_CAPABILITY_POSTCOPY_BLOCKTIME] = true,
+        },
+        .start_hook = migrate_hook_start_postcopy_prefetch,
+        .end_hook = migrate_hook_end_postcopy_prefetch,
+    };
+
+    test_postcopy_common(&args);
+}
+
 static void test_postcopy_recovery(void)
 {
     MigrateCommon args = { };
@@ -126,6 +166,8 @@ void migration_test_add_postcopy(MigrationTestEnv *env)
     }
 
     if (env->has_uffd) {
+        migration_test_add("/migration/postcopy/prefetch",
+                           test_postcopy_prefetch);
         migration_test_add("/migration/postcopy/preempt/recovery/plain",
                            test_postcopy_preempt_recovery);
 
@@ -51,6 +51,30 @@ static void test_precopy_unix_plain(void)
     test_precopy_common(&args);
 }
 
+static void *migrate_hook_start_hot_pages(QTestState *from, QTestState *to)
+{
+    migrate_set_parameter_int(from, "hot-page-rounds", 1);
+    return NULL;
+}
+
+static void test_precopy_unix_hot_pages(void)
+{
+    g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    MigrateCommon args = {
+        .listen_uri = uri,
+        .connect_uri = uri,
+        .start_hook = migrate_hook_start_hot_pages,
+        /*
+         * The guest keeps dirtying the same pages, so they get deferred
+         * and must all make it to the destination in the final stage.
+         */
+        .iterations = 3,
+        .live = true,
+    };
+
+    test_precopy_common(&args);
+}
+
 static void test_precopy_unix_suspend_live(void)
 {
     g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
@@ -233,6 +257,102 @@ static void test_precopy_tcp_switchover_ack(void)
     test_precopy_common(&args);
 }
 
+static void migrate_hook_end_downtime_stats(QTestState *from,
+                                           QTestState *to,
+                                           void *opaque)
+{
+    QDict *rsp, *stats;
+
+    rsp = migrate_query(from);
+    stats = qdict_get_qdict(rsp, "downtime-stats");
+    g_assert(stats);
+    g_assert(qdict_haskey(stats, "vm-stop"));
+    g_assert(qdict_haskey(stats, "bitmap-sync"));
+    g_assert(qdict_haskey(stats, "iterable-save"));
+    g_assert(qdict_haskey(stats, "non-iterable-save"));
+    g_assert(!qlist_empty(qdict_get_qlist(stats, "devices")));
+    qobject_unref(rsp);
+
+    rsp = migrate_query(to);
+    stats = qdict_get_qdict(rsp, "downtime-stats");
+    g_assert(stats);
+    g_assert(qdict_haskey(stats, "load"));
+    g_assert(qdict_haskey(stats, "start"));
+    g_assert(!qlist_empty(qdict_get_qlist(stats, "devices")));
+    qobject_unref(rsp);
+}
+
+static void test_precopy_tcp_downtime_stats(void)
+{
+    MigrateCommon args = {
+        .listen_uri = "tcp:127.0.0.1:0",
+        .start = {
+            .caps[MIGRATION_CAPABILITY_PREDICTIVE_SWITCHOVER] = true,
+        },
+        .end_hook = migrate_hook_end_downtime_stats,
+        .live = true,
+    };
+
+    test_precopy_common(&args);
+}
+
+/*
+ * With predictive-switchover, what stopping the VM and saving its devices
+ * cost at the first switchover is accounted in expected-downtime of the
+ * next migration of the same source.
+ */
+static void test_precopy_unix_predictive_switchover(void)
+{
+    g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    MigrateStart args = {
+        .caps[MIGRATION_CAPABILITY_PREDICTIVE_SWITCHOVER] = true,
+    };
+    QTestState *from, *to;
+    QDict *rsp, *stats;
+    int64_t cost, expected_downtime;
+
+    if (migrate_start(&from, &to, uri, &args)) {
+        return;
+    }
+
+    /* The first switchover measures the fixed cost */
+    migrate_ensure_converge(from);
+    migrate_qmp(from, to, uri, NULL, "{}");
+    wait_for_migration_complete(from);
+
+    rsp = migrate_query(from);
+    stats = qdict_get_qdict(rsp, "downtime-stats");
+    g_assert(stats);
+    cost = qdict_get_int(stats, "vm-stop") +
+           qdict_get_int(stats, "non-iterable-save");
+    qobject_unref(rsp);
+    qtest_quit(to);
+
+    args = (MigrateStart) {
+        .only_target = true,
+        .caps[MIGRATION_CAPABILITY_PREDICTIVE_SWITCHOVER] = true,
+    };
+    if (migrate_start(&from, &to, uri, &args)) {
+        return;
+    }
+
+    qtest_qmp_assert_success(from, "{ 'execute' : 'cont'}");
+    get_src()->stop_seen = false;
+
+    /* Fast enough to estimate, but the guest keeps it from converging */
+    migrate_set_parameter_int(from, "max-bandwidth", 1 * 1000 * 1000 * 1000);
+    migrate_set_parameter_int(from, "downtime-limit", 1);
+    migrate_qmp(from, to, uri, NULL, "{}");
+    wait_for_migration_pass(from, get_src());
+
+    expected_downtime = read_migrate_property_int(from, "expected-downtime");
+    g_assert_cmpint(expected_downtime, >=, cost / 1000);
+
+    migrate_ensure_converge(from);
+    wait_for_migration_complete(from);
+    migrate_end(from, to, true);
+}
+
 #ifndef _WIN32
 static void *migrate_hook_start_fd(QTestState *from,
                                    QTestState *to)
@@ -1278,6 +1398,12 @@ void migration_test_add_precopy(MigrationTestEnv *env)
 
     migration_test_add("/migration/precopy/tcp/plain/switchover-ack",
                        test_precopy_tcp_switchover_ack);
+    migration_test_add("/migration/precopy/tcp/plain/downtime-stats",
+                       test_precopy_tcp_downtime_stats);
+    migration_test_add("/migration/precopy/unix/predictive-switchover",
+                       test_precopy_unix_predictive_switchover);
+    migration_test_add("/migration/precopy/unix/hot-pages",
+                       test_precopy_unix_hot_pages);
 
 #ifndef _WIN32
     migration_test_add("/migration/precopy/fd/tcp",
@@ -8,11 +8,13 @@
  */
 
 #include "qemu/osdep.h"
+#include "qemu/bswap.h"
 #include "qemu/module.h"
 #include "qemu/units.h"
 #include "libqtest.h"
 #include "libqos/qgraph.h"
 #include "libqos/pci.h"
+#include "hw/pci/pci_regs.h"
 #include "block/nvme.h"
 
 typedef struct QNvme QNvme;
@@ -142,6 +144,284 @@ static void nvmetest_pmr_reg_test(void *obj, void *data, QGuestAllocator *alloc)
     qpci_iounmap(pdev, pmr_bar);
 }
 
+typedef struct NvmeTestQueue {
+    uint16_t qid;
+    uint16_t size;
+    uint64_t sq;
+    uint64_t cq;
+    uint16_t sq_tail;
+    uint16_t cq_head;
+    bool phase;
+} NvmeTestQueue;
+
+typedef struct NvmeTestCtrl {
+    QPCIDevice *pdev;
+    QPCIBar bar;
+    NvmeTestQueue adminq;
+    NvmeTestQueue ioq;
+    /* The I/O queue interrupt vector writes msix_data here */
+    uint64_t msix_addr;
+    uint32_t msix_data;
+} NvmeTestCtrl;
+
+#define NVMETEST_QUEUE_SIZE 16
+#define NVMETEST_TIMEOUT_US (10 * G_USEC_PER_SEC)
+
+static void nvmetest_queue_init(QTestState *qts, QGuestAllocator *alloc,
+                                NvmeTestQueue *q, uint16_t qid)
+{
+    q->qid = qid;
+    q->size = NVMETEST_QUEUE_SIZE;
+    q->sq = guest_alloc(alloc, q->size * sizeof(NvmeCmd));
+    q->cq = guest_alloc(alloc, q->size * sizeof(NvmeCqe));
+    qtest_memset(qts, q->cq, 0, q->size * sizeof(NvmeCqe));
+    q->sq_tail = q->cq_head = 0;
+    q->phase = true;
+}
+
+static void nvmetest_submit(NvmeTestCtrl *c, NvmeTestQueue *q, NvmeCmd *cmd,
+                            int n)
+{
+    QTestState *qts = c->pdev->bus->qts;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        NvmeCmd sqe = *cmd;
+
+        sqe.cid = cpu_to_le16(q->sq_tail);
+        qtest_memwrite(qts, q->sq + q->sq_tail * sizeof(NvmeCmd), &sqe,
+                       sizeof(sqe));
+        q->sq_tail = (q->sq_tail + 1) % q->size;
+    }
+    qpci_io_writel(c->pdev, c->bar, 0x1000 + 2 * q->qid * 4, q->sq_tail);
+}
+
+/*
+ * Wait for the next completion queue entry without moving the virtual
+ * clock, which would fire the interrupt coalescing timer.
+ */
+static void nvmetest_wait_cqe(NvmeTestCtrl *c, NvmeTestQueue *q, NvmeCqe *cqe)
+{
+    QTestState *qts = c->pdev->bus->qts;
+    gint64 deadline = g_get_monotonic_time() + NVMETEST_TIMEOUT_US;
+
+    for (;;) {
+        qtest_memread(qts, q->cq + q->cq_head * sizeof(NvmeCqe), cqe,
+                      sizeof(*cqe));
+        if ((le16_to_cpu(cqe->status) & 0x1) == q->phase) {
+            break;
+        }
+        g_assert(g_get_monotonic_time() < deadline);
+        g_usleep(1000);
+    }
+
+    cqe->result = le32_to_cpu(cqe->result);
+    cqe->status = le16_to_cpu(cqe->status) >> 1;
+
+    q->cq_head = (q->cq_head + 1) % q->size;
+    if (!q->cq_head) {
+        q->phase = !q->phase;
+    }
+}
+
+static void nvmetest_cq_doorbell(NvmeTestCtrl *c, NvmeTestQueue *q)
+{
+    qpci_io_writel(c->pdev, c->bar, 0x1000 + (2 * q->qid + 1) * 4,
+                   q->cq_head);
+}
+
+static uint16_t nvmetest_admin(NvmeTestCtrl *c, uint8_t opcode, uint32_t cdw10,
+                               uint32_t cdw11, uint64_t prp1, uint32_t *result)
+{
+    NvmeCmd cmd = {
+        .opcode = opcode,
+        .dptr.prp1 = cpu_to_le64(prp1),
+        .cdw10 = cpu_to_le32(cdw10),
+        .cdw11 = cpu_to_le32(cdw11),
+    };
+    NvmeCqe cqe;
+
+    nvmetest_submit(c, &c->adminq, &cmd, 1);
+    nvmetest_wait_cqe(c, &c->adminq, &cqe);
+    nvmetest_cq_doorbell(c, &c->adminq);
+
+    if (result) {
+        *result = cqe.result;
+    }
+    return cqe.status;
+}
+
+/*
+ * Submit @n flushes to the I/O queue and wait for their completions.  The
+ * entries are left unconsumed: the coalescing timer does not interrupt for
+ * a queue that the host has already emptied.
+ */
+static void nvmetest_flush(NvmeTestCtrl *c, int n)
+{
+    NvmeCmd cmd = {
+        .opcode = NVME_CMD_FLUSH,
+        .nsid = cpu_to_le32(1),
+    };
+    NvmeCqe cqe;
+    int i;
+
+    nvmetest_submit(c, &c->ioq, &cmd, n);
+    for (i = 0; i < n; i++) {
+        nvmetest_wait_cqe(c, &c->ioq, &cqe);
+        g_assert_cmphex(cqe.status, ==, NVME_SUCCESS);
+    }
+}
+
+/* Returns whether the I/O queue interrupt fired since the last call */
+static bool nvmetest_irq(NvmeTestCtrl *c)
+{
+    QTestState *qts = c->pdev->bus->qts;
+
+    if (qtest_readl(qts, c->msix_addr) != c->msix_data) {
+        return false;
+    }
+    qtest_writel(qts, c->msix_addr, 0);
+    return true;
+}
+
+static void nvmetest_msix_setup(NvmeTestCtrl *c, QGuestAllocator *alloc,
+                                uint16_t entry)
+{
+    QPCIDevice *pdev = c->pdev;
+    uint64_t off = pdev->msix_table_off + entry * PCI_MSIX_ENTRY_SIZE;
+    uint32_t control;
+
+    c->msix_addr = guest_alloc(alloc, 4);
+    c->msix_data = 0x12345678;
+    qtest_writel(pdev->bus->qts, c->msix_addr, 0);
+
+    qpci_io_writel(pdev, pdev->msix_table_bar,
+                   off + PCI_MSIX_ENTRY_LOWER_ADDR, c->msix_addr & ~0UL);
+    qpci_io_writel(pdev, pdev->msix_table_bar,
+                   off + PCI_MSIX_ENTRY_UPPER_ADDR,
+                   (c->msix_addr >> 32) & ~0UL);
+    qpci_io_writel(pdev, pdev->msix_table_bar,
+                   off + PCI_MSIX_ENTRY_DATA, c->msix_data);
+
+    control = qpci_io_readl(pdev, pdev->msix_table_bar,
+                            off + PCI_MSIX_ENTRY_VECTOR_CTRL);
+    qpci_io_writel(pdev, pdev->msix_table_bar,
+                   off + PCI_MSIX_ENTRY_VECTOR_CTRL,
+                   control & ~PCI_MSIX_ENTRY_CTRL_MASKBIT);
+}
+
+/*
+ * Enable the controller and create one I/O queue pair whose completion
+ * queue interrupts on MSI-X vector 1.
+ */
+static void nvmetest_ctrl_init(NvmeTestCtrl *c, QPCIDevice *pdev,
+                               QGuestAllocator *alloc)
+{
+    QTestState *qts = pdev->bus->qts;
+    gint64 deadline = g_get_monotonic_time() + NVMETEST_TIMEOUT_US;
+    uint32_t cc = 0;
+
+    c->pdev = pdev;
+    qpci_device_enable(pdev);
+    qpci_msix_enable(pdev);
+    /* The MSI-X table is in BAR 0, which qpci_msix_enable() mapped */
+    c->bar = pdev->msix_table_bar;
+    nvmetest_msix_setup(c, alloc, 1);
+
+    nvmetest_queue_init(qts, alloc, &c->adminq, 0);
+    qpci_io_writel(pdev, c->bar, NVME_REG_AQA,
+                   (c->adminq.size - 1) << 16 | (c->adminq.size - 1));
+    qpci_io_writeq(pdev, c->bar, NVME_REG_ASQ, c->adminq.sq);
+    qpci_io_writeq(pdev, c->bar, NVME_REG_ACQ, c->adminq.cq);
+
+    NVME_SET_CC_EN(cc, 1);
+    NVME_SET_CC_IOSQES(cc, 6);
+    NVME_SET_CC_IOCQES(cc, 4);
+    qpci_io_writel(pdev, c->bar, NVME_REG_CC, cc);
+    while (!NVME_CSTS_RDY(qpci_io_readl(pdev, c->bar, NVME_REG_CSTS))) {
+        g_assert(g_get_monotonic_time() < deadline);
+        g_usleep(1000);
+    }
+
+    nvmetest_queue_init(qts, alloc, &c->ioq, 1);
+    g_assert_cmphex(nvmetest_admin(c, NVME_ADM_CMD_CREATE_CQ,
+                                   (c->ioq.size - 1) << 16 | c->ioq.qid,
+                                   1 << 16 | NVME_CQ_IEN | NVME_CQ_PC,
+                                   c->ioq.cq, NULL), ==, NVME_SUCCESS);
+    g_assert_cmphex(nvmetest_admin(c, NVME_ADM_CMD_CREATE_SQ,
+                                   (c->ioq.size - 1) << 16 | c->ioq.qid,
+                                   c->ioq.qid << 16 | NVME_SQ_PC,
+                                   c->ioq.sq, NULL), ==, NVME_SUCCESS);
+}
+
+static void nvmetest_intc_test(void *obj, void *data, QGuestAllocator *alloc)
+{
+    QNvme *nvme = obj;
+    QTestState *qts = nvme->dev.bus->qts;
+    NvmeTestCtrl c;
+    /* Aggregation threshold of 4 entries (0's based), time of 1 ms */
+    const uint32_t intc = 3 | 10 << 8;
+    const int64_t intc_time_ns = 10 * 100 * 1000;
+    uint32_t result;
+
+    nvmetest_ctrl_init(&c, &nvme->dev, alloc);
+
+    /* Without coalescing, every completion interrupts */
+    nvmetest_flush(&c, 1);
+    g_assert(nvmetest_irq(&c));
+    nvmetest_cq_doorbell(&c, &c.ioq);
+
+    g_assert_cmphex(nvmetest_admin(&c, NVME_ADM_CMD_SET_FEATURES,
+                                   NVME_INTERRUPT_COALESCING, intc, 0, NULL),
+                    ==, NVME_SUCCESS);
+    g_assert_cmphex(nvmetest_admin(&c, NVME_ADM_CMD_GET_FEATURES,
+                                   NVME_INTERRUPT_COALESCING, 0, 0, &result),
+                    ==, NVME_SUCCESS);
+    g_assert_cmphex(result, ==, intc);
+
+    g_assert_cmphex(nvmetest_admin(&c, NVME_ADM_CMD_GET_FEATURES,
+                                   NVME_INTERRUPT_VECTOR_CONF, 1, 0, &result),
+                    ==, NVME_SUCCESS);
+    g_assert_cmphex(result, ==, 1);
+
+    /* Completions below the threshold are held back... */
+    nvmetest_flush(&c, 3);
+    g_assert(!nvmetest_irq(&c));
+
+    /* ...until the threshold is exceeded */
+    nvmetest_flush(&c, 1);
+    g_assert(nvmetest_irq(&c));
+    nvmetest_cq_doorbell(&c, &c.ioq);
+
+    /* Or until the aggregation time has passed */
+    nvmetest_flush(&c, 1);
+    g_assert(!nvmetest_irq(&c));
+    qtest_clock_step(qts, intc_time_ns - 1000);
+    g_assert(!nvmetest_irq(&c));
+    qtest_clock_step(qts, 1000);
+    g_assert(nvmetest_irq(&c));
+    nvmetest_cq_doorbell(&c, &c.ioq);
+
+    /* Coalescing Disable turns it off for the vector */
+    g_assert_cmphex(nvmetest_admin(&c, NVME_ADM_CMD_SET_FEATURES,
+                                   NVME_INTERRUPT_VECTOR_CONF,
+                                   1 | NVME_INTVC_NOCOALESCING, 0, NULL),
+                    ==, NVME_SUCCESS);
+    g_assert_cmphex(nvmetest_admin(&c, NVME_ADM_CMD_GET_FEATURES,
+                                   NVME_INTERRUPT_VECTOR_CONF, 1, 0, &result),
+                    ==, NVME_SUCCESS);
+    g_assert_cmphex(result, ==, 1 | NVME_INTVC_NOCOALESCING);
+
+    nvmetest_flush(&c, 1);
+    g_assert(nvmetest_irq(&c));
+    nvmetest_cq_doorbell(&c, &c.ioq);
+
+    /* Vectors past the last I/O queue are rejected */
+    g_assert_cmphex(nvmetest_admin(&c, NVME_ADM_CMD_SET_FEATURES,
+                                   NVME_INTERRUPT_VECTOR_CONF, 0xffff, 0,
+                                   NULL) & 0xff, ==, NVME_INVALID_FIELD);
+}
+
 static void nvme_register_nodes(void)
 {
     QOSGraphEdgeOptions opts = {
@@ -168,6 +448,8 @@ static void nvme_register_nodes(void)
     });
 
     qos_add_test("reg-read", "nvme", nvmetest_reg_read_test, NULL);
+
+    qos_add_test("interrupt-coalescing", "nvme", nvmetest_intc_test, NULL);
 }
 
 libqos_init(nvme_register_nodes);
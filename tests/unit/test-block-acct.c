@@ -0,0 +1,105 @@
+/*
+ * Test block accounting latency percentiles
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#include "qemu/osdep.h"
+#include "block/accounting.h"
+#include "qemu/timer.h"
+
+/* Account @n requests of @type that took @latency_ns plus the test's run time */
+static void account(BlockAcctStats *stats, enum BlockAcctType type,
+                    int n, int64_t latency_ns)
+{
+    BlockAcctCookie cookie;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        block_acct_start(stats, &cookie, 4096, type);
+        cookie.start_time_ns -= latency_ns;
+        block_acct_done(stats, &cookie);
+    }
+}
+
+/*
+ * Percentiles are the upper bound of a histogram bucket that is at most
+ * 1/16 of its lower bound wide.  The accounted latencies also include up
+ * to @elapsed_ns spent in the test itself.
+ */
+static void assert_percentile(BlockAcctStats *stats, enum BlockAcctType type,
+                              unsigned int permille, int64_t latency_ns,
+                              int64_t elapsed_ns)
+{
+    uint64_t value;
+
+    g_assert(block_acct_latency_percentile(stats, type, permille, &value));
+    g_assert_cmpuint(value, >=, latency_ns);
+    g_assert_cmpuint(value, <=, (latency_ns + elapsed_ns) * 17 / 16);
+}
+
+static void test_percentiles(void)
+{
+    BlockAcctStats stats = {};
+    int64_t start_ns, elapsed_ns;
+    uint64_t value;
+
+    block_acct_init(&stats);
+
+    g_assert(!block_acct_latency_percentile(&stats, BLOCK_ACCT_READ, 500,
+                                            &value));
+
+    start_ns = get_clock();
+    account(&stats, BLOCK_ACCT_READ, 900, 100 * SCALE_US);
+    account(&stats, BLOCK_ACCT_READ, 90, 1 * SCALE_MS);
+    account(&stats, BLOCK_ACCT_READ, 10, 10 * SCALE_MS);
+    account(&stats, BLOCK_ACCT_WRITE, 1, 5 * SCALE_MS);
+    elapsed_ns = get_clock() - start_ns;
+
+    assert_percentile(&stats, BLOCK_ACCT_READ, 500, 100 * SCALE_US,
+                      elapsed_ns);
+    assert_percentile(&stats, BLOCK_ACCT_READ, 900, 100 * SCALE_US,
+                      elapsed_ns);
+    assert_percentile(&stats, BLOCK_ACCT_READ, 990, 1 * SCALE_MS, elapsed_ns);
+    assert_percentile(&stats, BLOCK_ACCT_READ, 999, 10 * SCALE_MS,
+                      elapsed_ns);
+    assert_percentile(&stats, BLOCK_ACCT_READ, 1000, 10 * SCALE_MS,
+                      elapsed_ns);
+
+    /* Each request type has its own histogram */
+    assert_percentile(&stats, BLOCK_ACCT_WRITE, 0, 5 * SCALE_MS, elapsed_ns);
+    assert_percentile(&stats, BLOCK_ACCT_WRITE, 500, 5 * SCALE_MS,
+                      elapsed_ns);
+    g_assert(!block_acct_latency_percentile(&stats, BLOCK_ACCT_FLUSH, 500,
+                                            &value));
+
+    block_acct_cleanup(&stats);
+}
+
+/* Latencies past the largest bucket all report its upper bound */
+static void test_percentiles_overflow(void)
+{
+    BlockAcctStats stats = {};
+    uint64_t value;
+
+    block_acct_init(&stats);
+
+    account(&stats, BLOCK_ACCT_READ, 1, 100 * NANOSECONDS_PER_SECOND);
+    g_assert(block_acct_latency_percentile(&stats, BLOCK_ACCT_READ, 500,
+                                           &value));
+    g_assert_cmpuint(value, >=, 1ULL << (BLOCK_ACCT_HDR_MAX_BITS - 1));
+    g_assert_cmpuint(value, <, 100 * NANOSECONDS_PER_SECOND);
+
+    block_acct_cleanup(&stats);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/block-acct/percentiles", test_percentiles);
+    g_test_add_func("/block-acct/percentiles-overflow",
+                    test_percentiles_overflow);
+    return g_test_run();
+}
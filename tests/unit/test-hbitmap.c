@@ -350,6 +350,56 @@ static void test_hbitmap_set_overlap(TestHBitmapData *data,
     hbitmap_test_set(data, L3 - 1, L2);
 }
 
+static void test_hbitmap_merge_do(TestHBitmapData *data, bool in_place)
+{
+    static const uint64_t ranges[][2] = {
+        { 0, L1 },
+        { L2 - 1, L1 * 3 },
+        { L3 + 17, L2 },
+        { L3 * 2 + 10, 3 },
+    };
+    uint64_t size = L3 * 2 + 13;
+    HBitmap *src, *result;
+    int i;
+
+    hbitmap_test_init(data, size, 0);
+    hbitmap_test_set(data, L1 - 1, L1 + 2);
+    hbitmap_test_set(data, L2 + 5, 7);
+    hbitmap_test_set(data, size - 1, 1);
+
+    src = hbitmap_alloc(size, 0);
+    for (i = 0; i < ARRAY_SIZE(ranges); i++) {
+        hbitmap_set(src, ranges[i][0], ranges[i][1]);
+    }
+
+    if (in_place) {
+        hbitmap_merge(data->hb, src, data->hb);
+    } else {
+        result = hbitmap_alloc(size, 0);
+        hbitmap_merge(data->hb, src, result);
+        hbitmap_free(data->hb);
+        data->hb = result;
+    }
+    hbitmap_free(src);
+
+    for (i = 0; i < ARRAY_SIZE(ranges); i++) {
+        bitmap_set(data->bits, ranges[i][0], ranges[i][1]);
+    }
+    hbitmap_test_check(data, 0);
+}
+
+static void test_hbitmap_merge(TestHBitmapData *data,
+                               const void *unused)
+{
+    test_hbitmap_merge_do(data, false);
+}
+
+static void test_hbitmap_merge_in_place(TestHBitmapData *data,
+                                        const void *unused)
+{
+    test_hbitmap_merge_do(data, true);
+}
+
 static void test_hbitmap_reset_empty(TestHBitmapData *data,
                                      const void *unused)
 {
@@ -1058,6 +1108,8 @@ int main(int argc, char **argv)
     hbitmap_test_add("/hbitmap/set/general", test_hbitmap_set);
     hbitmap_test_add("/hbitmap/set/twice", test_hbitmap_set_twice);
     hbitmap_test_add("/hbitmap/set/overlap", test_hbitmap_set_overlap);
+    hbitmap_test_add("/hbitmap/merge/general", test_hbitmap_merge);
+    hbitmap_test_add("/hbitmap/merge/in_place", test_hbitmap_merge_in_place);
     hbitmap_test_add("/hbitmap/reset/empty", test_hbitmap_reset_empty);
     hbitmap_test_add("/hbitmap/reset/general", test_hbitmap_reset);
     hbitmap_test_add("/hbitmap/reset/all", test_hbitmap_reset_all);
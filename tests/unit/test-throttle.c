@@ -801,6 +801,73 @@ static void test_groups(void)
     g_assert(tgm3->throttle_state == NULL);
 }
 
+static void coroutine_fn test_local_budget_entry(void *opaque)
+{
+    ThrottleGroupMember *tgm = opaque;
+
+    throttle_group_co_io_limits_intercept(tgm, 4096, THROTTLE_READ);
+}
+
+static void test_local_budget(void)
+{
+    ThrottleConfig cfg1, cfg2;
+    BlockBackend *blk;
+    ThrottleGroupMember *tgm;
+    Object *group;
+    Coroutine *co;
+
+    group = object_new_with_props(TYPE_THROTTLE_GROUP,
+                                  object_get_objects_root(), "baz",
+                                  &error_abort, "local-budget-us", "100000",
+                                  NULL);
+
+    blk = blk_new(qemu_get_aio_context(), 0, BLK_PERM_ALL);
+    tgm = &blk_get_public(blk)->throttle_group_member;
+    throttle_group_register_tgm(tgm, "baz", blk_get_aio_context(blk));
+
+    /* 100 ms of 100 iops is 10 requests; bytes are not limited */
+    throttle_config_init(&cfg1);
+    cfg1.buckets[THROTTLE_OPS_READ].avg = 100;
+    throttle_group_config(tgm, &cfg1);
+
+    /* The first request goes through the group and fills the budget */
+    co = qemu_coroutine_create(test_local_budget_entry, tgm);
+    qemu_coroutine_enter(co);
+    g_assert_cmpint(tgm->budget_ops[THROTTLE_READ], ==, 10);
+    g_assert_cmpint(tgm->budget_ops[THROTTLE_WRITE], ==, 0);
+    g_assert_cmpint(tgm->budget_bytes[THROTTLE_READ], >, 1024 * 1024);
+
+    /* The budget is charged to the group in advance... */
+    throttle_group_get_config(tgm, &cfg2);
+    g_assert(double_cmp(cfg2.buckets[THROTTLE_OPS_READ].level, 11));
+
+    /* ...and spent without accounting again */
+    co = qemu_coroutine_create(test_local_budget_entry, tgm);
+    qemu_coroutine_enter(co);
+    g_assert_cmpint(tgm->budget_ops[THROTTLE_READ], ==, 9);
+    throttle_group_get_config(tgm, &cfg2);
+    g_assert(cfg2.buckets[THROTTLE_OPS_READ].level <= 11);
+
+    /*
+     * An expired budget is not spent: the request goes through the group,
+     * which gets the 9 unused requests back and hands out a new batch
+     */
+    tgm->budget_expiry_ns[THROTTLE_READ] = 0;
+    co = qemu_coroutine_create(test_local_budget_entry, tgm);
+    qemu_coroutine_enter(co);
+    g_assert_cmpint(tgm->budget_ops[THROTTLE_READ], ==, 10);
+    throttle_group_get_config(tgm, &cfg2);
+    g_assert(cfg2.buckets[THROTTLE_OPS_READ].level <= 13);
+
+    /* Changing the limits drops the budget */
+    throttle_group_config(tgm, &cfg1);
+    g_assert_cmpint(tgm->budget_ops[THROTTLE_READ], ==, 0);
+
+    throttle_group_unregister_tgm(tgm);
+    blk_unref(blk);
+    object_unparent(group);
+}
+
 int main(int argc, char **argv)
 {
     qemu_init_main_loop(&error_fatal);
@@ -830,6 +897,7 @@ int main(int argc, char **argv)
     g_test_add_func("/throttle/config_functions",   test_config_functions);
     g_test_add_func("/throttle/accounting",         test_accounting);
     g_test_add_func("/throttle/groups",             test_groups);
+    g_test_add_func("/throttle/local_budget",       test_local_budget);
     return g_test_run();
 }
 
@@ -290,12 +290,16 @@ static void test_simple_primitive(void)
 
 typedef struct TestSimpleArray {
     uint16_t u16_1[3];
+    int32_t i32_1[2];
+    uint64_t u64_1[2];
 } TestSimpleArray;
 
 /* Object instantiation, we are going to use it in more than one test */
 
 TestSimpleArray obj_simple_arr = {
     .u16_1 = { 0x42, 0x43, 0x44 },
+    .i32_1 = { -0x45, 0x46 },
+    .u64_1 = { 0x4748494a4b4c4d4eULL, 0x4f },
 };
 
 /* Description of the values.  If you add a primitive type
@@ -307,6 +311,8 @@ static const VMStateDescription vmstate_simple_arr = {
     .minimum_version_id = 1,
     .fields = (const VMStateField[]) {
         VMSTATE_UINT16_ARRAY(u16_1, TestSimpleArray, 3),
+        VMSTATE_INT32_ARRAY(i32_1, TestSimpleArray, 2),
+        VMSTATE_UINT64_ARRAY(u64_1, TestSimpleArray, 2),
         VMSTATE_END_OF_LIST()
     }
 };
@@ -315,6 +321,10 @@ uint8_t wire_simple_arr[] = {
     /* u16_1 */ 0x00, 0x42,
     /* u16_1 */ 0x00, 0x43,
     /* u16_1 */ 0x00, 0x44,
+    /* i32_1 */ 0xff, 0xff, 0xff, 0xbb,
+    /* i32_1 */ 0x00, 0x00, 0x00, 0x46,
+    /* u64_1 */ 0x47, 0x48, 0x49, 0x4a, 0x4b, 0x4c, 0x4d, 0x4e,
+    /* u64_1 */ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x4f,
     QEMU_VM_EOF, /* just to ensure we won't get EOF reported prematurely */
 };
 
@@ -335,6 +345,108 @@ static void test_simple_array(void)
     SUCCESS(load_vmstate(&vmstate_simple_arr, &obj, &obj_clone,
                          obj_simple_arr_copy, 1, wire_simple_arr,
                          sizeof(wire_simple_arr)));
+
+#define ARRAY_EQUAL(name) \
+    g_assert_cmpmem(obj.name, sizeof(obj.name), \
+                    obj_simple_arr.name, sizeof(obj_simple_arr.name))
+
+    ARRAY_EQUAL(u16_1);
+    ARRAY_EQUAL(i32_1);
+    ARRAY_EQUAL(u64_1);
+}
+
+typedef struct TestPlainRuns {
+    uint8_t mac[6];
+    uint16_t u16;
+    bool b;
+    uint32_t regs[200];
+    uint64_t u64_1[40];
+    uint64_t u64_2[40];
+    int8_t i8;
+    uint32_t u32_v2;
+    int64_t i64;
+} TestPlainRuns;
+
+/*
+ * Plain fields are loaded in merged runs: check that runs split at
+ * non-plain fields, at large arrays and at the bounce buffer size, and
+ * that fields absent in the loaded version are skipped.
+ */
+static const VMStateDescription vmstate_plain_runs = {
+    .name = "plain/runs",
+    .version_id = 2,
+    .minimum_version_id = 1,
+    .fields = (const VMStateField[]) {
+        VMSTATE_BUFFER(mac, TestPlainRuns),
+        VMSTATE_UINT16(u16, TestPlainRuns),
+        VMSTATE_BOOL(b, TestPlainRuns),
+        VMSTATE_UINT32_ARRAY(regs, TestPlainRuns, 200),
+        VMSTATE_UINT64_ARRAY(u64_1, TestPlainRuns, 40),
+        VMSTATE_UINT64_ARRAY(u64_2, TestPlainRuns, 40),
+        VMSTATE_INT8(i8, TestPlainRuns),
+        VMSTATE_UINT32_V(u32_v2, TestPlainRuns, 2),
+        VMSTATE_INT64(i64, TestPlainRuns),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static void test_plain_runs_version(int version)
+{
+    g_autofree TestPlainRuns *obj = g_new0(TestPlainRuns, 1);
+    g_autofree TestPlainRuns *loaded = g_new0(TestPlainRuns, 1);
+    QEMUFile *f;
+    int i;
+
+    memcpy(obj->mac, "\x52\x54\x00\x12\x34\x56", sizeof(obj->mac));
+    obj->u16 = 0x4243;
+    obj->b = true;
+    for (i = 0; i < ARRAY_SIZE(obj->regs); i++) {
+        obj->regs[i] = 0x01020304 * i;
+    }
+    for (i = 0; i < ARRAY_SIZE(obj->u64_1); i++) {
+        obj->u64_1[i] = 0x0102030405060708ULL * i;
+        obj->u64_2[i] = ~obj->u64_1[i];
+    }
+    obj->i8 = -0x44;
+    obj->u32_v2 = 0x45464748;
+    obj->i64 = -0x494a4b4c4d4eLL;
+
+    /* A version 1 stream is a version 2 one without u32_v2 */
+    save_vmstate(&vmstate_plain_runs, obj);
+    if (version == 1) {
+        /* mac, u16, b, the arrays and i8 */
+        size_t before_v2 = sizeof(obj->mac) + 2 + 1 + sizeof(obj->regs) +
+                           sizeof(obj->u64_1) + sizeof(obj->u64_2) + 1;
+        uint8_t wire[2048];
+        size_t size;
+
+        f = open_test_file(false);
+        size = qemu_get_buffer(f, wire, sizeof(wire));
+        qemu_fclose(f);
+        memmove(wire + before_v2, wire + before_v2 + sizeof(uint32_t),
+                size - before_v2 - sizeof(uint32_t));
+        save_buffer(wire, size - sizeof(uint32_t));
+        obj->u32_v2 = 0;
+    }
+
+    f = open_test_file(false);
+    SUCCESS(vmstate_load_state(f, &vmstate_plain_runs, loaded, version,
+                               &error_abort));
+    g_assert_cmpint(qemu_get_byte(f), ==, QEMU_VM_EOF);
+    g_assert(!qemu_file_get_error(f));
+    qemu_fclose(f);
+
+    g_assert_cmpmem(loaded, sizeof(*loaded), obj, sizeof(*obj));
+}
+
+static void test_plain_runs_v1(void)
+{
+    test_plain_runs_version(1);
+}
+
+static void test_plain_runs_v2(void)
+{
+    test_plain_runs_version(2);
 }
 
 typedef struct TestStruct {
@@ -1551,6 +1663,8 @@ int main(int argc, char **argv)
     g_test_init(&argc, &argv, NULL);
     g_test_add_func("/vmstate/simple/primitive", test_simple_primitive);
     g_test_add_func("/vmstate/simple/array", test_simple_array);
+    g_test_add_func("/vmstate/plain_runs/load/v1", test_plain_runs_v1);
+    g_test_add_func("/vmstate/plain_runs/load/v2", test_plain_runs_v2);
     g_test_add_func("/vmstate/versioned/load/v1", test_load_v1);
     g_test_add_func("/vmstate/versioned/load/v2", test_load_v2);
     g_test_add_func("/vmstate/field_exists/load/noskip", test_load_noskip);
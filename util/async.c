@@ -386,6 +386,12 @@ aio_ctx_finalize(GSource *source)
     }
 #endif
 
+#ifdef CONFIG_LINUX_IO_URING
+    if (ctx->luring_fixed) {
+        ctx->luring_fixed_cleanup(ctx);
+    }
+#endif
+
     assert(QSLIST_EMPTY(&ctx->scheduled_coroutines));
     qemu_bh_delete(ctx->co_schedule_bh);
 
@@ -892,6 +892,59 @@ static void hbitmap_sparse_merge(HBitmap *dst, const HBitmap *src)
     }
 }
 
+/* Mask of the bits of the last word of the last level that are in range */
+static unsigned long hb_last_word_mask(const HBitmap *hb)
+{
+    unsigned bits = hb->size & (BITS_PER_LONG - 1);
+
+    return bits ? (1UL << bits) - 1 : ~0UL;
+}
+
+/**
+ * hbitmap_merge_into: performs dst = dst | src
+ * requires equal granularities.
+ * Only the last-level words of @src that are non-zero are visited, as found
+ * through its penultimate level, so the cost follows the population of @src
+ * rather than the size of the bitmap.  The dirty count is updated with the
+ * newly set bits instead of being recomputed.
+ */
+static void hbitmap_merge_into(HBitmap *dst, const HBitmap *src)
+{
+    const int last = HBITMAP_LEVELS - 1;
+    const unsigned long *src_up = src->levels[last - 1];
+    const unsigned long *src_words = src->levels[last];
+    unsigned long *dst_words = dst->levels[last];
+    uint64_t nr_words = src->sizes[last];
+    unsigned long tail = hb_last_word_mask(src);
+    uint64_t i, j;
+    int lev;
+
+    for (i = 0; i < src->sizes[last - 1]; i++) {
+        unsigned long map = src_up[i];
+
+        while (map) {
+            unsigned long added;
+
+            j = (i << BITS_PER_LEVEL) + ctzl(map);
+            map &= map - 1;
+
+            added = src_words[j] & ~dst_words[j];
+            if (j == nr_words - 1) {
+                added &= tail;
+            }
+            dst->count += ctpopl(added);
+            dst_words[j] |= src_words[j];
+        }
+    }
+
+    /* The upper levels are small enough to be merged linearly */
+    for (lev = last - 1; lev >= 0; lev--) {
+        for (j = 0; j < src->sizes[lev]; j++) {
+            dst->levels[lev][j] |= src->levels[lev][j];
+        }
+    }
+}
+
 /**
  * Given HBitmaps A and B, let R := A (BITOR) B.
  * Bitmaps A and B will not be modified,
@@ -900,8 +953,9 @@ static void hbitmap_sparse_merge(HBitmap *dst, const HBitmap *src)
  */
 void hbitmap_merge(const HBitmap *a, const HBitmap *b, HBitmap *result)
 {
+    const int last = HBITMAP_LEVELS - 1;
     int i;
-    uint64_t j;
+    uint64_t j, count, nr_words;
 
     assert(a->orig_size == result->orig_size);
     assert(b->orig_size == result->orig_size);
@@ -929,19 +983,38 @@ void hbitmap_merge(const HBitmap *a, const HBitmap *b, HBitmap *result)
         return;
     }
 
+    assert(a->size == b->size);
+    if (result == a) {
+        hbitmap_merge_into(result, b);
+        return;
+    }
+    if (result == b) {
+        hbitmap_merge_into(result, a);
+        return;
+    }
+
     /* This merge is O(size), as BITS_PER_LONG and HBITMAP_LEVELS are constant.
-     * It may be possible to improve running times for sparsely populated maps
-     * by using hbitmap_iter_next, but this is suboptimal for dense maps.
+     * The last level is combined and counted in a single pass; the loop is
+     * kept simple so that the compiler can vectorize it.
      */
-    assert(a->size == b->size);
-    for (i = HBITMAP_LEVELS - 1; i >= 0; i--) {
+    nr_words = a->sizes[last];
+    count = 0;
+    for (j = 0; j < nr_words; j++) {
+        unsigned long word = a->levels[last][j] | b->levels[last][j];
+
+        result->levels[last][j] = word;
+        count += ctpopl(word);
+    }
+    count -= ctpopl(result->levels[last][nr_words - 1] &
+                    ~hb_last_word_mask(result));
+
+    for (i = last - 1; i >= 0; i--) {
         for (j = 0; j < a->sizes[i]; j++) {
             result->levels[i][j] = a->levels[i][j] | b->levels[i][j];
         }
     }
 
-    /* Recompute the dirty count */
-    result->count = hb_count_between(result, 0, result->size - 1);
+    result->count = count;
 }
 
 char *hbitmap_sha256(const HBitmap *bitmap, Error **errp)
@@ -469,6 +469,25 @@ bool throttle_schedule_timer(ThrottleState *ts,
  */
 void throttle_account(ThrottleState *ts, ThrottleDirection direction,
                       uint64_t size)
+{
+    double units = 1.0;
+
+    /* if cfg.op_size is defined and smaller than size we compute unit count */
+    if (ts->cfg.op_size && size > ts->cfg.op_size) {
+        units = (double) size / ts->cfg.op_size;
+    }
+
+    throttle_account_units(ts, direction, size, units);
+}
+
+/* do the accounting for @size bytes spread over @units operations
+ *
+ * @direction: throttle direction
+ * @size:      the number of bytes
+ * @units:     the number of operations
+ */
+void throttle_account_units(ThrottleState *ts, ThrottleDirection direction,
+                            uint64_t size, double units)
 {
     static const BucketType bucket_types_size[THROTTLE_MAX][2] = {
         { THROTTLE_BPS_TOTAL, THROTTLE_BPS_READ },
@@ -478,15 +497,9 @@ void throttle_account(ThrottleState *ts, ThrottleDirection direction,
         { THROTTLE_OPS_TOTAL, THROTTLE_OPS_READ },
         { THROTTLE_OPS_TOTAL, THROTTLE_OPS_WRITE }
     };
-    double units = 1.0;
     unsigned i;
 
     assert(direction < THROTTLE_MAX);
-    /* if cfg.op_size is defined and smaller than size we compute unit count */
-    if (ts->cfg.op_size && size > ts->cfg.op_size) {
-        units = (double) size / ts->cfg.op_size;
-    }
-
     for (i = 0; i < ARRAY_SIZE(bucket_types_size[THROTTLE_READ]); i++) {
         LeakyBucket *bkt;
 